@@ -3,10 +3,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+
+#include <stb_image.h>
 
 #include "room.h"
 #include "load.h"
 #include "model.h"
+#include "btx.h"
+#include "lz.h"
+#include "save_bff.h"
 
 #define DEBUG_BFF_WRITER
 #ifdef DEBUG_BFF_WRITER
@@ -23,20 +29,33 @@ struct BFF_WRITER {
   FILE *f;
   size_t cur_file_offset;
   translate_tex_index_func *translate_tex_index;
+  int packed_meshes;       // write mesh vertex and index data as chunks
+
+  int capturing;           // write to the capture buffer instead of the file
+  unsigned char *capture;
+  size_t capture_size;
+  size_t capture_alloc;
 };
 
 static int open_bff(struct BFF_WRITER *bff, const char *filename, translate_tex_index_func *translate_tex_index)
 {
+  bff->capturing = 0;
+  bff->capture = NULL;
+  bff->capture_size = 0;
+  bff->capture_alloc = 0;
   bff->f = fopen(filename, "wb");
   if (! bff->f)
     return 1;
   bff->cur_file_offset = 0;
   bff->translate_tex_index = translate_tex_index;
+  bff->packed_meshes = 0;
   return 0;
 }
 
 static int close_bff(struct BFF_WRITER *bff)
 {
+  free(bff->capture);
+  bff->capture = NULL;
   if (bff->f) {
     if (fclose(bff->f) != 0)
       return 1;
@@ -73,8 +92,42 @@ static int set_file_pos(struct BFF_WRITER *bff, size_t pos)
   return 0;
 }
 
+/*
+ * Between begin_capture() and end_capture() everything written goes
+ * to a memory buffer, so it can be compressed as a single chunk.
+ */
+static void begin_capture(struct BFF_WRITER *bff)
+{
+  bff->capturing = 1;
+  bff->capture_size = 0;
+}
+
+static void end_capture(struct BFF_WRITER *bff)
+{
+  bff->capturing = 0;
+}
+
+static int capture_data(struct BFF_WRITER *bff, const void *data, size_t size)
+{
+  if (bff->capture_size + size > bff->capture_alloc) {
+    size_t new_alloc = bff->capture_alloc ? 2*bff->capture_alloc : 64*1024;
+    while (new_alloc < bff->capture_size + size)
+      new_alloc *= 2;
+    unsigned char *new_capture = realloc(bff->capture, new_alloc);
+    if (! new_capture)
+      return 1;
+    bff->capture = new_capture;
+    bff->capture_alloc = new_alloc;
+  }
+  memcpy(bff->capture + bff->capture_size, data, size);
+  bff->capture_size += size;
+  return 0;
+}
+
 static int write_data(struct BFF_WRITER *bff, const void *data, size_t size)
 {
+  if (bff->capturing)
+    return capture_data(bff, data, size);
   if (fwrite(data, 1, size, bff->f) != size)
     return 1;
   bff->cur_file_offset += size;
@@ -83,29 +136,34 @@ static int write_data(struct BFF_WRITER *bff, const void *data, size_t size)
 
 static int write_u8(struct BFF_WRITER *bff, uint8_t n)
 {
-  if (fputc(n, bff->f) == EOF)
-    return 1;
-  bff->cur_file_offset++;
-  return 0;
+  return write_data(bff, &n, 1);
 }
 
 static int write_u16(struct BFF_WRITER *bff, uint16_t n)
 {
-  if (fputc((n      ) & 0xff, bff->f) == EOF ||
-      fputc((n >>  8) & 0xff, bff->f) == EOF)
-    return 1;
-  bff->cur_file_offset += 2;
-  return 0;
+  unsigned char data[2] = {
+    (n      ) & 0xff,
+    (n >>  8) & 0xff,
+  };
+  return write_data(bff, data, 2);
 }
 
 static int write_u32(struct BFF_WRITER *bff, uint32_t n)
 {
-  if (fputc((n      ) & 0xff, bff->f) == EOF ||
-      fputc((n >>  8) & 0xff, bff->f) == EOF ||
-      fputc((n >> 16) & 0xff, bff->f) == EOF ||
-      fputc((n >> 24) & 0xff, bff->f) == EOF)
+  unsigned char data[4] = {
+    (n      ) & 0xff,
+    (n >>  8) & 0xff,
+    (n >> 16) & 0xff,
+    (n >> 24) & 0xff,
+  };
+  return write_data(bff, data, 4);
+}
+
+static int write_u64(struct BFF_WRITER *bff, uint64_t n)
+{
+  if (write_u32(bff, n & 0xffffffff) != 0 ||
+      write_u32(bff, n >> 32) != 0)
     return 1;
-  bff->cur_file_offset += 4;
   return 0;
 }
 
@@ -143,6 +201,174 @@ static int write_string(struct BFF_WRITER *bff, const char *str)
   return 0;
 }
 
+static int texture_format = BFF_TEXTURE_AUTO;
+static int compress_chunks = 0;
+static int show_layout_stats = 0;
+
+void set_bff_texture_format(int format)
+{
+  texture_format = format;
+}
+
+void set_bff_compression(int enable)
+{
+  compress_chunks = enable;
+}
+
+void set_bff_layout_stats(int enable)
+{
+  show_layout_stats = enable;
+}
+
+/*
+ * Get the bytes to store for a chunk: the LZ compressed data if
+ * compression is on and it makes the chunk smaller, the data itself
+ * otherwise.  If *packed is not data, it must be freed with free().
+ */
+static int pack_chunk(const void *data, size_t size, void **packed, size_t *packed_size)
+{
+  *packed = (void *) data;
+  *packed_size = size;
+  if (! compress_chunks || size == 0)
+    return 0;
+
+  // the compressed data is followed by room to decompress it again as a check
+  size_t bound = lz_compress_bound(size);
+  unsigned char *buf = malloc(bound + size);
+  if (! buf)
+    return 1;
+  size_t lz_size = lz_compress(data, size, buf, bound);
+  if (lz_size == 0 || lz_size >= size) {
+    free(buf);
+    return 0;
+  }
+  if (lz_decompress(buf, lz_size, buf + bound, size) != 0 || memcmp(buf + bound, data, size) != 0) {
+    debug_log("** ERROR: compressed chunk doesn't decompress\n");
+    free(buf);
+    return 1;
+  }
+
+  *packed = buf;
+  *packed_size = lz_size;
+  return 0;
+}
+
+/*
+ * Texture record: u32 stored size, u32 data size, and the data
+ * (compressed if the sizes are different).
+ */
+static int write_texture_chunk(struct BFF_WRITER *bff, const void *data, uint32_t data_size)
+{
+  void *packed;
+  size_t packed_size;
+  if (pack_chunk(data, data_size, &packed, &packed_size) != 0)
+    return 1;
+  if (packed != data)
+    debug_log("   compressed %u -> %u bytes\n", (unsigned) data_size, (unsigned) packed_size);
+
+  int ret = 0;
+  if (write_u32(bff, packed_size) != 0 ||
+      write_u32(bff, data_size) != 0 ||
+      write_data(bff, packed, packed_size) != 0)
+    ret = 1;
+  if (packed != data)
+    free(packed);
+  return ret;
+}
+
+/*
+ * Mesh vertex and index data in BMF/BCF files: u32 stored size and
+ * the data (compressed if the stored size is not vtx_size+ind_size).
+ */
+static int write_mesh_chunk(struct BFF_WRITER *bff, struct MODEL_MESH *mesh)
+{
+  size_t data_size = (size_t) mesh->vtx_size + mesh->ind_size;
+  unsigned char *data = malloc(data_size);
+  if (! data)
+    return 1;
+  memcpy(data, mesh->vtx, mesh->vtx_size);
+  memcpy(data + mesh->vtx_size, mesh->ind, mesh->ind_size);
+
+  void *packed;
+  size_t packed_size;
+  if (pack_chunk(data, data_size, &packed, &packed_size) != 0) {
+    free(data);
+    return 1;
+  }
+
+  int ret = 0;
+  if (write_u32(bff, packed_size) != 0 ||
+      write_data(bff, packed, packed_size) != 0)
+    ret = 1;
+  if (packed != data)
+    free(packed);
+  free(data);
+  return ret;
+}
+
+static int get_btx_format(const unsigned char *rgba, int width, int height)
+{
+  switch (texture_format) {
+  case BFF_TEXTURE_RGBA: return BTX_FORMAT_RGBA8;
+  case BFF_TEXTURE_BC1:  return BTX_FORMAT_BC1;
+  case BFF_TEXTURE_BC3:  return BTX_FORMAT_BC3;
+  case BFF_TEXTURE_BC7:  return BTX_FORMAT_BC7;
+  }
+
+  // auto: BC1 unless there's alpha
+  for (size_t i = 0; i < (size_t) width * height; i++) {
+    if (rgba[4*i+3] != 255)
+      return BTX_FORMAT_BC3;
+  }
+  return BTX_FORMAT_BC1;
+}
+
+/*
+ * Write a texture record from PNG/JPEG data.  Unless we're keeping
+ * the original format, the image is decoded and written as a BTX
+ * chunk with all mip levels.
+ */
+static int write_texture(struct BFF_WRITER *bff, const void *data, uint32_t data_size)
+{
+  if (texture_format == BFF_TEXTURE_ORIGINAL)
+    return write_texture_chunk(bff, data, data_size);
+
+  int width, height, n_chan;
+  unsigned char *rgba = stbi_load_from_memory(data, data_size, &width, &height, &n_chan, 4);
+  if (! rgba) {
+    debug_log("** ERROR: can't decode texture image\n");
+    return 1;
+  }
+  int format = get_btx_format(rgba, width, height);
+  size_t btx_size;
+  unsigned char *btx = encode_btx(rgba, width, height, format, &btx_size);
+  if (! btx) {
+    debug_log("** ERROR: can't encode %dx%d texture\n", width, height);
+    stbi_image_free(rgba);
+    return 1;
+  }
+
+  double psnr;
+  if (check_btx(btx, btx_size, rgba, &psnr) != 0) {
+    debug_log("** ERROR: encoded texture doesn't decode\n");
+    goto err;
+  }
+  static const char *const format_names[] = { "RGBA8", "BC1", "BC3", "BC7" };
+  debug_log("   %dx%d %s, %u -> %u bytes, PSNR %.1f dB\n", width, height, format_names[format],
+            (unsigned) data_size, (unsigned) btx_size, psnr);
+
+  if (write_texture_chunk(bff, btx, btx_size) != 0)
+    goto err;
+  free(btx);
+  stbi_image_free(rgba);
+  return 0;
+
+ err:
+  free(btx);
+  stbi_image_free(rgba);
+  return 1;
+}
+
 static int write_model_meshes(struct BFF_WRITER *bff, struct MODEL *model, void *data)
 {
   if (write_u16(bff, model->n_meshes) != 0)
@@ -163,9 +389,13 @@ static int write_model_meshes(struct BFF_WRITER *bff, struct MODEL *model, void
         write_u16(bff, mesh->ind_type) != 0 ||
         write_u32(bff, tex0_index) != 0 ||
         write_u32(bff, tex1_index) != 0 ||
-        write_mat4(bff, mesh->matrix) != 0 ||
-        write_data(bff, mesh->vtx, mesh->vtx_size) != 0 ||
-        write_data(bff, mesh->ind, mesh->ind_size) != 0)
+        write_mat4(bff, mesh->matrix) != 0)
+      return 1;
+    if (bff->packed_meshes) {
+      if (write_mesh_chunk(bff, mesh) != 0)
+        return 1;
+    } else if (write_data(bff, mesh->vtx, mesh->vtx_size) != 0 ||
+               write_data(bff, mesh->ind, mesh->ind_size) != 0)
       return 1;
   }
 
@@ -176,7 +406,7 @@ static int write_model_meshes(struct BFF_WRITER *bff, struct MODEL *model, void
  * Write BCF
  */
 
-#define BCF_VERSION '1'
+#define BCF_VERSION '2'
 
 static int get_bcf_tex_index(struct BFF_WRITER *bff, struct MODEL *model, int model_tex_index, uint32_t *bcf_tex_index, void *data)
 {
@@ -206,9 +436,7 @@ static int write_bcf_model_textures(struct BFF_WRITER *bff, struct MODEL *model)
     debug_log("-> writing texture %d\n", i);
     
     struct MODEL_TEXTURE *tex = &model->textures[i];
-    uint32_t data_size = tex->height;
-    if (write_u32(bff, data_size) != 0 ||
-        write_data(bff, tex->data, data_size) != 0) {
+    if (write_texture(bff, tex->data, tex->height) != 0) {
       debug_log("** ERROR: can't write texture data\n");
       return 1;
     }
@@ -295,6 +523,7 @@ int write_bcf_file(const char *bcf_filename, const char *glb_filename)
     debug_log("** ERROR opening file '%s'\n", bcf_filename);
     goto err;
   }
+  bff.packed_meshes = 1;
 
   if (write_bcf_header(&bff) != 0)
     goto err;
@@ -329,7 +558,7 @@ int write_bcf_file(const char *bcf_filename, const char *glb_filename)
  * Write BMF
  */
 
-#define BMF_VERSION '1'
+#define BMF_VERSION '2'
 
 static int get_bmf_tex_index(struct BFF_WRITER *bff, struct MODEL *model, int model_tex_index, uint32_t *bwf_tex_index, void *data)
 {
@@ -359,9 +588,7 @@ int write_bmf_model_textures(struct BFF_WRITER *bff, struct MODEL *model)
     debug_log("-> writing texture %d\n", i);
     
     struct MODEL_TEXTURE *tex = &model->textures[i];
-    uint32_t data_size = tex->height;
-    if (write_u32(bff, data_size) != 0 ||
-        write_data(bff, tex->data, data_size) != 0) {
+    if (write_texture(bff, tex->data, tex->height) != 0) {
       debug_log("** ERROR: can't write texture data\n");
       return 1;
     }
@@ -382,6 +609,7 @@ int write_bmf_file(const char *bmf_filename, const char *glb_filename)
     debug_log("** ERROR opening file '%s'\n", bmf_filename);
     goto err;
   }
+  bff.packed_meshes = 1;
 
   if (write_bmf_header(&bff) != 0)
     goto err;
@@ -411,19 +639,28 @@ int write_bmf_file(const char *bmf_filename, const char *glb_filename)
  * Write BWF
  */
 
-#define BWF_VERSION '1'
+#define BWF_VERSION '4'
+
+#define BWF_HEADER_SIZE  16
+#define BWF_PAGE_SIZE    4096
 
 struct IMAGE_INFO {
   uint32_t index;
   char name[256];
-  struct ROOM_INFO *room_info;
+  struct ROOM_INFO *room_info;   // first room that uses the image
   int model_tex_index;
+  int n_rooms;                   // number of rooms that use the image
   size_t file_offset;
+  size_t file_size;
 };
 
 struct ROOM_INFO {
   struct EDITOR_ROOM *room;
   size_t file_offset;
+  size_t stored_size;
+  size_t data_size;
+  int n_images;
+  uint32_t image_index[MODEL_MAX_TEXTURES];
 };
 
 struct BWF_WRITER {
@@ -472,6 +709,7 @@ static struct ROOM_INFO *create_room_info(struct EDITOR_ROOM_LIST *rooms, int *p
   for (struct EDITOR_ROOM *room = rooms->list; room != NULL; room = room->next) {
     struct ROOM_INFO *info = &room_info[--room_index];
     info->room = room;
+    info->n_images = 0;
     room->serialization_index = room_index;
   }
 
@@ -500,18 +738,25 @@ static struct IMAGE_INFO *get_image(struct BWF_WRITER *bwf, struct MODEL_TEXTURE
   strcpy(image->name, image_name);
   image->room_info = room_info;
   image->model_tex_index = tex_index;
+  image->n_rooms = 0;
   image->file_offset = 0;
+  image->file_size = 0;
   return image;
 }
 
+/*
+ * The header has the magic, a reserved u32 and the u64 index offset,
+ * written at the end.
+ */
 static int write_bwf_header(struct BWF_WRITER *bwf)
 {
-  char header[8];
+  char header[BWF_HEADER_SIZE];
   
   memcpy(header + 0, "BWF", 3);
   header[3] = BWF_VERSION;
-  memset(header + 4, 0xff, 4);
-  if (write_data(&bwf->bff, header, 8) != 0) {
+  memset(header + 4, 0, 4);
+  memset(header + 8, 0xff, 8);
+  if (write_data(&bwf->bff, header, BWF_HEADER_SIZE) != 0) {
     debug_log("** ERROR: can't write file header\n");
     return 1;
   }
@@ -546,38 +791,49 @@ static int write_bwf_room_neighbors(struct BWF_WRITER *bwf, struct EDITOR_ROOM *
   return 0;
 }
 
-static int write_bwf_room_tiles(struct BWF_WRITER *bwf, uint16_t (*tiles)[256])
+#define BWF_TILE_CHUNK_SIZE  16
+
+static bool is_bwf_tile_chunk_empty(uint16_t (*tiles)[256], int cx, int cy)
 {
-  int x_min, y_min, x_max, y_max;
-  x_min = y_min = x_max = y_max = -1;
-  for (int y = 0; y < 256; y++) {
-    for (int x = 0; x < 256; x++) {
-      if (tiles[y][x]) {
-        if (x_min < 0 || x_min > x) x_min = x;
-        if (x_max < 0 || x_max < x) x_max = x;
-        if (y_min < 0 || y_min > y) y_min = y;
-        if (y_max < 0 || y_max < y) y_max = y;
-      }
+  for (int y = 0; y < BWF_TILE_CHUNK_SIZE; y++) {
+    for (int x = 0; x < BWF_TILE_CHUNK_SIZE; x++) {
+      if (tiles[cy*BWF_TILE_CHUNK_SIZE + y][cx*BWF_TILE_CHUNK_SIZE + x])
+        return false;
     }
   }
-  int x_size, y_size;
-  if (x_min < 0) {
-    x_min = y_min = 0;
-    x_size = y_size = 0;
-  } else {
-    x_size = x_max - x_min + 1;
-    y_size = y_max - y_min + 1;
+  return true;
+}
+
+/*
+ * Write only the 16x16 chunks that have a nonzero tile.  The room
+ * record starts with the 12 byte position and each chunk takes an
+ * even number of bytes, so the tiles are always 2 byte aligned.
+ */
+static int write_bwf_room_tiles(struct BWF_WRITER *bwf, uint16_t (*tiles)[256])
+{
+  int n_chunks = 0;
+  for (int cy = 0; cy < 256/BWF_TILE_CHUNK_SIZE; cy++) {
+    for (int cx = 0; cx < 256/BWF_TILE_CHUNK_SIZE; cx++) {
+      if (! is_bwf_tile_chunk_empty(tiles, cx, cy))
+        n_chunks++;
+    }
   }
 
-  if (write_u8(&bwf->bff, x_min) != 0 ||
-      write_u8(&bwf->bff, x_size) != 0 ||
-      write_u8(&bwf->bff, y_min) != 0 ||
-      write_u8(&bwf->bff, y_size) != 0)
+  if (write_u16(&bwf->bff, n_chunks) != 0)
     return 1;
-  for (int y = 0; y < y_size; y++) {
-    for (int x = 0; x < x_size; x++) {
-      if (write_u16(&bwf->bff, tiles[y_min + y][x_min + x]) != 0)
+  for (int cy = 0; cy < 256/BWF_TILE_CHUNK_SIZE; cy++) {
+    for (int cx = 0; cx < 256/BWF_TILE_CHUNK_SIZE; cx++) {
+      if (is_bwf_tile_chunk_empty(tiles, cx, cy))
+        continue;
+      if (write_u8(&bwf->bff, cx) != 0 ||
+          write_u8(&bwf->bff, cy) != 0)
         return 1;
+      for (int y = 0; y < BWF_TILE_CHUNK_SIZE; y++) {
+        for (int x = 0; x < BWF_TILE_CHUNK_SIZE; x++) {
+          if (write_u16(&bwf->bff, tiles[cy*BWF_TILE_CHUNK_SIZE + y][cx*BWF_TILE_CHUNK_SIZE + x]) != 0)
+            return 1;
+        }
+      }
     }
   }
   return 0;
@@ -589,7 +845,9 @@ static int write_bwf_room(struct BWF_WRITER *bwf, struct ROOM_INFO *room_info)
   
   debug_log("-> writing room %d (%s)\n", room->serialization_index, room->name);
 
+  // the whole room is a chunk
   room_info->file_offset = bwf->bff.cur_file_offset;
+  begin_capture(&bwf->bff);
 
   if (write_f32(&bwf->bff, room->pos[0]) != 0 ||
       write_f32(&bwf->bff, room->pos[1]) != 0 ||
@@ -598,16 +856,16 @@ static int write_bwf_room(struct BWF_WRITER *bwf, struct ROOM_INFO *room_info)
     return 1;
   }
 
-  if (write_bwf_room_neighbors(bwf, room) != 0) {
-    debug_log("** ERROR: can't write room neighbors\n");
-    return 1;
-  }
-  
   if (write_bwf_room_tiles(bwf, room->tiles) != 0) {
     debug_log("** ERROR: can't write room tiles\n");
     return 1;
   }
 
+  if (write_bwf_room_neighbors(bwf, room) != 0) {
+    debug_log("** ERROR: can't write room neighbors\n");
+    return 1;
+  }
+
   char filename[256];
   snprintf(filename, sizeof(filename), "data/%s.glb", room->name);
   
@@ -621,9 +879,24 @@ static int write_bwf_room(struct BWF_WRITER *bwf, struct ROOM_INFO *room_info)
     free_model(&model);
     return 1;
   }
-
   free_model(&model);
-  return 0;
+
+  end_capture(&bwf->bff);
+  void *packed;
+  size_t packed_size;
+  if (pack_chunk(bwf->bff.capture, bwf->bff.capture_size, &packed, &packed_size) != 0)
+    return 1;
+  room_info->stored_size = packed_size;
+  room_info->data_size = bwf->bff.capture_size;
+  if (packed != bwf->bff.capture)
+    debug_log("   compressed %u -> %u bytes\n", (unsigned) room_info->data_size, (unsigned) packed_size);
+
+  int ret = write_data(&bwf->bff, packed, packed_size);
+  if (packed != bwf->bff.capture)
+    free(packed);
+  if (ret != 0)
+    debug_log("** ERROR: can't write room data\n");
+  return ret;
 }
 
 static int write_bwf_image(struct BWF_WRITER *bwf, struct IMAGE_INFO *image)
@@ -658,50 +931,288 @@ static int write_bwf_image(struct BWF_WRITER *bwf, struct IMAGE_INFO *image)
   }
 
   image->file_offset = bwf->bff.cur_file_offset;
-  if (write_u32(&bwf->bff, data_size) != 0 ||
-      write_data(&bwf->bff, data, data_size) != 0) {
+  if (write_texture(&bwf->bff, data, data_size) != 0) {
     debug_log("** ERROR: can't write image data\n");
     free(data);
     return 1;
   }
+  image->file_size = bwf->bff.cur_file_offset - image->file_offset;
 
   free(data);
   return 0;
 }
 
+/*
+ * Find the images used by each room before writing anything, so we
+ * know which ones are exclusive to a room.
+ */
+static int scan_bwf_room_images(struct BWF_WRITER *bwf, struct ROOM_INFO *room_info)
+{
+  char filename[256];
+  snprintf(filename, sizeof(filename), "data/%s.glb", room_info->room->name);
+
+  struct MODEL model;
+  if (read_glb_model(&model, filename, MODEL_FLAGS_IMAGE_REFS) != 0) {
+    debug_log("** ERROR: can't read model from '%s'\n", filename);
+    return 1;
+  }
+  for (int i = 0; i < model.n_meshes; i++) {
+    int tex_index[2] = { model.meshes[i]->tex0_index, model.meshes[i]->tex1_index };
+    for (int j = 0; j < 2; j++) {
+      if (tex_index[j] == MODEL_TEXTURE_NONE)
+        continue;
+      struct IMAGE_INFO *image = get_image(bwf, &model.textures[tex_index[j]], room_info, tex_index[j]);
+      if (! image) {
+        free_model(&model);
+        return 1;
+      }
+      int k;
+      for (k = 0; k < room_info->n_images; k++) {
+        if (room_info->image_index[k] == image->index)
+          break;
+      }
+      if (k == room_info->n_images && room_info->n_images < MODEL_MAX_TEXTURES) {
+        room_info->image_index[room_info->n_images++] = image->index;
+        image->n_rooms++;
+      }
+    }
+  }
+  free_model(&model);
+  return 0;
+}
+
+/*
+ * Order the rooms breadth-first over the neighbor graph starting at
+ * room 0 (where the game starts), so rooms loaded together end up
+ * close together in the file.  The room indices don't change, only
+ * where the rooms are written.
+ */
+static int *get_bwf_room_order(struct BWF_WRITER *bwf)
+{
+  int *order = malloc(bwf->n_rooms * sizeof *order);
+  char *seen = calloc(bwf->n_rooms, 1);
+  if (! order || ! seen) {
+    free(order);
+    free(seen);
+    return NULL;
+  }
+
+  int n_ordered = 0;
+  for (int start = 0; start < bwf->n_rooms; start++) {
+    if (seen[start])
+      continue;
+    seen[start] = 1;
+    order[n_ordered++] = start;
+    for (int next = n_ordered - 1; next < n_ordered; next++) {
+      struct EDITOR_ROOM *room = bwf->rooms[order[next]].room;
+      for (int i = 0; i < room->n_neighbors; i++) {
+        int neighbor = room->neighbors[i]->serialization_index;
+        if (! seen[neighbor]) {
+          seen[neighbor] = 1;
+          order[n_ordered++] = neighbor;
+        }
+      }
+    }
+  }
+
+  free(seen);
+  return order;
+}
+
+static int align_bwf_file_pos(struct BWF_WRITER *bwf, size_t align)
+{
+  static const char zeros[BWF_PAGE_SIZE];
+  size_t pad = (align - bwf->bff.cur_file_offset % align) % align;
+  return write_data(&bwf->bff, zeros, pad);
+}
+
+struct PAGE_RANGE {
+  size_t first;
+  size_t last;
+};
+
+static int compare_page_ranges(const void *p1, const void *p2)
+{
+  const struct PAGE_RANGE *r1 = p1;
+  const struct PAGE_RANGE *r2 = p2;
+  return (r1->first > r2->first) - (r1->first < r2->first);
+}
+
+static void add_page_range(struct PAGE_RANGE *ranges, int *n_ranges, size_t offset, size_t size)
+{
+  if (size == 0)
+    return;
+  ranges[*n_ranges].first = offset / BWF_PAGE_SIZE;
+  ranges[*n_ranges].last = (offset + size - 1) / BWF_PAGE_SIZE;
+  (*n_ranges)++;
+}
+
+static size_t count_pages(struct PAGE_RANGE *ranges, int n_ranges)
+{
+  qsort(ranges, n_ranges, sizeof *ranges, compare_page_ranges);
+  size_t n_pages = 0;
+  size_t next_page = 0;   // first page not counted yet
+  for (int i = 0; i < n_ranges; i++) {
+    size_t first = (ranges[i].first > next_page) ? ranges[i].first : next_page;
+    if (ranges[i].last >= first) {
+      n_pages += ranges[i].last - first + 1;
+      next_page = ranges[i].last + 1;
+    }
+  }
+  return n_pages;
+}
+
+static int is_room_in_set(struct EDITOR_ROOM *set_room, struct EDITOR_ROOM *room)
+{
+  if (room == set_room)
+    return 1;
+  for (int i = 0; i < set_room->n_neighbors; i++) {
+    if (set_room->neighbors[i] == room)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Count the pages read when the game moves from room 'from' to room
+ * 'to': it loads 'to' and its neighbors, except the rooms it already
+ * has ('from' and its neighbors), with the textures they use that
+ * aren't used by the rooms it already has.
+ */
+static size_t count_transition_pages(struct BWF_WRITER *bwf, struct ROOM_INFO *from, struct ROOM_INFO *to,
+                                     size_t *room_off, size_t *image_off, struct PAGE_RANGE *ranges)
+{
+  struct EDITOR_ROOM *load[EDITOR_ROOM_MAX_NEIGHBORS+1];
+  int n_load = 0;
+  load[n_load++] = to->room;
+  for (int i = 0; i < to->room->n_neighbors; i++)
+    load[n_load++] = to->room->neighbors[i];
+
+  int n_ranges = 0;
+  for (int i = 0; i < n_load; i++) {
+    if (is_room_in_set(from->room, load[i]))
+      continue;
+    struct ROOM_INFO *info = &bwf->rooms[load[i]->serialization_index];
+    add_page_range(ranges, &n_ranges, room_off[load[i]->serialization_index], info->stored_size);
+    for (int j = 0; j < info->n_images; j++) {
+      struct IMAGE_INFO *image = &bwf->images[info->image_index[j]];
+      int loaded = 0;
+      for (int k = 0; k < bwf->n_rooms && ! loaded; k++) {
+        struct ROOM_INFO *other = &bwf->rooms[k];
+        if (! is_room_in_set(from->room, other->room))
+          continue;
+        for (int l = 0; l < other->n_images; l++) {
+          if (other->image_index[l] == image->index)
+            loaded = 1;
+        }
+      }
+      if (! loaded)
+        add_page_range(ranges, &n_ranges, image_off[image->index], image->file_size);
+    }
+  }
+  return count_pages(ranges, n_ranges);
+}
+
+/*
+ * Compare the pages touched by every room transition with what they
+ * would be in the old layout (rooms in index order, then all images),
+ * using the same chunk sizes.
+ */
+static int print_bwf_layout_stats(struct BWF_WRITER *bwf)
+{
+  size_t *old_room_off = malloc(bwf->n_rooms * sizeof(size_t));
+  size_t *new_room_off = malloc(bwf->n_rooms * sizeof(size_t));
+  size_t *old_image_off = malloc((bwf->n_images + 1) * sizeof(size_t));
+  size_t *new_image_off = malloc((bwf->n_images + 1) * sizeof(size_t));
+  struct PAGE_RANGE *ranges = malloc((EDITOR_ROOM_MAX_NEIGHBORS+1) * (MODEL_MAX_TEXTURES+1) * sizeof *ranges);
+  int ret = 1;
+  if (! old_room_off || ! new_room_off || ! old_image_off || ! new_image_off || ! ranges)
+    goto err;
+
+  size_t pos = BWF_HEADER_SIZE;
+  for (int i = 0; i < bwf->n_rooms; i++) {
+    old_room_off[i] = pos;
+    new_room_off[i] = bwf->rooms[i].file_offset;
+    pos += bwf->rooms[i].stored_size;
+  }
+  for (int i = 0; i < bwf->n_images; i++) {
+    old_image_off[i] = pos;
+    new_image_off[i] = bwf->images[i].file_offset;
+    pos += bwf->images[i].file_size;
+  }
+
+  printf("-> pages touched by room transitions (old layout -> new layout):\n");
+  size_t old_total = 0, new_total = 0;
+  int n_transitions = 0;
+  for (int i = 0; i < bwf->n_rooms; i++) {
+    struct ROOM_INFO *from = &bwf->rooms[i];
+    for (int j = 0; j < from->room->n_neighbors; j++) {
+      struct ROOM_INFO *to = &bwf->rooms[from->room->neighbors[j]->serialization_index];
+      size_t old_pages = count_transition_pages(bwf, from, to, old_room_off, old_image_off, ranges);
+      size_t new_pages = count_transition_pages(bwf, from, to, new_room_off, new_image_off, ranges);
+      printf("   %s -> %s: %u -> %u\n", from->room->name, to->room->name, (unsigned) old_pages, (unsigned) new_pages);
+      old_total += old_pages;
+      new_total += new_pages;
+      n_transitions++;
+    }
+  }
+  if (n_transitions > 0)
+    printf("   average: %.1f -> %.1f pages\n", (double) old_total / n_transitions, (double) new_total / n_transitions);
+  ret = 0;
+
+ err:
+  free(old_room_off);
+  free(new_room_off);
+  free(old_image_off);
+  free(new_image_off);
+  free(ranges);
+  return ret;
+}
+
+/*
+ * The index starts at a page with the room and image counts and two
+ * reserved u32s, followed by fixed size entries for the rooms (u64
+ * offset, u32 stored size, u32 data size) and images (u64 offset).
+ * The game reads entries straight from the file mapping as it needs
+ * them, and an entry never crosses a page.
+ */
 static int write_bwf_index(struct BWF_WRITER *bwf)
 {
   debug_log("-> writing index\n");
 
+  if (align_bwf_file_pos(bwf, BWF_PAGE_SIZE) != 0) {
+    debug_log("** ERROR: can't write index\n");
+    return 1;
+  }
   size_t index_offset = bwf->bff.cur_file_offset;
   
-  if (write_u32(&bwf->bff, bwf->n_rooms) != 0) {
-    debug_log("** ERROR: can't write room index\n");
+  if (write_u32(&bwf->bff, bwf->n_rooms) != 0 ||
+      write_u32(&bwf->bff, bwf->n_images) != 0 ||
+      write_u32(&bwf->bff, 0) != 0 ||
+      write_u32(&bwf->bff, 0) != 0) {
+    debug_log("** ERROR: can't write index\n");
     return 1;
   }
   for (int i = 0; i < bwf->n_rooms; i++) {
-    if (write_u32(&bwf->bff, bwf->rooms[i].file_offset) != 0) {
+    if (write_u64(&bwf->bff, bwf->rooms[i].file_offset) != 0 ||
+        write_u32(&bwf->bff, bwf->rooms[i].stored_size) != 0 ||
+        write_u32(&bwf->bff, bwf->rooms[i].data_size) != 0) {
       debug_log("** ERROR: can't write room index\n");
       return 1;
     }
   }
-
-  if (write_u32(&bwf->bff, bwf->n_images) != 0) {
-    debug_log("** ERROR: can't write image index\n");
-    return 1;
-  }
   for (int i = 0; i < bwf->n_images; i++) {
-    if (write_u32(&bwf->bff, bwf->images[i].file_offset) != 0) {
+    if (write_u64(&bwf->bff, bwf->images[i].file_offset) != 0) {
       debug_log("** ERROR: can't write image index\n");
       return 1;
     }
   }
 
-  if (set_file_pos(&bwf->bff, 4) != 0) {
+  if (set_file_pos(&bwf->bff, 8) != 0) {
     debug_log("** ERROR: can't seek to header\n");
     return 1;
   }
-  if (write_u32(&bwf->bff, index_offset) != 0) {
+  if (write_u64(&bwf->bff, index_offset) != 0) {
     debug_log("** ERROR: can't write index offset to header\n");
     return 1;
   }
@@ -711,6 +1222,7 @@ static int write_bwf_index(struct BWF_WRITER *bwf)
 
 int write_bwf_file(const char *filename, struct EDITOR_ROOM_LIST *rooms)
 {
+  int *order = NULL;
   struct BWF_WRITER bwf;
   if (open_bwf(&bwf, filename, get_bwf_tex_index) != 0) {
     debug_log("** ERROR opening file '%s'\n", filename);
@@ -723,21 +1235,44 @@ int write_bwf_file(const char *filename, struct EDITOR_ROOM_LIST *rooms)
     goto err;
   }
   
+  for (int i = 0; i < bwf.n_rooms; i++) {
+    if (scan_bwf_room_images(&bwf, &bwf.rooms[i]) != 0)
+      goto err;
+  }
+  order = get_bwf_room_order(&bwf);
+  if (! order) {
+    debug_log("** ERROR: out of memory for room order\n");
+    goto err;
+  }
+
   if (write_bwf_header(&bwf) != 0)
     goto err;
-  
+
+  // each room starts at a page and is followed by the images only it uses
   for (int i = 0; i < bwf.n_rooms; i++) {
-    if (write_bwf_room(&bwf, &bwf.rooms[i]) != 0)
+    struct ROOM_INFO *room_info = &bwf.rooms[order[i]];
+    if (align_bwf_file_pos(&bwf, BWF_PAGE_SIZE) != 0 ||
+        write_bwf_room(&bwf, room_info) != 0)
       goto err;
+    for (int j = 0; j < room_info->n_images; j++) {
+      struct IMAGE_INFO *image = &bwf.images[room_info->image_index[j]];
+      if (image->n_rooms == 1 && write_bwf_image(&bwf, image) != 0)
+        goto err;
+    }
   }
 
+  // shared images go at the end
   for (int i = 0; i < bwf.n_images; i++) {
-    if (write_bwf_image(&bwf, &bwf.images[i]) != 0)
+    if (bwf.images[i].n_rooms != 1 && write_bwf_image(&bwf, &bwf.images[i]) != 0)
       goto err;
   }
 
   if (write_bwf_index(&bwf) != 0)
     goto err;
+
+  if (show_layout_stats && print_bwf_layout_stats(&bwf) != 0)
+    goto err;
+  free(order);
   
   if (close_bwf(&bwf) != 0) {
     debug_log("** ERROR writing file data\n");
@@ -748,6 +1283,7 @@ int write_bwf_file(const char *filename, struct EDITOR_ROOM_LIST *rooms)
   return 0;
 
  err:
+  free(order);
   close_bwf(&bwf);
   return 1;
 }
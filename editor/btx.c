@@ -0,0 +1,254 @@
+/* btx.c
+ *
+ * BTX texture chunk reader and CPU decoder.  The decoder is used when
+ * the GL driver can't take a block compressed format, and lets tools
+ * check the pixels without a GL context.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "btx.h"
+
+static uint32_t read_btx_u32(const unsigned char *p)
+{
+  return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+int is_btx_data(const void *data, size_t size)
+{
+  return size >= BTX_HEADER_SIZE && memcmp(data, "BTX1", 4) == 0;
+}
+
+size_t get_btx_level_size(int format, int width, int height)
+{
+  size_t blocks = (size_t) ((width + 3) / 4) * ((height + 3) / 4);
+  switch (format) {
+  case BTX_FORMAT_RGBA8: return (size_t) width * height * 4;
+  case BTX_FORMAT_BC1:   return blocks * 8;
+  case BTX_FORMAT_BC3:   return blocks * 16;
+  case BTX_FORMAT_BC7:   return blocks * 16;
+  }
+  return 0;
+}
+
+int get_btx_level_width(struct BTX_INFO *info, int level)
+{
+  int width = info->width >> level;
+  return (width > 0) ? width : 1;
+}
+
+int get_btx_level_height(struct BTX_INFO *info, int level)
+{
+  int height = info->height >> level;
+  return (height > 0) ? height : 1;
+}
+
+/*
+ * Parse and check the chunk header.  The level data pointers point
+ * into the chunk.
+ */
+int read_btx_info(struct BTX_INFO *info, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+  if (! is_btx_data(data, size))
+    return 1;
+
+  info->format = p[4];
+  info->n_levels = p[5];
+  info->width = read_btx_u32(p + 8);
+  info->height = read_btx_u32(p + 12);
+  if (info->format > BTX_FORMAT_BC7 || info->n_levels < 1 || info->n_levels > BTX_MAX_LEVELS ||
+      info->width < 1 || info->width > BTX_MAX_SIZE || info->height < 1 || info->height > BTX_MAX_SIZE)
+    return 1;
+
+  size_t pos = BTX_HEADER_SIZE + 4 * (size_t) info->n_levels;
+  if (pos > size)
+    return 1;
+  for (int level = 0; level < info->n_levels; level++) {
+    int width = get_btx_level_width(info, level);
+    int height = get_btx_level_height(info, level);
+    size_t level_size = read_btx_u32(p + BTX_HEADER_SIZE + 4*level);
+    if (level_size != get_btx_level_size(info->format, width, height) || level_size > size - pos)
+      return 1;
+    info->level_data[level] = p + pos;
+    info->level_size[level] = level_size;
+    pos += level_size;
+  }
+  return 0;
+}
+
+/* ========================================================================================
+ * Block decoders.  Each one writes a 4x4 block of RGBA pixels.
+ */
+
+static void decode_rgb565(uint16_t c, unsigned char *rgb)
+{
+  unsigned int r = (c >> 11) & 0x1f;
+  unsigned int g = (c >>  5) & 0x3f;
+  unsigned int b = (c      ) & 0x1f;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+static void decode_bc1_block(const unsigned char *src, unsigned char *block, int force_four_colors)
+{
+  uint16_t c0 = src[0] | (src[1] << 8);
+  uint16_t c1 = src[2] | (src[3] << 8);
+  uint32_t indices = read_btx_u32(src + 4);
+
+  unsigned char palette[4][4];
+  decode_rgb565(c0, palette[0]);
+  decode_rgb565(c1, palette[1]);
+  palette[0][3] = palette[1][3] = 255;
+  if (c0 > c1 || force_four_colors) {
+    for (int i = 0; i < 3; i++) {
+      palette[2][i] = (2*palette[0][i] + palette[1][i]) / 3;
+      palette[3][i] = (palette[0][i] + 2*palette[1][i]) / 3;
+    }
+    palette[2][3] = palette[3][3] = 255;
+  } else {
+    for (int i = 0; i < 3; i++) {
+      palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+      palette[3][i] = 0;
+    }
+    palette[2][3] = 255;
+    palette[3][3] = 0;
+  }
+
+  for (int i = 0; i < 16; i++)
+    memcpy(&block[4*i], palette[(indices >> (2*i)) & 3], 4);
+}
+
+static void decode_bc3_alpha(const unsigned char *src, unsigned char *block)
+{
+  unsigned int a[8];
+  a[0] = src[0];
+  a[1] = src[1];
+  if (a[0] > a[1]) {
+    for (int i = 1; i < 7; i++)
+      a[i+1] = ((7-i)*a[0] + i*a[1]) / 7;
+  } else {
+    for (int i = 1; i < 5; i++)
+      a[i+1] = ((5-i)*a[0] + i*a[1]) / 5;
+    a[6] = 0;
+    a[7] = 255;
+  }
+
+  uint64_t indices = 0;
+  for (int i = 0; i < 6; i++)
+    indices |= (uint64_t) src[2+i] << (8*i);
+  for (int i = 0; i < 16; i++)
+    block[4*i+3] = a[(indices >> (3*i)) & 7];
+}
+
+static void decode_bc3_block(const unsigned char *src, unsigned char *block)
+{
+  decode_bc1_block(src + 8, block, 1);
+  decode_bc3_alpha(src, block);
+}
+
+static unsigned int read_block_bits(const unsigned char *src, int *pos, int n_bits)
+{
+  unsigned int val = 0;
+  for (int i = 0; i < n_bits; i++, (*pos)++)
+    val |= ((src[*pos >> 3] >> (*pos & 7)) & 1) << i;
+  return val;
+}
+
+static const unsigned char bc7_weights4[16] = {
+  0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+/*
+ * Only mode 6 (one subset, 7 bit RGBA endpoints with a p-bit each,
+ * 4 bit indices) is supported: it's the one the builder writes.
+ */
+static int decode_bc7_block(const unsigned char *src, unsigned char *block)
+{
+  if ((src[0] & 0x7f) != 0x40)
+    return 1;
+
+  int pos = 7;
+  unsigned int endpoint[2][4];
+  for (int c = 0; c < 4; c++) {
+    endpoint[0][c] = read_block_bits(src, &pos, 7);
+    endpoint[1][c] = read_block_bits(src, &pos, 7);
+  }
+  for (int e = 0; e < 2; e++) {
+    unsigned int pbit = read_block_bits(src, &pos, 1);
+    for (int c = 0; c < 4; c++)
+      endpoint[e][c] = (endpoint[e][c] << 1) | pbit;
+  }
+
+  for (int i = 0; i < 16; i++) {
+    unsigned int w = bc7_weights4[read_block_bits(src, &pos, (i == 0) ? 3 : 4)];
+    for (int c = 0; c < 4; c++)
+      block[4*i+c] = ((64-w)*endpoint[0][c] + w*endpoint[1][c] + 32) >> 6;
+  }
+  return 0;
+}
+
+/*
+ * Decode a level into width*height RGBA pixels.
+ */
+int decode_btx_level(struct BTX_INFO *info, int level, unsigned char *rgba)
+{
+  int width = get_btx_level_width(info, level);
+  int height = get_btx_level_height(info, level);
+  const unsigned char *src = info->level_data[level];
+
+  if (info->format == BTX_FORMAT_RGBA8) {
+    memcpy(rgba, src, info->level_size[level]);
+    return 0;
+  }
+
+  size_t block_size = (info->format == BTX_FORMAT_BC1) ? 8 : 16;
+  for (int by = 0; by < height; by += 4) {
+    for (int bx = 0; bx < width; bx += 4) {
+      unsigned char block[16*4];
+      switch (info->format) {
+      case BTX_FORMAT_BC1: decode_bc1_block(src, block, 0); break;
+      case BTX_FORMAT_BC3: decode_bc3_block(src, block); break;
+      case BTX_FORMAT_BC7:
+        if (decode_bc7_block(src, block) != 0)
+          return 1;
+        break;
+      }
+      src += block_size;
+
+      for (int y = 0; y < 4 && by + y < height; y++) {
+        int n = (bx + 4 <= width) ? 4 : width - bx;
+        memcpy(&rgba[4 * ((size_t) (by + y) * width + bx)], &block[16*y], 4*n);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Decode all levels into a single malloc()ed buffer of RGBA pixels,
+ * one level after the other.
+ */
+void *decode_btx_rgba(struct BTX_INFO *info, size_t *ret_size)
+{
+  size_t size = 0;
+  for (int level = 0; level < info->n_levels; level++)
+    size += get_btx_level_size(BTX_FORMAT_RGBA8, get_btx_level_width(info, level), get_btx_level_height(info, level));
+
+  unsigned char *rgba = malloc(size);
+  if (! rgba)
+    return NULL;
+  unsigned char *dest = rgba;
+  for (int level = 0; level < info->n_levels; level++) {
+    if (decode_btx_level(info, level, dest) != 0) {
+      free(rgba);
+      return NULL;
+    }
+    dest += get_btx_level_size(BTX_FORMAT_RGBA8, get_btx_level_width(info, level), get_btx_level_height(info, level));
+  }
+  if (ret_size)
+    *ret_size = size;
+  return rgba;
+}
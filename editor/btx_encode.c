@@ -0,0 +1,421 @@
+/* btx_encode.c
+ *
+ * BTX texture chunk encoder.  The encoded pixels are checked with the
+ * reader and decoder in btx.c, which are the same as the game's.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "btx.h"
+
+// the encoder picks indices by decoding the palette like btx.c does
+static const unsigned char bc7_weights4[16] = {
+  0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+static void decode_rgb565(uint16_t c, unsigned char *rgb)
+{
+  unsigned int r = (c >> 11) & 0x1f;
+  unsigned int g = (c >>  5) & 0x3f;
+  unsigned int b = (c      ) & 0x1f;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+static void write_btx_u32(unsigned char *p, uint32_t n)
+{
+  p[0] = (n      ) & 0xff;
+  p[1] = (n >>  8) & 0xff;
+  p[2] = (n >> 16) & 0xff;
+  p[3] = (n >> 24) & 0xff;
+}
+
+static void write_block_bits(unsigned char *dest, int *pos, unsigned int val, int n_bits)
+{
+  for (int i = 0; i < n_bits; i++, (*pos)++)
+    dest[*pos >> 3] |= ((val >> i) & 1) << (*pos & 7);
+}
+
+static int clamp_int(int val, int min, int max)
+{
+  return (val < min) ? min : (val > max) ? max : val;
+}
+
+static int color_dist(const unsigned char *a, const unsigned char *b, int n_comp)
+{
+  int dist = 0;
+  for (int c = 0; c < n_comp; c++)
+    dist += (a[c] - b[c]) * (a[c] - b[c]);
+  return dist;
+}
+
+/*
+ * Find the line through the block's pixels that best fits them (the
+ * principal axis, with a few power iterations over the covariance
+ * matrix) and return the extreme points of the pixels projected on it.
+ */
+static void find_block_endpoints(const unsigned char *block, int n_comp, float *end0, float *end1)
+{
+  float mean[4] = { 0, 0, 0, 0 };
+  for (int i = 0; i < 16; i++)
+    for (int c = 0; c < n_comp; c++)
+      mean[c] += block[4*i+c] / 16.0f;
+
+  float cov[4][4] = { { 0 } };
+  for (int i = 0; i < 16; i++) {
+    for (int a = 0; a < n_comp; a++)
+      for (int b = 0; b < n_comp; b++)
+        cov[a][b] += (block[4*i+a] - mean[a]) * (block[4*i+b] - mean[b]);
+  }
+
+  float axis[4] = { 1, 1, 1, 1 };
+  for (int iter = 0; iter < 8; iter++) {
+    float next[4] = { 0, 0, 0, 0 };
+    float len = 0;
+    for (int a = 0; a < n_comp; a++) {
+      for (int b = 0; b < n_comp; b++)
+        next[a] += cov[a][b] * axis[b];
+      len += next[a] * next[a];
+    }
+    if (len < 1e-6f)
+      break;
+    len = sqrtf(len);
+    for (int a = 0; a < n_comp; a++)
+      axis[a] = next[a] / len;
+  }
+
+  float t_min = 0, t_max = 0;
+  for (int i = 0; i < 16; i++) {
+    float t = 0;
+    for (int c = 0; c < n_comp; c++)
+      t += (block[4*i+c] - mean[c]) * axis[c];
+    if (i == 0 || t < t_min) t_min = t;
+    if (i == 0 || t > t_max) t_max = t;
+  }
+  for (int c = 0; c < n_comp; c++) {
+    end0[c] = mean[c] + axis[c] * t_max;
+    end1[c] = mean[c] + axis[c] * t_min;
+  }
+}
+
+static uint16_t encode_rgb565(const float *rgb)
+{
+  int r = clamp_int((int) (rgb[0] * 31.0f / 255.0f + 0.5f), 0, 31);
+  int g = clamp_int((int) (rgb[1] * 63.0f / 255.0f + 0.5f), 0, 63);
+  int b = clamp_int((int) (rgb[2] * 31.0f / 255.0f + 0.5f), 0, 31);
+  return (r << 11) | (g << 5) | b;
+}
+
+/*
+ * Always uses the four color mode, so the same block works for BC3.
+ */
+static void encode_bc1_block(const unsigned char *block, unsigned char *dest)
+{
+  float end0[4], end1[4];
+  find_block_endpoints(block, 3, end0, end1);
+  uint16_t c0 = encode_rgb565(end0);
+  uint16_t c1 = encode_rgb565(end1);
+  if (c0 < c1) {
+    uint16_t tmp = c0;
+    c0 = c1;
+    c1 = tmp;
+  }
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    unsigned char palette[4][4];
+    decode_rgb565(c0, palette[0]);
+    decode_rgb565(c1, palette[1]);
+    for (int i = 0; i < 3; i++) {
+      palette[2][i] = (2*palette[0][i] + palette[1][i]) / 3;
+      palette[3][i] = (palette[0][i] + 2*palette[1][i]) / 3;
+    }
+    for (int i = 0; i < 16; i++) {
+      int best = 0;
+      int best_dist = color_dist(&block[4*i], palette[0], 3);
+      for (int p = 1; p < 4; p++) {
+        int dist = color_dist(&block[4*i], palette[p], 3);
+        if (dist < best_dist) {
+          best = p;
+          best_dist = dist;
+        }
+      }
+      indices |= (uint32_t) best << (2*i);
+    }
+  }
+
+  dest[0] = c0 & 0xff;
+  dest[1] = c0 >> 8;
+  dest[2] = c1 & 0xff;
+  dest[3] = c1 >> 8;
+  write_btx_u32(dest + 4, indices);
+}
+
+static void encode_bc3_alpha(const unsigned char *block, unsigned char *dest)
+{
+  unsigned int a0 = block[3], a1 = block[3];
+  for (int i = 1; i < 16; i++) {
+    if (block[4*i+3] > a0) a0 = block[4*i+3];
+    if (block[4*i+3] < a1) a1 = block[4*i+3];
+  }
+
+  uint64_t indices = 0;
+  if (a0 > a1) {
+    unsigned int a[8];
+    a[0] = a0;
+    a[1] = a1;
+    for (int i = 1; i < 7; i++)
+      a[i+1] = ((7-i)*a0 + i*a1) / 7;
+    for (int i = 0; i < 16; i++) {
+      int best = 0;
+      int best_dist = abs((int) a[0] - block[4*i+3]);
+      for (int p = 1; p < 8; p++) {
+        int dist = abs((int) a[p] - block[4*i+3]);
+        if (dist < best_dist) {
+          best = p;
+          best_dist = dist;
+        }
+      }
+      indices |= (uint64_t) best << (3*i);
+    }
+  }
+
+  dest[0] = a0;
+  dest[1] = a1;
+  for (int i = 0; i < 6; i++)
+    dest[2+i] = (indices >> (8*i)) & 0xff;
+}
+
+static void encode_bc3_block(const unsigned char *block, unsigned char *dest)
+{
+  encode_bc3_alpha(block, dest);
+  encode_bc1_block(block, dest + 8);
+}
+
+/*
+ * Quantize an endpoint to 7 bits per component plus a shared p-bit,
+ * choosing the p-bit that gives the smaller error.
+ */
+static void quantize_bc7_endpoint(const float *end, unsigned int *q, unsigned int *pbit)
+{
+  float best_err = 0;
+  for (unsigned int p = 0; p < 2; p++) {
+    unsigned int cur[4];
+    float err = 0;
+    for (int c = 0; c < 4; c++) {
+      cur[c] = clamp_int((int) ((end[c] - p) / 2.0f + 0.5f), 0, 127);
+      float d = (float) ((cur[c] << 1) | p) - end[c];
+      err += d * d;
+    }
+    if (p == 0 || err < best_err) {
+      best_err = err;
+      memcpy(q, cur, sizeof(cur));
+      *pbit = p;
+    }
+  }
+}
+
+/*
+ * Mode 6: one subset, RGBA endpoints with 7 bits per component and a
+ * p-bit, 4 bit indices.
+ */
+static void encode_bc7_block(const unsigned char *block, unsigned char *dest)
+{
+  float end[2][4];
+  find_block_endpoints(block, 4, end[0], end[1]);
+
+  unsigned int q[2][4], pbit[2];
+  quantize_bc7_endpoint(end[0], q[0], &pbit[0]);
+  quantize_bc7_endpoint(end[1], q[1], &pbit[1]);
+
+  unsigned char palette[16][4];
+  for (int w = 0; w < 16; w++) {
+    for (int c = 0; c < 4; c++) {
+      unsigned int e0 = (q[0][c] << 1) | pbit[0];
+      unsigned int e1 = (q[1][c] << 1) | pbit[1];
+      palette[w][c] = ((64-bc7_weights4[w])*e0 + bc7_weights4[w]*e1 + 32) >> 6;
+    }
+  }
+  unsigned int indices[16];
+  for (int i = 0; i < 16; i++) {
+    int best = 0;
+    int best_dist = color_dist(&block[4*i], palette[0], 4);
+    for (int w = 1; w < 16; w++) {
+      int dist = color_dist(&block[4*i], palette[w], 4);
+      if (dist < best_dist) {
+        best = w;
+        best_dist = dist;
+      }
+    }
+    indices[i] = best;
+  }
+
+  // the first index is stored without its high bit, so it must be < 8
+  if (indices[0] >= 8) {
+    for (int c = 0; c < 4; c++) {
+      unsigned int tmp = q[0][c];
+      q[0][c] = q[1][c];
+      q[1][c] = tmp;
+    }
+    unsigned int tmp = pbit[0];
+    pbit[0] = pbit[1];
+    pbit[1] = tmp;
+    for (int i = 0; i < 16; i++)
+      indices[i] = 15 - indices[i];
+  }
+
+  memset(dest, 0, 16);
+  int pos = 0;
+  write_block_bits(dest, &pos, 1 << 6, 7);
+  for (int c = 0; c < 4; c++) {
+    write_block_bits(dest, &pos, q[0][c], 7);
+    write_block_bits(dest, &pos, q[1][c], 7);
+  }
+  write_block_bits(dest, &pos, pbit[0], 1);
+  write_block_bits(dest, &pos, pbit[1], 1);
+  for (int i = 0; i < 16; i++)
+    write_block_bits(dest, &pos, indices[i], (i == 0) ? 3 : 4);
+}
+
+static void encode_btx_level(const unsigned char *rgba, int width, int height, int format, unsigned char *dest)
+{
+  if (format == BTX_FORMAT_RGBA8) {
+    memcpy(dest, rgba, (size_t) width * height * 4);
+    return;
+  }
+
+  size_t block_size = (format == BTX_FORMAT_BC1) ? 8 : 16;
+  for (int by = 0; by < height; by += 4) {
+    for (int bx = 0; bx < width; bx += 4) {
+      // pixels outside the image repeat the last row/column
+      unsigned char block[16*4];
+      for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+          int sx = (bx + x < width) ? bx + x : width - 1;
+          int sy = (by + y < height) ? by + y : height - 1;
+          memcpy(&block[4*(4*y+x)], &rgba[4 * ((size_t) sy * width + sx)], 4);
+        }
+      }
+      switch (format) {
+      case BTX_FORMAT_BC1: encode_bc1_block(block, dest); break;
+      case BTX_FORMAT_BC3: encode_bc3_block(block, dest); break;
+      case BTX_FORMAT_BC7: encode_bc7_block(block, dest); break;
+      }
+      dest += block_size;
+    }
+  }
+}
+
+/*
+ * Make the next mip level with a box filter.
+ */
+static unsigned char *make_mip_level(const unsigned char *src, int width, int height, int *ret_width, int *ret_height)
+{
+  int new_width = (width > 1) ? width / 2 : 1;
+  int new_height = (height > 1) ? height / 2 : 1;
+  unsigned char *dest = malloc((size_t) new_width * new_height * 4);
+  if (! dest)
+    return NULL;
+
+  for (int y = 0; y < new_height; y++) {
+    int y0 = 2*y, y1 = (2*y+1 < height) ? 2*y+1 : 2*y;
+    if (y0 >= height) y0 = y1 = height - 1;
+    for (int x = 0; x < new_width; x++) {
+      int x0 = 2*x, x1 = (2*x+1 < width) ? 2*x+1 : 2*x;
+      if (x0 >= width) x0 = x1 = width - 1;
+      for (int c = 0; c < 4; c++) {
+        unsigned int sum = (src[4 * ((size_t) y0 * width + x0) + c] + src[4 * ((size_t) y0 * width + x1) + c] +
+                            src[4 * ((size_t) y1 * width + x0) + c] + src[4 * ((size_t) y1 * width + x1) + c]);
+        dest[4 * ((size_t) y * new_width + x) + c] = (sum + 2) / 4;
+      }
+    }
+  }
+  *ret_width = new_width;
+  *ret_height = new_height;
+  return dest;
+}
+
+/*
+ * Make a BTX chunk with the full mip chain of an RGBA image.  Returns
+ * a malloc()ed chunk, or NULL on error.
+ */
+unsigned char *encode_btx(const unsigned char *rgba, int width, int height, int format, size_t *ret_size)
+{
+  if (width < 1 || width > BTX_MAX_SIZE || height < 1 || height > BTX_MAX_SIZE || format < 0 || format > BTX_FORMAT_BC7)
+    return NULL;
+
+  int n_levels = 1;
+  while (n_levels < BTX_MAX_LEVELS && ((width >> n_levels) > 0 || (height >> n_levels) > 0))
+    n_levels++;
+
+  size_t size = BTX_HEADER_SIZE + 4 * (size_t) n_levels;
+  for (int level = 0; level < n_levels; level++) {
+    int w = (width >> level > 0) ? width >> level : 1;
+    int h = (height >> level > 0) ? height >> level : 1;
+    size += get_btx_level_size(format, w, h);
+  }
+  unsigned char *data = malloc(size);
+  if (! data)
+    return NULL;
+
+  memcpy(data, "BTX1", 4);
+  data[4] = format;
+  data[5] = n_levels;
+  data[6] = data[7] = 0;
+  write_btx_u32(data + 8, width);
+  write_btx_u32(data + 12, height);
+
+  unsigned char *dest = data + BTX_HEADER_SIZE + 4*n_levels;
+  const unsigned char *level_rgba = rgba;
+  unsigned char *mip = NULL;
+  int w = width, h = height;
+  for (int level = 0; level < n_levels; level++) {
+    if (level > 0) {
+      unsigned char *next = make_mip_level(level_rgba, w, h, &w, &h);
+      free(mip);
+      if (! next) {
+        free(data);
+        return NULL;
+      }
+      level_rgba = mip = next;
+    }
+    size_t level_size = get_btx_level_size(format, w, h);
+    write_btx_u32(data + BTX_HEADER_SIZE + 4*level, level_size);
+    encode_btx_level(level_rgba, w, h, format, dest);
+    dest += level_size;
+  }
+  free(mip);
+
+  *ret_size = size;
+  return data;
+}
+
+/*
+ * Decode level 0 of a BTX chunk and compare it with the original
+ * image, returning the PSNR over all channels.
+ */
+int check_btx(const void *data, size_t size, const unsigned char *rgba, double *ret_psnr)
+{
+  struct BTX_INFO info;
+  if (read_btx_info(&info, data, size) != 0)
+    return 1;
+  size_t n_bytes = (size_t) info.width * info.height * 4;
+  unsigned char *decoded = malloc(n_bytes);
+  if (! decoded)
+    return 1;
+  if (decode_btx_level(&info, 0, decoded) != 0) {
+    free(decoded);
+    return 1;
+  }
+
+  double err = 0;
+  for (size_t i = 0; i < n_bytes; i++)
+    err += (double) (decoded[i] - rgba[i]) * (decoded[i] - rgba[i]);
+  free(decoded);
+  err /= n_bytes;
+  *ret_psnr = (err > 0) ? 10.0 * log10(255.0 * 255.0 / err) : 99.0;
+  return 0;
+}
@@ -7,6 +7,7 @@
 #include "room.h"
 #include "load.h"
 #include "save_bff.h"
+#include "save_pack.h"
 
 static int convert_world(const char *in_filename, const char *out_filename)
 {
@@ -49,20 +50,82 @@ static int convert_character(const char *in_filename, const char *out_filename)
   return 0;
 }
 
+static int convert_pack(const char *in_filename, const char *out_filename)
+{
+  printf("-> packing files listed in '%s' to '%s'...\n", in_filename, out_filename);
+  if (write_pack_file(out_filename, in_filename) != 0) {
+    printf("** ERROR\n");
+    return 1;
+  }
+
+  printf("-> done\n");
+  return 0;
+}
+
+static int parse_texture_format(const char *name)
+{
+  static const struct {
+    const char *name;
+    int format;
+  } formats[] = {
+    { "original", BFF_TEXTURE_ORIGINAL },
+    { "auto",     BFF_TEXTURE_AUTO },
+    { "rgba",     BFF_TEXTURE_RGBA },
+    { "bc1",      BFF_TEXTURE_BC1 },
+    { "bc3",      BFF_TEXTURE_BC3 },
+    { "bc7",      BFF_TEXTURE_BC7 },
+  };
+
+  for (size_t i = 0; i < sizeof(formats)/sizeof(formats[0]); i++) {
+    if (strcmp(name, formats[i].name) == 0)
+      return formats[i].format;
+  }
+  return -1;
+}
+
+static void print_usage(const char *progname)
+{
+  printf("USAGE: %s [options] command input_file output_file\n", progname);
+  printf("\n");
+  printf("options:\n");
+  printf("   -t format  texture format: auto (default), bc1, bc3, bc7, rgba or original\n");
+  printf("   -z         compress rooms, meshes and textures\n");
+  printf("   -s         show the pages touched by room transitions in the world file\n");
+  printf("\n");
+  printf("commands:\n");
+  printf("   world      convert json to bwf\n");
+  printf("   model      convert glb to bmf\n");
+  printf("   char       convert glb to bcf\n");
+  printf("   pack       bundle the files listed in a text file into an asset pack\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc != 4) {
-    printf("USAGE: %s command input_file output_file\n", argv[0]);
-    printf("\n");
-    printf("commands:\n");
-    printf("   world      convert json to bwf\n");
-    printf("   model      convert glb to bmf\n");
-    printf("   char       convert glb to bcf\n");
-    exit(1);
+  int arg = 1;
+  while (arg < argc && argv[arg][0] == '-') {
+    if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+      int format = parse_texture_format(argv[arg+1]);
+      if (format < 0) {
+        printf("** ERROR: unknown texture format: '%s'\n", argv[arg+1]);
+        return 1;
+      }
+      set_bff_texture_format(format);
+      arg += 2;
+    } else if (strcmp(argv[arg], "-z") == 0) {
+      set_bff_compression(1);
+      arg++;
+    } else if (strcmp(argv[arg], "-s") == 0) {
+      set_bff_layout_stats(1);
+      arg++;
+    } else
+      print_usage(argv[0]);
   }
-  const char *command = argv[1];
-  const char *in_filename = argv[2];
-  const char *out_filename = argv[3];
+  if (argc - arg != 3)
+    print_usage(argv[0]);
+  const char *command = argv[arg];
+  const char *in_filename = argv[arg+1];
+  const char *out_filename = argv[arg+2];
 
   if (strcmp(command, "world") == 0)
     return convert_world(in_filename, out_filename);
@@ -72,6 +135,9 @@ int main(int argc, char *argv[])
 
   if (strcmp(command, "char") == 0)
     return convert_character(in_filename, out_filename);
+
+  if (strcmp(command, "pack") == 0)
+    return convert_pack(in_filename, out_filename);
   
   printf("** ERROR: unknown command: '%s'\n", command);
   return 1;
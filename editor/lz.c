@@ -0,0 +1,188 @@
+/* lz.c
+ *
+ * LZ block compressor.  The decompressor is the same as the game's,
+ * and is used to check the compressed data.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH      4
+#define LZ_MAX_OFFSET     65535
+#define LZ_LAST_LITERALS  5     // the block must end with at least this many literals...
+#define LZ_MATCH_LIMIT    12    // ...and the last match must start this far from the end
+#define LZ_HASH_BITS      12
+
+static uint32_t read_u32(const unsigned char *p)
+{
+  uint32_t n;
+  memcpy(&n, p, 4);
+  return n;
+}
+
+static uint32_t hash_lz_seq(const unsigned char *p)
+{
+  return (read_u32(p) * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *write_lz_length(unsigned char *out, size_t len)
+{
+  while (len >= 255) {
+    *out++ = 255;
+    len -= 255;
+  }
+  *out++ = len;
+  return out;
+}
+
+/*
+ * Write a sequence of literals followed by a match.  A match length
+ * of 0 means it's the last sequence, which has only literals.
+ */
+static unsigned char *write_lz_sequence(unsigned char *out, const unsigned char *literals, size_t n_literals,
+                                        size_t offset, size_t match_len)
+{
+  unsigned char *token = out++;
+  *token = ((n_literals >= 15) ? 15 : n_literals) << 4;
+  if (n_literals >= 15)
+    out = write_lz_length(out, n_literals - 15);
+  memcpy(out, literals, n_literals);
+  out += n_literals;
+  if (match_len == 0)
+    return out;
+
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  match_len -= LZ_MIN_MATCH;
+  *token |= (match_len >= 15) ? 15 : match_len;
+  if (match_len >= 15)
+    out = write_lz_length(out, match_len - 15);
+  return out;
+}
+
+size_t lz_compress_bound(size_t size)
+{
+  return size + size/255 + 16;
+}
+
+/*
+ * Greedy compressor: take the first match found through a hash of
+ * the next 4 bytes.  Returns the compressed size, or 0 if dest_size
+ * is smaller than lz_compress_bound(src_size).
+ */
+size_t lz_compress(const void *src, size_t src_size, void *dest, size_t dest_size)
+{
+  if (dest_size < lz_compress_bound(src_size))
+    return 0;
+
+  const unsigned char *in = src;
+  const unsigned char *in_end = in + src_size;
+  const unsigned char *anchor = in;
+  unsigned char *out = dest;
+
+  if (src_size > LZ_MATCH_LIMIT) {
+    uint32_t table[1 << LZ_HASH_BITS];    // position + 1, 0 for none
+    memset(table, 0, sizeof(table));
+    const unsigned char *match_end_limit = in_end - LZ_LAST_LITERALS;
+    const unsigned char *p = in;
+    while (p <= in_end - LZ_MATCH_LIMIT) {
+      uint32_t hash = hash_lz_seq(p);
+      uint32_t ref_pos = table[hash];
+      table[hash] = p - in + 1;
+      const unsigned char *ref = in + ref_pos - 1;
+      if (ref_pos == 0 || p - ref > LZ_MAX_OFFSET || read_u32(ref) != read_u32(p)) {
+        p++;
+        continue;
+      }
+
+      while (p > anchor && ref > in && p[-1] == ref[-1]) {
+        p--;
+        ref--;
+      }
+      const unsigned char *match_end = p + LZ_MIN_MATCH;
+      while (match_end < match_end_limit && *match_end == ref[match_end - p])
+        match_end++;
+
+      out = write_lz_sequence(out, anchor, p - anchor, p - ref, match_end - p);
+      p = anchor = match_end;
+      if (p - 2 >= in && p - 2 <= in_end - LZ_MATCH_LIMIT)
+        table[hash_lz_seq(p - 2)] = p - 2 - in + 1;
+    }
+  }
+
+  out = write_lz_sequence(out, anchor, in_end - anchor, 0, 0);
+  return out - (unsigned char *) dest;
+}
+
+/*
+ * Read a length that continues in the following bytes if its nibble
+ * is 15.  Returns 1 if it runs past the end of the input.
+ */
+static int read_lz_length(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+  if (*len != 15)
+    return 0;
+  unsigned char b;
+  do {
+    if (*p >= end)
+      return 1;
+    b = *(*p)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/*
+ * Decompress a block that must expand to exactly dest_size bytes.
+ * Corrupt input never reads or writes out of bounds, it just makes
+ * this return 1.
+ */
+int lz_decompress(const void *src, size_t src_size, void *dest, size_t dest_size)
+{
+  const unsigned char *in = src;
+  const unsigned char *in_end = in + src_size;
+  unsigned char *out = dest;
+  unsigned char *out_end = out + dest_size;
+
+  while (in < in_end) {
+    unsigned int token = *in++;
+
+    size_t n_literals = token >> 4;
+    if (read_lz_length(&in, in_end, &n_literals) != 0 ||
+        n_literals > (size_t) (in_end - in) || n_literals > (size_t) (out_end - out))
+      return 1;
+    memcpy(out, in, n_literals);
+    in += n_literals;
+    out += n_literals;
+    if (in == in_end)
+      break;
+
+    if (in_end - in < 2)
+      return 1;
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > (size_t) (out - (unsigned char *) dest))
+      return 1;
+
+    size_t match_len = token & 0xf;
+    if (read_lz_length(&in, in_end, &match_len) != 0)
+      return 1;
+    match_len += LZ_MIN_MATCH;
+    if (match_len > (size_t) (out_end - out))
+      return 1;
+
+    // the match may overlap what it's producing, so copy forward
+    const unsigned char *match = out - offset;
+    if (offset >= match_len) {
+      memcpy(out, match, match_len);
+      out += match_len;
+    } else {
+      for (size_t i = 0; i < match_len; i++)
+        *out++ = *match++;
+    }
+  }
+
+  return (out == out_end) ? 0 : 1;
+}
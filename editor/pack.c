@@ -0,0 +1,284 @@
+/* pack.c
+ *
+ * Asset pack writer.  The format is described in the game's file.c.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "save_pack.h"
+
+#define DEBUG_PACK_WRITER
+#ifdef DEBUG_PACK_WRITER
+#define debug_log printf
+#else
+#define debug_log(...)
+#endif
+
+#define PACK_HEADER_SIZE  16
+#define PACK_SLOT_SIZE    32
+#define PACK_ALIGN        4096  // file data is page aligned
+#define PACK_MAX_FILES    1024
+
+struct PACK_ENTRY {
+  char name[256];
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t name_offset;
+};
+
+struct PACK_WRITER {
+  FILE *f;
+  int n_files;
+  struct PACK_ENTRY files[PACK_MAX_FILES];
+  uint32_t n_slots;
+  int *slots;          // file index for each slot, -1 if empty
+};
+
+static uint64_t hash_file_name(const char *name, size_t len)
+{
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
+
+static int write_u32(FILE *f, uint32_t n)
+{
+  for (int i = 0; i < 4; i++)
+    if (fputc((n >> (8*i)) & 0xff, f) == EOF)
+      return 1;
+  return 0;
+}
+
+static int write_u64(FILE *f, uint64_t n)
+{
+  for (int i = 0; i < 8; i++)
+    if (fputc((n >> (8*i)) & 0xff, f) == EOF)
+      return 1;
+  return 0;
+}
+
+static int write_padding(FILE *f, uint64_t pos, uint64_t target)
+{
+  for (; pos < target; pos++)
+    if (fputc(0, f) == EOF)
+      return 1;
+  return 0;
+}
+
+static int get_file_size(const char *filename, uint64_t *size)
+{
+  FILE *f = fopen(filename, "rb");
+  if (! f)
+    return 1;
+  if (fseek(f, 0, SEEK_END) != 0) {
+    fclose(f);
+    return 1;
+  }
+  long pos = ftell(f);
+  fclose(f);
+  if (pos < 0)
+    return 1;
+  *size = (uint64_t) pos;
+  return 0;
+}
+
+/*
+ * Read the list of files to pack: one path per line, as the game
+ * opens it.  Empty lines and lines starting with '#' are ignored.
+ */
+static int read_file_list(struct PACK_WRITER *pack, const char *list_filename)
+{
+  FILE *f = fopen(list_filename, "r");
+  if (! f) {
+    debug_log("** ERROR: can't open '%s'\n", list_filename);
+    return 1;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' '))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#')
+      continue;
+    if (len >= sizeof(pack->files[0].name)) {
+      debug_log("** ERROR: file name too long: '%s'\n", line);
+      goto err;
+    }
+    if (pack->n_files >= PACK_MAX_FILES) {
+      debug_log("** ERROR: too many files\n");
+      goto err;
+    }
+
+    struct PACK_ENTRY *entry = &pack->files[pack->n_files];
+    strcpy(entry->name, line);
+    entry->hash = hash_file_name(line, len);
+    for (int i = 0; i < pack->n_files; i++) {
+      if (strcmp(pack->files[i].name, entry->name) == 0) {
+        debug_log("** ERROR: file '%s' is listed twice\n", line);
+        goto err;
+      }
+    }
+    if (get_file_size(entry->name, &entry->size) != 0) {
+      debug_log("** ERROR: can't read '%s'\n", entry->name);
+      goto err;
+    }
+    pack->n_files++;
+  }
+
+  fclose(f);
+  return 0;
+
+ err:
+  fclose(f);
+  return 1;
+}
+
+/*
+ * Place the files in a hash table at most half full, and lay out the
+ * names and data after it.
+ */
+static int build_toc(struct PACK_WRITER *pack)
+{
+  pack->n_slots = 1;
+  while (pack->n_slots < 2 * (uint32_t) pack->n_files)
+    pack->n_slots *= 2;
+  pack->slots = malloc(pack->n_slots * sizeof *pack->slots);
+  if (! pack->slots)
+    return 1;
+  for (uint32_t i = 0; i < pack->n_slots; i++)
+    pack->slots[i] = -1;
+
+  uint64_t pos = PACK_HEADER_SIZE + (uint64_t) pack->n_slots * PACK_SLOT_SIZE;
+  for (int i = 0; i < pack->n_files; i++) {
+    struct PACK_ENTRY *entry = &pack->files[i];
+    uint32_t slot = (uint32_t) entry->hash & (pack->n_slots - 1);
+    while (pack->slots[slot] >= 0)
+      slot = (slot + 1) & (pack->n_slots - 1);
+    pack->slots[slot] = i;
+    entry->name_offset = pos;
+    pos += strlen(entry->name);
+  }
+
+  for (int i = 0; i < pack->n_files; i++) {
+    struct PACK_ENTRY *entry = &pack->files[i];
+    pos = (pos + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+    entry->offset = pos;
+    pos += entry->size;
+  }
+  return 0;
+}
+
+static int write_toc(struct PACK_WRITER *pack)
+{
+  if (fwrite("BPF1", 1, 4, pack->f) != 4 ||
+      write_u32(pack->f, pack->n_slots) != 0 ||
+      write_u32(pack->f, pack->n_files) != 0 ||
+      write_u32(pack->f, 0) != 0)
+    return 1;
+
+  for (uint32_t slot = 0; slot < pack->n_slots; slot++) {
+    if (pack->slots[slot] < 0) {
+      if (write_padding(pack->f, 0, PACK_SLOT_SIZE) != 0)
+        return 1;
+      continue;
+    }
+    struct PACK_ENTRY *entry = &pack->files[pack->slots[slot]];
+    if (write_u64(pack->f, entry->hash) != 0 ||
+        write_u64(pack->f, entry->offset) != 0 ||
+        write_u64(pack->f, entry->size) != 0 ||
+        write_u32(pack->f, entry->name_offset) != 0 ||
+        write_u32(pack->f, strlen(entry->name)) != 0)
+      return 1;
+  }
+
+  for (int i = 0; i < pack->n_files; i++) {
+    size_t len = strlen(pack->files[i].name);
+    if (fwrite(pack->files[i].name, 1, len, pack->f) != len)
+      return 1;
+  }
+  return 0;
+}
+
+static int write_file_data(struct PACK_WRITER *pack, struct PACK_ENTRY *entry)
+{
+  debug_log("-> writing '%s' (%llu bytes)\n", entry->name, (unsigned long long) entry->size);
+
+  if (write_padding(pack->f, (uint64_t) ftell(pack->f), entry->offset) != 0)
+    return 1;
+
+  FILE *in = fopen(entry->name, "rb");
+  if (! in) {
+    debug_log("** ERROR: can't open '%s'\n", entry->name);
+    return 1;
+  }
+  char buf[65536];
+  uint64_t left = entry->size;
+  while (left > 0) {
+    size_t n = (left < sizeof(buf)) ? (size_t) left : sizeof(buf);
+    if (fread(buf, 1, n, in) != n) {
+      debug_log("** ERROR: can't read '%s'\n", entry->name);
+      fclose(in);
+      return 1;
+    }
+    if (fwrite(buf, 1, n, pack->f) != n) {
+      fclose(in);
+      return 1;
+    }
+    left -= n;
+  }
+  fclose(in);
+  return 0;
+}
+
+int write_pack_file(const char *pack_filename, const char *list_filename)
+{
+  struct PACK_WRITER *pack = malloc(sizeof *pack);
+  if (! pack)
+    return 1;
+  pack->f = NULL;
+  pack->n_files = 0;
+  pack->slots = NULL;
+
+  if (read_file_list(pack, list_filename) != 0 || build_toc(pack) != 0)
+    goto err;
+
+  pack->f = fopen(pack_filename, "wb");
+  if (! pack->f) {
+    debug_log("** ERROR opening file '%s'\n", pack_filename);
+    goto err;
+  }
+
+  if (write_toc(pack) != 0) {
+    debug_log("** ERROR: can't write table of contents\n");
+    goto err;
+  }
+  for (int i = 0; i < pack->n_files; i++) {
+    if (write_file_data(pack, &pack->files[i]) != 0)
+      goto err;
+  }
+
+  int ret = 0;
+  if (fclose(pack->f) != 0) {
+    debug_log("** ERROR writing file data\n");
+    ret = 1;
+  }
+  debug_log("-> %d files in %u slots\n", pack->n_files, (unsigned) pack->n_slots);
+  free(pack->slots);
+  free(pack);
+  return ret;
+
+ err:
+  if (pack->f)
+    fclose(pack->f);
+  free(pack->slots);
+  free(pack);
+  return 1;
+}
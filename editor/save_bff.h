@@ -3,9 +3,19 @@
 #ifndef SAVE_BFF_FILE
 #define SAVE_BFF_FILE
 
+#define BFF_TEXTURE_ORIGINAL  0   // copy the PNG/JPEG data from the GLB file
+#define BFF_TEXTURE_AUTO      1   // BC1, or BC3 for textures with alpha
+#define BFF_TEXTURE_RGBA      2
+#define BFF_TEXTURE_BC1       3
+#define BFF_TEXTURE_BC3       4
+#define BFF_TEXTURE_BC7       5
+
 struct EDITOR_ROOM_LIST;
 struct MODEL;
 
+void set_bff_texture_format(int format);
+void set_bff_compression(int enable);
+void set_bff_layout_stats(int enable);
 int write_bmf_file(const char *bmf_filename, const char *glb_filename);
 int write_bwf_file(const char *filename, struct EDITOR_ROOM_LIST *rooms);
 int write_bcf_file(const char *bcf_filename, const char *glb_filename);
@@ -0,0 +1,8 @@
+/* save_pack.h */
+
+#ifndef SAVE_PACK_FILE
+#define SAVE_PACK_FILE
+
+int write_pack_file(const char *pack_filename, const char *list_filename);
+
+#endif /* SAVE_PACK_FILE */
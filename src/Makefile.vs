@@ -6,16 +6,38 @@ LDFLAGS =
 #LDFLAGS = -ZI
 
 OBJS = main.obj render.obj gfx.obj bff.obj game.obj model.obj skeleton.obj font.obj shader.obj debug.obj glad.obj \
-       gl_error.obj image.obj matrix.obj gamepad.obj camera.obj room.obj file.obj thread.obj queue.obj asset_loader.obj
+       gl_error.obj image.obj matrix.obj gamepad.obj camera.obj room.obj stream.obj render_queue.obj cull.obj file.obj file_uring.obj btx.obj lz.obj thread.obj queue.obj ring.obj asset_loader.obj gfx_queue.obj job.obj
 LIBS = $(GLFW_HOME)\lib-vc2015\glfw3dll.lib
 
+CHAN_BENCH_OBJS = chan_bench.obj thread.obj queue.obj ring.obj
+JOB_BENCH_OBJS = job_bench.obj job.obj thread.obj queue.obj ring.obj skeleton.obj matrix.obj debug.obj
+IO_BENCH_OBJS = io_bench.obj bff.obj gfx.obj gfx_queue.obj model.obj skeleton.obj matrix.obj debug.obj glad.obj gl_error.obj \
+                image.obj file.obj file_uring.obj btx.obj lz.obj thread.obj queue.obj ring.obj asset_loader.obj room.obj
+BTX_CHECK_OBJS = btx_check.obj btx.obj btx_encode.obj
+
 all: game.exe
 
 clean:
-	-del *.obj game.exe
+	-del *.obj game.exe chan_bench.exe job_bench.exe io_bench.exe btx_check.exe
 
 game.exe: $(OBJS)
 	$(CC) -Fe$@ $(OBJS) $(LIBS) $(LDFLAGS)
 
+chan_bench.exe: $(CHAN_BENCH_OBJS)
+	$(CC) -Fe$@ $(CHAN_BENCH_OBJS) $(LDFLAGS)
+
+job_bench.exe: $(JOB_BENCH_OBJS)
+	$(CC) -Fe$@ $(JOB_BENCH_OBJS) $(LDFLAGS)
+
+io_bench.exe: $(IO_BENCH_OBJS)
+	$(CC) -Fe$@ $(IO_BENCH_OBJS) $(LIBS) $(LDFLAGS)
+
+btx_check.exe: $(BTX_CHECK_OBJS)
+	$(CC) -Fe$@ $(BTX_CHECK_OBJS) $(LDFLAGS)
+
+# the encoder is the builder's
+btx_encode.obj: ..\editor\btx_encode.c
+	$(CC) $(CFLAGS) -c ..\editor\btx_encode.c
+
 .c.obj:
 	$(CC) $(CFLAGS) -c $<
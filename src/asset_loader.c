@@ -1,106 +1,590 @@
 /* asset_loader.c */
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 
 #include <stb_image.h>
 
 #include "asset_loader.h"
+#include "bff.h"
+#include "room.h"
 #include "thread.h"
 #include "debug.h"
+#include "file_uring.h"
+#include "gfx.h"
+#include "btx.h"
+#include "lz.h"
 
-struct ASSET_LOADER {
+#define ASSET_DEQUE_INIT_CAPACITY  64
+#define ASSET_RESPONSE_CAPACITY    256
+
+struct ASSET_JOB {
+  struct ASSET_REQUEST req;
+  void *io_buffer;     // file data read for the request, or NULL to use the file mapping
+};
+
+/*
+ * Each worker owns a deque: it takes jobs from the front (so requests
+ * are processed roughly in the order they were sent), idle workers
+ * steal from the back of the other workers' deques.
+ */
+struct ASSET_DEQUE {
+  struct MUTEX *mutex;
+  size_t capacity;
+  size_t first;
+  size_t num;
+  struct ASSET_JOB *jobs;
+};
+
+struct ASSET_WORKER {
   struct THREAD *thread;
-  struct CHANNEL *request;
+  int index;
+  bool finished;
+  struct ASSET_DEQUE deque;
+};
+
+struct ASSET_LOADER {
+  int n_workers;
+  struct ASSET_WORKER workers[ASSET_LOADER_MAX_WORKERS];
   struct CHANNEL *response;
+
+  // everything below is protected by the mutex
+  struct MUTEX *mutex;
+  struct COND_VAR *work_available;
+  int n_queued;
+  int next_worker;
+  bool quit;
+  int n_io_pending;
+
+  // io_uring mode: reads are completed by the I/O thread, which hands the jobs to the workers
+  int io_mode;
+  struct FILE_URING *uring;
+  struct THREAD *io_thread;
+  bool io_quit;
 };
 
 static struct ASSET_LOADER loader;
 
+static int init_deque(struct ASSET_DEQUE *deque)
+{
+  deque->capacity = ASSET_DEQUE_INIT_CAPACITY;
+  deque->first = 0;
+  deque->num = 0;
+  deque->jobs = malloc(sizeof *deque->jobs * deque->capacity);
+  if (! deque->jobs)
+    return 1;
+  deque->mutex = new_mutex();
+  if (! deque->mutex) {
+    free(deque->jobs);
+    return 1;
+  }
+  return 0;
+}
+
+static void free_deque(struct ASSET_DEQUE *deque)
+{
+  free_mutex(deque->mutex);
+  free(deque->jobs);
+}
+
+static int deque_push_back(struct ASSET_DEQUE *deque, struct ASSET_JOB *job)
+{
+  mutex_lock(deque->mutex);
+  if (deque->num == deque->capacity) {
+    // grow instead of blocking: the sender is usually the render thread
+    size_t new_capacity = 2 * deque->capacity;
+    struct ASSET_JOB *new_jobs = malloc(sizeof *new_jobs * new_capacity);
+    if (! new_jobs) {
+      mutex_unlock(deque->mutex);
+      return 1;
+    }
+    for (size_t i = 0; i < deque->num; i++)
+      new_jobs[i] = deque->jobs[(deque->first + i) & (deque->capacity - 1)];
+    free(deque->jobs);
+    deque->jobs = new_jobs;
+    deque->capacity = new_capacity;
+    deque->first = 0;
+  }
+  deque->jobs[(deque->first + deque->num) & (deque->capacity - 1)] = *job;
+  deque->num++;
+  mutex_unlock(deque->mutex);
+  return 0;
+}
+
+static int deque_pop_front(struct ASSET_DEQUE *deque, struct ASSET_JOB *job)
+{
+  int ret = 1;
+  mutex_lock(deque->mutex);
+  if (deque->num > 0) {
+    *job = deque->jobs[deque->first];
+    deque->first = (deque->first + 1) & (deque->capacity - 1);
+    deque->num--;
+    ret = 0;
+  }
+  mutex_unlock(deque->mutex);
+  return ret;
+}
+
+static int deque_pop_back(struct ASSET_DEQUE *deque, struct ASSET_JOB *job)
+{
+  int ret = 1;
+  mutex_lock(deque->mutex);
+  if (deque->num > 0) {
+    deque->num--;
+    *job = deque->jobs[(deque->first + deque->num) & (deque->capacity - 1)];
+    ret = 0;
+  }
+  mutex_unlock(deque->mutex);
+  return ret;
+}
+
+static int take_job(struct ASSET_WORKER *worker, struct ASSET_JOB *job)
+{
+  if (deque_pop_front(&worker->deque, job) != 0) {
+    int i;
+    for (i = 1; i < loader.n_workers; i++) {
+      struct ASSET_WORKER *victim = &loader.workers[(worker->index + i) % loader.n_workers];
+      if (deque_pop_back(&victim->deque, job) == 0)
+        break;
+    }
+    if (i >= loader.n_workers)
+      return 1;
+  }
+
+  mutex_lock(loader.mutex);
+  loader.n_queued--;
+  mutex_unlock(loader.mutex);
+  return 0;
+}
+
+static int get_btx_gfx_format(int btx_format)
+{
+  switch (btx_format) {
+  case BTX_FORMAT_BC1: return GFX_TEX_FORMAT_BC1;
+  case BTX_FORMAT_BC3: return GFX_TEX_FORMAT_BC3;
+  case BTX_FORMAT_BC7: return GFX_TEX_FORMAT_BC7;
+  }
+  return GFX_TEX_FORMAT_RGBA;
+}
+
+/*
+ * BTX textures are copied as they are if the driver takes their
+ * format, and decoded to RGBA otherwise.  Anything else goes through
+ * stb_image, and gets its mipmaps generated by GL.
+ */
+static void decode_texture(const void *src, size_t size, struct ASSET_REPLY_TEXTURE *reply)
+{
+  if (is_btx_data(src, size)) {
+    struct BTX_INFO info;
+    reply->data = NULL;
+    if (read_btx_info(&info, src, size) != 0)
+      return;
+    reply->width = info.width;
+    reply->height = info.height;
+    reply->n_levels = info.n_levels;
+    reply->format = get_btx_gfx_format(info.format);
+    if (gfx_texture_format_is_supported(reply->format)) {
+      size_t data_size = 0;
+      for (int level = 0; level < info.n_levels; level++)
+        data_size += info.level_size[level];
+      reply->data = malloc(data_size);
+      if (reply->data)
+        memcpy(reply->data, info.level_data[0], data_size);
+    } else {
+      reply->format = GFX_TEX_FORMAT_RGBA;
+      reply->data = decode_btx_rgba(&info, NULL);
+    }
+    return;
+  }
+
+  int n_chan;
+  reply->data = stbi_load_from_memory(src, size, &reply->width, &reply->height, &n_chan, 0);
+  reply->format = (n_chan == 3) ? GFX_TEX_FORMAT_RGB : GFX_TEX_FORMAT_RGBA;
+  reply->n_levels = 1;
+}
+
+static void process_job(struct ASSET_JOB *job)
+{
+  struct ASSET_REQUEST *req = &job->req;
+
+  switch (req->type) {
+  case ASSET_TYPE_REQ_TEXTURE:
+    {
+      struct ASSET_REQ_TEXTURE *req_tex = &req->data.req_texture;
+      struct ASSET_REQUEST reply;
+      struct ASSET_REPLY_TEXTURE *reply_tex = &reply.data.reply_texture;
+      reply.type = ASSET_TYPE_REPLY_TEXTURE;
+      reply_tex->gfx = req_tex->gfx;
+      const void *src = (job->io_buffer) ? job->io_buffer : req_tex->src_file_pos;
+      void *data = NULL;
+      if (req_tex->data_size != req_tex->src_file_len) {
+        data = alloc_io_buffer(req_tex->data_size);
+        if (data && lz_decompress(src, req_tex->src_file_len, data, req_tex->data_size) != 0) {
+          debug("** ERROR: corrupt compressed texture\n");
+          free_io_buffer(data);
+          data = NULL;
+        }
+        src = data;
+      }
+      if (src)
+        decode_texture(src, req_tex->data_size, reply_tex);
+      else
+        reply_tex->data = NULL;
+      free_io_buffer(data);
+      free_io_buffer(job->io_buffer);
+      file_unref_mapping(req_tex->src_file);
+      chan_send(loader.response, &reply);
+    }
+    break;
+
+  case ASSET_TYPE_REQ_ROOM:
+    {
+      struct ASSET_REQ_ROOM *req_room = &req->data.req_room;
+      struct ASSET_REQUEST reply;
+      reply.type = ASSET_TYPE_REPLY_ROOM;
+      reply.data.reply_room.room = req_room->room;
+      if (! begin_room_load(req_room->room)) {
+        // evicted before we got to it, the game frees it when it gets the reply
+        free_io_buffer(job->io_buffer);
+        reply.data.reply_room.data = NULL;
+      } else if (job->io_buffer)
+        reply.data.reply_room.data = read_bwf_room_buffer(req_room->bwf, req_room->room, job->io_buffer);
+      else
+        reply.data.reply_room.data = read_bwf_room(req_room->bwf, req_room->room);
+      chan_send(loader.response, &reply);
+    }
+    break;
+
+  default:
+    chan_send(loader.response, req);
+    break;
+  }
+}
+
 static void asset_loader_loop(void *thread_data)
 {
+  struct ASSET_WORKER *worker = thread_data;
+
   while (1) {
-    struct ASSET_REQUEST req;
-    if (chan_recv(loader.request, &req, 1) != 0)
-      return;
-      
-    switch (req.type) {
-    case ASSET_TYPE_QUIT:
-      chan_send(loader.response, &req);
+    struct ASSET_JOB job;
+    if (take_job(worker, &job) == 0) {
+      process_job(&job);
+      continue;
+    }
+
+    mutex_lock(loader.mutex);
+    while (loader.n_queued == 0 && ! loader.quit)
+      cond_var_wait(loader.work_available, loader.mutex);
+    bool quit = loader.quit;
+    if (quit)
+      worker->finished = true;
+    mutex_unlock(loader.mutex);
+    if (quit)
       return;
+  }
+}
 
-    case ASSET_TYPE_REQ_TEXTURE:
-      {
-        struct ASSET_REQ_TEXTURE *req_tex = &req.data.req_texture;
-        struct ASSET_REQUEST reply;
-        struct ASSET_REPLY_TEXTURE *reply_tex = &reply.data.reply_texture;
-        reply.type = ASSET_TYPE_REPLY_TEXTURE;
-        reply_tex->gfx = req_tex->gfx;
-        reply_tex->data = stbi_load_from_memory(req_tex->src_file_pos, req_tex->src_file_len, &reply_tex->width, &reply_tex->height, &reply_tex->n_chan, 0);
-        chan_send(loader.response, &reply);
-      }
-      break;
+static void push_job(struct ASSET_JOB *job)
+{
+  mutex_lock(loader.mutex);
+  struct ASSET_WORKER *worker = &loader.workers[loader.next_worker];
+  loader.next_worker = (loader.next_worker + 1) % loader.n_workers;
+  if (deque_push_back(&worker->deque, job) != 0) {
+    debug("** ERROR: out of memory for asset request\n");
+    mutex_unlock(loader.mutex);
+    free_io_buffer(job->io_buffer);
+    if (job->req.type == ASSET_TYPE_REQ_TEXTURE)
+      file_unref_mapping(job->req.data.req_texture.src_file);
+    return;
+  }
+  loader.n_queued++;
+  cond_var_signal(loader.work_available);
+  mutex_unlock(loader.mutex);
+}
 
-    case ASSET_TYPE_CLOSE_FILE:
-      file_close(&req.data.close_file.file);
-      break;
-      
-    default:
-      chan_send(loader.response, &req);
+/*
+ * Start reading the file range needed by the request.  Returns
+ * nonzero if the request should use the file mapping instead.
+ */
+static int start_job_read(struct ASSET_JOB *job)
+{
+  int fd;
+  uint64_t offset;
+  size_t size;
+  switch (job->req.type) {
+  case ASSET_TYPE_REQ_TEXTURE:
+    fd = job->req.data.req_texture.src_file_fd;
+    offset = job->req.data.req_texture.src_file_offset;
+    size = job->req.data.req_texture.src_file_len;
+    break;
+
+  case ASSET_TYPE_REQ_ROOM:
+    {
+      struct BWF_READER *bwf = job->req.data.req_room.bwf;
+      struct ROOM *room = job->req.data.req_room.room;
+      int index = room->index;
+      struct BWF_ROOM_ENTRY entry;
+      if (room->state == ROOM_STATE_EVICTING || index < 0 || get_bwf_room_entry(bwf, index, &entry) != 0)
+        return 1;
+      fd = file_get_fd(&bwf->file);
+      offset = file_get_fd_offset(&bwf->file) + entry.offset;
+      size = entry.size;
+    }
+    break;
+
+  default:
+    return 1;
+  }
+  if (fd < 0 || size == 0)
+    return 1;
+
+  struct ASSET_JOB *io_job = malloc(sizeof *io_job);
+  if (! io_job)
+    return 1;
+  *io_job = *job;
+  io_job->io_buffer = alloc_io_buffer(size);
+  if (! io_job->io_buffer) {
+    free(io_job);
+    return 1;
+  }
+
+  mutex_lock(loader.mutex);
+  loader.n_io_pending++;
+  mutex_unlock(loader.mutex);
+  if (file_uring_read(loader.uring, fd, offset, io_job->io_buffer, size, io_job) != 0) {
+    mutex_lock(loader.mutex);
+    loader.n_io_pending--;
+    mutex_unlock(loader.mutex);
+    free_io_buffer(io_job->io_buffer);
+    free(io_job);
+    return 1;
+  }
+  return 0;
+}
+
+static void io_thread_loop(void *thread_data)
+{
+  while (1) {
+    struct FILE_URING_COMPLETION completion;
+    if (file_uring_wait(loader.uring, &completion) != 0) {
+      debug("** ERROR: can't wait for io_uring completion\n");
+      thread_sleep(1);
+      continue;
+    }
+    if (! completion.user_data) {
+      mutex_lock(loader.mutex);
+      bool quit = loader.io_quit && loader.n_io_pending == 0;
+      mutex_unlock(loader.mutex);
+      if (quit)
+        return;
+      continue;
+    }
+
+    struct ASSET_JOB *io_job = completion.user_data;
+    struct ASSET_JOB job = *io_job;
+    free(io_job);
+    if (completion.error) {
+      // let the worker read it from the file mapping
+      free_io_buffer(job.io_buffer);
+      job.io_buffer = NULL;
+    }
+    push_job(&job);
+
+    mutex_lock(loader.mutex);
+    loader.n_io_pending--;
+    mutex_unlock(loader.mutex);
+  }
+}
+
+/*
+ * Wait for the reads in flight (their jobs still have to go to the
+ * workers) and stop the I/O thread.
+ */
+static void stop_io_thread(void)
+{
+  if (! loader.io_thread)
+    return;
+
+  while (1) {
+    mutex_lock(loader.mutex);
+    bool io_pending = (loader.n_io_pending > 0);
+    loader.io_quit = ! io_pending;
+    mutex_unlock(loader.mutex);
+    if (! io_pending)
       break;
+    thread_sleep(1);
+  }
+  file_uring_wake(loader.uring);
+  join_thread(loader.io_thread);
+  loader.io_thread = NULL;
+}
+
+/*
+ * If io_uring is not available, fall back to reading from the file
+ * mappings.
+ */
+static void start_io_thread(void)
+{
+  loader.uring = new_file_uring();
+  if (loader.uring) {
+    loader.io_thread = start_thread(io_thread_loop, NULL);
+    if (loader.io_thread)
+      return;
+    free_file_uring(loader.uring);
+    loader.uring = NULL;
+  }
+  debug("* WARNING: io_uring not available, using memory mapped files\n");
+  loader.io_mode = ASSET_LOADER_IO_MMAP;
+}
+
+static void free_loader(void)
+{
+  for (int i = 0; i < loader.n_workers; i++)
+    free_deque(&loader.workers[i].deque);
+  loader.n_workers = 0;
+
+  if (loader.work_available)
+    free_cond_var(loader.work_available);
+  if (loader.mutex)
+    free_mutex(loader.mutex);
+  if (loader.response)
+    free_chan(loader.response);
+  if (loader.uring)
+    free_file_uring(loader.uring);
+  loader.work_available = NULL;
+  loader.mutex = NULL;
+  loader.response = NULL;
+  loader.uring = NULL;
+}
+
+/*
+ * Stop the workers that are running: we must keep draining responses
+ * while waiting for them, since a worker might be blocked sending a
+ * response.
+ */
+static void stop_workers(int n_running)
+{
+  mutex_lock(loader.mutex);
+  loader.quit = true;
+  cond_var_broadcast(loader.work_available);
+  mutex_unlock(loader.mutex);
+
+  for (int i = 0; i < n_running; i++) {
+    while (1) {
+      struct ASSET_REQUEST resp;
+      if (chan_recv(loader.response, &resp, 0) == 0) {
+        if (resp.type == ASSET_TYPE_REPLY_TEXTURE)
+          free(resp.data.reply_texture.data);
+        else if (resp.type == ASSET_TYPE_REPLY_ROOM && resp.data.reply_room.data)
+          free_bwf_room_data(resp.data.reply_room.data);
+        continue;
+      }
+      mutex_lock(loader.mutex);
+      bool finished = loader.workers[i].finished;
+      mutex_unlock(loader.mutex);
+      if (finished)
+        break;
+      thread_sleep(1);
     }
+    join_thread(loader.workers[i].thread);
+    loader.workers[i].thread = NULL;
   }
 }
 
-int start_asset_loader(void)
+int start_asset_loader(int n_workers)
 {
-  if (loader.thread)
+  if (loader.n_workers != 0)
     return 1;
 
-  loader.request = new_chan(128, sizeof(struct ASSET_REQUEST));
-  if (! loader.request)
-    goto err;
+  if (n_workers <= 0)
+    n_workers = get_num_processors() - 1;  // leave one processor for the render thread
+  if (n_workers < 1)
+    n_workers = 1;
+  if (n_workers > ASSET_LOADER_MAX_WORKERS)
+    n_workers = ASSET_LOADER_MAX_WORKERS;
+
+  loader.quit = false;
+  loader.io_quit = false;
+  loader.n_queued = 0;
+  loader.n_io_pending = 0;
+  loader.next_worker = 0;
 
-  loader.response = new_chan(0, sizeof(struct ASSET_REQUEST));
+  loader.response = new_chan(ASSET_RESPONSE_CAPACITY, sizeof(struct ASSET_REQUEST), CHAN_FLAG_LOCK_FREE|CHAN_FLAG_SINGLE_CONSUMER);
   if (! loader.response)
     goto err;
- 
-  loader.thread = start_thread(asset_loader_loop, NULL);
-  if (! loader.thread)
+
+  loader.mutex = new_mutex();
+  if (! loader.mutex)
     goto err;
 
+  loader.work_available = new_cond_var();
+  if (! loader.work_available)
+    goto err;
+
+  for (loader.n_workers = 0; loader.n_workers < n_workers; loader.n_workers++) {
+    struct ASSET_WORKER *worker = &loader.workers[loader.n_workers];
+    worker->index = loader.n_workers;
+    worker->thread = NULL;
+    worker->finished = false;
+    if (init_deque(&worker->deque) != 0)
+      goto err;
+  }
+
+  for (int i = 0; i < loader.n_workers; i++) {
+    loader.workers[i].thread = start_thread(asset_loader_loop, &loader.workers[i]);
+    if (! loader.workers[i].thread) {
+      stop_workers(i);
+      goto err;
+    }
+  }
+
+  if (loader.io_mode == ASSET_LOADER_IO_URING)
+    start_io_thread();
+
+  debug("- Asset loader started with %d workers (%s)\n", loader.n_workers,
+        (loader.io_mode == ASSET_LOADER_IO_URING) ? "io_uring" : "mmap");
   return 0;
-  
+
  err:
-  free_chan(loader.request);
-  free_chan(loader.response);
+  free_loader();
   return 1;
 }
 
 void stop_asset_loader(void)
 {
-  if (loader.request && loader.response && loader.thread) {
-    struct ASSET_REQUEST req = {
-      .type = ASSET_TYPE_QUIT
-    };
-    send_asset_request(&req);
-    while (1) {
-      struct ASSET_REQUEST resp;
-      if (chan_recv(loader.response, &resp, 1) != 0 ||
-          resp.type == ASSET_TYPE_QUIT)
-        break;
-    }
-    
-    join_thread(loader.thread);
-    free_chan(loader.request);
-    free_chan(loader.response);
-  }
+  if (loader.n_workers == 0)
+    return;
+
+  stop_io_thread();
+  stop_workers(loader.n_workers);
+  free_loader();
+}
+
+/*
+ * Select how asset data is read.  Must be called before
+ * start_asset_loader().
+ */
+void set_asset_loader_io_mode(int mode)
+{
+  loader.io_mode = mode;
+}
+
+int get_asset_loader_io_mode(void)
+{
+  return loader.io_mode;
 }
 
 void send_asset_request(struct ASSET_REQUEST *req)
 {
-  chan_send(loader.request, req);
+  struct ASSET_JOB job;
+  job.req = *req;
+  job.io_buffer = NULL;
+
+  if (loader.uring && start_job_read(&job) == 0)
+    return;
+  push_job(&job);
 }
 
 int recv_asset_response(struct ASSET_REQUEST *resp)
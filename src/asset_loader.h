@@ -5,29 +5,48 @@
 
 #include "file.h"
 
-#define ASSET_TYPE_QUIT            0
+#define ASSET_LOADER_MAX_WORKERS   16
+
+#define ASSET_LOADER_IO_MMAP       0   // workers read from the file mappings
+#define ASSET_LOADER_IO_URING      1   // file ranges are read with io_uring before the workers see them
+
 #define ASSET_TYPE_REQ_TEXTURE     1
 #define ASSET_TYPE_REPLY_TEXTURE   2
-#define ASSET_TYPE_CLOSE_FILE      3
+#define ASSET_TYPE_REQ_ROOM        4
+#define ASSET_TYPE_REPLY_ROOM      5
 
 struct GFX_TEXTURE;
+struct BWF_READER;
+struct BWF_ROOM_DATA;
+struct ROOM;
 
 struct ASSET_REQ_TEXTURE {
+  struct FILE_MAPPING *src_file;   // reference to the mapping that contains src_file_pos
+  int src_file_fd;
+  uint64_t src_file_offset;
   void *src_file_pos;
   size_t src_file_len;
+  size_t data_size;                // LZ compressed to src_file_len bytes if different
   struct GFX_TEXTURE *gfx;
 };
 
 struct ASSET_REPLY_TEXTURE {
+  int format;     // GFX_TEX_FORMAT_xxx
   int width;
   int height;
-  int n_chan;
-  void *data;
+  int n_levels;
+  void *data;     // all levels, NULL on error
   struct GFX_TEXTURE *gfx;
 };
 
-struct ASSET_CLOSE_FILE {
-  struct FILE_READER file;
+struct ASSET_REQ_ROOM {
+  struct BWF_READER *bwf;
+  struct ROOM *room;
+};
+
+struct ASSET_REPLY_ROOM {
+  struct ROOM *room;
+  struct BWF_ROOM_DATA *data;  // NULL on error
 };
 
 struct ASSET_REQUEST {
@@ -35,11 +54,14 @@ struct ASSET_REQUEST {
   union {
     struct ASSET_REQ_TEXTURE req_texture;
     struct ASSET_REPLY_TEXTURE reply_texture;
-    struct ASSET_CLOSE_FILE close_file;
+    struct ASSET_REQ_ROOM req_room;
+    struct ASSET_REPLY_ROOM reply_room;
   } data;
 };
 
-int start_asset_loader(void);
+void set_asset_loader_io_mode(int mode);
+int get_asset_loader_io_mode(void);
+int start_asset_loader(int n_workers);
 void stop_asset_loader(void);
 
 void send_asset_request(struct ASSET_REQUEST *req);
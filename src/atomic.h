@@ -0,0 +1,86 @@
+/* atomic.h */
+
+#ifndef ATOMIC_H_FILE
+#define ATOMIC_H_FILE
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+/*
+ * On x86/x64 MSVC plain volatile loads and stores already have
+ * acquire/release semantics, we only need to stop the compiler from
+ * reordering around them.
+ */
+
+static inline size_t atomic_load_acquire(volatile size_t *p)
+{
+  size_t v = *p;
+  _ReadWriteBarrier();
+  return v;
+}
+
+static inline void atomic_store_release(volatile size_t *p, size_t v)
+{
+  _ReadWriteBarrier();
+  *p = v;
+}
+
+static inline bool atomic_cas(volatile size_t *p, size_t expected, size_t desired)
+{
+#if defined(_WIN64)
+  return (size_t) _InterlockedCompareExchange64((volatile __int64 *) p, (__int64) desired, (__int64) expected) == expected;
+#else
+  return (size_t) _InterlockedCompareExchange((volatile long *) p, (long) desired, (long) expected) == expected;
+#endif
+}
+
+static inline size_t atomic_fetch_add(volatile size_t *p, size_t v)
+{
+#if defined(_WIN64)
+  return (size_t) _InterlockedExchangeAdd64((volatile __int64 *) p, (__int64) v);
+#else
+  return (size_t) _InterlockedExchangeAdd((volatile long *) p, (long) v);
+#endif
+}
+
+static inline void cpu_relax(void)
+{
+  _mm_pause();
+}
+
+#else /* gcc, clang */
+
+static inline size_t atomic_load_acquire(volatile size_t *p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_release(volatile size_t *p, size_t v)
+{
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline bool atomic_cas(volatile size_t *p, size_t expected, size_t desired)
+{
+  return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static inline size_t atomic_fetch_add(volatile size_t *p, size_t v)
+{
+  return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
+#endif
+
+#endif /* ATOMIC_H_FILE */
@@ -13,90 +13,199 @@
 #include "skeleton.h"
 #include "matrix.h"
 #include "room.h"
+#include "file_uring.h"
+#include "gfx_queue.h"
+#include "lz.h"
+
+#define BMF_MAX_VERSION '2'
+#define BCF_MAX_VERSION '2'
+#define BWF_MAX_VERSION '4'
+
+/*
+ * Check the magic and return the format version.  Version 2 and
+ * later files may have LZ compressed chunks: each chunk is stored raw
+ * if it doesn't get smaller, so it's compressed exactly when its
+ * stored size differs from its data size.
+ */
+static int read_bff_header(struct FILE_READER *file, const char *magic, char max_version, int *version)
+{
+  char header[4];
+  file_read_data(file, header, 4);
+  if (file_has_error(file) || memcmp(header, magic, 3) != 0 || header[3] < '1' || header[3] > max_version)
+    return 1;
+  *version = header[3] - '0';
+  return 0;
+}
 
-#define MAX_ROOM_MESHES  256
+static void read_bff_mesh_header(struct FILE_READER *file, struct BFF_MESH_INFO *mesh_info)
+{
+  mesh_info->vtx_size = file_read_u32(file);
+  mesh_info->ind_size = file_read_u32(file);
+  mesh_info->ind_count = file_read_u32(file);
+  mesh_info->vtx_type = file_read_u16(file);
+  mesh_info->ind_type = file_read_u16(file);
+  mesh_info->tex0_index = file_read_u32(file);
+  mesh_info->tex1_index = file_read_u32(file);
+  file_read_f32_vec(file, mesh_info->matrix, 16);
+}
 
-static struct GFX_MESH *load_bff_mesh(struct FILE_READER *file, uint32_t type, uint32_t info, void *data, uint32_t *tex0_index, uint32_t *tex1_index)
+static void read_bff_mesh_info(struct FILE_READER *file, struct BFF_MESH_INFO *mesh_info)
 {
-  uint16_t vtx_type, ind_type;
-  uint32_t vtx_size, ind_size;
-  uint32_t ind_count;
+  read_bff_mesh_header(file, mesh_info);
+  mesh_info->vtx = file_skip_data(file, mesh_info->vtx_size);
+  mesh_info->ind = file_skip_data(file, mesh_info->ind_size);
+}
 
-  vtx_size = file_read_u32(file);
-  ind_size = file_read_u32(file);
-  ind_count = file_read_u32(file);
-  vtx_type = file_read_u16(file);
-  ind_type = file_read_u16(file);
-  
-  *tex0_index = file_read_u32(file);
-  *tex1_index = file_read_u32(file);
+/*
+ * In version 2 BMF/BCF files the vertex and index data of each mesh
+ * is a chunk that may be compressed.  If it is, it's decompressed to
+ * *buffer, which must be freed with free_io_buffer() after the mesh
+ * is uploaded.
+ */
+static int read_bff_mesh_info_chunk(struct FILE_READER *file, struct BFF_MESH_INFO *mesh_info, void **buffer)
+{
+  *buffer = NULL;
+  read_bff_mesh_header(file, mesh_info);
+  uint32_t stored_size = file_read_u32(file);
+  unsigned char *stored = file_skip_data(file, stored_size);
+  if (! stored)
+    return 1;
 
+  size_t data_size = (size_t) mesh_info->vtx_size + mesh_info->ind_size;
+  unsigned char *data = stored;
+  if (stored_size != data_size) {
+    *buffer = data = alloc_io_buffer(data_size);
+    if (! data)
+      return 1;
+    if (lz_decompress(stored, stored_size, data, data_size) != 0) {
+      debug("** ERROR: corrupt mesh data\n");
+      free_io_buffer(data);
+      *buffer = NULL;
+      return 1;
+    }
+  }
+  mesh_info->vtx = data;
+  mesh_info->ind = data + mesh_info->vtx_size;
+  return 0;
+}
+
+static struct GFX_MESH *upload_bff_mesh(struct BFF_MESH_INFO *mesh_info, uint32_t type, uint32_t info, void *data, int async)
+{
   struct MODEL_MESH mesh;
-  init_model_mesh(&mesh, vtx_type, vtx_size, ind_type, ind_size, ind_count);
-  file_read_f32_vec(file, mesh.matrix, 16);
-  mesh.vtx = file_skip_data(file, vtx_size);
-  mesh.ind = file_skip_data(file, ind_size);
+  init_model_mesh(&mesh, mesh_info->vtx_type, mesh_info->vtx_size, mesh_info->ind_type, mesh_info->ind_size, mesh_info->ind_count);
+  mat4_copy(mesh.matrix, mesh_info->matrix);
+  mesh.vtx = mesh_info->vtx;
+  mesh.ind = mesh_info->ind;
 
+  if (async)
+    return gfx_upload_model_mesh_async(&mesh, type, info, data);
   return gfx_upload_model_mesh(&mesh, type, info, data);
 }
 
-static struct GFX_TEXTURE *load_bff_texture(struct FILE_READER *file)
+static struct GFX_MESH *load_bff_mesh(struct FILE_READER *file, int version, uint32_t type, uint32_t info, void *data, uint32_t *tex0_index, uint32_t *tex1_index)
 {
-  struct GFX_TEXTURE *gfx_tex = gfx_alloc_texture();
-  gfx_tex->use_count++; // asset loader counts as user until load is completed
+  *tex0_index = MODEL_TEXTURE_NONE;
+  *tex1_index = MODEL_TEXTURE_NONE;
+
+  struct BFF_MESH_INFO mesh_info;
+  void *buffer = NULL;
+  if (version >= 2) {
+    if (read_bff_mesh_info_chunk(file, &mesh_info, &buffer) != 0)
+      return NULL;
+  } else
+    read_bff_mesh_info(file, &mesh_info);
+  if (file_has_error(file)) {
+    free_io_buffer(buffer);
+    return NULL;
+  }
+  *tex0_index = mesh_info.tex0_index;
+  *tex1_index = mesh_info.tex1_index;
+  struct GFX_MESH *gfx_mesh = upload_bff_mesh(&mesh_info, type, info, data, 0);
+  free_io_buffer(buffer);
+  return gfx_mesh;
+}
 
-  uint32_t data_size = file_read_u32(file);
-  void *file_pos = file_skip_data(file, data_size);
+/*
+ * 64-bit FNV-1a hash, used to key textures in the GFX texture cache.
+ * Never returns 0 (which means "no key").
+ */
+static uint64_t hash_bff_data(const void *data, size_t size, uint64_t hash)
+{
+  const unsigned char *p = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return (hash != 0) ? hash : 1;
+}
+
+#define BFF_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+/*
+ * Return a reference to the texture at the file position.  If a
+ * texture with the same key is already loaded (or being loaded), it's
+ * shared; otherwise a new one is requested from the asset loader.  A
+ * key of 0 means the key is the hash of the texture data.  Version 2
+ * texture records have the uncompressed size after the stored size.
+ */
+static struct GFX_TEXTURE *load_bff_texture(struct FILE_READER *file, int version, uint64_t key)
+{
+  uint32_t stored_size = file_read_u32(file);
+  uint32_t data_size = (version >= 2) ? file_read_u32(file) : stored_size;
+  void *file_pos = file_skip_data(file, stored_size);
+  if (! file_pos)
+    return NULL;
+
+  if (key == 0)
+    key = hash_bff_data(file_pos, stored_size, BFF_HASH_INIT);
+  struct GFX_TEXTURE *gfx_tex = gfx_find_texture(key);
+  if (gfx_tex)
+    return gfx_tex;
+
+  gfx_tex = gfx_alloc_texture();
+  if (! gfx_tex) {
+    debug("** ERROR: too many textures\n");
+    return NULL;
+  }
+  gfx_tex->use_count++; // asset loader counts as user until load is completed
+  gfx_set_texture_key(gfx_tex, key);
   
   struct ASSET_REQUEST req;
   req.type = ASSET_TYPE_REQ_TEXTURE;
   req.data.req_texture.gfx = gfx_tex;
+  req.data.req_texture.src_file = file_ref_mapping(file);
+  req.data.req_texture.src_file_fd = file_get_fd(file);
+  req.data.req_texture.src_file_offset = file_get_fd_offset(file) + ((unsigned char *) file_pos - file->start);
   req.data.req_texture.src_file_pos = file_pos;
-  req.data.req_texture.src_file_len = data_size;
+  req.data.req_texture.src_file_len = stored_size;
+  req.data.req_texture.data_size = data_size;
   send_asset_request(&req);
 
   return gfx_tex;
 }
 
-static void request_file_close(struct FILE_READER *file)
-{
-  struct ASSET_REQUEST req;
-  req.type = ASSET_TYPE_CLOSE_FILE;
-  req.data.close_file.file = *file;
-  send_asset_request(&req);
-}
-
 /* ========================================================================================
  * BMF reader
  */
 
 struct BMF_READER {
   struct FILE_READER file;
+  int version;
   
   struct BFF_MODEL_INFO *info;
   uint32_t mesh_texture_index[MODEL_MAX_MESHES];
 };
 
-static int read_bmf_header(struct BMF_READER *bmf)
-{
-  char header[4];
-  file_read_data(&bmf->file, header, 4);
-  if (memcmp(header, "BMF1", 4) != 0)
-    return 1;
-
-  return 0;
-}
-
 static int load_bmf_meshes(struct BMF_READER *bmf, uint32_t type, uint32_t info, void *data)
 {
   uint16_t n_meshes = file_read_u16(&bmf->file);
-  if (n_meshes > MODEL_MAX_MESHES)
+  if (file_has_error(&bmf->file) || n_meshes > MODEL_MAX_MESHES)
     return 1;
 
   bmf->info->n_gfx_meshes = n_meshes;
   for (uint16_t i = 0; i < n_meshes; i++) {
     uint32_t tex0_index, tex1_index;
-    bmf->info->gfx_meshes[i] = load_bff_mesh(&bmf->file, type, info, data, &tex0_index, &tex1_index);
+    bmf->info->gfx_meshes[i] = load_bff_mesh(&bmf->file, bmf->version, type, info, data, &tex0_index, &tex1_index);
     if (! bmf->info->gfx_meshes[i])
       return 1;
     bmf->mesh_texture_index[i] = tex0_index;
@@ -108,13 +217,16 @@ static int load_bmf_textures(struct BMF_READER *bmf)
 {
   uint16_t n_textures = file_read_u16(&bmf->file);
   for (uint16_t i = 0; i < n_textures; i++) {
-    struct GFX_TEXTURE *texture = load_bff_texture(&bmf->file);
+    struct GFX_TEXTURE *texture = load_bff_texture(&bmf->file, bmf->version, 0);
     if (! texture)
       return 1;
     for (int mesh = 0; mesh < bmf->info->n_gfx_meshes; mesh++) {
-      if (bmf->mesh_texture_index[mesh] == i)
+      if (bmf->mesh_texture_index[mesh] == i) {
+        texture->use_count++;
         bmf->info->gfx_meshes[mesh]->texture = texture;
+      }
     }
+    gfx_release_texture(texture);
   }
   return 0;
 }
@@ -127,7 +239,7 @@ int load_bmf(struct BFF_MODEL_INFO *bff_info, const char *filename, uint32_t typ
   if (file_open(&bmf.file, filename) != 0)
     return 1;
 
-  if (read_bmf_header(&bmf) != 0)
+  if (read_bff_header(&bmf.file, "BMF", BMF_MAX_VERSION, &bmf.version) != 0)
     goto err;
 
   if (load_bmf_meshes(&bmf, type, info, data) != 0)
@@ -136,11 +248,11 @@ int load_bmf(struct BFF_MODEL_INFO *bff_info, const char *filename, uint32_t typ
   if (load_bmf_textures(&bmf) != 0)
     goto err;
   
-  request_file_close(&bmf.file);
+  file_close(&bmf.file);
   return 0;
 
  err:
-  request_file_close(&bmf.file);
+  file_close(&bmf.file);
   return 1;
 }
 
@@ -148,21 +260,14 @@ int load_bmf(struct BFF_MODEL_INFO *bff_info, const char *filename, uint32_t typ
  * BCF reader
  */
 
-static int read_bcf_header(struct FILE_READER *file)
-{
-  char header[4];
-  file_read_data(file, header, 4);
-  if (memcmp(header, "BCF1", 4) != 0)
-    return 1;
-
-  return 0;
-}
-
-static void load_bcf_keyframes(struct FILE_READER *file, struct SKEL_BONE_KEYFRAME **p_keyframes_data,
-                               uint16_t *ret_n_keyframes, struct SKEL_BONE_KEYFRAME **ret_keyframes, int n_comp)
+static int load_bcf_keyframes(struct FILE_READER *file, struct SKEL_BONE_KEYFRAME **p_keyframes_data,
+                              struct SKEL_BONE_KEYFRAME *keyframes_end,
+                              uint16_t *ret_n_keyframes, struct SKEL_BONE_KEYFRAME **ret_keyframes, int n_comp)
 {
   uint16_t n_keyframes = file_read_u16(file);
   struct SKEL_BONE_KEYFRAME *keyframes = *p_keyframes_data;
+  if (n_keyframes > keyframes_end - keyframes)
+    return 1;
   for (uint16_t i = 0; i < n_keyframes; i++) {
     keyframes[i].time = file_read_f32(file);
     file_read_f32_vec(file, keyframes[i].data, n_comp);
@@ -172,6 +277,7 @@ static void load_bcf_keyframes(struct FILE_READER *file, struct SKEL_BONE_KEYFRA
   *ret_keyframes = keyframes;
   *ret_n_keyframes = n_keyframes;
   (*p_keyframes_data) += n_keyframes;
+  return 0;
 }
 
 static int read_anim_name(struct FILE_READER *file, struct SKEL_ANIMATION *anim)
@@ -190,12 +296,14 @@ static int load_bcf_skeleton(struct FILE_READER *file, struct SKELETON *skel)
   uint16_t n_anim = file_read_u16(file);
   uint32_t n_keyframes = file_read_u32(file);
 
-  if (new_skeleton(skel, n_bones, n_anim, n_keyframes) != 0)
+  if (file_has_error(file) || new_skeleton(skel, n_bones, n_anim, n_keyframes) != 0)
     return 1;
   
   for (uint16_t bone_index = 0; bone_index < n_bones; bone_index++) {
     struct SKEL_BONE *bone = &skel->bones[bone_index];
     uint16_t parent = file_read_u16(file);
+    if (parent != 0xffff && parent >= n_bones)
+      return 1;
     bone->parent = (parent == 0xffff) ? -1 : parent;
     file_read_f32_vec(file, bone->inv_matrix, 16);
     file_read_f32_vec(file, bone->pose_matrix, 16);
@@ -217,6 +325,7 @@ static int load_bcf_skeleton(struct FILE_READER *file, struct SKELETON *skel)
 #endif
   
   struct SKEL_BONE_KEYFRAME *keyframe_data = skel->keyframe_data;
+  struct SKEL_BONE_KEYFRAME *keyframe_end = skel->keyframe_data + n_keyframes;
   for (uint16_t anim_index = 0; anim_index < n_anim; anim_index++) {
     struct SKEL_ANIMATION *anim = &skel->animations[anim_index];
     if (read_anim_name(file, anim) != 0)
@@ -227,12 +336,15 @@ static int load_bcf_skeleton(struct FILE_READER *file, struct SKELETON *skel)
     anim->loop_end_time = file_read_f32(file);
     for (uint16_t bone_index = 0; bone_index < n_bones; bone_index++) {
       struct SKEL_BONE_ANIMATION *bone_anim = &anim->bones[bone_index];
-      load_bcf_keyframes(file, &keyframe_data, &bone_anim->n_trans_keyframes, &bone_anim->trans_keyframes, 3);
-      load_bcf_keyframes(file, &keyframe_data, &bone_anim->n_rot_keyframes, &bone_anim->rot_keyframes, 4);
-      load_bcf_keyframes(file, &keyframe_data, &bone_anim->n_scale_keyframes, &bone_anim->scale_keyframes, 3);
+      if (load_bcf_keyframes(file, &keyframe_data, keyframe_end, &bone_anim->n_trans_keyframes, &bone_anim->trans_keyframes, 3) != 0 ||
+          load_bcf_keyframes(file, &keyframe_data, keyframe_end, &bone_anim->n_rot_keyframes, &bone_anim->rot_keyframes, 4) != 0 ||
+          load_bcf_keyframes(file, &keyframe_data, keyframe_end, &bone_anim->n_scale_keyframes, &bone_anim->scale_keyframes, 3) != 0)
+        return 1;
     }
   }
 
+  if (file_has_error(file))
+    return 1;
   return 0;
 }
 
@@ -244,7 +356,7 @@ int load_bcf(struct BFF_MODEL_INFO *bff_info, const char *filename, struct SKELE
   if (file_open(&bmf.file, filename) != 0)
     return 1;
 
-  if (read_bcf_header(&bmf.file) != 0)
+  if (read_bff_header(&bmf.file, "BCF", BCF_MAX_VERSION, &bmf.version) != 0)
     goto err;
 
   if (load_bmf_meshes(&bmf, type, info, data) != 0)
@@ -256,11 +368,11 @@ int load_bcf(struct BFF_MODEL_INFO *bff_info, const char *filename, struct SKELE
   if (load_bcf_skeleton(&bmf.file, skel) != 0)
     goto err;
   
-  request_file_close(&bmf.file);
+  file_close(&bmf.file);
   return 0;
 
  err:
-  request_file_close(&bmf.file);
+  file_close(&bmf.file);
   return 1;
 }
 
@@ -268,101 +380,492 @@ int load_bcf(struct BFF_MODEL_INFO *bff_info, const char *filename, struct SKELE
  * BWF reader
  */
 
-static int read_bwf_index(struct BWF_READER *bwf)
+/*
+ * Version 3 index, at a page aligned offset given by the u64 in the
+ * file header after the magic and a reserved u32:
+ *
+ *   u32  n_rooms
+ *   u32  n_textures
+ *   u32  reserved[2]
+ *   room entries:    u64 offset, u32 stored size, u32 data size
+ *   texture entries: u64 offset
+ *
+ * Entries are fixed size and never cross a page, so a lookup goes
+ * straight to its entry and touches a single page of the index.
+ */
+#define BWF_INDEX_HEADER_SIZE   16
+#define BWF_ROOM_ENTRY_SIZE     16
+#define BWF_TEXTURE_ENTRY_SIZE  8
+
+/*
+ * The version 1 index doesn't store the room sizes, so use the
+ * distance to the next thing in the file.
+ */
+static void compute_bwf_room_sizes(struct BWF_READER *bwf, uint32_t index_off)
 {
-  char header[4];
-  file_read_data(&bwf->file, header, 4);
-  if (memcmp(header, "BWF1", 4) != 0)
-    return 1;
+  for (uint32_t i = 0; i < bwf->n_rooms; i++) {
+    uint64_t start = bwf->legacy_rooms[i].offset;
+    uint64_t end = (index_off > start) ? index_off : (uint64_t) bwf->file.size;
+    for (uint32_t j = 0; j < bwf->n_rooms; j++) {
+      if (bwf->legacy_rooms[j].offset > start && bwf->legacy_rooms[j].offset < end)
+        end = bwf->legacy_rooms[j].offset;
+    }
+    for (uint32_t j = 0; j < bwf->n_textures; j++) {
+      if (bwf->legacy_textures[j] > start && bwf->legacy_textures[j] < end)
+        end = bwf->legacy_textures[j];
+    }
+    bwf->legacy_rooms[i].size = (start < end) ? end - start : 0;
+    bwf->legacy_rooms[i].data_size = bwf->legacy_rooms[i].size;
+  }
+}
 
+static int read_bwf_legacy_index(struct BWF_READER *bwf)
+{
   uint32_t index_off = file_read_u32(&bwf->file);
   if (file_set_pos(&bwf->file, index_off) != 0)
     return 1;
 
   bwf->n_rooms = file_read_u32(&bwf->file);
-  for (uint32_t i = 0; i < bwf->n_rooms; i++)
-    bwf->room_off[i] = file_read_u32(&bwf->file);
+  if (bwf->n_rooms > BWF_MAX_LEGACY_ROOMS)
+    return 1;
+  bwf->legacy_rooms = malloc((bwf->n_rooms + 1) * sizeof *bwf->legacy_rooms);
+  if (! bwf->legacy_rooms)
+    return 1;
+  for (uint32_t i = 0; i < bwf->n_rooms; i++) {
+    bwf->legacy_rooms[i].offset = file_read_u32(&bwf->file);
+    if (bwf->version >= 2) {
+      bwf->legacy_rooms[i].size = file_read_u32(&bwf->file);
+      bwf->legacy_rooms[i].data_size = file_read_u32(&bwf->file);
+    }
+  }
 
   bwf->n_textures = file_read_u32(&bwf->file);
+  if (bwf->n_textures > BWF_MAX_LEGACY_TEXTURES)
+    return 1;
+  bwf->legacy_textures = malloc((bwf->n_textures + 1) * sizeof *bwf->legacy_textures);
+  if (! bwf->legacy_textures)
+    return 1;
   for (uint32_t i = 0; i < bwf->n_textures; i++)
-    bwf->texture_off[i] = file_read_u32(&bwf->file);
+    bwf->legacy_textures[i] = file_read_u32(&bwf->file);
 
+  if (file_has_error(&bwf->file))
+    return 1;
+  if (bwf->version < 2)
+    compute_bwf_room_sizes(bwf, index_off);
   return 0;
 }
 
-static int load_bwf_mesh(struct BWF_READER *bwf, struct ROOM *room)
+static int read_bwf_index(struct BWF_READER *bwf)
 {
-  uint32_t tex0_index, tex1_index;
-  struct GFX_MESH *gfx_mesh = load_bff_mesh(&bwf->file, GFX_MESH_TYPE_ROOM, room->index, room, &tex0_index, &tex1_index);
-  if (! gfx_mesh)
+  if (read_bff_header(&bwf->file, "BWF", BWF_MAX_VERSION, &bwf->version) != 0)
     return 1;
+  if (bwf->version < 3)
+    return read_bwf_legacy_index(bwf);
 
-  if (tex0_index != 0xffffffff) {
-    uint32_t cur_file_pos = file_get_pos(&bwf->file);
-    
-    if (tex0_index >= bwf->n_textures ||
-        file_set_pos(&bwf->file, bwf->texture_off[tex0_index]) != 0)
-      return 1;
+  file_read_u32(&bwf->file);  // reserved
+  uint64_t index_off = file_read_u64(&bwf->file);
+  if (file_has_error(&bwf->file) || index_off > bwf->file.size || file_set_pos(&bwf->file, index_off) != 0)
+    return 1;
+  bwf->n_rooms = file_read_u32(&bwf->file);
+  bwf->n_textures = file_read_u32(&bwf->file);
+  if (file_has_error(&bwf->file))
+    return 1;
+
+  bwf->room_index_off = index_off + BWF_INDEX_HEADER_SIZE;
+  bwf->texture_index_off = bwf->room_index_off + (size_t) bwf->n_rooms * BWF_ROOM_ENTRY_SIZE;
+  uint64_t index_end = bwf->texture_index_off + (uint64_t) bwf->n_textures * BWF_TEXTURE_ENTRY_SIZE;
+  if (index_end > bwf->file.size)
+    return 1;
+  return 0;
+}
+
+/*
+ * Set up a reader of the BWF file that doesn't share the BWF reader's
+ * position and error flag, which the render thread may be using.  Only
+ * the fields that don't change after the file is opened are read.
+ */
+static void init_bwf_file_reader(struct BWF_READER *bwf, struct FILE_READER *file)
+{
+  file->start = bwf->file.start;
+  file->pos = bwf->file.start;
+  file->size = bwf->file.size;
+  file->error = 0;
+  file->mapping = bwf->file.mapping;
+}
+
+/*
+ * Get the file position and size of a room.  This doesn't touch the
+ * BWF reader's file position, so it's safe to call from the asset
+ * loader threads.
+ */
+int get_bwf_room_entry(struct BWF_READER *bwf, uint32_t index, struct BWF_ROOM_ENTRY *entry)
+{
+  if (index >= bwf->n_rooms)
+    return 1;
 
-    gfx_mesh->texture = load_bff_texture(&bwf->file);
-    if (! gfx_mesh->texture)
+  if (bwf->legacy_rooms)
+    *entry = bwf->legacy_rooms[index];
+  else {
+    struct FILE_READER file;
+    init_bwf_file_reader(bwf, &file);
+    file_set_pos(&file, bwf->room_index_off + (size_t) index * BWF_ROOM_ENTRY_SIZE);
+    entry->offset = file_read_u64(&file);
+    entry->size = file_read_u32(&file);
+    entry->data_size = file_read_u32(&file);
+    if (file_has_error(&file))
       return 1;
-    
-    if (file_set_pos(&bwf->file, cur_file_pos) != 0)
+  }
+
+  if (entry->offset > bwf->file.size || entry->size > bwf->file.size - entry->offset)
+    return 1;
+  return 0;
+}
+
+static int get_bwf_texture_offset(struct BWF_READER *bwf, uint32_t index, uint64_t *offset)
+{
+  if (index >= bwf->n_textures)
+    return 1;
+
+  if (bwf->legacy_textures)
+    *offset = bwf->legacy_textures[index];
+  else {
+    struct FILE_READER file;
+    init_bwf_file_reader(bwf, &file);
+    file_set_pos(&file, bwf->texture_index_off + (size_t) index * BWF_TEXTURE_ENTRY_SIZE);
+    *offset = file_read_u64(&file);
+    if (file_has_error(&file))
       return 1;
-  } else {
+  }
+  return (*offset > bwf->file.size) ? 1 : 0;
+}
+
+/*
+ * World textures are keyed by file and texture index instead of by
+ * contents, so we don't have to read them (or even their index entry)
+ * to find out they're already loaded.  BWF readers of the same file
+ * share the mapping, and so the textures.  The mapping serial is used
+ * instead of the mapped address, which can be reused for another file
+ * once this one is unmapped, and the offset in the mapping tells apart
+ * BWF files in the same pack.
+ */
+static uint64_t get_bwf_texture_key(struct BWF_READER *bwf, uint32_t tex_index)
+{
+  uint64_t serial = file_get_mapping_serial(&bwf->file);
+  uint64_t offset = file_get_fd_offset(&bwf->file);
+  uint64_t key = hash_bff_data(&serial, sizeof(serial), BFF_HASH_INIT);
+  key = hash_bff_data(&offset, sizeof(offset), key);
+  return hash_bff_data(&tex_index, sizeof(tex_index), key);
+}
+
+static int load_bwf_texture(struct BWF_READER *bwf, struct GFX_MESH *gfx_mesh, uint32_t tex_index)
+{
+  if (tex_index == 0xffffffff) {
     gfx_mesh->texture = NULL;
+    return 0;
   }
+  if (tex_index >= bwf->n_textures)
+    return 1;
+
+  uint64_t key = get_bwf_texture_key(bwf, tex_index);
+  gfx_mesh->texture = gfx_find_texture(key);
+  if (gfx_mesh->texture)
+    return 0;
+
+  uint64_t offset;
+  if (get_bwf_texture_offset(bwf, tex_index, &offset) != 0)
+    return 1;
+  file_clear_error(&bwf->file);
+  if (file_set_pos(&bwf->file, offset) != 0)
+    return 1;
+
+  gfx_mesh->texture = load_bff_texture(&bwf->file, bwf->version, key);
+  if (! gfx_mesh->texture)
+    return 1;
   return 0;
 }
 
-static int read_bwf_room_info(struct BWF_READER *bwf, struct ROOM *room)
+/*
+ * Version 1-3 rooms store the bounding rectangle of their nonzero
+ * tiles; allocate chunks only where the rectangle has tiles.
+ */
+static int read_bwf_room_tile_rect(struct FILE_READER *file, struct ROOM *room)
 {
-  file_read_f32_vec(&bwf->file, room->pos, 3);
+  uint8_t x_tiles_start = file_read_u8(file);
+  uint8_t x_tiles_size  = file_read_u8(file);
+  uint8_t y_tiles_start = file_read_u8(file);
+  uint8_t y_tiles_size  = file_read_u8(file);
+  if (x_tiles_start + x_tiles_size > 256 || y_tiles_start + y_tiles_size > 256)
+    return 1;
 
-  room->n_neighbors = file_read_u8(&bwf->file);
-  for (uint8_t i = 0; i < room->n_neighbors; i++)
-    room->neighbor_index[i] = file_read_u32(&bwf->file);
-
-  memset(room->tiles, 0, sizeof(room->tiles));
-  uint8_t x_tiles_start = file_read_u8(&bwf->file);
-  uint8_t x_tiles_size  = file_read_u8(&bwf->file);
-  uint8_t y_tiles_start = file_read_u8(&bwf->file);
-  uint8_t y_tiles_size  = file_read_u8(&bwf->file);
-  for (int y = 0; y < y_tiles_size; y++) {
-    for (int x = 0; x < x_tiles_size; x++)
-      room->tiles[y_tiles_start + y][x_tiles_start + x] = file_read_u16(&bwf->file);
+  uint16_t *chunks[ROOM_TILE_CHUNKS][ROOM_TILE_CHUNKS] = { { NULL } };
+  for (int y = y_tiles_start; y < y_tiles_start + y_tiles_size; y++) {
+    for (int x = x_tiles_start; x < x_tiles_start + x_tiles_size; x++) {
+      uint16_t tile = file_read_u16(file);
+      if (tile == 0)
+        continue;
+      uint16_t **chunk = &chunks[y / ROOM_TILE_CHUNK_SIZE][x / ROOM_TILE_CHUNK_SIZE];
+      if (! *chunk) {
+        *chunk = alloc_room_tile_chunk();
+        if (! *chunk)
+          return 1;
+        memset(*chunk, 0, ROOM_TILE_CHUNK_SIZE * ROOM_TILE_CHUNK_SIZE * sizeof(uint16_t));
+        room->tile_chunks[y / ROOM_TILE_CHUNK_SIZE][x / ROOM_TILE_CHUNK_SIZE] = *chunk;
+      }
+      (*chunk)[(y % ROOM_TILE_CHUNK_SIZE) * ROOM_TILE_CHUNK_SIZE + x % ROOM_TILE_CHUNK_SIZE] = tile;
+    }
   }
   return 0;
 }
 
-int load_bwf_room(struct BWF_READER *bwf, struct ROOM *room)
+/*
+ * Version 4 rooms store only the chunks with nonzero tiles.  When
+ * reading straight from the file mapping the chunks point into it, so
+ * the BWF reader must stay open while the room is loaded; otherwise
+ * they're copied to chunks from the room tile pool.
+ */
+static int read_bwf_room_tile_chunks(struct FILE_READER *file, struct ROOM *room)
 {
-  if (room->index < 0 || (uint32_t)room->index >= bwf->n_rooms)
-    return 1;
+  const size_t chunk_tiles = ROOM_TILE_CHUNK_SIZE * ROOM_TILE_CHUNK_SIZE;
 
-  if (file_set_pos(&bwf->file, bwf->room_off[room->index]) != 0)
+  bool seen[ROOM_TILE_CHUNKS][ROOM_TILE_CHUNKS] = { { false } };
+  uint16_t n_chunks = file_read_u16(file);
+  if (n_chunks > ROOM_TILE_CHUNKS * ROOM_TILE_CHUNKS)
     return 1;
+  for (uint16_t i = 0; i < n_chunks; i++) {
+    uint8_t cx = file_read_u8(file);
+    uint8_t cy = file_read_u8(file);
+    if (file_has_error(file) || cx >= ROOM_TILE_CHUNKS || cy >= ROOM_TILE_CHUNKS || seen[cy][cx])
+      return 1;
+    seen[cy][cx] = true;
+    if (FILE_HOST_LITTLE_ENDIAN && file->mapping && ((uintptr_t) file->pos % sizeof(uint16_t)) == 0) {
+      const void *tiles = file_skip_data(file, chunk_tiles * sizeof(uint16_t));
+      if (! tiles)
+        return 1;
+      room->tile_chunks[cy][cx] = tiles;
+    } else {
+      uint16_t *tiles = alloc_room_tile_chunk();
+      if (! tiles)
+        return 1;
+      room->tile_chunks[cy][cx] = tiles;
+      file_read_u16_vec(file, tiles, chunk_tiles);
+    }
+  }
+  return 0;
+}
 
-  if (read_bwf_room_info(bwf, room) != 0)
-    return 1;
-  
-  uint16_t n_meshes = file_read_u16(&bwf->file);
-  for (uint16_t i = 0; i < n_meshes; i++) {
-    if (load_bwf_mesh(bwf, room) != 0)
+static int read_bwf_room_info(struct FILE_READER *file, int version, struct ROOM *room)
+{
+  file_read_f32_vec(file, room->pos, 3);
+
+  clear_room_tiles(room);
+  if (version >= 4 && read_bwf_room_tile_chunks(file, room) != 0)
+    goto err;
+
+  room->n_neighbors = file_read_u8(file);
+  if (room->n_neighbors > ROOM_MAX_NEIGHBORS)
+    goto err;
+  for (uint8_t i = 0; i < room->n_neighbors; i++)
+    room->neighbor_index[i] = file_read_u32(file);
+
+  if (version < 4 && read_bwf_room_tile_rect(file, room) != 0)
+    goto err;
+  if (file_has_error(file))
+    goto err;
+  return 0;
+
+ err:
+  clear_room_tiles(room);
+  return 1;
+}
+
+static struct BWF_ROOM_DATA *parse_bwf_room(struct FILE_READER *file, int version, struct ROOM *room)
+{
+  if (read_bwf_room_info(file, version, room) != 0)
+    return NULL;
+
+  uint16_t n_meshes = file_read_u16(file);
+  if (file_has_error(file) || n_meshes > BWF_MAX_ROOM_MESHES) {
+    clear_room_tiles(room);
+    return NULL;
+  }
+
+  struct BWF_ROOM_DATA *data = malloc(sizeof *data);
+  if (! data) {
+    clear_room_tiles(room);
+    return NULL;
+  }
+  data->buffer = NULL;
+  data->n_meshes = n_meshes;
+  for (uint16_t i = 0; i < n_meshes; i++)
+    read_bff_mesh_info(file, &data->meshes[i]);
+  if (file_has_error(file)) {
+    debug("** ERROR: room %d is truncated\n", room->index);
+    clear_room_tiles(room);
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/*
+ * Parse a room from a buffer allocated with alloc_io_buffer().  The
+ * room data takes the buffer even on error.
+ */
+static struct BWF_ROOM_DATA *parse_bwf_room_buffer(int version, struct ROOM *room, void *buffer, size_t size)
+{
+  struct FILE_READER file;
+  file.start = file.pos = buffer;
+  file.size = size;
+  file.error = 0;
+  file.mapping = NULL;
+
+  struct BWF_ROOM_DATA *data = parse_bwf_room(&file, version, room);
+  if (! data) {
+    free_io_buffer(buffer);
+    return NULL;
+  }
+  data->buffer = buffer;
+  return data;
+}
+
+/*
+ * Decompress a compressed room to a new buffer and parse it.
+ */
+static struct BWF_ROOM_DATA *unpack_bwf_room(int version, struct BWF_ROOM_ENTRY *entry, struct ROOM *room, const void *src)
+{
+  void *buffer = alloc_io_buffer(entry->data_size);
+  if (! buffer)
+    return NULL;
+  if (lz_decompress(src, entry->size, buffer, entry->data_size) != 0) {
+    debug("** ERROR: room %d has corrupt compressed data\n", room->index);
+    free_io_buffer(buffer);
+    return NULL;
+  }
+  return parse_bwf_room_buffer(version, room, buffer, entry->data_size);
+}
+
+/*
+ * Read the room info and mesh headers.  This doesn't touch GL or the
+ * BWF reader's file position, so it can run on an asset loader worker
+ * while the render thread keeps using the reader.
+ */
+struct BWF_ROOM_DATA *read_bwf_room(struct BWF_READER *bwf, struct ROOM *room)
+{
+  struct BWF_ROOM_ENTRY entry;
+  if (room->index < 0 || get_bwf_room_entry(bwf, room->index, &entry) != 0)
+    return NULL;
+
+  struct FILE_READER file;
+  init_bwf_file_reader(bwf, &file);
+  if (file_set_pos(&file, entry.offset) != 0)
+    return NULL;
+
+  // bring in the whole room (including the mesh data we'll upload later) in one go
+  file_advise(&file, entry.offset, entry.size, FILE_ADVICE_WILLNEED);
+
+  if (entry.size != entry.data_size)
+    return unpack_bwf_room(bwf->version, &entry, room, file.pos);
+  return parse_bwf_room(&file, bwf->version, room);
+}
+
+/*
+ * Like read_bwf_room(), but parse the room from a buffer holding the
+ * stored bytes of its index entry.  The room data takes the buffer
+ * (allocated with alloc_io_buffer()) even on error, and the mesh
+ * data points into it -- or into a new buffer if the room is
+ * compressed, in which case this one is freed.
+ */
+struct BWF_ROOM_DATA *read_bwf_room_buffer(struct BWF_READER *bwf, struct ROOM *room, void *buffer)
+{
+  struct BWF_ROOM_ENTRY entry;
+  if (room->index < 0 || get_bwf_room_entry(bwf, room->index, &entry) != 0) {
+    free_io_buffer(buffer);
+    return NULL;
+  }
+
+  if (entry.size != entry.data_size) {
+    struct BWF_ROOM_DATA *data = unpack_bwf_room(bwf->version, &entry, room, buffer);
+    free_io_buffer(buffer);
+    return data;
+  }
+  return parse_bwf_room_buffer(bwf->version, room, buffer, entry.size);
+}
+
+void free_bwf_room_data(struct BWF_ROOM_DATA *data)
+{
+  free_io_buffer(data->buffer);
+  free(data);
+}
+
+static void free_room_data_callback(void *data)
+{
+  free_bwf_room_data(data);
+}
+
+/*
+ * Free the room data after the mesh uploads reading from it are done.
+ */
+void release_bwf_room_data(struct BWF_ROOM_DATA *data)
+{
+  gfx_queue_free_after_uploads(free_room_data_callback, data);
+}
+
+/*
+ * The mesh data points into the BWF file mapping or the room data's
+ * buffer, so the room data must be freed with release_bwf_room_data()
+ * to let the asynchronous uploads finish.
+ */
+int upload_bwf_room(struct BWF_READER *bwf, struct ROOM *room, struct BWF_ROOM_DATA *data)
+{
+  room->cpu_bytes = get_room_tile_bytes(room);
+  room->mesh_bytes = 0;
+  room->n_meshes = 0;
+  for (int i = 0; i < data->n_meshes; i++) {
+    struct GFX_MESH *gfx_mesh = upload_bff_mesh(&data->meshes[i], GFX_MESH_TYPE_ROOM, room->index, room, 1);
+    if (! gfx_mesh)
+      return 1;
+    room->meshes[room->n_meshes++] = gfx_mesh;
+    if (load_bwf_texture(bwf, gfx_mesh, data->meshes[i].tex0_index) != 0)
       return 1;
+    room->mesh_bytes += data->meshes[i].vtx_size + data->meshes[i].ind_size;
   }
+  update_room_gpu_bytes(room);
+  return 0;
+}
 
+int request_bwf_room(struct BWF_READER *bwf, struct ROOM *room)
+{
+  if (room->index < 0 || (uint32_t)room->index >= bwf->n_rooms)
+    return 1;
+
+  struct ASSET_REQUEST req;
+  req.type = ASSET_TYPE_REQ_ROOM;
+  req.data.req_room.bwf = bwf;
+  req.data.req_room.room = room;
+  send_asset_request(&req);
   return 0;
 }
 
+int load_bwf_room(struct BWF_READER *bwf, struct ROOM *room)
+{
+  struct BWF_ROOM_DATA *data = read_bwf_room(bwf, room);
+  if (! data)
+    return 1;
+
+  int ret = upload_bwf_room(bwf, room, data);
+  free_bwf_room_data(data);
+  return ret;
+}
+
 int open_bwf(struct BWF_READER *bwf, const char *filename)
 {
+  bwf->legacy_rooms = NULL;
+  bwf->legacy_textures = NULL;
   if (file_open(&bwf->file, filename) != 0)
     return 1;
 
   if (read_bwf_index(bwf) != 0) {
-    file_close(&bwf->file);
+    close_bwf(bwf);
     return 1;
   }
   return 0;
@@ -370,5 +873,9 @@ int open_bwf(struct BWF_READER *bwf, const char *filename)
 
 void close_bwf(struct BWF_READER *bwf)
 {
+  free(bwf->legacy_rooms);
+  free(bwf->legacy_textures);
+  bwf->legacy_rooms = NULL;
+  bwf->legacy_textures = NULL;
   file_close(&bwf->file);
 }
@@ -8,17 +8,59 @@
 #include "model.h"
 #include "skeleton.h"
 #include "file.h"
+#include "room.h"
 
-#define BWF_MAX_ROOMS    1024
-#define BWF_MAX_TEXTURES 1024
+#define BWF_MAX_LEGACY_ROOMS    1024   // limits for version 1 and 2 files
+#define BWF_MAX_LEGACY_TEXTURES 1024
+#define BWF_MAX_ROOM_MESHES ROOM_MAX_MESHES
 
+struct BWF_ROOM_ENTRY {
+  uint64_t offset;
+  uint32_t size;        // bytes stored in the file
+  uint32_t data_size;   // bytes after decompression
+};
+
+/*
+ * The version 3 index is read from the file mapping when an entry is
+ * needed, so opening the file reads only the header.  Older files
+ * have their (small) index read into memory.
+ */
 struct BWF_READER {
   struct FILE_READER file;
+  int version;
   uint32_t n_rooms;
-  uint32_t room_off[BWF_MAX_ROOMS];
   uint32_t n_textures;
-  uint32_t texture_off[BWF_MAX_TEXTURES];
-  int texture_index[BWF_MAX_TEXTURES];
+  size_t room_index_off;
+  size_t texture_index_off;
+  struct BWF_ROOM_ENTRY *legacy_rooms;
+  uint64_t *legacy_textures;
+};
+
+/*
+ * Mesh header as stored in the file.  The vertex and index pointers
+ * point into the file mapping.
+ */
+struct BFF_MESH_INFO {
+  uint32_t vtx_size;
+  uint32_t ind_size;
+  uint32_t ind_count;
+  uint16_t vtx_type;
+  uint16_t ind_type;
+  uint32_t tex0_index;
+  uint32_t tex1_index;
+  float matrix[16];
+  void *vtx;
+  void *ind;
+};
+
+/*
+ * Room meshes parsed by an asset loader worker: all the render thread
+ * has to do is upload them.
+ */
+struct BWF_ROOM_DATA {
+  void *buffer;      // holds the mesh data if it's not read from the file mapping
+  int n_meshes;
+  struct BFF_MESH_INFO meshes[BWF_MAX_ROOM_MESHES];
 };
 
 struct BFF_MODEL_INFO {
@@ -30,7 +72,14 @@ struct ROOM;
 
 int open_bwf(struct BWF_READER *bwf, const char *filename);
 void close_bwf(struct BWF_READER *bwf);
+int get_bwf_room_entry(struct BWF_READER *bwf, uint32_t index, struct BWF_ROOM_ENTRY *entry);
 int load_bwf_room(struct BWF_READER *bwf, struct ROOM *room);
+int request_bwf_room(struct BWF_READER *bwf, struct ROOM *room);
+struct BWF_ROOM_DATA *read_bwf_room(struct BWF_READER *bwf, struct ROOM *room);
+struct BWF_ROOM_DATA *read_bwf_room_buffer(struct BWF_READER *bwf, struct ROOM *room, void *buffer);
+int upload_bwf_room(struct BWF_READER *bwf, struct ROOM *room, struct BWF_ROOM_DATA *data);
+void free_bwf_room_data(struct BWF_ROOM_DATA *data);
+void release_bwf_room_data(struct BWF_ROOM_DATA *data);
 
 int load_bmf(struct BFF_MODEL_INFO *bff_info, const char *filename, uint32_t type, uint32_t info, void *data);
 int load_bcf(struct BFF_MODEL_INFO *bff_info, const char *filename, struct SKELETON *skel, uint32_t type, uint32_t info, void *data);
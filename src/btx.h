@@ -0,0 +1,54 @@
+/* btx.h */
+
+#ifndef BTX_H_FILE
+#define BTX_H_FILE
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * BTX texture chunk: a texture with its mip chain, stored ready to be
+ * uploaded.  It's written by the builder in place of the PNG/JPEG
+ * data of a texture record (so it's preceded by its u32 size), and
+ * readers tell the two apart by the magic.  All numbers are little
+ * endian:
+ *
+ *   char magic[4]            "BTX1"
+ *   u8   format              BTX_FORMAT_xxx
+ *   u8   n_levels
+ *   u16  reserved            0
+ *   u32  width               of level 0
+ *   u32  height              of level 0
+ *   u32  level_size[n_levels]
+ *   level data, from level 0 down
+ *
+ * Block compressed levels are stored as rows of 4x4 pixel blocks.
+ */
+
+#define BTX_FORMAT_RGBA8  0   // 4 bytes per pixel
+#define BTX_FORMAT_BC1    1   // 8 bytes per block, no alpha
+#define BTX_FORMAT_BC3    2   // 16 bytes per block
+#define BTX_FORMAT_BC7    3   // 16 bytes per block (only mode 6 is decoded)
+
+#define BTX_MAX_LEVELS    15
+#define BTX_MAX_SIZE      16384
+#define BTX_HEADER_SIZE   16
+
+struct BTX_INFO {
+  int format;
+  int width;
+  int height;
+  int n_levels;
+  const unsigned char *level_data[BTX_MAX_LEVELS];
+  size_t level_size[BTX_MAX_LEVELS];
+};
+
+int is_btx_data(const void *data, size_t size);
+int read_btx_info(struct BTX_INFO *info, const void *data, size_t size);
+size_t get_btx_level_size(int format, int width, int height);
+int get_btx_level_width(struct BTX_INFO *info, int level);
+int get_btx_level_height(struct BTX_INFO *info, int level);
+int decode_btx_level(struct BTX_INFO *info, int level, unsigned char *rgba);
+void *decode_btx_rgba(struct BTX_INFO *info, size_t *ret_size);
+
+#endif /* BTX_H_FILE */
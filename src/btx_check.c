@@ -0,0 +1,140 @@
+/* btx_check.c
+ *
+ * Check the game's BTX decoder against the builder's encoder: encode
+ * a known image in every BTX format and compare the decoded pixels
+ * with the original.  Block compression is lossy, so each format has
+ * a minimum PSNR; RGBA8 must decode exactly.
+ *
+ * Usage: btx_check [size]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "btx.h"
+
+// from the builder (editor/btx_encode.c)
+unsigned char *encode_btx(const unsigned char *rgba, int width, int height, int format, size_t *ret_size);
+
+struct CHECK_FORMAT {
+  int format;
+  const char *name;
+  int has_alpha;
+  double min_psnr;
+};
+
+static const struct CHECK_FORMAT check_formats[] = {
+  { BTX_FORMAT_RGBA8, "RGBA8",   1, INFINITY },
+  { BTX_FORMAT_BC1,   "BC1",     0, 30.0 },
+  { BTX_FORMAT_BC3,   "BC3",     1, 30.0 },
+  { BTX_FORMAT_BC7,   "BC7 (6)", 1, 36.0 },
+};
+
+/*
+ * Smooth gradients with a few hard edges, so blocks need both
+ * interpolated colors and endpoints far apart.  Formats without alpha
+ * get an opaque image.
+ */
+static unsigned char *make_check_image(int size, int has_alpha)
+{
+  unsigned char *rgba = malloc(4 * (size_t) size * size);
+  if (! rgba)
+    return NULL;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      unsigned char *p = &rgba[4 * ((size_t) y * size + x)];
+      int edge = (((x + 2) / 16) + ((y + 2) / 16)) % 2;   // edges inside blocks
+      p[0] = 255 * x / (size - 1);
+      p[1] = 255 * y / (size - 1);
+      p[2] = (edge) ? 200 : 40;
+      p[3] = (has_alpha) ? 255 - 255 * (x + y) / (2 * (size - 1)) : 255;
+    }
+  }
+  return rgba;
+}
+
+static double get_psnr(const unsigned char *a, const unsigned char *b, size_t n_bytes, int *ret_max_err)
+{
+  double err = 0;
+  int max_err = 0;
+  for (size_t i = 0; i < n_bytes; i++) {
+    int d = abs(a[i] - b[i]);
+    if (d > max_err)
+      max_err = d;
+    err += (double) d * d;
+  }
+  *ret_max_err = max_err;
+  err /= n_bytes;
+  return (err > 0) ? 10.0 * log10(255.0 * 255.0 / err) : INFINITY;
+}
+
+/*
+ * Encode, read and decode every level, and compare level 0.  Returns
+ * 0 if the decoded image is within the format's tolerance.
+ */
+static int check_format(const struct CHECK_FORMAT *fmt, int size)
+{
+  int ret = 1;
+  unsigned char *rgba = make_check_image(size, fmt->has_alpha);
+  unsigned char *decoded = malloc(4 * (size_t) size * size);
+  unsigned char *btx = NULL;
+  if (! rgba || ! decoded) {
+    printf("** ERROR: out of memory for %dx%d image\n", size, size);
+    goto err;
+  }
+
+  size_t btx_size;
+  btx = encode_btx(rgba, size, size, fmt->format, &btx_size);
+  if (! btx) {
+    printf("** ERROR: can't encode %s\n", fmt->name);
+    goto err;
+  }
+
+  struct BTX_INFO info;
+  if (read_btx_info(&info, btx, btx_size) != 0 || info.format != fmt->format || info.width != size || info.height != size) {
+    printf("** ERROR: can't read %s chunk\n", fmt->name);
+    goto err;
+  }
+  for (int level = info.n_levels - 1; level >= 0; level--) {
+    if (decode_btx_level(&info, level, decoded) != 0) {
+      printf("** ERROR: can't decode %s level %d\n", fmt->name, level);
+      goto err;
+    }
+  }
+
+  int max_err;
+  double psnr = get_psnr(rgba, decoded, 4 * (size_t) size * size, &max_err);
+  int ok = (fmt->format == BTX_FORMAT_RGBA8) ? max_err == 0 : psnr >= fmt->min_psnr;
+  printf("%-8s %2d levels  psnr %6.2f dB (min %5.1f)  max error %3d  %s\n",
+         fmt->name, info.n_levels, psnr, fmt->min_psnr, max_err, (ok) ? "ok" : "FAILED");
+  if (ok)
+    ret = 0;
+
+ err:
+  free(btx);
+  free(decoded);
+  free(rgba);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  int size = (argc > 1) ? atoi(argv[1]) : 64;
+  if (size < 4 || size > BTX_MAX_SIZE) {
+    printf("** ERROR: invalid size: %d\n", size);
+    return 1;
+  }
+
+  printf("%dx%d image\n", size, size);
+  int n_failed = 0;
+  for (size_t i = 0; i < sizeof(check_formats) / sizeof(check_formats[0]); i++) {
+    if (check_format(&check_formats[i], size) != 0)
+      n_failed++;
+  }
+  if (n_failed > 0) {
+    printf("%d format(s) FAILED\n", n_failed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+/* chan_bench.c
+ *
+ * Compare throughput and latency of the mutex and lock-free channels
+ * with 1, 2 and N producers sending to a single consumer.
+ *
+ * Usage: chan_bench [messages_per_producer]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "thread.h"
+
+#define CHAN_CAPACITY   256
+#define MAX_PRODUCERS   64
+
+struct BENCH_MSG {
+  int producer;
+  unsigned int seq;
+  double send_time;
+};
+
+struct PRODUCER {
+  struct CHANNEL *chan;
+  int index;
+  unsigned int n_msgs;
+};
+
+struct BENCH_RESULT {
+  double elapsed;
+  double avg_latency;
+  double max_latency;
+  unsigned int n_errors;
+};
+
+static void producer_loop(void *data)
+{
+  struct PRODUCER *prod = data;
+  for (unsigned int seq = 0; seq < prod->n_msgs; seq++) {
+    struct BENCH_MSG msg;
+    msg.producer = prod->index;
+    msg.seq = seq;
+    msg.send_time = get_monotonic_time();
+    chan_send(prod->chan, &msg);
+  }
+}
+
+static int run_bench(struct BENCH_RESULT *result, unsigned int chan_flags, int n_producers, unsigned int n_msgs)
+{
+  struct CHANNEL *chan = new_chan(CHAN_CAPACITY, sizeof(struct BENCH_MSG), chan_flags);
+  if (! chan)
+    return 1;
+
+  struct PRODUCER producers[MAX_PRODUCERS];
+  struct THREAD *threads[MAX_PRODUCERS];
+  unsigned int next_seq[MAX_PRODUCERS];
+
+  double start_time = get_monotonic_time();
+  for (int i = 0; i < n_producers; i++) {
+    producers[i].chan = chan;
+    producers[i].index = i;
+    producers[i].n_msgs = n_msgs;
+    next_seq[i] = 0;
+    threads[i] = start_thread(producer_loop, &producers[i]);
+    if (! threads[i]) {
+      printf("** ERROR: can't start producer thread\n");
+      exit(1);
+    }
+  }
+
+  double total_latency = 0;
+  result->max_latency = 0;
+  result->n_errors = 0;
+  unsigned long total_msgs = (unsigned long) n_msgs * n_producers;
+  for (unsigned long i = 0; i < total_msgs; i++) {
+    struct BENCH_MSG msg;
+    chan_recv(chan, &msg, 1);
+    double latency = get_monotonic_time() - msg.send_time;
+    total_latency += latency;
+    if (result->max_latency < latency)
+      result->max_latency = latency;
+
+    // messages from the same producer must arrive in order
+    if (msg.producer < 0 || msg.producer >= n_producers || msg.seq != next_seq[msg.producer]++)
+      result->n_errors++;
+  }
+  result->elapsed = get_monotonic_time() - start_time;
+  result->avg_latency = total_latency / total_msgs;
+
+  for (int i = 0; i < n_producers; i++)
+    join_thread(threads[i]);
+  free_chan(chan);
+  return 0;
+}
+
+static void report(const char *name, int n_producers, unsigned int n_msgs, struct BENCH_RESULT *result)
+{
+  double total_msgs = (double) n_msgs * n_producers;
+  printf("%-10s %3d producers: %8.3f Mmsg/s   latency avg %9.2f us, max %10.2f us%s\n",
+         name, n_producers,
+         total_msgs / result->elapsed / 1000000.0,
+         result->avg_latency * 1000000.0,
+         result->max_latency * 1000000.0,
+         (result->n_errors == 0) ? "" : "   ** ORDER ERRORS **");
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned int n_msgs = (argc > 1) ? (unsigned int) atoi(argv[1]) : 1000000;
+
+  int n_procs = get_num_processors();
+  int producer_counts[3] = { 1, 2, (n_procs > 2) ? n_procs : 4 };
+  if (producer_counts[2] > MAX_PRODUCERS)
+    producer_counts[2] = MAX_PRODUCERS;
+
+  printf("%u messages per producer, channel capacity %d, %d processors\n\n", n_msgs, CHAN_CAPACITY, n_procs);
+
+  for (int i = 0; i < 3; i++) {
+    int n_producers = producer_counts[i];
+    struct BENCH_RESULT result;
+
+    if (run_bench(&result, 0, n_producers, n_msgs) != 0)
+      return 1;
+    report("mutex", n_producers, n_msgs, &result);
+
+    unsigned int flags = CHAN_FLAG_LOCK_FREE | CHAN_FLAG_SINGLE_CONSUMER;
+    if (n_producers == 1)
+      flags |= CHAN_FLAG_SINGLE_PRODUCER;
+    if (run_bench(&result, flags, n_producers, n_msgs) != 0)
+      return 1;
+    report((n_producers == 1) ? "ring spsc" : "ring mpmc", n_producers, n_msgs, &result);
+    printf("\n");
+    fflush(stdout);
+  }
+
+  return 0;
+}
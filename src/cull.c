@@ -0,0 +1,111 @@
+/* cull.c */
+
+#include <math.h>
+
+#include "cull.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define CULL_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+/*
+ * Extract the frustum planes from the (row major) view projection
+ * matrix: a point is inside when -w <= x,y,z <= w in clip space, so
+ * each plane is the last row plus or minus one of the others.
+ */
+void get_cull_frustum(struct CULL_FRUSTUM *frustum, const float *m)
+{
+  for (int i = 0; i < 3; i++) {
+    for (int k = 0; k < 4; k++) {
+      frustum->planes[2*i+0][k] = m[12+k] + m[4*i+k];
+      frustum->planes[2*i+1][k] = m[12+k] - m[4*i+k];
+    }
+  }
+
+  for (int i = 0; i < 6; i++) {
+    float *p = frustum->planes[i];
+    float len = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+    if (len > 0) {
+      for (int k = 0; k < 4; k++)
+        p[k] /= len;
+    }
+  }
+}
+
+/*
+ * Set a sphere from its model space center and radius.  The radius is
+ * scaled by the largest scale of the model matrix, so the sphere stays
+ * conservative under non-uniform scaling.  Spheres are set by index so
+ * different threads can fill different ranges.
+ */
+void set_cull_sphere(struct CULL_SPHERES *spheres, int i, const float *m, const float *sphere)
+{
+  float scale2 = 0;
+  for (int k = 0; k < 3; k++) {
+    float col2 = m[k]*m[k] + m[4+k]*m[4+k] + m[8+k]*m[8+k];
+    if (col2 > scale2)
+      scale2 = col2;
+  }
+
+  spheres->x[i] = m[ 0]*sphere[0] + m[ 1]*sphere[1] + m[ 2]*sphere[2] + m[ 3];
+  spheres->y[i] = m[ 4]*sphere[0] + m[ 5]*sphere[1] + m[ 6]*sphere[2] + m[ 7];
+  spheres->z[i] = m[ 8]*sphere[0] + m[ 9]*sphere[1] + m[10]*sphere[2] + m[11];
+  spheres->r[i] = sphere[3] * sqrtf(scale2);
+}
+
+static int is_sphere_visible(const struct CULL_FRUSTUM *frustum, float x, float y, float z, float r)
+{
+  for (int i = 0; i < 6; i++) {
+    const float *p = frustum->planes[i];
+    if ((p[0]*x + p[1]*y) + (p[2]*z + p[3]) < -r)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Test the spheres in [start, end) against the frustum, setting
+ * visible[i] to 1 for spheres that are at least partially inside and 0
+ * for the rest.  Returns the number of visible spheres.  With SSE, 4
+ * spheres are tested against each plane at once.
+ */
+int cull_spheres(const struct CULL_FRUSTUM *frustum, const struct CULL_SPHERES *spheres, int start, int end, uint8_t *visible)
+{
+  int n_visible = 0;
+  int i = start;
+
+#ifdef CULL_USE_SSE
+  __m128 plane[6][4];
+  for (int p = 0; p < 6; p++) {
+    for (int k = 0; k < 4; k++)
+      plane[p][k] = _mm_set1_ps(frustum->planes[p][k]);
+  }
+
+  for (; i + 4 <= end; i += 4) {
+    __m128 x = _mm_loadu_ps(&spheres->x[i]);
+    __m128 y = _mm_loadu_ps(&spheres->y[i]);
+    __m128 z = _mm_loadu_ps(&spheres->z[i]);
+    __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres->r[i]));
+
+    __m128 outside = _mm_setzero_ps();
+    for (int p = 0; p < 6; p++) {
+      __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[p][0], x), _mm_mul_ps(plane[p][1], y)),
+                               _mm_add_ps(_mm_mul_ps(plane[p][2], z), plane[p][3]));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, neg_r));
+    }
+
+    int mask = _mm_movemask_ps(outside);
+    for (int k = 0; k < 4; k++) {
+      visible[i+k] = ((mask >> k) & 1) ? 0 : 1;
+      n_visible += visible[i+k];
+    }
+  }
+#endif
+
+  for (; i < end; i++) {
+    visible[i] = is_sphere_visible(frustum, spheres->x[i], spheres->y[i], spheres->z[i], spheres->r[i]);
+    n_visible += visible[i];
+  }
+  return n_visible;
+}
@@ -0,0 +1,35 @@
+/* cull.h */
+
+#ifndef CULL_H_FILE
+#define CULL_H_FILE
+
+#include <stdint.h>
+#include "render_queue.h"
+
+#define CULL_MAX_SPHERES RENDER_QUEUE_MAX_ITEMS   // at most one per draw
+
+/*
+ * Frustum planes (a, b, c, d), normalized and facing in: a point p is
+ * inside a plane when a*p.x + b*p.y + c*p.z + d >= 0.
+ */
+struct CULL_FRUSTUM {
+  float planes[6][4];
+};
+
+/*
+ * Bounding spheres in world space, stored as separate arrays so they
+ * can be tested several at a time.
+ */
+struct CULL_SPHERES {
+  int n;
+  float x[CULL_MAX_SPHERES];
+  float y[CULL_MAX_SPHERES];
+  float z[CULL_MAX_SPHERES];
+  float r[CULL_MAX_SPHERES];
+};
+
+void get_cull_frustum(struct CULL_FRUSTUM *frustum, const float *mat_view_projection);
+void set_cull_sphere(struct CULL_SPHERES *spheres, int index, const float *mat_model, const float *sphere);
+int cull_spheres(const struct CULL_FRUSTUM *frustum, const struct CULL_SPHERES *spheres, int start, int end, uint8_t *visible);
+
+#endif /* CULL_H_FILE */
@@ -1,4 +1,46 @@
-/* file.c */
+/* file.c
+ *
+ * Memory mapped files are shared: opening a file that's already
+ * mapped (even through a different path) returns a new reader for
+ * the same mapping.  Each reader and each reference taken with
+ * file_ref_mapping() keeps the mapping alive, and the file is
+ * unmapped when the last of them is released.
+ *
+ * While a pack is open, file_open() looks up paths in the pack's
+ * table of contents first: files found there are readers for a slice
+ * of the pack's mapping.  Pack layout (little endian):
+ *
+ *   char magic[4]            "BPF1"
+ *   u32  n_slots             power of 2
+ *   u32  n_files
+ *   u32  reserved            0
+ *   slot[n_slots]:           open addressing hash table, linear probing
+ *     u64  name_hash         FNV-1a of the path
+ *     u64  offset            of the file data, page aligned
+ *     u64  size
+ *     u32  name_offset       of the path in the pack
+ *     u32  name_len          0 for an empty slot
+ *   path names
+ *   file data
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "file.h"
+#include "thread.h"
+#include "debug.h"
+
+#define MAX_OPEN_FILES  32
+
+#define PACK_HEADER_SIZE  16
+#define PACK_SLOT_SIZE    32
+
+struct FILE_ID {
+  uint64_t dev;
+  uint64_t ino;
+};
 
 #if defined(_WIN32)
 
@@ -13,3 +55,269 @@
 #error "Unknown system, can't use memory mapped file"
 
 #endif
+
+struct FILE_MAPPING {
+  struct FILE_MAPPING *next;
+  int ref_count;
+  uint64_t serial;        // never reused, unlike the mapped address or the file id
+  struct FILE_ID id;
+  char filename[256];
+  unsigned char *start;
+  size_t size;
+  struct FILE_PLATFORM_DATA platform;
+};
+
+static int initialized;
+static struct MUTEX *registry_mutex;
+static struct FILE_MAPPING *free_list;
+static struct FILE_MAPPING *used_list;
+static struct FILE_MAPPING mapping_table[MAX_OPEN_FILES];
+static uint64_t next_mapping_serial = 1;
+
+static struct FILE_READER pack;
+static uint32_t pack_n_slots;
+
+/*
+ * The first file_open() must happen before other threads use files.
+ */
+static int init_registry(void)
+{
+  registry_mutex = new_mutex();
+  if (! registry_mutex)
+    return 1;
+  for (int i = 0; i < MAX_OPEN_FILES-1; i++)
+    mapping_table[i].next = &mapping_table[i+1];
+  mapping_table[MAX_OPEN_FILES-1].next = NULL;
+  free_list = &mapping_table[0];
+  used_list = NULL;
+
+  initialized = 1;
+  return 0;
+}
+
+static struct FILE_MAPPING *find_mapping(struct FILE_ID *id)
+{
+  for (struct FILE_MAPPING *map = used_list; map != NULL; map = map->next) {
+    if (map->id.dev == id->dev && map->id.ino == id->ino)
+      return map;
+  }
+  return NULL;
+}
+
+static struct FILE_MAPPING *new_mapping(const char *filename, struct FILE_ID *id)
+{
+  struct FILE_MAPPING *map = free_list;
+  if (! map) {
+    debug("** ERROR: too many open files\n");
+    return NULL;
+  }
+  if (map_file(filename, &map->platform, &map->start, &map->size) != 0)
+    return NULL;
+  free_list = map->next;
+  map->next = used_list;
+  used_list = map;
+
+  map->ref_count = 0;
+  map->serial = next_mapping_serial++;
+  map->id = *id;
+  strncpy(map->filename, filename, sizeof(map->filename) - 1);
+  map->filename[sizeof(map->filename) - 1] = '\0';
+  return map;
+}
+
+static void free_mapping(struct FILE_MAPPING *map)
+{
+  struct FILE_MAPPING **p = &used_list;
+  while (*p && *p != map)
+    p = &(*p)->next;
+  if (*p)
+    *p = map->next;
+
+  unmap_file(&map->platform, map->start, map->size);
+  map->next = free_list;
+  free_list = map;
+}
+
+static uint64_t hash_file_name(const char *name, size_t len)
+{
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
+
+/*
+ * Open a pack to use in file_open().  This must be done before other
+ * threads use files, and the pack can't be changed while they do.
+ * Returns 1 without complaining if the pack doesn't exist.
+ */
+int file_open_pack(const char *filename)
+{
+  file_close_pack();
+  if (file_open(&pack, filename) != 0)
+    return 1;
+
+  char magic[4];
+  file_read_data(&pack, magic, 4);
+  pack_n_slots = file_read_u32(&pack);
+  file_read_u32(&pack);  // n_files
+  if (file_has_error(&pack) || memcmp(magic, "BPF1", 4) != 0 ||
+      pack_n_slots == 0 || (pack_n_slots & (pack_n_slots - 1)) != 0 ||
+      pack_n_slots > (pack.size - PACK_HEADER_SIZE) / PACK_SLOT_SIZE) {
+    debug("** ERROR: invalid pack file '%s'\n", filename);
+    file_close_pack();
+    return 1;
+  }
+  return 0;
+}
+
+void file_close_pack(void)
+{
+  file_close(&pack);
+  pack_n_slots = 0;
+}
+
+/*
+ * Find a file in the pack, returning 1 if it's not there.
+ */
+static int find_pack_file(const char *filename, size_t *ret_offset, size_t *ret_size)
+{
+  if (! pack.start)
+    return 1;
+
+  size_t name_len = strlen(filename);
+  uint64_t hash = hash_file_name(filename, name_len);
+  struct FILE_READER toc = pack;
+  for (uint32_t i = 0; i < pack_n_slots; i++) {
+    uint32_t slot = (uint32_t) (hash + i) & (pack_n_slots - 1);
+    file_set_pos(&toc, PACK_HEADER_SIZE + slot * PACK_SLOT_SIZE);
+    uint64_t slot_hash = file_read_u64(&toc);
+    uint64_t offset = file_read_u64(&toc);
+    uint64_t size = file_read_u64(&toc);
+    uint32_t slot_name_offset = file_read_u32(&toc);
+    uint32_t slot_name_len = file_read_u32(&toc);
+    if (slot_name_len == 0)
+      return 1;
+    if (slot_hash != hash || slot_name_len != name_len)
+      continue;
+    if (file_set_pos(&toc, slot_name_offset) != 0 || file_get_remaining(&toc) < name_len ||
+        memcmp(toc.pos, filename, name_len) != 0) {
+      file_clear_error(&toc);
+      continue;
+    }
+    if (offset > pack.size || size > pack.size - offset)
+      return 1;
+    *ret_offset = offset;
+    *ret_size = size;
+    return 0;
+  }
+  return 1;
+}
+
+int file_open(struct FILE_READER *file, const char *filename)
+{
+  file->start = file->pos = NULL;
+  file->size = 0;
+  file->error = 0;
+  file->mapping = NULL;
+
+  if (! initialized && init_registry() != 0)
+    return 1;
+
+  size_t pack_offset, pack_size;
+  if (find_pack_file(filename, &pack_offset, &pack_size) == 0) {
+    file->mapping = file_ref_mapping(&pack);
+    file->start = file->pos = pack.start + pack_offset;
+    file->size = pack_size;
+    return 0;
+  }
+
+  struct FILE_ID id;
+  if (get_file_id(filename, &id) != 0)
+    return 1;
+
+  mutex_lock(registry_mutex);
+  struct FILE_MAPPING *map = find_mapping(&id);
+  if (! map)
+    map = new_mapping(filename, &id);
+  if (map)
+    map->ref_count++;
+  mutex_unlock(registry_mutex);
+  if (! map)
+    return 1;
+
+  file->mapping = map;
+  file->start = file->pos = map->start;
+  file->size = map->size;
+  return 0;
+}
+
+void file_close(struct FILE_READER *file)
+{
+  if (file->mapping)
+    file_unref_mapping(file->mapping);
+  file->mapping = NULL;
+  file->start = file->pos = NULL;
+  file->size = 0;
+}
+
+/*
+ * Take a new reference to the file's mapping, to be released with
+ * file_unref_mapping().  The file can be closed while the mapping is
+ * still referenced.
+ */
+struct FILE_MAPPING *file_ref_mapping(struct FILE_READER *file)
+{
+  struct FILE_MAPPING *map = file->mapping;
+  if (map) {
+    mutex_lock(registry_mutex);
+    map->ref_count++;
+    mutex_unlock(registry_mutex);
+  }
+  return map;
+}
+
+void file_unref_mapping(struct FILE_MAPPING *map)
+{
+  mutex_lock(registry_mutex);
+  if (--map->ref_count == 0)
+    free_mapping(map);
+  mutex_unlock(registry_mutex);
+}
+
+/*
+ * Return the file descriptor of the file, or -1 if the platform
+ * doesn't have one.  It stays valid while the file is open.
+ */
+int file_get_fd(struct FILE_READER *file)
+{
+  if (! file->mapping)
+    return -1;
+  return get_platform_fd(&file->mapping->platform);
+}
+
+/*
+ * Return a number that identifies the file's mapping while it exists
+ * and is never used for another mapping, or 0 if the file has no
+ * mapping.  Files in the same pack have the same mapping: they're told
+ * apart by file_get_fd_offset().
+ */
+uint64_t file_get_mapping_serial(struct FILE_READER *file)
+{
+  if (! file->mapping)
+    return 0;
+  return file->mapping->serial;
+}
+
+/*
+ * Return the offset of the start of the file in the file descriptor
+ * returned by file_get_fd(): it's not 0 for files inside a pack.
+ */
+uint64_t file_get_fd_offset(struct FILE_READER *file)
+{
+  if (! file->mapping)
+    return 0;
+  return (uint64_t) (file->start - file->mapping->start);
+}
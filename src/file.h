@@ -7,63 +7,169 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define FILE_HOST_LITTLE_ENDIAN 1
+#else
+#define FILE_HOST_LITTLE_ENDIAN 0
+#endif
+
+enum FILE_ADVICE {
+  FILE_ADVICE_WILLNEED,     // will be read soon, start reading it in
+  FILE_ADVICE_SEQUENTIAL,   // will be read in order
+  FILE_ADVICE_DONTNEED,     // won't be read again soon, pages can be dropped
+};
+
+struct FILE_MAPPING;
+
+/*
+ * Memory mapped file reader.  Reading past the end of the file
+ * doesn't touch the mapping: it sets the error flag and returns zero
+ * (or NULL for file_skip_data()).  The flag stays set until
+ * file_clear_error(), so a parser can read a whole structure and
+ * check for errors once at the end.
+ */
 struct FILE_READER {
   unsigned char *start;
   unsigned char *pos;
   size_t size;
-  void *platform_data;
+  int error;
+  struct FILE_MAPPING *mapping;
 };
 
+int file_open_pack(const char *filename);
+void file_close_pack(void);
 int file_open(struct FILE_READER *file, const char *filename);
 void file_close(struct FILE_READER *file);
+struct FILE_MAPPING *file_ref_mapping(struct FILE_READER *file);
+void file_unref_mapping(struct FILE_MAPPING *map);
+int file_get_fd(struct FILE_READER *file);
+uint64_t file_get_fd_offset(struct FILE_READER *file);
+uint64_t file_get_mapping_serial(struct FILE_READER *file);
+int file_advise(struct FILE_READER *file, size_t offset, size_t size, enum FILE_ADVICE advice);
+
+static inline int file_has_error(struct FILE_READER *file)
+{
+  return file->error;
+}
 
-static inline int file_set_pos(struct FILE_READER *file, uint32_t pos)
+static inline void file_clear_error(struct FILE_READER *file)
 {
-  if (pos > file->size)
+  file->error = 0;
+}
+
+static inline size_t file_get_remaining(struct FILE_READER *file)
+{
+  return file->size - (size_t) (file->pos - file->start);
+}
+
+/*
+ * Return a pointer to the next 'size' bytes and advance past them, or
+ * NULL (and set the error flag) if there aren't enough bytes left.
+ */
+static inline unsigned char *file_consume(struct FILE_READER *file, size_t size)
+{
+  if (file->error || size > file_get_remaining(file)) {
+    file->error = 1;
+    return NULL;
+  }
+  unsigned char *ret = file->pos;
+  file->pos += size;
+  return ret;
+}
+
+static inline int file_set_pos(struct FILE_READER *file, size_t pos)
+{
+  if (pos > file->size) {
+    file->error = 1;
     return 1;
+  }
   file->pos = file->start + pos;
   return 0;
 }
 
-static inline uint32_t file_get_pos(struct FILE_READER *file)
+static inline size_t file_get_pos(struct FILE_READER *file)
 {
   return file->pos - file->start;
 }
 
 static inline void *file_skip_data(struct FILE_READER *file, size_t size)
 {
-  void *ret = file->pos;
-  file->pos += size;
-  return ret;
+  return file_consume(file, size);
 }
 
 static inline void file_read_data(struct FILE_READER *file, void *data, size_t size)
 {
-  memcpy(data, file->pos, size);
-  file->pos += size;
+  unsigned char *p = file_consume(file, size);
+  if (p)
+    memcpy(data, p, size);
+  else
+    memset(data, 0, size);
 }
 
 static inline uint8_t file_read_u8(struct FILE_READER *file)
 {
-  return *file->pos++;
+  unsigned char *p = file_consume(file, 1);
+  return (p) ? p[0] : 0;
 }
 
 static inline uint16_t file_read_u16(struct FILE_READER *file)
 {
-  uint16_t b0 = *file->pos++;
-  uint16_t b1 = *file->pos++;
-  
-  return (b1 << 8) | b0;
+  unsigned char *p = file_consume(file, 2);
+  if (! p)
+    return 0;
+#if FILE_HOST_LITTLE_ENDIAN
+  uint16_t val;
+  memcpy(&val, p, 2);
+  return val;
+#else
+  return ((uint16_t) p[1] << 8) | p[0];
+#endif
 }
 
 static inline uint32_t file_read_u32(struct FILE_READER *file)
 {
-  uint32_t b0 = *file->pos++;
-  uint32_t b1 = *file->pos++;
-  uint32_t b2 = *file->pos++;
-  uint32_t b3 = *file->pos++;
-  
-  return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+  unsigned char *p = file_consume(file, 4);
+  if (! p)
+    return 0;
+#if FILE_HOST_LITTLE_ENDIAN
+  uint32_t val;
+  memcpy(&val, p, 4);
+  return val;
+#else
+  return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+#endif
+}
+
+static inline uint64_t file_read_u64(struct FILE_READER *file)
+{
+  unsigned char *p = file_consume(file, 8);
+  if (! p)
+    return 0;
+#if FILE_HOST_LITTLE_ENDIAN
+  uint64_t val;
+  memcpy(&val, p, 8);
+  return val;
+#else
+  uint64_t val = 0;
+  for (int i = 7; i >= 0; i--)
+    val = (val << 8) | p[i];
+  return val;
+#endif
+}
+
+static inline void file_read_u16_vec(struct FILE_READER *file, uint16_t *vec, size_t n)
+{
+  unsigned char *p = file_consume(file, 2*n);
+  if (! p) {
+    memset(vec, 0, sizeof(uint16_t) * n);
+    return;
+  }
+#if FILE_HOST_LITTLE_ENDIAN
+  memcpy(vec, p, 2*n);
+#else
+  for (size_t i = 0; i < n; i++, p += 2)
+    vec[i] = ((uint16_t) p[1] << 8) | p[0];
+#endif
 }
 
 static inline float file_read_f32(struct FILE_READER *file)
@@ -79,8 +185,23 @@ static inline float file_read_f32(struct FILE_READER *file)
 
 static inline void file_read_f32_vec(struct FILE_READER *file, float *vec, size_t n)
 {
-  for (size_t i = 0; i < n; i++)
-    vec[i] = file_read_f32(file);
+  unsigned char *p = file_consume(file, 4*n);
+  if (! p) {
+    memset(vec, 0, sizeof(float) * n);
+    return;
+  }
+#if FILE_HOST_LITTLE_ENDIAN
+  memcpy(vec, p, 4*n);
+#else
+  for (size_t i = 0; i < n; i++, p += 4) {
+    union {
+      float f;
+      uint32_t u;
+    } pun;
+    pun.u = ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+    vec[i] = pun.f;
+  }
+#endif
 }
 
 #endif /* FILE_H_FILE */
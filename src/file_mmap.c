@@ -5,46 +5,77 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-#include "file.h"
+struct FILE_PLATFORM_DATA {
+  int fd;           // kept open for reads that don't go through the mapping
+};
 
-#define MAX_OPEN_FILES  32
-
-void file_close(struct FILE_READER *file)
+static int get_file_id(const char *filename, struct FILE_ID *id)
 {
-  if (file->start)
-    munmap(file->start, file->size);
+  struct stat st;
+  if (stat(filename, &st) != 0)
+    return 1;
+  id->dev = (uint64_t) st.st_dev;
+  id->ino = (uint64_t) st.st_ino;
+  return 0;
 }
 
-static void file_init(struct FILE_READER *file)
+static int map_file(const char *filename, struct FILE_PLATFORM_DATA *data, unsigned char **ret_start, size_t *ret_size)
 {
-  file->start = NULL;
-  file->platform_data = NULL;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return 1;
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size <= 0) {
+    close(fd);
+    return 1;
+  }
+
+  void *start = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+  if (start == MAP_FAILED) {
+    close(fd);
+    return 1;
+  }
+
+  data->fd = fd;
+  *ret_start = start;
+  *ret_size = (size_t) size;
+  return 0;
 }
 
-int file_open(struct FILE_READER *file, const char *filename)
+static void unmap_file(struct FILE_PLATFORM_DATA *data, unsigned char *start, size_t size)
 {
-  file_init(file);
+  munmap(start, size);
+  close(data->fd);
+}
 
-  int fd = open(filename, O_RDONLY);
-  if (fd < 0)
-    goto err;
+static int get_platform_fd(struct FILE_PLATFORM_DATA *data)
+{
+  return data->fd;
+}
 
-  off_t size = lseek(fd, 0, SEEK_END);
-  if (size < 0)
-    goto err;
-  file->size = (size_t) size;
+int file_advise(struct FILE_READER *file, size_t offset, size_t size, enum FILE_ADVICE advice)
+{
+  if (! file->start || offset >= file->size)
+    return 1;
+  if (size > file->size - offset)
+    size = file->size - offset;
 
-  file->start = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
-  if (! file->start)
-    goto err;
+  // madvise() wants a page-aligned address; the mapping is aligned,
+  // but the file start isn't if it's inside a pack
+  uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+  uintptr_t addr = (uintptr_t) (file->start + offset);
+  uintptr_t page_addr = addr & ~(page_size - 1);
+  size += addr - page_addr;
 
-  close(fd);
-  file->pos = file->start;
+  int mode;
+  switch (advice) {
+  case FILE_ADVICE_WILLNEED:   mode = MADV_WILLNEED; break;
+  case FILE_ADVICE_SEQUENTIAL: mode = MADV_SEQUENTIAL; break;
+  case FILE_ADVICE_DONTNEED:   mode = MADV_DONTNEED; break;
+  default: return 1;
+  }
+  if (madvise((void *) page_addr, size, mode) != 0)
+    return 1;
   return 0;
-   
- err:
-  if (fd >= 0)
-    close(fd);
-  file_close(file);
-  return 1;
 }
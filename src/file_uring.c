@@ -0,0 +1,402 @@
+/* file_uring.c */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_uring.h"
+#include "atomic.h"
+
+/* ========================================================================================
+ * I/O buffer pool
+ */
+
+#define IO_BUFFER_MIN_SHIFT   16    // 64KB
+#define IO_BUFFER_NUM_CLASSES 9     // up to 16MB
+#define IO_BUFFER_MAX_FREE    8     // free buffers kept per size class
+
+/*
+ * The header is 16 bytes so the data stays aligned for any type.
+ */
+union IO_BUFFER_HEADER {
+  union IO_BUFFER_HEADER *next;
+  int size_class;                   // -1 if not pooled
+  unsigned char align[16];
+};
+
+static volatile size_t io_pool_lock;
+static union IO_BUFFER_HEADER *io_pool_free[IO_BUFFER_NUM_CLASSES];
+static int io_pool_num_free[IO_BUFFER_NUM_CLASSES];
+
+static void lock_io_pool(void)
+{
+  while (! atomic_cas(&io_pool_lock, 0, 1))
+    cpu_relax();
+}
+
+static void unlock_io_pool(void)
+{
+  atomic_store_release(&io_pool_lock, 0);
+}
+
+static int get_size_class(size_t size)
+{
+  for (int i = 0; i < IO_BUFFER_NUM_CLASSES; i++) {
+    if (size <= ((size_t)1 << (IO_BUFFER_MIN_SHIFT + i)))
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Allocate a buffer for reading file data.  Buffers are recycled by
+ * size class, so streaming rooms and textures doesn't keep hitting
+ * malloc() with large sizes.
+ */
+void *alloc_io_buffer(size_t size)
+{
+  int size_class = get_size_class(size);
+  union IO_BUFFER_HEADER *header = NULL;
+
+  if (size_class >= 0) {
+    lock_io_pool();
+    header = io_pool_free[size_class];
+    if (header) {
+      io_pool_free[size_class] = header->next;
+      io_pool_num_free[size_class]--;
+    }
+    unlock_io_pool();
+    if (! header)
+      header = malloc(sizeof *header + ((size_t)1 << (IO_BUFFER_MIN_SHIFT + size_class)));
+  } else {
+    header = malloc(sizeof *header + size);
+  }
+  if (! header)
+    return NULL;
+  header->size_class = size_class;
+  return header + 1;
+}
+
+void free_io_buffer(void *buf)
+{
+  if (! buf)
+    return;
+  union IO_BUFFER_HEADER *header = (union IO_BUFFER_HEADER *) buf - 1;
+  int size_class = header->size_class;
+  if (size_class >= 0) {
+    lock_io_pool();
+    if (io_pool_num_free[size_class] < IO_BUFFER_MAX_FREE) {
+      header->next = io_pool_free[size_class];
+      io_pool_free[size_class] = header;
+      io_pool_num_free[size_class]++;
+      header = NULL;
+    }
+    unlock_io_pool();
+  }
+  free(header);
+}
+
+#if defined(__linux__)
+
+/* ========================================================================================
+ * io_uring
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "thread.h"
+#include "debug.h"
+
+struct FILE_URING_READ {
+  struct FILE_URING_READ *next;
+  int fd;
+  uint64_t offset;
+  unsigned char *buf;
+  size_t size;
+  void *user_data;
+};
+
+struct FILE_URING {
+  int fd;
+
+  // submission queue, protected by the mutex
+  struct MUTEX *mutex;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  // completion queue, only used by the thread calling file_uring_wait()
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring_ptr;
+  size_t sq_ring_size;
+  void *cq_ring_ptr;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  int dead;                             // set if a read may be in the kernel after a failed submit
+  struct FILE_URING_READ *free_reads;   // protected by the mutex
+  struct FILE_URING_READ reads[FILE_URING_MAX_READS];
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+void free_file_uring(struct FILE_URING *ring)
+{
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring_ptr && ring->cq_ring_ptr != MAP_FAILED && ring->cq_ring_ptr != ring->sq_ring_ptr)
+    munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+  if (ring->sq_ring_ptr && ring->sq_ring_ptr != MAP_FAILED)
+    munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  if (ring->mutex)
+    free_mutex(ring->mutex);
+  free(ring);
+}
+
+struct FILE_URING *new_file_uring(void)
+{
+  struct FILE_URING *ring = malloc(sizeof *ring);
+  if (! ring)
+    return NULL;
+  memset(ring, 0, sizeof *ring);
+  ring->fd = -1;
+
+  ring->mutex = new_mutex();
+  if (! ring->mutex)
+    goto err;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = sys_io_uring_setup(FILE_URING_MAX_READS, &params);
+  if (ring->fd < 0)
+    goto err;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                           ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring_ptr == MAP_FAILED)
+    goto err;
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring_ptr = ring->sq_ring_ptr;
+  } else {
+    ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring_ptr == MAP_FAILED)
+      goto err;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto err;
+
+  unsigned char *sq = ring->sq_ring_ptr;
+  ring->sq_head  = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask  = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+  unsigned char *cq = ring->cq_ring_ptr;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes    = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  for (int i = 0; i < FILE_URING_MAX_READS-1; i++)
+    ring->reads[i].next = &ring->reads[i+1];
+  ring->reads[FILE_URING_MAX_READS-1].next = NULL;
+  ring->free_reads = &ring->reads[0];
+  return ring;
+
+ err:
+  free_file_uring(ring);
+  return NULL;
+}
+
+/*
+ * Must be called with the mutex held.  The kernel consumes the entry
+ * in io_uring_enter(), so the submission queue never fills up.
+ *
+ * If io_uring_enter() fails without consuming the entry, the entry is
+ * taken back so it's not sent with the next submission, and 1 is
+ * returned so the caller can read the data some other way.  This
+ * includes EAGAIN and EBUSY: retrying them here would hold the mutex
+ * that the thread reaping completions needs.  If the entry was
+ * consumed anyway, its completion will still come, so the caller must
+ * not reuse the buffer: 0 is returned, and the ring is marked dead so
+ * no new reads are started.
+ */
+static int submit_sqe(struct FILE_URING *ring, int opcode, struct FILE_URING_READ *read)
+{
+  if (ring->dead && read)
+    return 1;
+
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = opcode;
+  if (read) {
+    sqe->fd = read->fd;
+    sqe->off = read->offset;
+    sqe->addr = (uint64_t) (uintptr_t) read->buf;
+    sqe->len = (read->size > 0x7ffff000) ? 0x7ffff000 : (unsigned) read->size;
+  }
+  sqe->user_data = (uint64_t) (uintptr_t) read;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (sys_io_uring_enter(ring->fd, 1, 0, 0) < 0) {
+    if (errno == EINTR)
+      continue;
+    if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+      __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+      return 1;
+    }
+    debug("** ERROR: io_uring submission failed after consuming the entry, not using it for new reads\n");
+    ring->dead = 1;
+    return 0;
+  }
+  return 0;
+}
+
+/*
+ * Start reading 'size' bytes at 'offset' into 'buf'.  Returns nonzero
+ * if the read can't be started (too many reads in flight); the caller
+ * should then read the data some other way.
+ */
+int file_uring_read(struct FILE_URING *ring, int fd, uint64_t offset, void *buf, size_t size, void *user_data)
+{
+  mutex_lock(ring->mutex);
+  struct FILE_URING_READ *read = ring->free_reads;
+  if (! read) {
+    mutex_unlock(ring->mutex);
+    return 1;
+  }
+  ring->free_reads = read->next;
+  read->fd = fd;
+  read->offset = offset;
+  read->buf = buf;
+  read->size = size;
+  read->user_data = user_data;
+  int ret = submit_sqe(ring, IORING_OP_READ, read);
+  if (ret != 0) {
+    read->next = ring->free_reads;
+    ring->free_reads = read;
+  }
+  mutex_unlock(ring->mutex);
+  return ret;
+}
+
+/*
+ * Make the thread waiting in file_uring_wait() return a completion
+ * with NULL user_data.
+ */
+int file_uring_wake(struct FILE_URING *ring)
+{
+  mutex_lock(ring->mutex);
+  int ret = submit_sqe(ring, IORING_OP_NOP, NULL);
+  mutex_unlock(ring->mutex);
+  return ret;
+}
+
+/*
+ * Wait for the next read to complete.  Short reads are continued
+ * here, so a completion is only returned when the whole range was
+ * read or an error happened.
+ */
+int file_uring_wait(struct FILE_URING *ring, struct FILE_URING_COMPLETION *completion)
+{
+  while (1) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      if (sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        return 1;
+      continue;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    struct FILE_URING_READ *read = (struct FILE_URING_READ *) (uintptr_t) cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (! read) {
+      completion->user_data = NULL;
+      completion->error = 0;
+      return 0;
+    }
+
+    // the kernel orders the read's fields for us, but the lock makes that visible to tools
+    mutex_lock(ring->mutex);
+    int error = (res <= 0);
+    if (! error && (size_t) res < read->size) {
+      read->offset += res;
+      read->buf += res;
+      read->size -= res;
+      error = submit_sqe(ring, IORING_OP_READ, read);
+      if (! error) {
+        mutex_unlock(ring->mutex);
+        continue;
+      }
+    }
+
+    completion->user_data = read->user_data;
+    completion->error = error;
+    read->next = ring->free_reads;
+    ring->free_reads = read;
+    mutex_unlock(ring->mutex);
+    return 0;
+  }
+}
+
+#else /* no io_uring */
+
+struct FILE_URING *new_file_uring(void)
+{
+  return NULL;
+}
+
+void free_file_uring(struct FILE_URING *ring)
+{
+}
+
+int file_uring_read(struct FILE_URING *ring, int fd, uint64_t offset, void *buf, size_t size, void *user_data)
+{
+  return 1;
+}
+
+int file_uring_wake(struct FILE_URING *ring)
+{
+  return 1;
+}
+
+int file_uring_wait(struct FILE_URING *ring, struct FILE_URING_COMPLETION *completion)
+{
+  return 1;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* file_uring.h */
+
+#ifndef FILE_URING_H_FILE
+#define FILE_URING_H_FILE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILE_URING_MAX_READS  128   // reads in flight
+
+/*
+ * Asynchronous reads of file ranges with Linux io_uring.  Reads are
+ * submitted from any thread; completions must be collected by a
+ * single thread with file_uring_wait().  On other systems (or if the
+ * kernel doesn't support io_uring) new_file_uring() returns NULL.
+ */
+
+struct FILE_URING;
+
+struct FILE_URING_COMPLETION {
+  void *user_data;      // NULL for a wakeup sent by file_uring_wake()
+  int error;
+};
+
+struct FILE_URING *new_file_uring(void);
+void free_file_uring(struct FILE_URING *ring);
+int file_uring_read(struct FILE_URING *ring, int fd, uint64_t offset, void *buf, size_t size, void *user_data);
+int file_uring_wake(struct FILE_URING *ring);
+int file_uring_wait(struct FILE_URING *ring, struct FILE_URING_COMPLETION *completion);
+
+void *alloc_io_buffer(size_t size);
+void free_io_buffer(void *buf);
+
+#endif /* FILE_URING_H_FILE */
@@ -4,93 +4,75 @@
 
 #include <windows.h>
 
-#include "file.h"
-
-#define MAX_OPEN_FILES  32
-
-struct FILE_INFO {
-  struct FILE_INFO *next;
+struct FILE_PLATFORM_DATA {
   HANDLE file;
   HANDLE mapping;
 };
 
-static int initialized;
-static struct FILE_INFO *free_list;
-static struct FILE_INFO info_table[MAX_OPEN_FILES];
-
-static void init_file_table(void)
-{
-  for (int i = 0; i < MAX_OPEN_FILES-1; i++)
-    info_table[i].next = &info_table[i+1];
-  info_table[MAX_OPEN_FILES-1].next = NULL;
-  free_list = &info_table[0];
-  
-  initialized = 1;
-}
-
-static struct FILE_INFO *alloc_file_info(void)
+static int get_file_id(const char *filename, struct FILE_ID *id)
 {
-  struct FILE_INFO *info = free_list;
-  if (! info)
-    return NULL;
-  free_list = info->next;
-  return info;
-}
-
-static void free_file_info(struct FILE_INFO *info)
-{
-  info->next = free_list;
-  free_list = info;
-}
+  HANDLE file = CreateFileA(filename, 0, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return 1;
 
-void file_close(struct FILE_READER *file)
-{
-  struct FILE_INFO *info = file->platform_data;
-  if (file->start)
-    UnmapViewOfFile(file->start);
-  if (info->mapping != INVALID_HANDLE_VALUE)
-    CloseHandle(info->mapping);
-  if (info->file != INVALID_HANDLE_VALUE)
-    CloseHandle(info->file);
-  free_file_info(info);
+  BY_HANDLE_FILE_INFORMATION info;
+  BOOL ok = GetFileInformationByHandle(file, &info);
+  CloseHandle(file);
+  if (! ok)
+    return 1;
+  id->dev = info.dwVolumeSerialNumber;
+  id->ino = ((uint64_t) info.nFileIndexHigh << 32) | info.nFileIndexLow;
+  return 0;
 }
 
-static void file_init(struct FILE_READER *file, struct FILE_INFO *info)
+static void unmap_file(struct FILE_PLATFORM_DATA *data, unsigned char *start, size_t size)
 {
-  file->start = NULL;
-  file->platform_data = info;
-  info->file = INVALID_HANDLE_VALUE;
-  info->mapping = INVALID_HANDLE_VALUE;
+  if (start)
+    UnmapViewOfFile(start);
+  if (data->mapping != NULL)
+    CloseHandle(data->mapping);
+  if (data->file != INVALID_HANDLE_VALUE)
+    CloseHandle(data->file);
 }
 
-int file_open(struct FILE_READER *file, const char *filename)
+static int map_file(const char *filename, struct FILE_PLATFORM_DATA *data, unsigned char **ret_start, size_t *ret_size)
 {
-  if (! initialized)
-    init_file_table();
-
-  struct FILE_INFO *info = alloc_file_info();
-  if (! info)
-    return 1;
-  file_init(file, info);
+  unsigned char *start = NULL;
+  data->file = INVALID_HANDLE_VALUE;
+  data->mapping = NULL;
 
-  info->file = CreateFileA(filename, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-  if (info->file == INVALID_HANDLE_VALUE)
+  data->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (data->file == INVALID_HANDLE_VALUE)
     goto err;
 
-  file->size = GetFileSize(info->file, NULL);
+  DWORD size = GetFileSize(data->file, NULL);
+  if (size == INVALID_FILE_SIZE || size == 0)
+    goto err;
   
-  info->mapping = CreateFileMappingA(info->file, NULL, PAGE_READONLY, 0, 0, NULL);
-  if (info->mapping == INVALID_HANDLE_VALUE)
+  data->mapping = CreateFileMappingA(data->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (data->mapping == NULL)
     goto err;
 
-  file->start = MapViewOfFile(info->mapping, FILE_MAP_READ, 0, 0, 0);
-  if (! file->start)
+  start = MapViewOfFile(data->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (! start)
     goto err;
 
-  file->pos = file->start;
+  *ret_start = start;
+  *ret_size = size;
   return 0;
    
  err:
-  file_close(file);
+  unmap_file(data, start, 0);
   return 1;
 }
+
+static int get_platform_fd(struct FILE_PLATFORM_DATA *data)
+{
+  return -1;
+}
+
+int file_advise(struct FILE_READER *file, size_t offset, size_t size, enum FILE_ADVICE advice)
+{
+  // not implemented: the hints are optional
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include "font.h"
 #include "matrix.h"
 #include "debug.h"
+#include "file.h"
 
 static struct MODEL_MESH *create_font_mesh(int tex_w, int tex_h)
 {
@@ -70,8 +71,12 @@ int read_font(struct FONT *font, const char *filename)
 {
   init_font(font);
   
+  struct FILE_READER file;
+  if (file_open(&file, filename) != 0)
+    goto err;
   int width, height, n_chan;
-  font->texture.data = stbi_load(filename, &width, &height, &n_chan, 4);
+  font->texture.data = stbi_load_from_memory(file.start, file.size, &width, &height, &n_chan, 4);
+  file_close(&file);
   if (! font->texture.data)
     goto err;
   font->texture.width = width;
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "game.h"
@@ -12,8 +13,11 @@
 #include "matrix.h"
 #include "bff.h"
 #include "room.h"
+#include "stream.h"
 #include "asset_loader.h"
 #include "model.h"
+#include "thread.h"
+#include "gfx_queue.h"
 
 struct GAME game;
 struct GAMEPAD gamepad;
@@ -21,8 +25,47 @@ struct FPS_COUNTER fps_counter;
 
 static struct BWF_READER bwf_reader;
 static int bwf_reader_open;
+static int gfx_queue_started;
+static uint8_t *failed_room_map;           // one bit per world room index that failed to load
 
-#define MOVE_SPEED (1.0 / 20.0)
+// game thread state
+static struct THREAD *game_thread;
+static struct CHANNEL *step_chan;          // GAME_INPUT, render thread -> game thread
+static struct CHANNEL *step_done_chan;     // int, game thread -> render thread
+static struct RENDER_SNAPSHOT *snapshots[2];
+static int building_snapshot;              // snapshot being built by the game step
+static int step_running;
+static struct GAME_INPUT pending_input;    // collected by the render thread until the next step
+static double last_frame_start_time;
+static double tick_time_left;              // simulation time not yet run, less than GAME_TICK_TIME
+
+static void run_game_step(struct GAME_INPUT *input, struct RENDER_SNAPSHOT *snap);
+static int start_game_thread(void);
+static void stop_game_thread(void);
+
+// units per second
+#define MOVE_SPEED 3.0
+
+// animation seconds per game second
+#define ANIM_SPEED 1.5
+
+// number of asset loader threads (0 to use one per available processor)
+#define NUM_ASSET_LOADER_WORKERS 0
+
+// number of job system threads besides the main thread (-1 to use one per available processor)
+#define NUM_JOB_WORKERS -1
+
+// bytes of room tiles, meshes and textures kept loaded
+#define ROOM_MEMORY_BUDGET (128*1024*1024)
+
+// number of creatures added with each press of the spawn key
+#define SPAWN_CREATURES_STEP 64
+
+// run the game step in its own thread, pipelined with rendering
+#define USE_GAME_THREAD 1
+
+// read world data with io_uring where available (instead of page faults on the file mapping)
+#define USE_IO_URING 1
 
 // these should be configurable:
 #define PAD_BTN_A      0
@@ -45,18 +88,21 @@ static int bwf_reader_open;
 #define PAD_AXIS_LT     4
 #define PAD_AXIS_RT     5
 
-#define CAM_SENSITIVITY_X (1.0 / 40.0)
-#define CAM_SENSITIVITY_Y (1.0 / 40.0)
+// radians per second
+#define CAM_SENSITIVITY_X 1.5
+#define CAM_SENSITIVITY_Y 1.5
+#define CAM_FOVY_SPEED    0.6
+#define CAM_ZOOM_SPEED    0.6
 
-void get_light_pos(float *restrict light_pos)
+void get_light_pos(struct CAMERA *camera, float *restrict light_pos)
 {
   float camera_pos[3];
-  get_camera_pos(&game.camera, camera_pos);
+  get_camera_pos(camera, camera_pos);
 
   float camera_dir[3] = {
-    camera_pos[0] - game.camera.center[0],
-    camera_pos[1] - game.camera.center[1],
-    camera_pos[2] - game.camera.center[2],
+    camera_pos[0] - camera->center[0],
+    camera_pos[1] - camera->center[1],
+    camera_pos[2] - camera->center[2],
   };
   vec3_normalize(camera_dir);
   vec3_scale(camera_dir, 4.0);
@@ -65,115 +111,389 @@ void get_light_pos(float *restrict light_pos)
   light_pos[2] = camera_pos[2] + camera_dir[2];
 }
 
+static void save_creature_state(struct CREATURE *creature)
+{
+  vec3_copy(creature->prev_pos, creature->pos);
+  creature->prev_theta = creature->theta;
+  creature->prev_anim_time = creature->anim_time;
+}
+
+static struct RENDER_MODEL_INSTANCE *new_model_instance(struct RENDER_MODEL *model)
+{
+  if (! model)
+    return NULL;
+  struct RENDER_MODEL_INSTANCE *inst = alloc_render_model_instance(model);
+  if (! inst) {
+    debug("** ERROR: can't allocate render model instance\n");
+    return NULL;
+  }
+  struct SKELETON *skel = get_render_model_skeleton(model);
+  if (skel->n_bones > 0) {
+    inst->anim = new_skeleton_animation_state(skel);
+    if (! inst->anim) {
+      debug("** ERROR: can't allocate animation state\n");
+      free_render_model_instance(inst);
+      return NULL;
+    }
+  }
+  mat4_id(inst->matrix);
+  return inst;
+}
+
+static void spawn_creatures(int n_creatures)
+{
+  struct RENDER_MODEL_INSTANCE *player_inst = game.creatures[0].inst;
+  struct SKELETON *skel = player_inst->anim->skel;
+
+  for (int n = 0; n < n_creatures && game.n_creatures < MAX_CREATURES; n++) {
+    struct CREATURE *creature = &game.creatures[game.n_creatures];
+    creature->inst = new_model_instance(player_inst->model);
+    if (! creature->inst)
+      return;
+
+    int index = game.n_creatures - 3;
+    creature->anim_time = skel->animations[0].loop_end_time * (index % 7) / 7;
+    creature->pos[0] = game.creatures[0].pos[0] + ((index % 16) - 8) * 1.5;
+    creature->pos[1] = game.creatures[0].pos[1];
+    creature->pos[2] = game.creatures[0].pos[2] + (index / 16 + 2) * 1.5;
+    creature->theta = index * 0.7;
+    mat4_copy(creature->model_matrix, game.creatures[0].model_matrix);
+    save_creature_state(creature);
+    game.n_creatures++;
+  }
+  console("- %d creatures\n", game.n_creatures);
+}
+
 void handle_game_key(int key, int press, int mods)
 {
   if (key == 'Q' && (mods & KEY_MOD_CTRL))
     game.quit = 1;
+  if (key == 'N' && press)
+    pending_input.spawn_creatures += SPAWN_CREATURES_STEP;
 }
 
-static void unload_unused_rooms(bool unload_all)
+void set_game_viewport(int width, int height)
+{
+  pending_input.viewport_width = width;
+  pending_input.viewport_height = height;
+}
+
+static void mark_room_and_neighbors(struct ROOM *room)
+{
+  room->mark = 1;
+  touch_room(room);
+  if (room->state != ROOM_STATE_RESIDENT)
+    return;
+  for (int i = 0; i < room->n_neighbors; i++) {
+    struct ROOM *neighbor = get_room_by_index(room->neighbor_index[i]);
+    if (neighbor) {
+      neighbor->mark = 1;
+      touch_room(neighbor);
+    }
+  }
+}
+
+/*
+ * Pin the current and next room sets by marking them, and make them
+ * the most recently used rooms.  Planned prefetches aren't pinned, but
+ * they're touched so they're evicted after older rooms.
+ */
+static void pin_room_sets(void)
 {
   mark_all_rooms(0);
 
-  if (game.current_room) {
-    game.current_room->mark = 1;
-    for (int i = 0; i < game.current_room->n_neighbors; i++)
-      game.current_room->neighbor[i]->mark = 1;
+  for (int i = 0; i < game.stream_plan.n_rooms; i++) {
+    struct ROOM *room = get_room_by_index(game.stream_plan.room_index[i]);
+    if (room)
+      touch_room(room);
+  }
+  struct ROOM *next_room = get_room(game.next_room);
+  if (game.current_room)
+    mark_room_and_neighbors(game.current_room);
+  if (next_room)
+    mark_room_and_neighbors(next_room);
+}
+
+/*
+ * Resident rooms are freed right away.  Rooms the asset loader is
+ * still reading are evicted and freed when the loader replies.
+ */
+static void unload_room(struct ROOM *room)
+{
+  if (room->prefetched) {
+    game.stream_stats.n_wasted++;
+    room->prefetched = false;
+  }
+  if (room->state == ROOM_STATE_RESIDENT) {
+    gfx_free_meshes(GFX_MESH_TYPE_ROOM, room->index);
+    free_room(room);
+  } else {
+    evict_room(room);
   }
+}
 
+/*
+ * Keep the resident rooms within the memory budget by evicting the
+ * least recently used ones that aren't pinned.  If 'need_slot' is
+ * set, also evict one if there's no free room slot.
+ */
+static void trim_resident_rooms(bool need_slot)
+{
+  pin_room_sets();
   while (1) {
-    struct ROOM *unused = get_marked_room(0);
-    if (! unused)
-      break;
-    gfx_free_meshes(GFX_MESH_TYPE_ROOM, unused->index);
-    free_room(unused);
-    if (! unload_all)
+    struct ROOM *room = get_room_to_evict(need_slot && ! has_free_room());
+    if (! room)
       break;
+    unload_room(room);
   }
 }
 
-static struct ROOM *load_room(int room_index)
+/*
+ * Cancel the loads of rooms that left the current and next room sets,
+ * like the neighbors of a room the player turned back from.
+ * Prefetches are cancelled by update_room_stream().
+ */
+static void cancel_unused_loads(void)
+{
+  pin_room_sets();
+
+  // go backwards, since freeing a room moves the last one to its place
+  for (int i = get_num_rooms() - 1; i >= 0; i--) {
+    struct ROOM *room = get_room_at(i);
+    if (room->mark != 0 || room->prefetched)
+      continue;
+    if (room->state == ROOM_STATE_REQUESTED || room->state == ROOM_STATE_LOADING)
+      unload_room(room);
+  }
+}
+
+/*
+ * Rooms that failed to load aren't requested again until the current
+ * room changes, so a broken neighbor isn't retried every frame.
+ */
+static bool is_room_failed(int room_index)
+{
+  if (room_index < 0 || (uint32_t) room_index >= bwf_reader.n_rooms)
+    return false;
+  return (failed_room_map[room_index / 8] & (1 << (room_index % 8))) != 0;
+}
+
+static void set_room_failed(int room_index)
 {
-  struct ROOM *room = alloc_room();
+  if (room_index < 0 || (uint32_t) room_index >= bwf_reader.n_rooms)
+    return;
+  failed_room_map[room_index / 8] |= 1 << (room_index % 8);
+}
+
+static void clear_failed_rooms(void)
+{
+  memset(failed_room_map, 0, (bwf_reader.n_rooms + 7) / 8);
+}
+
+static struct ROOM *request_room(int room_index)
+{
+  struct ROOM *room = get_room_by_index(room_index);
+  if (room) {
+    if (room->prefetched) {
+      if (room->state == ROOM_STATE_RESIDENT)
+        game.stream_stats.n_hits++;
+      else
+        game.stream_stats.n_late++;
+      room->prefetched = false;
+    }
+    return room;
+  }
+
+  if (! has_free_room())
+    trim_resident_rooms(true);
+  room = alloc_room(room_index);
   if (! room) {
     debug("** ERROR: out of memory for room %d\n", room_index);
+    set_room_failed(room_index);
     return NULL;
   }
-  room->index = room_index;
-  if (load_bwf_room(&bwf_reader, room) != 0) {
-    debug("** ERROR: can't load room\n");
-    close_bwf(&bwf_reader);
-    bwf_reader_open = 0;
+  if (request_bwf_room(&bwf_reader, room) != 0) {
+    debug("** ERROR: can't request room %d\n", room_index);
+    set_room_failed(room_index);
+    free_room(room);
     return NULL;
   }
-  for (int i = 0; i < room->n_neighbors; i++)
-    room->neighbor[i] = NULL;
   return room;
 }
 
-static int load_room_neighbors(struct ROOM *room)
+static void handle_loaded_room(struct ROOM *room, struct BWF_ROOM_DATA *data)
+{
+  if (room->state == ROOM_STATE_EVICTING) {
+    free_room(room);
+  } else if (! data || upload_bwf_room(&bwf_reader, room, data) != 0) {
+    debug("** ERROR: can't load room %d\n", room->index);
+    set_room_failed(room->index);
+    if (game.next_room == room->handle)
+      game.next_room = ROOM_HANDLE_NONE;
+    gfx_free_meshes(GFX_MESH_TYPE_ROOM, room->index);
+    free_room(room);
+  } else {
+    set_room_resident(room);
+  }
+  if (data)
+    release_bwf_room_data(data);
+}
+
+/*
+ * Switch to the next room once it and all its neighbors are loaded.
+ * Until then the game keeps using the current room set.
+ */
+static void update_next_room(void)
 {
+  struct ROOM *room = get_room(game.next_room);
+  if (! room || room->state != ROOM_STATE_RESIDENT)
+    return;
+
+  bool ready = true;
   for (int i = 0; i < room->n_neighbors; i++) {
-    room->neighbor[i] = get_room_by_index(room->neighbor_index[i]);
-    if (room->neighbor[i])
+    if (is_room_failed(room->neighbor_index[i]))
       continue;
-
-    room->neighbor[i] = load_room(room->neighbor_index[i]);
-    if (room->neighbor[i])
+    struct ROOM *neighbor = request_room(room->neighbor_index[i]);
+    if (! neighbor) {
+      debug("** ERROR: can't load room %d (neighbor of %d)\n", room->neighbor_index[i], room->index);
       continue;
-
-    debug("** ERROR: can't load room %d (neighbor of %d)\n", room->neighbor_index[i], room->index);
-    return 1;
+    }
+    if (neighbor->state != ROOM_STATE_RESIDENT)
+      ready = false;
   }
-  return 0;
+  if (! ready)
+    return;
+
+  game.current_room = room;
+  game.next_room = ROOM_HANDLE_NONE;
+  cancel_unused_loads();
+  clear_failed_rooms();
 }
 
 static int set_current_room(int room_index)
 {
-  struct ROOM *room = get_room_by_index(room_index);
-  if (! room) {
-    if (! has_free_room())
-      unload_unused_rooms(false);
-    room = load_room(room_index);
-    if (! room)
-      return 1;
-  }
-  game.current_room = room;
-  if (load_room_neighbors(room) != 0)
+  struct ROOM *room = request_room(room_index);
+  if (! room)
     return 1;
-  unload_unused_rooms(true);
+  game.next_room = room->handle;
+  update_next_room();
   return 0;
 }
 
-static void check_room_change(void)
+/*
+ * Load the rooms the player will probably need next.  Prefetches only
+ * use free room slots and only a few are queued at a time, so the
+ * rooms the game needs now don't wait behind them.  Prefetches that
+ * drop out of the plan before they finish loading are cancelled.
+ */
+static void update_room_stream(const float *player_pos, const float *player_vel)
 {
-  /*
-   * HACK: just find the closest loaded room to the player character
-   * and make it the current room. We really should use the tiles to
-   * check for room transitions, but that's not yet implemented in the
-   * editor).
-   */
-  float *player_pos = game.creatures[0].pos;
-  
-  struct ROOM *closest_room = NULL;
-  float closest_dist = 0;
-  for (struct ROOM *room = get_room_list(); room != NULL; room = room->next) {
-    float dist = ((room->pos[0] - player_pos[0]) * (room->pos[0] - player_pos[0]) +
-                  (room->pos[1] - player_pos[1]) * (room->pos[1] - player_pos[1]) +
-                  (room->pos[2] - player_pos[2]) * (room->pos[2] - player_pos[2]));
-    if (closest_room == NULL || dist < closest_dist) {
-      closest_room = room;
-      closest_dist = dist;
+  plan_room_stream(&game.stream_plan, game.current_room, player_pos, player_vel);
+
+  int n_in_flight = 0;
+  for (int i = get_num_rooms() - 1; i >= 0; i--) {
+    struct ROOM *room = get_room_at(i);
+    if (! room->prefetched || room->state == ROOM_STATE_RESIDENT)
+      continue;
+    if (stream_plan_has_room(&game.stream_plan, room->index))
+      n_in_flight++;
+    else
+      unload_room(room);
+  }
+
+  for (int i = 0; i < game.stream_plan.n_rooms && n_in_flight < STREAM_MAX_IN_FLIGHT; i++) {
+    int room_index = game.stream_plan.room_index[i];
+    if (get_room_by_index(room_index))
+      continue;
+    if (get_num_free_rooms() <= STREAM_RESERVED_ROOMS)
+      break;
+    struct ROOM *room = alloc_room(room_index);
+    if (request_bwf_room(&bwf_reader, room) != 0) {
+      debug("** ERROR: can't request room %d\n", room_index);
+      free_room(room);
+      continue;
+    }
+    room->prefetched = true;
+    game.stream_stats.n_requested++;
+    n_in_flight++;
+  }
+}
+
+/*
+ * Make the room with the floor tile under the player the current
+ * room.  Where rooms overlap, the player stays in the current room.
+ */
+static void check_room_change(float *player_pos)
+{
+  struct ROOM *room = find_room_at(player_pos, game.current_room);
+  if (room && room != game.current_room && room->handle != game.next_room)
+    set_current_room(room->index);
+}
+
+/*
+ * Handle asset loader responses until the deadline is reached.  Room
+ * meshes are uploaded here, textures go to the GFX queue.  Returns 0
+ * if at least one response was handled.
+ */
+static int handle_loaded_assets(double deadline)
+{
+  int n_handled = 0;
+  struct ASSET_REQUEST resp;
+  while (get_monotonic_time() < deadline && recv_asset_response(&resp) == 0) {
+    n_handled++;
+    switch (resp.type) {
+    case ASSET_TYPE_REPLY_TEXTURE:
+      {
+        // the asset loader's reference to the texture goes to the GFX queue
+        struct ASSET_REPLY_TEXTURE *tex = &resp.data.reply_texture;
+        if (! tex->data) {
+          // don't let other meshes share the broken texture
+          console("** ERROR: can't decode texture\n");
+          gfx_set_texture_key(tex->gfx, 0);
+          gfx_release_texture(tex->gfx);
+        } else if (gfx_queue_texture_upload(tex->gfx, tex->format, tex->width, tex->height, tex->n_levels, tex->data, 0) != 0) {
+          gfx_release_texture(tex->gfx);
+          free(tex->data);
+        }
+      }
+      break;
+
+    case ASSET_TYPE_REPLY_ROOM:
+      handle_loaded_room(resp.data.reply_room.room, resp.data.reply_room.data);
+      break;
+
+    default:
+      console("** ERROR: got unknown asset type %d\n", resp.type);
+      break;
     }
   }
+  return (n_handled > 0) ? 0 : 1;
+}
 
-  if (closest_room && closest_room != game.current_room)
-    set_current_room(closest_room->index);
+/*
+ * Spend up to GFX_QUEUE_FRAME_BUDGET seconds of this frame on asset
+ * loading work that must run on the main thread.
+ */
+static int run_main_thread_loading(void)
+{
+  double deadline = get_monotonic_time() + GFX_QUEUE_FRAME_BUDGET;
+  int ret = handle_loaded_assets(deadline);
+  run_gfx_queue(deadline);
+  return ret;
 }
 
-static struct RENDER_MODEL_INSTANCE *load_animated_model(const char *filename)
+/*
+ * Models are shared by all creatures loaded from the same file: the
+ * meshes, skeleton and textures are only uploaded once, and each
+ * creature gets its own instance and animation state.
+ */
+static struct RENDER_MODEL *load_animated_model(const char *filename)
 {
-  struct RENDER_MODEL *model = alloc_render_model();
+  struct RENDER_MODEL *model = find_render_model(filename);
+  if (model)
+    return model;
+
+  model = alloc_render_model(filename);
   if (! model) {
     debug("** ERROR: can't allocate render model\n");
     return NULL;
@@ -186,36 +506,16 @@ static struct RENDER_MODEL_INSTANCE *load_animated_model(const char *filename)
     return NULL;
   }
   set_render_model_meshes(model, info.n_gfx_meshes, info.gfx_meshes);
-
-  struct RENDER_MODEL_INSTANCE *inst = alloc_render_model_instance(model);
-  if (! inst) {
-    debug("** ERROR: can't allocate render model instance\n");
-    return NULL;
-  }
-  inst->anim = new_skeleton_animation_state(skel);
-  if (! inst->anim) {
-    debug("** ERROR: can't allocate animation state\n");
-    free_render_model(model);
-    return NULL;
-  }
-  mat4_id(inst->matrix);
-  
-#if 0
-  inst->anim->time = 0.8;
-  inst->anim->anim_index = 0;
-  update_skeleton_animation_state(inst->anim);
-  for (int i = 0; i < skel.n_bones; i++) {
-    console("skel matrix [%d]:\n", i);
-    mat4_dump(&inst->anim->matrices[16*i]);
-  }
-#endif
-
-  return inst;
+  return model;
 }
 
-static struct RENDER_MODEL_INSTANCE *load_static_model(const char *filename)
+static struct RENDER_MODEL *load_static_model(const char *filename)
 {
-  struct RENDER_MODEL *model = alloc_render_model();
+  struct RENDER_MODEL *model = find_render_model(filename);
+  if (model)
+    return model;
+
+  model = alloc_render_model(filename);
   if (! model) {
     debug("** ERROR: can't allocate render model\n");
     return NULL;
@@ -227,53 +527,70 @@ static struct RENDER_MODEL_INSTANCE *load_static_model(const char *filename)
     return NULL;
   }
   set_render_model_meshes(model, test.n_gfx_meshes, test.gfx_meshes);
-  struct RENDER_MODEL_INSTANCE *inst = alloc_render_model_instance(model);
-  if (! inst) {
-    debug("** ERROR: can't allocate render model instance\n");
-    return NULL;
-  }
-
-  mat4_id(inst->matrix);
-  return inst;
+  return model;
 }
 
 static int load_creatures(void)
 {
   struct RENDER_MODEL_INSTANCE *inst;
 
-  inst = load_animated_model("data/Monster.bcf");
+  inst = new_model_instance(load_animated_model("data/Monster.bcf"));
   if (! inst)
     return 1;
   inst->anim->skel->animations[0].end_time = inst->anim->skel->animations[0].loop_end_time = 1;
   game.creatures[0].inst = inst;
+  float *fix = game.creatures[0].model_matrix;
+  float m[16];
+  mat4_load_scale(fix, 0.001, 0.001, 0.001);
+  mat4_load_rot_x(m, -M_PI/2); mat4_mul_left(fix, m);
+  mat4_load_translation(m, -1.2, 0.52, 0); mat4_mul_left(fix, m);
+  mat4_load_rot_y(m, M_PI/2); mat4_mul_left(fix, m);
   
-  inst = load_animated_model("data/test1.bcf");
+  inst = new_model_instance(load_animated_model("data/test1.bcf"));
   if (! inst)
     return 1;
   inst->anim->skel->animations[1].end_time = inst->anim->skel->animations[0].loop_end_time = 1.65;
-  mat4_load_translation(inst->matrix, 2, 0, 0);
+  vec3_load(game.creatures[1].pos, 2, 0, 0);
+  mat4_id(game.creatures[1].model_matrix);
   game.creatures[1].inst = inst;
 
-  inst = load_static_model("data/player.bmf");
+  inst = new_model_instance(load_static_model("data/player.bmf"));
   if (! inst)
     return 1;
-  mat4_load_translation(inst->matrix, -2, 0, 0);
+  vec3_load(game.creatures[2].pos, -2, 0, 0);
+  mat4_id(game.creatures[2].model_matrix);
   game.creatures[2].inst = inst;
-  
+
+  game.n_creatures = 3;
   return 0;
 }
 
 static int init_rooms(void)
 {
-  init_room_store();
+  if (init_room_store() != 0)
+    return 1;
+  set_room_budget(ROOM_MEMORY_BUDGET);
   if (open_bwf(&bwf_reader, "data/world.bwf") != 0) {
     debug("** ERROR: can't open data/world.bmf\n");
     return 1;
   }
   bwf_reader_open = 1;
+  failed_room_map = calloc((bwf_reader.n_rooms + 7) / 8 + 1, 1);
+  if (! failed_room_map) {
+    debug("** ERROR: out of memory for room map\n");
+    return 1;
+  }
   if (set_current_room(0) != 0)
     return 1;
 
+  // wait for the first room set to load
+  while (! game.current_room) {
+    if (! get_room(game.next_room))
+      return 1;
+    if (run_main_thread_loading() != 0)
+      thread_sleep(1);
+    update_next_room();
+  }
   return 0;
 }
 
@@ -281,8 +598,18 @@ int init_game(int width, int height)
 {
   game.quit = 0;
 
-  debug("- Starting asset loader thread...\n");
-  if (start_asset_loader() != 0)
+  if (init_gfx_queue() != 0)
+    return 1;
+  gfx_queue_started = 1;
+
+  debug("- Starting job system...\n");
+  if (start_job_system(NUM_JOB_WORKERS) != 0)
+    return 1;
+  debug("- Job system started with %d workers\n", get_job_system_workers());
+
+  debug("- Starting asset loader threads...\n");
+  set_asset_loader_io_mode(USE_IO_URING ? ASSET_LOADER_IO_URING : ASSET_LOADER_IO_MMAP);
+  if (start_asset_loader(NUM_ASSET_LOADER_WORKERS) != 0)
     return 0;
     
   init_camera(&game.camera, width, height);
@@ -295,16 +622,51 @@ int init_game(int width, int height)
     return 1;
 
   vec3_copy(game.creatures[0].pos, game.current_room->pos);
+  for (int i = 0; i < game.n_creatures; i++)
+    save_creature_state(&game.creatures[i]);
+
+  snapshots[0] = new_render_snapshot();
+  snapshots[1] = new_render_snapshot();
+  if (! snapshots[0] || ! snapshots[1]) {
+    debug("** ERROR: out of memory for render snapshots\n");
+    return 1;
+  }
+
+  // build the first snapshot here, so the first frame has something to render
+  struct GAME_INPUT input;
+  memset(&input, 0, sizeof(input));
+  run_game_step(&input, snapshots[building_snapshot]);
+
+#if USE_GAME_THREAD
+  debug("- Starting game thread...\n");
+  if (start_game_thread() != 0)
+    return 1;
+#endif
   return 0;
 }
 
 void close_game(void)
 {
+  debug("- Stopping game thread...\n");
+  stop_game_thread();
+  for (int i = 0; i < 2; i++) {
+    if (snapshots[i])
+      free_render_snapshot(snapshots[i]);
+    snapshots[i] = NULL;
+  }
+
   debug("- Stopping asset loader...\n");
   stop_asset_loader();
+  debug("- Stopping job system...\n");
+  stop_job_system();
   
+  // the upload thread may still be reading room meshes from the BWF file
+  if (gfx_queue_started)
+    close_gfx_queue();
   if (bwf_reader_open)
     close_bwf(&bwf_reader);
+  free(failed_room_map);
+  failed_room_map = NULL;
 }
 
 static float apply_dead_zone(float val)
@@ -321,40 +683,54 @@ static float apply_dead_zone_at(float val, float dead_zone_val)
   return val;
 }
 
-static void handle_input(void)
+static void apply_camera_input(struct CAMERA *camera, struct GAMEPAD *pad, float dt)
 {
-  if (update_gamepad(&gamepad) < 0)
-    return;
-  //dump_gamepad_state(&gamepad);
-  
-  game.show_camera_info = gamepad.btn_state[PAD_BTN_START];
-  
-  if (gamepad.btn_state[PAD_BTN_LB]) game.camera.fovy -= 0.01;
-  if (gamepad.btn_state[PAD_BTN_RB]) game.camera.fovy += 0.01;
-  game.camera.fovy = clamp(game.camera.fovy, M_PI/4, M_PI*0.9);
+  if (pad->btn_state[PAD_BTN_LB]) camera->fovy -= CAM_FOVY_SPEED * dt;
+  if (pad->btn_state[PAD_BTN_RB]) camera->fovy += CAM_FOVY_SPEED * dt;
+  camera->fovy = clamp(camera->fovy, M_PI/4, M_PI*0.9);
   
-  float cam_x = apply_dead_zone(gamepad.axis[PAD_AXIS_CAM_X]);
-  float cam_y = apply_dead_zone(gamepad.axis[PAD_AXIS_CAM_Y]);
+  float cam_x = apply_dead_zone(pad->axis[PAD_AXIS_CAM_X]);
+  float cam_y = apply_dead_zone(pad->axis[PAD_AXIS_CAM_Y]);
   if (cam_x != 0.0 || cam_y != 0.0) {
-    game.camera.theta += cam_x * CAM_SENSITIVITY_X;
-    game.camera.phi -= cam_y * CAM_SENSITIVITY_Y;
-    float phi_min = -asin(game.camera.center[1] / game.camera.distance);
-    game.camera.phi = clamp(game.camera.phi, phi_min + 0.05, M_PI/2 - 0.2);
+    camera->theta += cam_x * CAM_SENSITIVITY_X * dt;
+    camera->phi -= cam_y * CAM_SENSITIVITY_Y * dt;
+    float phi_min = -asin(camera->center[1] / camera->distance);
+    camera->phi = clamp(camera->phi, phi_min + 0.05, M_PI/2 - 0.2);
   }
 
-  float zoom_in = apply_dead_zone_at(gamepad.axis[PAD_AXIS_RT], -1.0);
-  float zoom_out = apply_dead_zone_at(gamepad.axis[PAD_AXIS_LT], -1.0);
+  float zoom_in = apply_dead_zone_at(pad->axis[PAD_AXIS_RT], -1.0);
+  float zoom_out = apply_dead_zone_at(pad->axis[PAD_AXIS_LT], -1.0);
   if (zoom_in != -1.0 || zoom_out != -1.0) {
-    zoom_in =  1.0 - (1.0 + zoom_in) * 0.01;
-    zoom_out = 1.0 + (1.0 + zoom_out) * 0.01;
-    game.camera.distance *= zoom_in * zoom_out;
-    game.camera.distance = clamp(game.camera.distance, 1.0, 20.0);
-    float phi_min = -asin(game.camera.center[1] / game.camera.distance);
-    game.camera.phi = clamp(game.camera.phi, phi_min + 0.05, M_PI/2 - 0.2);
+    float zoom = (zoom_out - zoom_in) * CAM_ZOOM_SPEED * dt;
+    camera->distance *= exp(zoom);
+    camera->distance = clamp(camera->distance, 1.0, 20.0);
+    float phi_min = -asin(camera->center[1] / camera->distance);
+    camera->phi = clamp(camera->phi, phi_min + 0.05, M_PI/2 - 0.2);
   }
-  
-  float move_x = apply_dead_zone(gamepad.axis[PAD_AXIS_MOVE_X]);
-  float move_y = apply_dead_zone(gamepad.axis[PAD_AXIS_MOVE_Y]);
+}
+
+/*
+ * Handle the input that doesn't affect the simulation once per
+ * frame.
+ */
+static void handle_frame_input(struct GAME_INPUT *input)
+{
+  if (input->viewport_width > 0 && input->viewport_height > 0)
+    set_camera_viewport(&game.camera, input->viewport_width, input->viewport_height);
+  if (input->spawn_creatures > 0)
+    spawn_creatures(input->spawn_creatures);
+
+  if (! input->has_gamepad)
+    return;
+  //dump_gamepad_state(&input->pad);
+  game.show_camera_info = input->pad.btn_state[PAD_BTN_START];
+  apply_camera_input(&game.camera, &input->pad, input->frame_time);
+}
+
+static void move_player(struct GAMEPAD *pad)
+{
+  float move_x = apply_dead_zone(pad->axis[PAD_AXIS_MOVE_X]);
+  float move_y = apply_dead_zone(pad->axis[PAD_AXIS_MOVE_Y]);
   if (move_x != 0.0 || move_y != 0.0) {
     float front[3], left[3];
     get_camera_vectors(&game.camera, front, left, NULL, NULL);
@@ -367,94 +743,269 @@ static void handle_input(void)
 
     float move[3];
     vec3_add(move, front, left);
-    vec3_scale(move, MOVE_SPEED * (gamepad.btn_state[PAD_BTN_A] ? 2.0 : 1.0));
+    vec3_scale(move, MOVE_SPEED * GAME_TICK_TIME * (pad->btn_state[PAD_BTN_A] ? 2.0 : 1.0));
     vec3_add_to(game.creatures[0].pos, move);
     game.creatures[0].theta = atan2(move[2], move[0]) - M_PI/2;
   }
 }
 
-static void handle_loaded_assets(void)
+static void advance_creature_animation(struct CREATURE *creature)
 {
-  struct ASSET_REQUEST resp;
-  if (recv_asset_response(&resp) != 0)
-    return;
-  
-  switch (resp.type) {
-  case ASSET_TYPE_REPLY_TEXTURE:
-    {
-      struct ASSET_REPLY_TEXTURE *tex = &resp.data.reply_texture;
-      struct MODEL_TEXTURE model_tex;
-      model_tex.width = tex->width;
-      model_tex.height = tex->height;
-      model_tex.n_chan = tex->n_chan;
-      model_tex.data = tex->data;
-      gfx_upload_model_texture(tex->gfx, &model_tex, 0);
-      gfx_release_texture(tex->gfx); // release from asset loader
-      free(tex->data);
-    }
-    break;
+  struct SKEL_ANIMATION_STATE *anim_state = creature->inst->anim;
+  struct SKEL_ANIMATION *anim = &anim_state->skel->animations[anim_state->anim_index];
+  if (anim->loop_end_time > anim->loop_start_time) {
+    float time = creature->anim_time + ANIM_SPEED * GAME_TICK_TIME;
+    if (time > anim->loop_end_time)
+      time -= anim->loop_end_time - anim->loop_start_time;
+    creature->anim_time = time;
+  }
+}
 
-  default:
-    console("** ERROR: got unknown asset type %d\n", resp.type);
-    break;
+/*
+ * Run one simulation tick of GAME_TICK_TIME seconds.
+ */
+static void run_game_tick(struct GAME_INPUT *input)
+{
+  for (int i = 0; i < game.n_creatures; i++) {
+    struct CREATURE *creature = &game.creatures[i];
+    save_creature_state(creature);
+    if (creature->inst && creature->inst->anim)
+      advance_creature_animation(creature);
   }
+
+  if (input->has_gamepad)
+    move_player(&input->pad);
 }
 
-static void update_player_creature_matrix(void)
+static float lerp_angle(float from, float to, float alpha)
 {
-  struct CREATURE *player = &game.creatures[0];
+  float diff = fmod(to - from, 2*M_PI);
+  if (diff > M_PI)
+    diff -= 2*M_PI;
+  else if (diff < -M_PI)
+    diff += 2*M_PI;
+  return from + diff * alpha;
+}
 
-#if 1
-  struct RENDER_MODEL_INSTANCE *inst = game.creatures[0].inst;
-  mat4_load_scale(inst->matrix, 0.001, 0.001, 0.001);
-  float fix[16];
-  mat4_load_rot_x(fix, -M_PI/2); mat4_mul_left(inst->matrix, fix);
-  mat4_load_translation(fix, -1.2, 0.52, 0); mat4_mul_left(inst->matrix, fix);
-  mat4_load_rot_y(fix, M_PI/2); mat4_mul_left(inst->matrix, fix);
-#else
-  mat4_id(inst->matrix);
-#endif
+static float lerp_anim_time(struct SKEL_ANIMATION_STATE *anim_state, float from, float to, float alpha)
+{
+  struct SKEL_ANIMATION *anim = &anim_state->skel->animations[anim_state->anim_index];
+  float loop_len = anim->loop_end_time - anim->loop_start_time;
+  if (to < from)   // wrapped around the loop
+    to += loop_len;
+  float time = from + (to - from) * alpha;
+  if (time > anim->loop_end_time)
+    time -= loop_len;
+  return time;
+}
+
+/*
+ * Set the creature's render instance to its state interpolated
+ * between the last two ticks.
+ */
+static void update_creature_instance(struct CREATURE *creature, float alpha)
+{
+  float pos[3];
+  for (int i = 0; i < 3; i++)
+    pos[i] = creature->prev_pos[i] + (creature->pos[i] - creature->prev_pos[i]) * alpha;
+  float theta = lerp_angle(creature->prev_theta, creature->theta, alpha);
 
   float place[16];
-  mat4_load_rot_y(place, player->theta);
-  place[ 3] += player->pos[0];
-  place[ 7] += player->pos[1];
-  place[11] += player->pos[2];
+  mat4_load_rot_y(place, theta);
+  place[ 3] += pos[0];
+  place[ 7] += pos[1];
+  place[11] += pos[2];
+  mat4_mul(creature->inst->matrix, place, creature->model_matrix);
+
+  if (creature->inst->anim) {
+    struct SKEL_ANIMATION_STATE *anim_state = creature->inst->anim;
+    anim_state->time = lerp_anim_time(anim_state, creature->prev_anim_time, creature->anim_time, alpha);
+    update_skeleton_animation_state(anim_state);
+  }
+}
 
-  mat4_mul_left(inst->matrix, place);
+static void update_creature_range(void *data, int start, int end)
+{
+  float alpha = *(float *) data;
+  for (int i = start; i < end; i++) {
+    struct CREATURE *creature = &game.creatures[i];
+    if (creature->inst)
+      update_creature_instance(creature, alpha);
+  }
 }
 
-static void update_creatures(void)
+static void update_creatures(float alpha)
 {
-  update_player_creature_matrix();
+  double start_time = get_monotonic_time();
 
-  for (int i = 0; i < MAX_CREATURES; i++) {
-    if (game.creatures[i].inst && game.creatures[i].inst->anim) {
-      struct SKEL_ANIMATION_STATE *anim_state = game.creatures[i].inst->anim;
-      struct SKEL_ANIMATION *anim = &anim_state->skel->animations[anim_state->anim_index];
-      if (anim->loop_end_time > anim->loop_start_time) {
-        float time = anim_state->time + 0.025;
-        if (time > anim->loop_end_time)
-          time -= anim->loop_end_time - anim->loop_start_time;
-        anim_state->time = time;
-      }
-      update_skeleton_animation_state(game.creatures[i].inst->anim);
-    }
+  struct JOB_COUNTER done;
+  init_job_counter(&done);
+  run_parallel_for(game.n_creatures, 0, update_creature_range, &alpha, NULL, &done);
+  wait_job_counter(&done);
+
+  game.creature_update_time = get_monotonic_time() - start_time;
+}
+
+static void build_render_snapshot(struct RENDER_SNAPSHOT *snap)
+{
+  clear_render_snapshot(snap);
+  snap->camera = game.camera;
+  vec3_copy(snap->player_pos, game.creatures[0].pos);
+  for (int i = 0; i < 3; i++)
+    snap->player_vel[i] = (game.creatures[0].pos[i] - game.creatures[0].prev_pos[i]) / GAME_TICK_TIME;
+  snap->show_camera_info = game.show_camera_info;
+  snap->n_creatures = game.n_creatures;
+  snap->creature_update_time = game.creature_update_time;
+
+  for (int i = 0; i < game.n_creatures; i++) {
+    if (game.creatures[i].inst && add_render_snapshot_instance(snap, game.creatures[i].inst) != 0)
+      break;
   }
 }
 
-int process_game_step(void)
+/*
+ * Advance the game one step and build the next render snapshot.  This
+ * runs in the game thread and must not touch GL, the rooms or the GFX
+ * pools, which belong to the render thread.
+ */
+static void run_game_step(struct GAME_INPUT *input, struct RENDER_SNAPSHOT *snap)
 {
-  handle_loaded_assets();
-  handle_input();
+  handle_frame_input(input);
+
+  // run the ticks that fit in the elapsed time, dropping time if we're too far behind
+  tick_time_left += input->frame_time;
+  if (tick_time_left > GAME_MAX_TICKS_PER_FRAME * GAME_TICK_TIME)
+    tick_time_left = GAME_MAX_TICKS_PER_FRAME * GAME_TICK_TIME;
+  while (tick_time_left >= GAME_TICK_TIME) {
+    run_game_tick(input);
+    tick_time_left -= GAME_TICK_TIME;
+  }
 
-  check_room_change();
-  update_creatures();
-  
+  // render the state between the last two ticks
+  float alpha = tick_time_left / GAME_TICK_TIME;
+  update_creatures(alpha);
+
+  struct CREATURE *player = &game.creatures[0];
   vec3_load(game.camera.center,
-            game.creatures[0].pos[0],
-            game.creatures[0].pos[1] + 0.8,
-            game.creatures[0].pos[2]);
+            player->prev_pos[0] + (player->pos[0] - player->prev_pos[0]) * alpha,
+            player->prev_pos[1] + (player->pos[1] - player->prev_pos[1]) * alpha + 0.8,
+            player->prev_pos[2] + (player->pos[2] - player->prev_pos[2]) * alpha);
+
+  build_render_snapshot(snap);
+}
+
+static void game_thread_main(void *data)
+{
+  while (1) {
+    struct GAME_INPUT input;
+    chan_recv(step_chan, &input, 1);
+    if (input.quit)
+      break;
+    run_game_step(&input, snapshots[building_snapshot]);
+    int done = 1;
+    chan_send(step_done_chan, &done);
+  }
+}
+
+static void start_game_step(struct GAME_INPUT *input)
+{
+  if (game_thread) {
+    chan_send(step_chan, input);
+    step_running = 1;
+  } else {
+    run_game_step(input, snapshots[building_snapshot]);
+  }
+}
+
+static void wait_game_step(void)
+{
+  if (step_running) {
+    int done;
+    chan_recv(step_done_chan, &done, 1);
+    step_running = 0;
+  }
+}
+
+static int start_game_thread(void)
+{
+  step_chan = new_chan(1, sizeof(struct GAME_INPUT), 0);
+  step_done_chan = new_chan(1, sizeof(int), 0);
+  if (! step_chan || ! step_done_chan) {
+    debug("** ERROR: can't create game thread channels\n");
+    return 1;
+  }
+  game_thread = start_thread(game_thread_main, NULL);
+  if (! game_thread) {
+    debug("** ERROR: can't start game thread\n");
+    return 1;
+  }
+  return 0;
+}
+
+static void stop_game_thread(void)
+{
+  if (game_thread) {
+    wait_game_step();
+    struct GAME_INPUT input;
+    memset(&input, 0, sizeof(input));
+    input.quit = 1;
+    chan_send(step_chan, &input);
+    join_thread(game_thread);
+    game_thread = NULL;
+  }
+  if (step_chan)
+    free_chan(step_chan);
+  if (step_done_chan)
+    free_chan(step_done_chan);
+  step_chan = NULL;
+  step_done_chan = NULL;
+}
+
+/*
+ * Run one frame of the game on the render thread: collect the snapshot
+ * built by the last step, start the next step with fresh input and do
+ * the work that needs GL or the rooms.  Returns the snapshot to
+ * render, or NULL to quit.
+ *
+ * The input is sampled right before the step starts, and its camera
+ * controls are also applied to the returned snapshot so the camera
+ * responds without waiting for the extra pipeline stage.
+ */
+struct RENDER_SNAPSHOT *process_game_frame(void)
+{
+  if (game.quit)
+    return NULL;
+
+  wait_game_step();
+  struct RENDER_SNAPSHOT *snap = snapshots[building_snapshot];
+  building_snapshot ^= 1;
+
+  double now = get_monotonic_time();
+  struct GAME_INPUT input = pending_input;
+  memset(&pending_input, 0, sizeof(pending_input));
+  input.frame_time = (last_frame_start_time > 0) ? now - last_frame_start_time : 0;
+  last_frame_start_time = now;
+  input.has_gamepad = (update_gamepad(&gamepad) >= 0);
+  input.pad = gamepad;
+  start_game_step(&input);
+
+  run_main_thread_loading();
+  update_next_room();
+  check_room_change(snap->player_pos);
+  update_room_stream(snap->player_pos, snap->player_vel);
+  update_pending_room_gpu_bytes();
+  trim_resident_rooms(false);
+  snap->stream_stats = game.stream_stats;
+  get_room_residency_stats(&snap->residency_stats);
+
+  snap->n_rooms = 0;
+  if (game.current_room) {
+    snap->room_index[snap->n_rooms++] = game.current_room->index;
+    for (int i = 0; i < game.current_room->n_neighbors; i++)
+      snap->room_index[snap->n_rooms++] = game.current_room->neighbor_index[i];
+  }
 
-  return game.quit;
+  if (input.has_gamepad)
+    apply_camera_input(&snap->camera, &input.pad, input.frame_time);
+  return snap;
 }
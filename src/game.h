@@ -45,7 +45,12 @@
 #define KEY_KP_ADD      334
 #define KEY_KP_ENTER    335
 
-#define MAX_CREATURES 16
+#define MAX_CREATURES 1024
+
+// the game simulation runs at a fixed rate, independent of the frame rate
+#define GAME_TICK_RATE            60
+#define GAME_TICK_TIME            (1.0 / GAME_TICK_RATE)
+#define GAME_MAX_TICKS_PER_FRAME  8
 
 struct FPS_COUNTER {
   double start_time;
@@ -56,22 +61,46 @@ struct FPS_COUNTER {
 struct CREATURE {
   float pos[3];
   float theta;
+  float anim_time;
+  float prev_pos[3];        // state at the previous tick, for interpolation
+  float prev_theta;
+  float prev_anim_time;
+  float model_matrix[16];   // places the model in the creature's space
   struct RENDER_MODEL_INSTANCE *inst;
 };
 
+/*
+ * Input collected by the render thread for one game step.
+ */
+struct GAME_INPUT {
+  int quit;               // stop the game thread
+  double frame_time;      // real time elapsed since the last step
+  int has_gamepad;
+  struct GAMEPAD pad;
+  int spawn_creatures;
+  int viewport_width;     // 0 if unchanged
+  int viewport_height;
+};
+
 struct GAME {
   int quit;
   int show_camera_info;
   struct CAMERA camera;
   struct CREATURE creatures[MAX_CREATURES];
+  int n_creatures;
+  double creature_update_time;   // seconds spent in the last update_creatures()
   struct ROOM *current_room;
+  uint32_t next_room;       // handle of the room that becomes current_room when it and its neighbors are loaded
+  struct STREAM_PLAN stream_plan;
+  struct STREAM_STATS stream_stats;
 };
 
 int init_game(int width, int height);
 void close_game(void);
 void handle_game_key(int key, int press, int mods);
-int process_game_step(void);
-void get_light_pos(float *light_pos);
+struct RENDER_SNAPSHOT *process_game_frame(void);
+void set_game_viewport(int width, int height);
+void get_light_pos(struct CAMERA *camera, float *light_pos);
 
 extern struct GAME game;
 extern struct GAMEPAD gamepad;
@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <string.h>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
@@ -11,6 +12,7 @@
 #include "matrix.h"
 #include "model.h"
 #include "font.h"
+#include "gfx_queue.h"
 
 //#define DEBUG_GFX
 #ifdef DEBUG_GFX
@@ -19,15 +21,72 @@
 #define debug_log(...)
 #endif
 
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM    0x8E8C
+#endif
+
+static unsigned int gfx_texture_formats;   // (1<<GFX_TEX_FORMAT_xxx) for each format the driver takes
 static struct GFX_MESH *gfx_mesh_free_list;
 static struct GFX_MESH *gfx_mesh_used_list;
 static struct GFX_TEXTURE *gfx_texture_free_list;
 static struct GFX_TEXTURE *gfx_texture_used_list;
+static struct GFX_TEXTURE *gfx_texture_buckets[NUM_GFX_TEXTURE_BUCKETS];
 struct GFX_MESH gfx_meshes[NUM_GFX_MESHES];
 struct GFX_TEXTURE gfx_textures[NUM_GFX_TEXTURES];
 
+/*
+ * Block compressed formats come from extensions that (in practice)
+ * every desktop driver has, but check anyway: textures in formats we
+ * can't upload are decoded by the asset loader.
+ */
+static void detect_texture_formats(void)
+{
+  gfx_texture_formats = (1<<GFX_TEX_FORMAT_RGB) | (1<<GFX_TEX_FORMAT_RGBA);
+
+  GLint n_extensions = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &n_extensions);
+  for (GLint i = 0; i < n_extensions; i++) {
+    const char *ext = (const char *) glGetStringi(GL_EXTENSIONS, i);
+    if (! ext)
+      continue;
+    if (strcmp(ext, "GL_EXT_texture_compression_s3tc") == 0)
+      gfx_texture_formats |= (1<<GFX_TEX_FORMAT_BC1) | (1<<GFX_TEX_FORMAT_BC3);
+    else if (strcmp(ext, "GL_ARB_texture_compression_bptc") == 0)
+      gfx_texture_formats |= (1<<GFX_TEX_FORMAT_BC7);
+  }
+}
+
+/*
+ * This can be called from any thread after init_gfx().
+ */
+int gfx_texture_format_is_supported(int format)
+{
+  return (gfx_texture_formats & (1u<<format)) != 0;
+}
+
+size_t gfx_get_texture_level_size(int format, int width, int height)
+{
+  size_t blocks = (size_t) ((width + 3) / 4) * ((height + 3) / 4);
+  switch (format) {
+  case GFX_TEX_FORMAT_RGB:  return (size_t) width * height * 3;
+  case GFX_TEX_FORMAT_RGBA: return (size_t) width * height * 4;
+  case GFX_TEX_FORMAT_BC1:  return blocks * 8;
+  case GFX_TEX_FORMAT_BC3:  return blocks * 16;
+  case GFX_TEX_FORMAT_BC7:  return blocks * 16;
+  }
+  return 0;
+}
+
 void init_gfx(void)
 {
+  detect_texture_formats();
+
   for (int i = 0; i < NUM_GFX_MESHES-1; i++)
     gfx_meshes[i].next = &gfx_meshes[i+1];
   gfx_meshes[NUM_GFX_MESHES-1].next = NULL;
@@ -39,11 +98,59 @@ void init_gfx(void)
   gfx_textures[NUM_GFX_TEXTURES-1].next = NULL;
   gfx_texture_free_list = &gfx_textures[0];
   gfx_texture_used_list = NULL;
+  for (int i = 0; i < NUM_GFX_TEXTURE_BUCKETS; i++)
+    gfx_texture_buckets[i] = NULL;
+}
+
+static struct GFX_TEXTURE **gfx_texture_bucket(uint64_t key)
+{
+  return &gfx_texture_buckets[(key ^ (key >> 32)) % NUM_GFX_TEXTURE_BUCKETS];
+}
+
+/*
+ * Return a new reference to the texture with the given key, or NULL
+ * if there's none.  The texture may still be loading.
+ */
+struct GFX_TEXTURE *gfx_find_texture(uint64_t key)
+{
+  if (key == 0)
+    return NULL;
+  for (struct GFX_TEXTURE *tex = *gfx_texture_bucket(key); tex != NULL; tex = tex->hash_next) {
+    if (tex->key == key) {
+      tex->use_count++;
+      return tex;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Make the texture findable by key (or not, if the key is 0) until
+ * it's freed.
+ */
+void gfx_set_texture_key(struct GFX_TEXTURE *tex, uint64_t key)
+{
+  if (tex->key != 0) {
+    struct GFX_TEXTURE **p = gfx_texture_bucket(tex->key);
+    while (*p && *p != tex)
+      p = &(*p)->hash_next;
+    if (*p)
+      *p = tex->hash_next;
+  }
+  tex->key = key;
+  tex->hash_next = NULL;
+  if (key != 0) {
+    struct GFX_TEXTURE **bucket = gfx_texture_bucket(key);
+    tex->hash_next = *bucket;
+    *bucket = tex;
+  }
 }
 
 static void gfx_free_texture(struct GFX_TEXTURE *tex)
 {
-  glDeleteTextures(1, &tex->id);
+  if (tex->flags & GFX_TEX_FLAG_CREATED)
+    gfx_queue_delete_texture(tex->id);
+  gfx_set_texture_key(tex, 0);
   tex->use_count = 0;
 
   // remove from used list
@@ -72,6 +179,9 @@ struct GFX_TEXTURE *gfx_alloc_texture(void)
   
   tex->use_count = 1;
   tex->flags = 0;
+  tex->key = 0;
+  tex->size = 0;
+  tex->hash_next = NULL;
   return tex;
 }
 
@@ -84,14 +194,17 @@ void gfx_release_texture(struct GFX_TEXTURE *tex)
 
 static void gfx_unload_mesh(struct GFX_MESH *mesh)
 {
-  GL_CHECK(glDeleteVertexArrays(1, &mesh->vtx_array_obj));
-  GL_CHECK(glDeleteBuffers(1, &mesh->vtx_buf_obj));
-  GL_CHECK(glDeleteBuffers(1, &mesh->index_buf_obj));
+  if (mesh->vtx_array_obj != 0)
+    gfx_queue_delete_vertex_array(mesh->vtx_array_obj);
+  gfx_queue_delete_buffer(mesh->vtx_buf_obj);
+  gfx_queue_delete_buffer(mesh->index_buf_obj);
 
   if (mesh->texture)
     gfx_release_texture(mesh->texture);
 
   mesh->use_count = 0;
+  mesh->flags = 0;
+  mesh->upload_serial = 0;
 }
 
 void gfx_free_mesh(struct GFX_MESH *mesh)
@@ -149,10 +262,13 @@ static struct GFX_MESH *gfx_alloc_mesh(void)
   gfx_mesh_used_list = mesh;
 
   mesh->use_count = 1;
+  mesh->flags = 0;
+  mesh->upload_serial = 0;
+  mesh->vtx_array_obj = 0;
   return mesh;
 }
 
-struct GFX_MESH *gfx_upload_model_mesh(struct MODEL_MESH *mesh, uint32_t type, uint32_t info, void *data)
+static struct GFX_MESH *alloc_model_mesh(struct MODEL_MESH *mesh, uint32_t type, uint32_t info, void *data)
 {
   struct GFX_MESH *gfx = gfx_alloc_mesh();
   if (! gfx)
@@ -162,10 +278,25 @@ struct GFX_MESH *gfx_upload_model_mesh(struct MODEL_MESH *mesh, uint32_t type, u
   gfx->data = data;
   gfx->texture = NULL;
 
-  debug_log("-> uploading mesh %d with (type=%u, info=%u)\n", (int) (gfx - gfx_meshes), type, info);
+  mat4_copy(gfx->matrix, mesh->matrix);
+  get_model_mesh_bound(mesh, gfx->bound);
+  
+  gfx->index_count = mesh->ind_count;
+  switch (mesh->ind_type) {
+  case MODEL_MESH_IND_U8:  gfx->index_type = GL_UNSIGNED_BYTE; break;
+  case MODEL_MESH_IND_U16: gfx->index_type = GL_UNSIGNED_SHORT; break;
+  case MODEL_MESH_IND_U32: gfx->index_type = GL_UNSIGNED_INT; break;
+  }
+  return gfx;
+}
 
-  GL_CHECK(glGenVertexArrays(1, &gfx->vtx_array_obj));
-  GL_CHECK(glBindVertexArray(gfx->vtx_array_obj));
+struct GFX_MESH *gfx_upload_model_mesh(struct MODEL_MESH *mesh, uint32_t type, uint32_t info, void *data)
+{
+  struct GFX_MESH *gfx = alloc_model_mesh(mesh, type, info, data);
+  if (! gfx)
+    return NULL;
+
+  debug_log("-> uploading mesh %d with (type=%u, info=%u)\n", (int) (gfx - gfx_meshes), type, info);
 
   //dump_vtx_buffer(mesh->vtx, mesh->vtx_size);
   
@@ -174,20 +305,51 @@ struct GFX_MESH *gfx_upload_model_mesh(struct MODEL_MESH *mesh, uint32_t type, u
   GL_CHECK(glBufferData(GL_ARRAY_BUFFER, mesh->vtx_size, mesh->vtx, GL_STATIC_DRAW));
   
   GL_CHECK(glGenBuffers(1, &gfx->index_buf_obj));
+  GL_CHECK(glBindBuffer(GL_ARRAY_BUFFER, gfx->index_buf_obj));
+  GL_CHECK(glBufferData(GL_ARRAY_BUFFER, mesh->ind_size, mesh->ind, GL_STATIC_DRAW));
+
+  gfx_setup_mesh_vertex_array(gfx, mesh->vtx_type);
+  gfx->flags |= GFX_MESH_FLAG_READY;
+  return gfx;
+}
+
+/*
+ * Like gfx_upload_model_mesh(), but the buffer data is sent by the GL
+ * upload thread if it's running.  The mesh is not ready for rendering
+ * until the upload is done, and the vertex and index data must stay
+ * valid until then.
+ */
+struct GFX_MESH *gfx_upload_model_mesh_async(struct MODEL_MESH *mesh, uint32_t type, uint32_t info, void *data)
+{
+  if (! gfx_queue_has_upload_thread())
+    return gfx_upload_model_mesh(mesh, type, info, data);
+
+  struct GFX_MESH *gfx = alloc_model_mesh(mesh, type, info, data);
+  if (! gfx)
+    return NULL;
+
+  debug_log("-> queueing mesh %d with (type=%u, info=%u)\n", (int) (gfx - gfx_meshes), type, info);
+
+  // buffer names are shared between contexts, so we create them here
+  GL_CHECK(glGenBuffers(1, &gfx->vtx_buf_obj));
+  GL_CHECK(glGenBuffers(1, &gfx->index_buf_obj));
+  gfx_queue_mesh_upload(gfx, mesh->vtx_type, mesh->vtx, mesh->vtx_size, mesh->ind, mesh->ind_size);
+  return gfx;
+}
+
+/*
+ * Create the mesh's vertex array object.  VAOs are not shared between
+ * contexts, so this must always run on the render thread.
+ */
+void gfx_setup_mesh_vertex_array(struct GFX_MESH *gfx, uint32_t vtx_type)
+{
+  GL_CHECK(glGenVertexArrays(1, &gfx->vtx_array_obj));
+  GL_CHECK(glBindVertexArray(gfx->vtx_array_obj));
+  GL_CHECK(glBindBuffer(GL_ARRAY_BUFFER, gfx->vtx_buf_obj));
   GL_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gfx->index_buf_obj));
-  GL_CHECK(glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->ind_size, mesh->ind, GL_STATIC_DRAW));
 
-  mat4_copy(gfx->matrix, mesh->matrix);
-  
-  gfx->index_count = mesh->ind_count;
-  switch (mesh->ind_type) {
-  case MODEL_MESH_IND_U8:  gfx->index_type = GL_UNSIGNED_BYTE; break;
-  case MODEL_MESH_IND_U16: gfx->index_type = GL_UNSIGNED_SHORT; break;
-  case MODEL_MESH_IND_U32: gfx->index_type = GL_UNSIGNED_INT; break;
-  }
-  
   // TODO: handle *_SKEL types properly
-  switch (mesh->vtx_type) {
+  switch (vtx_type) {
   case MODEL_MESH_VTX_POS:
     GL_CHECK(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float)*3, (void *) 0));
     GL_CHECK(glEnableVertexAttribArray(0));
@@ -267,10 +429,9 @@ struct GFX_MESH *gfx_upload_model_mesh(struct MODEL_MESH *mesh, uint32_t type, u
     break;
 
   default:
-    console("** WARNING: unsupported vertex type: %d\n", mesh->vtx_type);
+    console("** WARNING: unsupported vertex type: %d\n", vtx_type);
     break;
   }    
-  return gfx;
 }
 
 void gfx_update_texture(struct GFX_TEXTURE *gfx, int xoff, int yoff, int width, int height, void *data, int n_chan)
@@ -282,11 +443,27 @@ void gfx_update_texture(struct GFX_TEXTURE *gfx, int xoff, int yoff, int width,
     GL_CHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, xoff, yoff, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data));
 }
 
-void gfx_upload_model_texture(struct GFX_TEXTURE *gfx, struct MODEL_TEXTURE *texture, unsigned int flags)
+/*
+ * Create the GL texture object and its level 0 image.  If data is NULL
+ * the storage is allocated but left undefined, to be filled later with
+ * gfx_update_texture() or from a pixel buffer object.
+ */
+void gfx_create_texture(struct GFX_TEXTURE *gfx, int width, int height, int n_chan, void *data, unsigned int flags)
 {
   GL_CHECK(glGenTextures(1, &gfx->id));
-  debug_log("-> uploading texture id %d\n", gfx->id);
-  GL_CHECK(glBindTexture(GL_TEXTURE_2D, gfx->id));
+  debug_log("-> creating texture id %d\n", gfx->id);
+  gfx_set_texture_image(gfx->id, width, height, n_chan, data, flags);
+  gfx->flags |= GFX_TEX_FLAG_CREATED;
+}
+
+/*
+ * Bind an existing texture object and set its parameters.  This and
+ * the other functions that only take the texture id don't touch the
+ * GFX_TEXTURE, so the GL upload thread can use them.
+ */
+void gfx_set_texture_params(GLuint id, int n_levels, unsigned int flags)
+{
+  GL_CHECK(glBindTexture(GL_TEXTURE_2D, id));
 
   if (flags & GFX_TEX_UPLOAD_FLAG_NO_REPEAT) {
     GL_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
@@ -304,15 +481,103 @@ void gfx_upload_model_texture(struct GFX_TEXTURE *gfx, struct MODEL_TEXTURE *tex
     GL_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
   }
 
-  if (texture->n_chan == 3)
-    GL_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,  texture->width, texture->height, 0, GL_RGB,  GL_UNSIGNED_BYTE, texture->data));
-  else
-    GL_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture->width, texture->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texture->data));
+  // a precomputed mip chain may stop before 1x1
+  if (n_levels > 1)
+    GL_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, n_levels - 1));
+}
+
+/*
+ * Bytes of GPU memory used by a texture with the given levels,
+ * including the levels that will be generated when only level 0 is
+ * given.
+ */
+size_t gfx_get_texture_gpu_size(int format, int width, int height, int n_levels, unsigned int flags)
+{
+  if (n_levels == 1 && format < GFX_TEX_FORMAT_BC1 && (flags & GFX_TEX_UPLOAD_FLAG_NO_MIPMAP) == 0)
+    n_levels = 0;  // generated down to 1x1
+
+  size_t size = 0;
+  for (int level = 0; n_levels == 0 || level < n_levels; level++) {
+    int level_width = (width >> level > 0) ? width >> level : 1;
+    int level_height = (height >> level > 0) ? height >> level : 1;
+    size += gfx_get_texture_level_size(format, level_width, level_height);
+    if (level_width == 1 && level_height == 1)
+      break;
+  }
+  return size;
+}
+
+/*
+ * Set one level of the bound texture.
+ */
+void gfx_set_texture_level(int format, int level, int width, int height, const void *data)
+{
+  switch (format) {
+  case GFX_TEX_FORMAT_RGB:
+    GL_CHECK(glTexImage2D(GL_TEXTURE_2D, level, GL_RGB,  width, height, 0, GL_RGB,  GL_UNSIGNED_BYTE, data));
+    break;
+
+  case GFX_TEX_FORMAT_RGBA:
+    GL_CHECK(glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data));
+    break;
+
+  case GFX_TEX_FORMAT_BC1:
+  case GFX_TEX_FORMAT_BC3:
+  case GFX_TEX_FORMAT_BC7:
+    {
+      GLenum internal_format = ((format == GFX_TEX_FORMAT_BC1) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT :
+                                (format == GFX_TEX_FORMAT_BC3) ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT :
+                                GL_COMPRESSED_RGBA_BPTC_UNORM);
+      GLsizei size = gfx_get_texture_level_size(format, width, height);
+      GL_CHECK(glCompressedTexImage2D(GL_TEXTURE_2D, level, internal_format, width, height, 0, size, data));
+    }
+    break;
+  }
+}
+
+/*
+ * Set the parameters and level 0 image of an existing texture object.
+ */
+void gfx_set_texture_image(GLuint id, int width, int height, int n_chan, void *data, unsigned int flags)
+{
+  gfx_set_texture_params(id, 1, flags);
+  gfx_set_texture_level((n_chan == 3) ? GFX_TEX_FORMAT_RGB : GFX_TEX_FORMAT_RGBA, 0, width, height, data);
+}
+
+/*
+ * Set the parameters and all levels of an existing texture object.
+ * The levels are stored one after the other in data.  If there's
+ * only level 0, the other levels are generated (unless the format is
+ * compressed or mipmaps are disabled).
+ */
+void gfx_set_texture_levels(GLuint id, int format, int width, int height, int n_levels, const void *data, unsigned int flags)
+{
+  if (n_levels == 1 && format >= GFX_TEX_FORMAT_BC1)
+    flags |= GFX_TEX_UPLOAD_FLAG_NO_MIPMAP;
+  gfx_set_texture_params(id, n_levels, flags);
+
+  const unsigned char *level_data = data;
+  for (int level = 0; level < n_levels; level++) {
+    int level_width = (width >> level > 0) ? width >> level : 1;
+    int level_height = (height >> level > 0) ? height >> level : 1;
+    gfx_set_texture_level(format, level, level_width, level_height, level_data);
+    level_data += gfx_get_texture_level_size(format, level_width, level_height);
+  }
+
+  if (n_levels == 1 && (flags & GFX_TEX_UPLOAD_FLAG_NO_MIPMAP) == 0)
+    GL_CHECK(glGenerateMipmap(GL_TEXTURE_2D));
+}
+
+void gfx_upload_model_texture(struct GFX_TEXTURE *gfx, struct MODEL_TEXTURE *texture, unsigned int flags)
+{
+  gfx_create_texture(gfx, texture->width, texture->height, texture->n_chan, texture->data, flags);
+  gfx->size = gfx_get_texture_gpu_size((texture->n_chan == 3) ? GFX_TEX_FORMAT_RGB : GFX_TEX_FORMAT_RGBA,
+                                       texture->width, texture->height, 1, flags);
 
   if ((flags & GFX_TEX_UPLOAD_FLAG_NO_MIPMAP) == 0)
     GL_CHECK(glGenerateMipmap(GL_TEXTURE_2D));
 
-  gfx->flags = GFX_TEX_FLAG_LOADED;
+  gfx->flags |= GFX_TEX_FLAG_LOADED;
 }
 
 int gfx_upload_model(struct MODEL *model, uint32_t type, uint32_t info, void *data)
@@ -7,27 +7,42 @@
 
 #define NUM_GFX_MESHES   1024
 #define NUM_GFX_TEXTURES 1024
+#define NUM_GFX_TEXTURE_BUCKETS 256
 
 #define GFX_TEX_UPLOAD_FLAG_NO_REPEAT  (1<<0)
 #define GFX_TEX_UPLOAD_FLAG_NO_FILTER  (1<<1)
 #define GFX_TEX_UPLOAD_FLAG_NO_MIPMAP  (1<<2)
 
+#define GFX_TEX_FORMAT_RGB      0   // 3 bytes per pixel
+#define GFX_TEX_FORMAT_RGBA     1   // 4 bytes per pixel
+#define GFX_TEX_FORMAT_BC1      2   // 8 bytes per 4x4 block
+#define GFX_TEX_FORMAT_BC3      3   // 16 bytes per 4x4 block
+#define GFX_TEX_FORMAT_BC7      4   // 16 bytes per 4x4 block
+
 #define GFX_MESH_TYPE_STATIC   0
 #define GFX_MESH_TYPE_ROOM     1
 #define GFX_MESH_TYPE_CREATURE 2
 
-#define GFX_TEX_FLAG_LOADED      (1<<0)
+#define GFX_TEX_FLAG_LOADED      (1<<0)   // ready to be used for rendering
+#define GFX_TEX_FLAG_CREATED     (1<<1)   // has a GL texture object
+
+#define GFX_MESH_FLAG_READY      (1<<0)   // ready to be used for rendering
 
 struct GFX_TEXTURE {
   struct GFX_TEXTURE *next;
+  struct GFX_TEXTURE *hash_next;
   int use_count;
   unsigned int flags;
+  uint64_t key;              // identifies the texture contents for gfx_find_texture(), 0 if none
+  size_t size;               // bytes of GPU memory, 0 until the upload is queued
   GLuint id;
 };
 
 struct GFX_MESH {
   struct GFX_MESH *next;
   int use_count;
+  unsigned int flags;
+  uint32_t upload_serial;   // identifies the pending upload thread job, if any
   GLuint vtx_array_obj;
   GLuint vtx_buf_obj;
   GLuint index_buf_obj;
@@ -36,6 +51,7 @@ struct GFX_MESH {
   uint32_t index_count;
   uint32_t index_type;
   float matrix[16];
+  float bound[4];           // bounding sphere (x, y, z, radius) of the vertices, before the matrix
   
   uint32_t type;
   uint32_t info;
@@ -55,7 +71,19 @@ void init_gfx(void);
 struct GFX_MESH *gfx_upload_font(struct FONT *font);
 struct GFX_MESH *gfx_upload_grid_tiles(struct GRID_TILES *tiles);
 struct GFX_MESH *gfx_upload_model_mesh(struct MODEL_MESH *mesh, uint32_t type, uint32_t info, void *data);
+struct GFX_MESH *gfx_upload_model_mesh_async(struct MODEL_MESH *mesh, uint32_t type, uint32_t info, void *data);
+void gfx_setup_mesh_vertex_array(struct GFX_MESH *gfx, uint32_t vtx_type);
 struct GFX_TEXTURE *gfx_alloc_texture(void);
+struct GFX_TEXTURE *gfx_find_texture(uint64_t key);
+void gfx_set_texture_key(struct GFX_TEXTURE *tex, uint64_t key);
+void gfx_create_texture(struct GFX_TEXTURE *tex, int width, int height, int n_chan, void *data, unsigned int flags);
+void gfx_set_texture_image(GLuint id, int width, int height, int n_chan, void *data, unsigned int flags);
+int gfx_texture_format_is_supported(int format);
+size_t gfx_get_texture_level_size(int format, int width, int height);
+size_t gfx_get_texture_gpu_size(int format, int width, int height, int n_levels, unsigned int flags);
+void gfx_set_texture_params(GLuint id, int n_levels, unsigned int flags);
+void gfx_set_texture_level(int format, int level, int width, int height, const void *data);
+void gfx_set_texture_levels(GLuint id, int format, int width, int height, int n_levels, const void *data, unsigned int flags);
 void gfx_upload_model_texture(struct GFX_TEXTURE *tex, struct MODEL_TEXTURE *model_tex, unsigned int flags);
 void gfx_update_texture(struct GFX_TEXTURE *tex, int xoff, int yoff, int width, int height, void *data, int n_chan);
 int gfx_upload_model(struct MODEL *model, uint32_t type, uint32_t info, void *data);
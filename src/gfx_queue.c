@@ -0,0 +1,651 @@
+/* gfx_queue.c */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "gfx_queue.h"
+#include "gfx.h"
+#include "debug.h"
+#include "gl_error.h"
+#include "queue.h"
+#include "thread.h"
+
+#define UPLOAD_STATE_CREATE  0
+#define UPLOAD_STATE_STREAM  1
+#define UPLOAD_STATE_MIPMAP  2
+#define UPLOAD_STATE_LEVELS  3
+#define UPLOAD_STATE_DONE    4
+
+struct GFX_UPLOAD_JOB {
+  struct GFX_TEXTURE *tex;
+  int format;
+  int width;
+  int height;
+  int n_chan;       // for uncompressed formats
+  int n_levels;
+  unsigned int flags;
+  unsigned char *data;
+  int state;
+  int next_row;
+  int next_level;
+  size_t next_level_pos;
+};
+
+struct GFX_DELETE_LIST {
+  int n_ids;
+  GLuint ids[GFX_QUEUE_MAX_DELETES];
+};
+
+#define THREAD_JOB_TEXTURE  0
+#define THREAD_JOB_MESH     1
+#define THREAD_JOB_DELETE   2
+#define THREAD_JOB_QUIT     3
+#define THREAD_JOB_FREE     4
+
+/*
+ * Job for the upload thread.  The same struct is sent back when the
+ * job is done, with the fence the render thread must wait for before
+ * using the uploaded objects.
+ */
+struct GFX_THREAD_JOB {
+  int type;
+  GLsync fence;
+  union {
+    struct {
+      struct GFX_TEXTURE *tex;
+      GLuint id;
+      int format;
+      int width;
+      int height;
+      int n_levels;
+      unsigned int flags;
+      void *data;
+    } texture;
+    struct {
+      struct GFX_MESH *mesh;
+      uint32_t serial;
+      uint32_t vtx_type;
+      GLuint vtx_buf_obj;
+      GLuint index_buf_obj;
+      const void *vtx;
+      const void *ind;
+      size_t vtx_size;
+      size_t ind_size;
+    } mesh;
+    struct {
+      int n_textures;
+      int n_buffers;
+      GLuint *ids;   // textures followed by buffers
+    } del;
+    struct {
+      void (*func)(void *data);
+      void *data;
+    } free;
+  } data;
+};
+
+struct GFX_UPLOAD_THREAD {
+  GLFWwindow *window;
+  struct THREAD *thread;
+  struct CHANNEL *job_chan;
+  struct CHANNEL *done_chan;
+  int n_in_flight;
+  uint32_t next_serial;
+  int stopped;               // joined, only finished jobs are left
+};
+
+static struct QUEUE upload_queue;
+static struct GFX_UPLOAD_JOB cur_upload;
+static int has_cur_upload;
+static GLuint stream_pbo;
+
+static struct GFX_DELETE_LIST del_textures;
+static struct GFX_DELETE_LIST del_buffers;
+static struct GFX_DELETE_LIST del_vertex_arrays;
+
+static GLFWwindow *upload_window;
+static struct GFX_UPLOAD_THREAD *upload_thread;
+static struct GFX_THREAD_JOB pending_done;   // received from the upload thread, waiting for its fence
+static int has_pending_done;
+
+/* ========================================================================================
+ * Upload thread
+ */
+
+static void run_thread_job(struct GFX_THREAD_JOB *job)
+{
+  switch (job->type) {
+  case THREAD_JOB_TEXTURE:
+    gfx_set_texture_levels(job->data.texture.id, job->data.texture.format, job->data.texture.width, job->data.texture.height,
+                           job->data.texture.n_levels, job->data.texture.data, job->data.texture.flags);
+    free(job->data.texture.data);
+    job->data.texture.data = NULL;
+    break;
+
+  case THREAD_JOB_MESH:
+    // there's no VAO here, so use a binding point that doesn't need one
+    GL_CHECK(glBindBuffer(GL_COPY_WRITE_BUFFER, job->data.mesh.vtx_buf_obj));
+    GL_CHECK(glBufferData(GL_COPY_WRITE_BUFFER, job->data.mesh.vtx_size, job->data.mesh.vtx, GL_STATIC_DRAW));
+    GL_CHECK(glBindBuffer(GL_COPY_WRITE_BUFFER, job->data.mesh.index_buf_obj));
+    GL_CHECK(glBufferData(GL_COPY_WRITE_BUFFER, job->data.mesh.ind_size, job->data.mesh.ind, GL_STATIC_DRAW));
+    GL_CHECK(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+    break;
+
+  case THREAD_JOB_DELETE:
+    if (job->data.del.n_textures > 0)
+      GL_CHECK(glDeleteTextures(job->data.del.n_textures, job->data.del.ids));
+    if (job->data.del.n_buffers > 0)
+      GL_CHECK(glDeleteBuffers(job->data.del.n_buffers, job->data.del.ids + job->data.del.n_textures));
+    free(job->data.del.ids);
+    job->data.del.ids = NULL;
+    break;
+
+  case THREAD_JOB_FREE:
+    job->data.free.func(job->data.free.data);
+    break;
+  }
+}
+
+static void upload_thread_main(void *data)
+{
+  struct GFX_UPLOAD_THREAD *ut = data;
+
+  glfwMakeContextCurrent(ut->window);
+  while (1) {
+    struct GFX_THREAD_JOB job;
+    chan_recv(ut->job_chan, &job, 1);
+    if (job.type == THREAD_JOB_QUIT)
+      break;
+    run_thread_job(&job);
+    job.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    chan_send(ut->done_chan, &job);
+  }
+  glfwMakeContextCurrent(NULL);
+}
+
+/*
+ * Publish the objects of a finished job to the render thread.
+ */
+static void finish_thread_job(struct GFX_THREAD_JOB *job)
+{
+  switch (job->type) {
+  case THREAD_JOB_TEXTURE:
+    job->data.texture.tex->flags |= GFX_TEX_FLAG_LOADED;
+    gfx_release_texture(job->data.texture.tex);
+    break;
+
+  case THREAD_JOB_MESH:
+    {
+      // the mesh may have been freed (and even reused) while it was being uploaded
+      struct GFX_MESH *mesh = job->data.mesh.mesh;
+      if (mesh->use_count > 0 && mesh->upload_serial == job->data.mesh.serial) {
+        gfx_setup_mesh_vertex_array(mesh, job->data.mesh.vtx_type);
+        mesh->upload_serial = 0;
+        mesh->flags |= GFX_MESH_FLAG_READY;
+      }
+    }
+    break;
+  }
+}
+
+/*
+ * Receive a finished job and, if its fence has signaled, publish its
+ * objects.  Returns 0 if a job was finished.
+ */
+static int poll_thread_job(int block)
+{
+  if (! has_pending_done) {
+    if (chan_recv(upload_thread->done_chan, &pending_done, block) != 0)
+      return 1;
+    has_pending_done = 1;
+  }
+
+  while (1) {
+    GLenum status = glClientWaitSync(pending_done.fence, 0, block ? 1000000000 : 0);
+    if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+      break;
+    if (status == GL_WAIT_FAILED) {
+      debug("** ERROR: can't wait for GL upload fence\n");
+      break;
+    }
+    if (! block)
+      return 1;
+  }
+  glDeleteSync(pending_done.fence);
+
+  // finishing the job may queue more work, so clear our state first
+  struct GFX_THREAD_JOB job = pending_done;
+  has_pending_done = 0;
+  upload_thread->n_in_flight--;
+  finish_thread_job(&job);
+  return 0;
+}
+
+static void send_thread_job(struct GFX_THREAD_JOB *job)
+{
+  // keep the number of jobs in flight under the capacity of the channels
+  while (upload_thread->n_in_flight >= GFX_QUEUE_MAX_THREAD_JOBS)
+    poll_thread_job(1);
+  upload_thread->n_in_flight++;
+  chan_send(upload_thread->job_chan, job);
+}
+
+static int start_upload_thread(void)
+{
+  upload_thread = malloc(sizeof *upload_thread);
+  if (! upload_thread)
+    return 1;
+  upload_thread->window = upload_window;
+  upload_thread->n_in_flight = 0;
+  upload_thread->next_serial = 1;
+  upload_thread->stopped = 0;
+  has_pending_done = 0;
+
+  upload_thread->job_chan = new_chan(GFX_QUEUE_MAX_THREAD_JOBS, sizeof(struct GFX_THREAD_JOB), 0);
+  upload_thread->done_chan = new_chan(GFX_QUEUE_MAX_THREAD_JOBS, sizeof(struct GFX_THREAD_JOB),
+                                      CHAN_FLAG_LOCK_FREE | CHAN_FLAG_SINGLE_PRODUCER | CHAN_FLAG_SINGLE_CONSUMER);
+  if (! upload_thread->job_chan || ! upload_thread->done_chan)
+    goto err;
+
+  upload_thread->thread = start_thread(upload_thread_main, upload_thread);
+  if (! upload_thread->thread)
+    goto err;
+  return 0;
+
+ err:
+  if (upload_thread->job_chan)
+    free_chan(upload_thread->job_chan);
+  if (upload_thread->done_chan)
+    free_chan(upload_thread->done_chan);
+  free(upload_thread);
+  upload_thread = NULL;
+  return 1;
+}
+
+static void stop_upload_thread(void)
+{
+  struct GFX_THREAD_JOB job;
+  job.type = THREAD_JOB_QUIT;
+  chan_send(upload_thread->job_chan, &job);
+  join_thread(upload_thread->thread);
+
+  // finishing the jobs the thread ran may release objects: their
+  // deletes stay in the lists for close_gfx_queue() to run here
+  upload_thread->stopped = 1;
+  while (upload_thread->n_in_flight > 0)
+    poll_thread_job(1);
+
+  free_chan(upload_thread->job_chan);
+  free_chan(upload_thread->done_chan);
+  free(upload_thread);
+  upload_thread = NULL;
+}
+
+void gfx_queue_set_upload_window(GLFWwindow *window)
+{
+  upload_window = window;
+}
+
+int gfx_queue_has_upload_thread(void)
+{
+  return upload_thread != NULL;
+}
+
+/* ======================================================================================== */
+
+int init_gfx_queue(void)
+{
+  if (new_queue(&upload_queue, GFX_QUEUE_MAX_UPLOADS, sizeof(struct GFX_UPLOAD_JOB)) != 0) {
+    debug("** ERROR: out of memory for GFX upload queue\n");
+    return 1;
+  }
+  has_cur_upload = 0;
+  del_textures.n_ids = 0;
+  del_buffers.n_ids = 0;
+  del_vertex_arrays.n_ids = 0;
+  GL_CHECK(glGenBuffers(1, &stream_pbo));
+
+  if (upload_window) {
+    if (start_upload_thread() != 0)
+      debug("** WARNING: can't start GL upload thread, uploading on the main thread\n");
+    else
+      debug("- GL upload thread started\n");
+  }
+  return 0;
+}
+
+/*
+ * Objects created by the upload thread are deleted by it too, so the
+ * deletion is ordered after any upload still pending for them.
+ * Vertex arrays are not shared, so they're always deleted here.
+ */
+static int send_deletes_to_thread(void)
+{
+  int n_ids = del_textures.n_ids + del_buffers.n_ids;
+  if (n_ids == 0)
+    return 0;
+  GLuint *ids = malloc(n_ids * sizeof *ids);
+  if (! ids)
+    return 1;
+  memcpy(ids, del_textures.ids, del_textures.n_ids * sizeof *ids);
+  memcpy(ids + del_textures.n_ids, del_buffers.ids, del_buffers.n_ids * sizeof *ids);
+
+  struct GFX_THREAD_JOB job;
+  job.type = THREAD_JOB_DELETE;
+  job.data.del.n_textures = del_textures.n_ids;
+  job.data.del.n_buffers = del_buffers.n_ids;
+  job.data.del.ids = ids;
+  del_textures.n_ids = 0;
+  del_buffers.n_ids = 0;
+  send_thread_job(&job);
+  return 0;
+}
+
+static void flush_deletes(void)
+{
+  if (upload_thread && ! upload_thread->stopped && send_deletes_to_thread() != 0) {
+    // no memory to send the ids, wait for pending uploads and delete them here
+    while (upload_thread->n_in_flight > 0)
+      poll_thread_job(1);
+  }
+
+  if (del_textures.n_ids > 0)
+    GL_CHECK(glDeleteTextures(del_textures.n_ids, del_textures.ids));
+  if (del_buffers.n_ids > 0)
+    GL_CHECK(glDeleteBuffers(del_buffers.n_ids, del_buffers.ids));
+  if (del_vertex_arrays.n_ids > 0)
+    GL_CHECK(glDeleteVertexArrays(del_vertex_arrays.n_ids, del_vertex_arrays.ids));
+  del_textures.n_ids = 0;
+  del_buffers.n_ids = 0;
+  del_vertex_arrays.n_ids = 0;
+}
+
+static int has_deletes(void)
+{
+  return del_textures.n_ids > 0 || del_buffers.n_ids > 0 || del_vertex_arrays.n_ids > 0;
+}
+
+static void add_delete(struct GFX_DELETE_LIST *list, GLuint id)
+{
+  if (list->n_ids == GFX_QUEUE_MAX_DELETES)
+    flush_deletes();
+  list->ids[list->n_ids++] = id;
+}
+
+void gfx_queue_delete_texture(GLuint id)
+{
+  add_delete(&del_textures, id);
+}
+
+void gfx_queue_delete_buffer(GLuint id)
+{
+  add_delete(&del_buffers, id);
+}
+
+void gfx_queue_delete_vertex_array(GLuint id)
+{
+  add_delete(&del_vertex_arrays, id);
+}
+
+/*
+ * Queue a texture upload.  The queue takes over one reference to tex
+ * and ownership of data (which must be allocated with malloc()); both
+ * are released when the upload is done.  data holds n_levels levels
+ * of the texture, one after the other; with a single level of an
+ * uncompressed format the mipmaps are generated.
+ */
+int gfx_queue_texture_upload(struct GFX_TEXTURE *tex, int format, int width, int height, int n_levels, void *data, unsigned int flags)
+{
+  tex->size = gfx_get_texture_gpu_size(format, width, height, n_levels, flags);
+  if (upload_thread) {
+    // texture names are shared between contexts, so we create them here
+    GL_CHECK(glGenTextures(1, &tex->id));
+    tex->flags |= GFX_TEX_FLAG_CREATED;
+
+    struct GFX_THREAD_JOB job;
+    job.type = THREAD_JOB_TEXTURE;
+    job.data.texture.tex = tex;
+    job.data.texture.id = tex->id;
+    job.data.texture.format = format;
+    job.data.texture.width = width;
+    job.data.texture.height = height;
+    job.data.texture.n_levels = n_levels;
+    job.data.texture.flags = flags;
+    job.data.texture.data = data;
+    send_thread_job(&job);
+    return 0;
+  }
+
+  struct GFX_UPLOAD_JOB job;
+  job.tex = tex;
+  job.format = format;
+  job.width = width;
+  job.height = height;
+  job.n_chan = (format == GFX_TEX_FORMAT_RGB) ? 3 : 4;
+  job.n_levels = n_levels;
+  job.flags = flags;
+  job.data = data;
+  job.state = UPLOAD_STATE_CREATE;
+  job.next_row = 0;
+  job.next_level = 0;
+  job.next_level_pos = 0;
+  if (queue_add(&upload_queue, &job) != 0) {
+    debug("** ERROR: GFX upload queue is full\n");
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Send the vertex and index data of a mesh (whose buffer names must
+ * already be generated) to the upload thread.
+ */
+void gfx_queue_mesh_upload(struct GFX_MESH *mesh, uint32_t vtx_type, const void *vtx, size_t vtx_size, const void *ind, size_t ind_size)
+{
+  mesh->upload_serial = upload_thread->next_serial++;
+  if (upload_thread->next_serial == 0)
+    upload_thread->next_serial = 1;
+
+  struct GFX_THREAD_JOB job;
+  job.type = THREAD_JOB_MESH;
+  job.data.mesh.mesh = mesh;
+  job.data.mesh.serial = mesh->upload_serial;
+  job.data.mesh.vtx_type = vtx_type;
+  job.data.mesh.vtx_buf_obj = mesh->vtx_buf_obj;
+  job.data.mesh.index_buf_obj = mesh->index_buf_obj;
+  job.data.mesh.vtx = vtx;
+  job.data.mesh.vtx_size = vtx_size;
+  job.data.mesh.ind = ind;
+  job.data.mesh.ind_size = ind_size;
+  send_thread_job(&job);
+}
+
+/*
+ * Call func(data) once the uploads queued so far no longer need their
+ * source data.  Without the upload thread the uploads already
+ * happened, so it's called right away.
+ */
+void gfx_queue_free_after_uploads(void (*func)(void *data), void *data)
+{
+  if (! upload_thread) {
+    func(data);
+    return;
+  }
+
+  struct GFX_THREAD_JOB job;
+  job.type = THREAD_JOB_FREE;
+  job.data.free.func = func;
+  job.data.free.data = data;
+  send_thread_job(&job);
+}
+
+static void finish_upload(struct GFX_UPLOAD_JOB *job)
+{
+  job->tex->flags |= GFX_TEX_FLAG_LOADED;
+  gfx_release_texture(job->tex);
+  free(job->data);
+  job->state = UPLOAD_STATE_DONE;
+}
+
+/*
+ * Send the next chunk of rows of a texture through the stream PBO.
+ * Orphaning the buffer before mapping it lets the driver hand us new
+ * storage while the previous chunk is still being transferred.
+ */
+static void stream_texture_rows(struct GFX_UPLOAD_JOB *job)
+{
+  size_t row_size = (size_t) job->width * job->n_chan;
+  int n_rows = (row_size >= GFX_QUEUE_PBO_CHUNK_SIZE) ? 1 : (int) (GFX_QUEUE_PBO_CHUNK_SIZE / row_size);
+  if (n_rows > job->height - job->next_row)
+    n_rows = job->height - job->next_row;
+  size_t size = row_size * n_rows;
+  unsigned char *src = job->data + row_size * job->next_row;
+  GLenum format = (job->n_chan == 3) ? GL_RGB : GL_RGBA;
+
+  GL_CHECK(glBindTexture(GL_TEXTURE_2D, job->tex->id));
+  GL_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream_pbo));
+  GL_CHECK(glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW));
+  void *dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (dest) {
+    memcpy(dest, src, size);
+    GL_CHECK(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+    GL_CHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, job->next_row, job->width, n_rows, format, GL_UNSIGNED_BYTE, (void *) 0));
+    GL_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+  } else {
+    // can't map the PBO, send the rows straight from memory
+    GL_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    GL_CHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, job->next_row, job->width, n_rows, format, GL_UNSIGNED_BYTE, src));
+  }
+  job->next_row += n_rows;
+}
+
+/*
+ * Send the next level of a texture with precomputed levels.
+ */
+static void upload_texture_level(struct GFX_UPLOAD_JOB *job)
+{
+  int level = job->next_level;
+  int width = (job->width >> level > 0) ? job->width >> level : 1;
+  int height = (job->height >> level > 0) ? job->height >> level : 1;
+
+  GL_CHECK(glBindTexture(GL_TEXTURE_2D, job->tex->id));
+  gfx_set_texture_level(job->format, level, width, height, job->data + job->next_level_pos);
+  job->next_level_pos += gfx_get_texture_level_size(job->format, width, height);
+  job->next_level++;
+}
+
+/*
+ * Run a single step of a texture upload.  Small textures are created
+ * with their data in one go, big ones are created empty and streamed
+ * one chunk per step; mipmaps are generated in a step of their own.
+ * Compressed textures and textures with precomputed mipmaps are sent
+ * one level per step.
+ */
+static void run_upload_step(struct GFX_UPLOAD_JOB *job)
+{
+  switch (job->state) {
+  case UPLOAD_STATE_CREATE:
+    if (job->n_levels > 1 || job->format >= GFX_TEX_FORMAT_BC1) {
+      GL_CHECK(glGenTextures(1, &job->tex->id));
+      job->tex->flags |= GFX_TEX_FLAG_CREATED;
+      unsigned int flags = job->flags;
+      if (job->n_levels == 1)
+        flags |= GFX_TEX_UPLOAD_FLAG_NO_MIPMAP;
+      gfx_set_texture_params(job->tex->id, job->n_levels, flags);
+      job->state = UPLOAD_STATE_LEVELS;
+    } else if ((size_t) job->width * job->height * job->n_chan > GFX_QUEUE_PBO_MIN_SIZE) {
+      gfx_create_texture(job->tex, job->width, job->height, job->n_chan, NULL, job->flags);
+      job->state = UPLOAD_STATE_STREAM;
+    } else {
+      gfx_create_texture(job->tex, job->width, job->height, job->n_chan, job->data, job->flags);
+      job->state = UPLOAD_STATE_MIPMAP;
+    }
+    break;
+
+  case UPLOAD_STATE_STREAM:
+    stream_texture_rows(job);
+    if (job->next_row >= job->height)
+      job->state = UPLOAD_STATE_MIPMAP;
+    break;
+
+  case UPLOAD_STATE_MIPMAP:
+    if ((job->flags & GFX_TEX_UPLOAD_FLAG_NO_MIPMAP) == 0) {
+      GL_CHECK(glBindTexture(GL_TEXTURE_2D, job->tex->id));
+      GL_CHECK(glGenerateMipmap(GL_TEXTURE_2D));
+    }
+    finish_upload(job);
+    break;
+
+  case UPLOAD_STATE_LEVELS:
+    upload_texture_level(job);
+    if (job->next_level >= job->n_levels)
+      finish_upload(job);
+    break;
+  }
+}
+
+/*
+ * Run queued GPU work until the deadline (a get_monotonic_time()
+ * value) is reached.  At least one step is always run so the queue
+ * keeps moving even when the frame is already over budget.  Returns 0
+ * when the queue is empty.
+ */
+int run_gfx_queue(double deadline)
+{
+  if (upload_thread) {
+    while (poll_thread_job(0) == 0)
+      ;
+  }
+
+  if (has_deletes())
+    flush_deletes();
+
+  do {
+    if (! has_cur_upload) {
+      if (queue_remove(&upload_queue, &cur_upload) != 0)
+        return 0;
+      has_cur_upload = 1;
+    }
+    run_upload_step(&cur_upload);
+    if (cur_upload.state == UPLOAD_STATE_DONE)
+      has_cur_upload = 0;
+  } while (get_monotonic_time() < deadline);
+
+  return ! gfx_queue_is_empty();
+}
+
+int gfx_queue_is_empty(void)
+{
+  if (upload_thread && upload_thread->n_in_flight > 0)
+    return 0;
+  return ! has_cur_upload && upload_queue.num_items == 0 && ! has_deletes();
+}
+
+void close_gfx_queue(void)
+{
+  // drop pending uploads, but still delete everything the game released
+  if (has_cur_upload) {
+    gfx_release_texture(cur_upload.tex);
+    free(cur_upload.data);
+    has_cur_upload = 0;
+  }
+  struct GFX_UPLOAD_JOB job;
+  while (queue_remove(&upload_queue, &job) == 0) {
+    gfx_release_texture(job.tex);
+    free(job.data);
+  }
+  free_queue(&upload_queue);
+
+  // finishing the last thread jobs may release more objects, so
+  // delete everything here once the upload thread is gone
+  if (upload_thread) {
+    stop_upload_thread();
+    glfwDestroyWindow(upload_window);
+    upload_window = NULL;
+  }
+  flush_deletes();
+  GL_CHECK(glDeleteBuffers(1, &stream_pbo));
+}
@@ -0,0 +1,46 @@
+/* gfx_queue.h */
+
+#ifndef GFX_QUEUE_H_FILE
+#define GFX_QUEUE_H_FILE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <glad/glad.h>
+
+#define GFX_QUEUE_FRAME_BUDGET      0.002        // seconds of GPU work per frame
+#define GFX_QUEUE_MAX_UPLOADS       1024
+#define GFX_QUEUE_MAX_DELETES       1024
+#define GFX_QUEUE_PBO_MIN_SIZE      (256*1024)   // textures bigger than this are streamed through a PBO
+#define GFX_QUEUE_PBO_CHUNK_SIZE    (256*1024)   // bytes sent per streaming step
+#define GFX_QUEUE_MAX_THREAD_JOBS   256          // jobs in flight on the upload thread
+
+struct GFX_TEXTURE;
+struct GFX_MESH;
+struct GLFWwindow;
+
+/*
+ * GPU work scheduled from the main thread.  Texture uploads and GL
+ * object deletions are queued here and executed a step at a time by
+ * run_gfx_queue() until the frame's time budget is spent.
+ *
+ * If an upload window (a hidden window whose context is shared with
+ * the main one) is set before init_gfx_queue(), texture and buffer
+ * uploads run on a separate thread owning that context instead, and
+ * run_gfx_queue() only publishes the objects whose fences signaled.
+ */
+
+void gfx_queue_set_upload_window(struct GLFWwindow *window);
+int gfx_queue_has_upload_thread(void);
+int init_gfx_queue(void);
+void close_gfx_queue(void);
+int run_gfx_queue(double deadline);
+int gfx_queue_is_empty(void);
+
+int gfx_queue_texture_upload(struct GFX_TEXTURE *tex, int format, int width, int height, int n_levels, void *data, unsigned int flags);
+void gfx_queue_mesh_upload(struct GFX_MESH *mesh, uint32_t vtx_type, const void *vtx, size_t vtx_size, const void *ind, size_t ind_size);
+void gfx_queue_free_after_uploads(void (*func)(void *data), void *data);
+void gfx_queue_delete_texture(GLuint id);
+void gfx_queue_delete_buffer(GLuint id);
+void gfx_queue_delete_vertex_array(GLuint id);
+
+#endif /* GFX_QUEUE_H_FILE */
@@ -0,0 +1,165 @@
+/* io_bench.c
+ *
+ * Measure the latency of loading BWF rooms from a cold page cache
+ * with the asset loader reading from the file mapping and with
+ * io_uring.  For each room we measure the time from the request to
+ * the reply, and the time the render thread then spends touching the
+ * room's mesh data (which includes any page faults it takes).
+ *
+ * Usage: io_bench [world.bwf [runs]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+#include "bff.h"
+#include "room.h"
+#include "asset_loader.h"
+
+struct BENCH_RESULT {
+  int n_rooms;
+  double total_latency;
+  double max_latency;
+  double total_touch;
+  double max_touch;
+};
+
+static struct ROOM bench_room;
+static volatile unsigned int touch_sum;
+
+/*
+ * Ask the kernel to drop the file from the page cache.  This only
+ * works for pages nobody has mapped, so the file must be closed.
+ */
+static void drop_file_cache(const char *filename)
+{
+#if defined(POSIX_FADV_DONTNEED)
+  int fd = open(filename, O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#endif
+}
+
+/*
+ * Read every page of the room's mesh data, like the mesh upload does.
+ */
+static void touch_room_data(struct BWF_ROOM_DATA *data)
+{
+  unsigned int sum = 0;
+  for (int i = 0; i < data->n_meshes; i++) {
+    const unsigned char *vtx = data->meshes[i].vtx;
+    const unsigned char *ind = data->meshes[i].ind;
+    for (uint32_t p = 0; p < data->meshes[i].vtx_size; p += 512)
+      sum += vtx[p];
+    for (uint32_t p = 0; p < data->meshes[i].ind_size; p += 512)
+      sum += ind[p];
+  }
+  touch_sum += sum;
+}
+
+static int load_room(struct BWF_READER *bwf, int index, struct BENCH_RESULT *result)
+{
+  bench_room.index = index;
+  bench_room.state = ROOM_STATE_REQUESTED;
+  double start_time = get_monotonic_time();
+  if (request_bwf_room(bwf, &bench_room) != 0)
+    return 1;
+
+  struct ASSET_REQUEST resp;
+  while (recv_asset_response(&resp) != 0)
+    thread_yield();
+  double reply_time = get_monotonic_time();
+  if (resp.type != ASSET_TYPE_REPLY_ROOM || ! resp.data.reply_room.data) {
+    printf("** ERROR: can't read room %d\n", index);
+    return 1;
+  }
+  touch_room_data(resp.data.reply_room.data);
+  double touch_time = get_monotonic_time();
+  free_bwf_room_data(resp.data.reply_room.data);
+  clear_room_tiles(&bench_room);
+
+  double latency = reply_time - start_time;
+  double touch = touch_time - reply_time;
+  result->n_rooms++;
+  result->total_latency += latency;
+  result->total_touch += touch;
+  if (latency > result->max_latency)
+    result->max_latency = latency;
+  if (touch > result->max_touch)
+    result->max_touch = touch;
+  return 0;
+}
+
+static int run_bench(const char *filename, int io_mode, int n_runs, struct BENCH_RESULT *result)
+{
+  result->n_rooms = 0;
+  result->total_latency = result->max_latency = 0;
+  result->total_touch = result->max_touch = 0;
+
+  set_asset_loader_io_mode(io_mode);
+  if (start_asset_loader(1) != 0)
+    return 1;
+  if (get_asset_loader_io_mode() != io_mode) {
+    stop_asset_loader();
+    return 1;
+  }
+
+  for (int run = 0; run < n_runs; run++) {
+    drop_file_cache(filename);
+    struct BWF_READER *bwf = malloc(sizeof *bwf);
+    if (! bwf || open_bwf(bwf, filename) != 0) {
+      printf("** ERROR: can't open '%s'\n", filename);
+      free(bwf);
+      stop_asset_loader();
+      return 1;
+    }
+    for (uint32_t i = 0; i < bwf->n_rooms; i++) {
+      if (load_room(bwf, i, result) != 0)
+        break;
+    }
+    close_bwf(bwf);
+    free(bwf);
+  }
+  stop_asset_loader();
+  return 0;
+}
+
+static void print_result(const char *name, struct BENCH_RESULT *result)
+{
+  if (result->n_rooms == 0)
+    return;
+  printf("%-10s %10.3f %10.3f %10.3f %10.3f\n", name,
+         1000.0 * result->total_latency / result->n_rooms, 1000.0 * result->max_latency,
+         1000.0 * result->total_touch / result->n_rooms, 1000.0 * result->max_touch);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *filename = (argc > 1) ? argv[1] : "data/world.bwf";
+  int n_runs = (argc > 2) ? atoi(argv[2]) : 20;
+
+  printf("%d runs loading every room of '%s' with a cold cache\n", n_runs, filename);
+  printf("times in ms:\n\n");
+  printf("%-10s %10s %10s %10s %10s\n", "", "avg load", "max load", "avg touch", "max touch");
+
+  if (init_room_store() != 0)
+    return 1;
+
+  struct BENCH_RESULT result;
+  if (run_bench(filename, ASSET_LOADER_IO_MMAP, n_runs, &result) == 0)
+    print_result("mmap", &result);
+  if (run_bench(filename, ASSET_LOADER_IO_URING, n_runs, &result) == 0)
+    print_result("io_uring", &result);
+  else
+    printf("%-10s not available\n", "io_uring");
+  return 0;
+}
@@ -0,0 +1,275 @@
+/* job.c */
+
+#include <stdlib.h>
+
+#include "thread.h"
+#include "debug.h"
+
+#define MAX_JOBS 4096
+
+struct JOB {
+  struct JOB *next;
+  void (*func)(void *data);
+  void (*func_range)(void *data, int start, int end);
+  void *data;
+  int start;
+  int end;
+  struct JOB_COUNTER *counter;
+};
+
+struct JOB_SYSTEM {
+  struct MUTEX *mutex;
+  struct COND_VAR *job_available;
+  struct COND_VAR *job_done;
+  int quit;
+  int n_workers;
+  struct THREAD *workers[JOB_MAX_WORKERS];
+
+  struct JOB *free_list;
+  struct JOB *queue_head;
+  struct JOB *queue_tail;
+  struct JOB jobs[MAX_JOBS];
+};
+
+static struct JOB_SYSTEM job_system;
+
+static void push_job(struct JOB *job)
+{
+  job->next = NULL;
+  if (job_system.queue_tail)
+    job_system.queue_tail->next = job;
+  else
+    job_system.queue_head = job;
+  job_system.queue_tail = job;
+}
+
+static struct JOB *pop_job(void)
+{
+  struct JOB *job = job_system.queue_head;
+  if (job) {
+    job_system.queue_head = job->next;
+    if (! job_system.queue_head)
+      job_system.queue_tail = NULL;
+  }
+  return job;
+}
+
+static void execute_job(struct JOB *job)
+{
+  if (job->func_range)
+    job->func_range(job->data, job->start, job->end);
+  else
+    job->func(job->data);
+}
+
+/*
+ * Must be called with the mutex held.
+ */
+static void finish_job(struct JOB *job)
+{
+  struct JOB_COUNTER *counter = job->counter;
+  job->next = job_system.free_list;
+  job_system.free_list = job;
+
+  if (! counter || --counter->count > 0)
+    return;
+
+  // release the jobs that were waiting for this counter
+  if (counter->waiting) {
+    struct JOB *waiting = counter->waiting;
+    counter->waiting = NULL;
+    while (waiting) {
+      struct JOB *next = waiting->next;
+      push_job(waiting);
+      waiting = next;
+    }
+    cond_var_broadcast(job_system.job_available);
+  }
+  cond_var_broadcast(job_system.job_done);
+}
+
+static void worker_main(void *data)
+{
+  mutex_lock(job_system.mutex);
+  while (1) {
+    while (! job_system.quit && ! job_system.queue_head)
+      cond_var_wait(job_system.job_available, job_system.mutex);
+    struct JOB *job = pop_job();
+    if (! job)
+      break;
+    mutex_unlock(job_system.mutex);
+    execute_job(job);
+    mutex_lock(job_system.mutex);
+    finish_job(job);
+  }
+  mutex_unlock(job_system.mutex);
+}
+
+/*
+ * Start the job system with the given number of worker threads (if
+ * n_workers < 0, one per processor minus one, since the thread
+ * waiting for the jobs also runs them).  With no workers, all jobs run
+ * inside wait_job_counter().
+ */
+int start_job_system(int n_workers)
+{
+  if (n_workers < 0) {
+    n_workers = get_num_processors() - 1;
+    if (n_workers < 0)
+      n_workers = 0;
+  }
+  if (n_workers > JOB_MAX_WORKERS)
+    n_workers = JOB_MAX_WORKERS;
+
+  job_system.quit = 0;
+  job_system.n_workers = 0;
+  job_system.queue_head = NULL;
+  job_system.queue_tail = NULL;
+  for (int i = 0; i < MAX_JOBS-1; i++)
+    job_system.jobs[i].next = &job_system.jobs[i+1];
+  job_system.jobs[MAX_JOBS-1].next = NULL;
+  job_system.free_list = &job_system.jobs[0];
+
+  job_system.mutex = new_mutex();
+  job_system.job_available = new_cond_var();
+  job_system.job_done = new_cond_var();
+  if (! job_system.mutex || ! job_system.job_available || ! job_system.job_done) {
+    debug("** ERROR: can't create job system mutex\n");
+    goto err;
+  }
+
+  for (int i = 0; i < n_workers; i++) {
+    job_system.workers[i] = start_thread(worker_main, NULL);
+    if (! job_system.workers[i]) {
+      debug("** ERROR: can't start job worker thread\n");
+      goto err;
+    }
+    job_system.n_workers++;
+  }
+  return 0;
+
+ err:
+  stop_job_system();
+  return 1;
+}
+
+void stop_job_system(void)
+{
+  if (job_system.mutex) {
+    mutex_lock(job_system.mutex);
+    job_system.quit = 1;
+    cond_var_broadcast(job_system.job_available);
+    mutex_unlock(job_system.mutex);
+  }
+  for (int i = 0; i < job_system.n_workers; i++)
+    join_thread(job_system.workers[i]);
+  job_system.n_workers = 0;
+
+  if (job_system.job_done)
+    free_cond_var(job_system.job_done);
+  if (job_system.job_available)
+    free_cond_var(job_system.job_available);
+  if (job_system.mutex)
+    free_mutex(job_system.mutex);
+  job_system.job_done = NULL;
+  job_system.job_available = NULL;
+  job_system.mutex = NULL;
+}
+
+int get_job_system_workers(void)
+{
+  return job_system.n_workers;
+}
+
+void init_job_counter(struct JOB_COUNTER *counter)
+{
+  counter->count = 0;
+  counter->waiting = NULL;
+}
+
+static void submit_job(void (*func)(void *data), void (*func_range)(void *data, int start, int end), void *data,
+                       int start, int end, struct JOB_COUNTER *after, struct JOB_COUNTER *counter)
+{
+  mutex_lock(job_system.mutex);
+  struct JOB *job = job_system.free_list;
+  if (! job) {
+    // out of jobs: run it here
+    mutex_unlock(job_system.mutex);
+    if (after)
+      wait_job_counter(after);
+    if (func_range)
+      func_range(data, start, end);
+    else
+      func(data);
+    return;
+  }
+  job_system.free_list = job->next;
+
+  job->func = func;
+  job->func_range = func_range;
+  job->data = data;
+  job->start = start;
+  job->end = end;
+  job->counter = counter;
+  if (counter)
+    counter->count++;
+
+  if (after && after->count > 0) {
+    job->next = after->waiting;
+    after->waiting = job;
+  } else {
+    push_job(job);
+    cond_var_signal(job_system.job_available);
+  }
+  mutex_unlock(job_system.mutex);
+}
+
+/*
+ * Run func(data) in a worker after the counter 'after' (if not NULL)
+ * reaches zero.  If 'counter' is not NULL, it's incremented now and
+ * decremented when the job is done.
+ */
+void run_job(void (*func)(void *data), void *data, struct JOB_COUNTER *after, struct JOB_COUNTER *counter)
+{
+  submit_job(func, NULL, data, 0, 0, after, counter);
+}
+
+/*
+ * Split the range [0, count) in batches of batch_size items (or an
+ * automatic size if batch_size <= 0) and run func(data, start, end) on
+ * each batch as a separate job.
+ */
+void run_parallel_for(int count, int batch_size, void (*func)(void *data, int start, int end), void *data,
+                      struct JOB_COUNTER *after, struct JOB_COUNTER *counter)
+{
+  if (batch_size <= 0) {
+    // a few batches per thread so uneven batches still balance out
+    batch_size = count / (4 * (job_system.n_workers + 1));
+    if (batch_size < 1)
+      batch_size = 1;
+  }
+  for (int start = 0; start < count; start += batch_size) {
+    int end = (start + batch_size < count) ? start + batch_size : count;
+    submit_job(NULL, func, data, start, end, after, counter);
+  }
+}
+
+/*
+ * Wait until the counter reaches zero, running queued jobs meanwhile.
+ */
+void wait_job_counter(struct JOB_COUNTER *counter)
+{
+  mutex_lock(job_system.mutex);
+  while (counter->count > 0) {
+    struct JOB *job = pop_job();
+    if (job) {
+      mutex_unlock(job_system.mutex);
+      execute_job(job);
+      mutex_lock(job_system.mutex);
+      finish_job(job);
+    } else {
+      cond_var_wait(job_system.job_done, job_system.mutex);
+    }
+  }
+  mutex_unlock(job_system.mutex);
+}
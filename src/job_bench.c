@@ -0,0 +1,156 @@
+/* job_bench.c
+ *
+ * Measure the time to update the skeleton animation of N creatures
+ * using the job system with different numbers of worker threads.
+ *
+ * Usage: job_bench [max_creatures [frames]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "thread.h"
+#include "skeleton.h"
+#include "matrix.h"
+
+#define N_BONES       SKELETON_MAX_BONES
+#define N_KEYFRAMES   16
+#define ANIM_LENGTH   2.0
+
+struct BENCH_CREATURE {
+  struct SKEL_ANIMATION_STATE *anim;
+  float pos[3];
+  float theta;
+  float matrix[16];
+};
+
+static struct SKELETON skel;
+
+static int make_skeleton(void)
+{
+  if (new_skeleton(&skel, N_BONES, 1, N_BONES * N_KEYFRAMES * 2) != 0)
+    return 1;
+
+  struct SKEL_ANIMATION *anim = &skel.animations[0];
+  anim->start_time = anim->loop_start_time = 0;
+  anim->end_time = anim->loop_end_time = ANIM_LENGTH;
+
+  struct SKEL_BONE_KEYFRAME *keyframe = skel.keyframe_data;
+  for (int b = 0; b < N_BONES; b++) {
+    struct SKEL_BONE *bone = &skel.bones[b];
+    bone->parent = b - 1;
+    mat4_id(bone->inv_matrix);
+    mat4_load_translation(bone->pose_matrix, 0, 0.1, 0);
+
+    struct SKEL_BONE_ANIMATION *bone_anim = &anim->bones[b];
+    bone_anim->n_scale_keyframes = 0;
+    bone_anim->scale_keyframes = NULL;
+    bone_anim->n_trans_keyframes = N_KEYFRAMES;
+    bone_anim->trans_keyframes = keyframe;
+    for (int k = 0; k < N_KEYFRAMES; k++, keyframe++) {
+      keyframe->time = ANIM_LENGTH * k / N_KEYFRAMES;
+      keyframe->data[0] = 0;
+      keyframe->data[1] = 0.1;
+      keyframe->data[2] = 0.01 * k;
+    }
+    bone_anim->n_rot_keyframes = N_KEYFRAMES;
+    bone_anim->rot_keyframes = keyframe;
+    for (int k = 0; k < N_KEYFRAMES; k++, keyframe++) {
+      float angle = 0.1 * k;
+      keyframe->time = ANIM_LENGTH * k / N_KEYFRAMES;
+      keyframe->data[0] = sin(angle/2);
+      keyframe->data[1] = 0;
+      keyframe->data[2] = 0;
+      keyframe->data[3] = cos(angle/2);
+    }
+  }
+  return 0;
+}
+
+static void update_creature_range(void *data, int start, int end)
+{
+  struct BENCH_CREATURE *creatures = data;
+  for (int i = start; i < end; i++) {
+    struct BENCH_CREATURE *creature = &creatures[i];
+    creature->anim->time += 0.025;
+    if (creature->anim->time > ANIM_LENGTH)
+      creature->anim->time -= ANIM_LENGTH;
+    update_skeleton_animation_state(creature->anim);
+
+    mat4_load_rot_y(creature->matrix, creature->theta);
+    creature->matrix[ 3] += creature->pos[0];
+    creature->matrix[ 7] += creature->pos[1];
+    creature->matrix[11] += creature->pos[2];
+  }
+}
+
+static double run_bench(struct BENCH_CREATURE *creatures, int n_creatures, int n_frames)
+{
+  double start_time = get_monotonic_time();
+  for (int frame = 0; frame < n_frames; frame++) {
+    struct JOB_COUNTER done;
+    init_job_counter(&done);
+    run_parallel_for(n_creatures, 0, update_creature_range, creatures, NULL, &done);
+    wait_job_counter(&done);
+  }
+  return (get_monotonic_time() - start_time) / n_frames;
+}
+
+int main(int argc, char *argv[])
+{
+  int max_creatures = (argc > 1) ? atoi(argv[1]) : 4096;
+  int n_frames = (argc > 2) ? atoi(argv[2]) : 200;
+  int n_procs = get_num_processors();
+
+  if (make_skeleton() != 0) {
+    printf("** ERROR: out of memory for skeleton\n");
+    return 1;
+  }
+  struct BENCH_CREATURE *creatures = malloc(sizeof *creatures * max_creatures);
+  if (! creatures) {
+    printf("** ERROR: out of memory for creatures\n");
+    return 1;
+  }
+  for (int i = 0; i < max_creatures; i++) {
+    creatures[i].anim = new_skeleton_animation_state(&skel);
+    if (! creatures[i].anim) {
+      printf("** ERROR: out of memory for animation state\n");
+      return 1;
+    }
+    creatures[i].anim->time = ANIM_LENGTH * (i % 64) / 64;
+    creatures[i].pos[0] = i % 64;
+    creatures[i].pos[1] = 0;
+    creatures[i].pos[2] = i / 64;
+    creatures[i].theta = 0.1 * i;
+  }
+
+  int max_workers = (n_procs > 2) ? n_procs : 2;
+  printf("%d bones per skeleton, %d frames per run, %d processors\n", N_BONES, n_frames, n_procs);
+  printf("time per frame in ms:\n\n");
+
+  for (int n_workers = 0; n_workers <= max_workers; n_workers = (n_workers == 0) ? 1 : n_workers * 2) {
+    if (start_job_system(n_workers) != 0)
+      return 1;
+    if (n_workers == 0) {
+      printf("%8s", "workers");
+      for (int n_creatures = 16; n_creatures <= max_creatures; n_creatures *= 4)
+        printf(" %9d", n_creatures);
+      printf(" creatures\n");
+    }
+    printf("%8d", n_workers);
+    for (int n_creatures = 16; n_creatures <= max_creatures; n_creatures *= 4) {
+      double frame_time = run_bench(creatures, n_creatures, n_frames);
+      printf(" %9.3f", frame_time * 1000.0);
+      fflush(stdout);
+    }
+    printf("\n");
+    stop_job_system();
+  }
+
+  for (int i = 0; i < max_creatures; i++)
+    free_skeleton_animation_state(creatures[i].anim);
+  free(creatures);
+  free_skeleton(&skel);
+  return 0;
+}
@@ -0,0 +1,79 @@
+/* lz.c */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH  4
+
+/*
+ * Read a length that continues in the following bytes if its nibble
+ * is 15.  Returns 1 if it runs past the end of the input.
+ */
+static int read_lz_length(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+  if (*len != 15)
+    return 0;
+  unsigned char b;
+  do {
+    if (*p >= end)
+      return 1;
+    b = *(*p)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/*
+ * Decompress a block that must expand to exactly dest_size bytes.
+ * Corrupt input never reads or writes out of bounds, it just makes
+ * this return 1.
+ */
+int lz_decompress(const void *src, size_t src_size, void *dest, size_t dest_size)
+{
+  const unsigned char *in = src;
+  const unsigned char *in_end = in + src_size;
+  unsigned char *out = dest;
+  unsigned char *out_end = out + dest_size;
+
+  while (in < in_end) {
+    unsigned int token = *in++;
+
+    size_t n_literals = token >> 4;
+    if (read_lz_length(&in, in_end, &n_literals) != 0 ||
+        n_literals > (size_t) (in_end - in) || n_literals > (size_t) (out_end - out))
+      return 1;
+    memcpy(out, in, n_literals);
+    in += n_literals;
+    out += n_literals;
+    if (in == in_end)
+      break;
+
+    if (in_end - in < 2)
+      return 1;
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > (size_t) (out - (unsigned char *) dest))
+      return 1;
+
+    size_t match_len = token & 0xf;
+    if (read_lz_length(&in, in_end, &match_len) != 0)
+      return 1;
+    match_len += LZ_MIN_MATCH;
+    if (match_len > (size_t) (out_end - out))
+      return 1;
+
+    // the match may overlap what it's producing, so copy forward
+    const unsigned char *match = out - offset;
+    if (offset >= match_len) {
+      memcpy(out, match, match_len);
+      out += match_len;
+    } else {
+      for (size_t i = 0; i < match_len; i++)
+        *out++ = *match++;
+    }
+  }
+
+  return (out == out_end) ? 0 : 1;
+}
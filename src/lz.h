@@ -0,0 +1,19 @@
+/* lz.h */
+
+#ifndef LZ_H_FILE
+#define LZ_H_FILE
+
+#include <stddef.h>
+
+/*
+ * LZ77 block codec using the LZ4 block format: a sequence of
+ * (literals, match) pairs, each starting with a token byte whose high
+ * nibble is the literal count and low nibble the match length minus
+ * 4 (15 means more length bytes follow), then the literals, then a
+ * 16-bit little endian match offset.  The last sequence has only
+ * literals.
+ */
+
+int lz_decompress(const void *src, size_t src_size, void *dest, size_t dest_size);
+
+#endif /* LZ_H_FILE */
@@ -11,11 +11,19 @@
 #include "gamepad.h"
 #include "render.h"
 #include "game.h"
+#include "gfx_queue.h"
+#include "file.h"
 
 #define WINDOW_WIDTH   800
 #define WINDOW_HEIGHT  600
 #define WINDOW_NAME    "Game"
 
+// if this exists, data files are read from it instead of from the data directory
+#define ASSET_PACK_FILE  "assets.bpf"
+
+// upload textures and room meshes from a second GL context in its own thread
+#define USE_GL_UPLOAD_THREAD 1
+
 static GLFWwindow *window;
 static int gfx_initialized;
 
@@ -27,6 +35,7 @@ static void error_callback(int error, const char *description)
 static void reset_viewport_callback(GLFWwindow *window, int width, int height)
 {
   render_set_viewport(width, height);
+  set_game_viewport(width, height);
 }
 
 static void joystick_callback(int joy, int event)
@@ -87,6 +96,16 @@ static int init_graphics(void)
     return -1;
   }
 
+#if USE_GL_UPLOAD_THREAD
+  glfwWindowHint(GLFW_MAXIMIZED, 0);
+  glfwWindowHint(GLFW_VISIBLE, 0);
+  GLFWwindow *upload_window = glfwCreateWindow(1, 1, WINDOW_NAME, NULL, window);
+  if (upload_window)
+    gfx_queue_set_upload_window(upload_window);
+  else
+    debug("* WARNING: can't create GL upload context\n");
+#endif
+
   return 0;
 }
 
@@ -118,6 +137,8 @@ int main(void)
   int ret = 1;
 
   init_debug();
+  if (file_open_pack(ASSET_PACK_FILE) == 0)
+    debug("- Using asset pack '%s'\n", ASSET_PACK_FILE);
   if (init_graphics() != 0)
     goto err;
 
@@ -137,9 +158,10 @@ int main(void)
     glfwPollEvents();
     if (glfwWindowShouldClose(window))
       break;
-    if (process_game_step())
+    struct RENDER_SNAPSHOT *snap = process_game_frame();
+    if (! snap)
       break;
-    render_screen();
+    render_screen(snap);
     update_fps_counter();
     glfwSwapBuffers(window);
   }
@@ -150,6 +172,7 @@ int main(void)
   close_game();
   debug("- Cleaning up GFX...\n");
   cleanup_gfx();
+  file_close_pack();
 
   debug("- Terminating\n");
   return ret;
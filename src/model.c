@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 
 #include <stb_image.h>
 
@@ -35,3 +36,58 @@ struct MODEL_MESH *new_model_mesh(uint8_t vtx_type, uint32_t vtx_size, uint8_t i
   mesh->ind = (char *)mesh->data + v_size;
   return mesh;
 }
+
+/*
+ * Vertex types come in groups of 6 (position with the same normal and
+ * uv attributes), first without bones, then with 1 and 2 sets of 4
+ * bone indices and weights.
+ */
+size_t get_model_mesh_vertex_size(uint8_t vtx_type)
+{
+  static const uint8_t n_floats[6] = { 3, 3+2, 3+2+2, 3+3, 3+3+2, 3+3+2+2 };
+  if (vtx_type > MODEL_MESH_VTX_POS_NORMAL_UV2_SKEL2)
+    return 0;
+  size_t n_skel = vtx_type / 6;
+  return sizeof(float) * n_floats[vtx_type % 6] + n_skel * (sizeof(uint16_t)*4 + sizeof(float)*4);
+}
+
+/*
+ * Get a bounding sphere (x, y, z, radius) of the vertex positions,
+ * before the mesh matrix or bones are applied.  The center is the
+ * center of the vertices' bounding box.
+ */
+void get_model_mesh_bound(const struct MODEL_MESH *mesh, float *sphere)
+{
+  size_t vtx_size = get_model_mesh_vertex_size(mesh->vtx_type);
+  size_t n_vtx = (vtx_size > 0) ? mesh->vtx_size / vtx_size : 0;
+  const unsigned char *vtx = mesh->vtx;
+
+  for (int i = 0; i < 4; i++)
+    sphere[i] = 0;
+  if (n_vtx == 0)
+    return;
+
+  // vertex data may come unaligned from a mapped file
+  float min[3], max[3], pos[3];
+  memcpy(min, vtx, sizeof(min));
+  memcpy(max, vtx, sizeof(max));
+  for (size_t i = 1; i < n_vtx; i++) {
+    memcpy(pos, vtx + i * vtx_size, sizeof(pos));
+    for (int k = 0; k < 3; k++) {
+      if (pos[k] < min[k]) min[k] = pos[k];
+      if (pos[k] > max[k]) max[k] = pos[k];
+    }
+  }
+  for (int k = 0; k < 3; k++)
+    sphere[k] = 0.5f * (min[k] + max[k]);
+
+  float radius2 = 0;
+  for (size_t i = 0; i < n_vtx; i++) {
+    memcpy(pos, vtx + i * vtx_size, sizeof(pos));
+    float dx = pos[0] - sphere[0], dy = pos[1] - sphere[1], dz = pos[2] - sphere[2];
+    float dist2 = dx*dx + dy*dy + dz*dz;
+    if (dist2 > radius2)
+      radius2 = dist2;
+  }
+  sphere[3] = sqrtf(radius2);
+}
@@ -8,7 +8,7 @@
 int new_queue(struct QUEUE *queue, size_t capacity, size_t item_size)
 {
   if (capacity) {
-    queue->data = malloc(sizeof(void *) * capacity * item_size);
+    queue->data = malloc(capacity * item_size);
     if (! queue->data)
       return 1;
   } else {
@@ -8,7 +8,7 @@ struct QUEUE {
   size_t first_item;
   size_t num_items;
   size_t item_size;
-  void **data;
+  void *data;
 };
 
 int new_queue(struct QUEUE *queue, size_t capacity, size_t item_size);
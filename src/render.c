@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -18,13 +19,18 @@
 #include "bff.h"
 #include "skeleton.h"
 #include "room.h"
+#include "render_queue.h"
+#include "cull.h"
+#include "thread.h"
 
 struct RENDER_MODEL {
   struct RENDER_MODEL *next;
-  int use_count;
+  int use_count;               // number of instances
+  char name[256];
   struct SKELETON skel;
   int n_gfx_meshes;
   struct GFX_MESH *gfx_meshes[MODEL_MAX_MESHES];
+  float *anim_bounds;          // bounding sphere of the skinned meshes for each animation, NULL if none
 };
 
 struct GFX_SHADER {
@@ -82,25 +88,102 @@ static void init_render_lists(void)
   render_model_instances_used_list = NULL;
 }
 
-struct RENDER_MODEL *alloc_render_model(void)
+/*
+ * Render models are cached by name (the file they were loaded from).
+ * A model without instances stays in the cache until its slot is
+ * needed for a new model.
+ */
+struct RENDER_MODEL *find_render_model(const char *name)
 {
-  struct RENDER_MODEL *model = render_models_free_list;
-  if (model == NULL)
+  for (struct RENDER_MODEL *model = render_models_used_list; model != NULL; model = model->next) {
+    if (strcmp(model->name, name) == 0)
+      return model;
+  }
+  return NULL;
+}
+
+/*
+ * Free the least recently allocated model that has no instances.
+ */
+static int evict_render_model(void)
+{
+  struct RENDER_MODEL *unused = NULL;
+  for (struct RENDER_MODEL *model = render_models_used_list; model != NULL; model = model->next) {
+    if (model->use_count == 0)
+      unused = model;
+  }
+  if (! unused)
+    return 1;
+  free_render_model(unused);
+  return 0;
+}
+
+struct RENDER_MODEL *alloc_render_model(const char *name)
+{
+  if (render_models_free_list == NULL && evict_render_model() != 0)
     return NULL;
+  struct RENDER_MODEL *model = render_models_free_list;
   render_models_free_list = model->next;
   model->next = render_models_used_list;
   render_models_used_list = model;
 
+  model->use_count = 0;
+  strncpy(model->name, name, sizeof(model->name) - 1);
+  model->name[sizeof(model->name) - 1] = '\0';
   model->n_gfx_meshes = 0;
+  model->anim_bounds = NULL;
   init_skeleton(&model->skel, 0, 0);
   return model;
 }
 
+/*
+ * Compute the bound of the model's skinned meshes for each animation
+ * of its skeleton.  If it fails, animated instances are never culled.
+ */
+static void set_render_model_anim_bounds(struct RENDER_MODEL *model)
+{
+  // sphere around the box of the mesh spheres in bind pose
+  float min[3] = { INFINITY, INFINITY, INFINITY };
+  float max[3] = { -INFINITY, -INFINITY, -INFINITY };
+  for (int i = 0; i < model->n_gfx_meshes; i++) {
+    const float *bound = model->gfx_meshes[i]->bound;
+    for (int k = 0; k < 3; k++) {
+      if (bound[k] - bound[3] < min[k]) min[k] = bound[k] - bound[3];
+      if (bound[k] + bound[3] > max[k]) max[k] = bound[k] + bound[3];
+    }
+  }
+  if (model->n_gfx_meshes == 0)
+    return;
+  float sphere[4];
+  float radius2 = 0;
+  for (int k = 0; k < 3; k++) {
+    sphere[k] = 0.5f * (min[k] + max[k]);
+    radius2 += 0.25f * (max[k] - min[k]) * (max[k] - min[k]);
+  }
+  sphere[3] = sqrtf(radius2);
+
+  model->anim_bounds = malloc(sizeof(float) * 4 * model->skel.n_animations);
+  if (! model->anim_bounds) {
+    debug("** ERROR: out of memory for animation bounds of '%s'\n", model->name);
+    return;
+  }
+  for (int i = 0; i < model->skel.n_animations; i++) {
+    if (get_skeleton_animation_bound(&model->skel, i, sphere, &model->anim_bounds[4*i]) != 0) {
+      debug("** ERROR: can't compute animation bounds of '%s'\n", model->name);
+      free(model->anim_bounds);
+      model->anim_bounds = NULL;
+      return;
+    }
+  }
+}
+
 void set_render_model_meshes(struct RENDER_MODEL *model, int n_meshes, struct GFX_MESH **meshes)
 {
   model->n_gfx_meshes = n_meshes;
   for (int i = 0; i < n_meshes; i++)
     model->gfx_meshes[i] = meshes[i];
+  if (model->skel.n_bones > 0 && model->skel.n_animations > 0)
+    set_render_model_anim_bounds(model);
 }
 
 struct SKELETON *get_render_model_skeleton(struct RENDER_MODEL *model)
@@ -110,6 +193,13 @@ struct SKELETON *get_render_model_skeleton(struct RENDER_MODEL *model)
 
 void free_render_model(struct RENDER_MODEL *model)
 {
+  if (model->use_count != 0)
+    debug("** ERROR: freeing render model '%s' with %d instances\n", model->name, model->use_count);
+  for (int i = 0; i < model->n_gfx_meshes; i++)
+    gfx_free_mesh(model->gfx_meshes[i]);
+  model->n_gfx_meshes = 0;
+  free(model->anim_bounds);
+  model->anim_bounds = NULL;
   free_skeleton(&model->skel);
   
   // remove from used list
@@ -145,6 +235,9 @@ struct RENDER_MODEL_INSTANCE *alloc_render_model_instance(struct RENDER_MODEL *m
 void free_render_model_instance(struct RENDER_MODEL_INSTANCE *inst)
 {
   inst->model->use_count--;
+  if (inst->anim)
+    free_skeleton_animation_state(inst->anim);
+  inst->anim = NULL;
   
   // remove from used list
   struct RENDER_MODEL_INSTANCE **p = &render_model_instances_used_list;
@@ -239,85 +332,246 @@ int render_setup(int width, int height)
 void render_set_viewport(int width, int height)
 {
   glViewport(0, 0, width, height);
-  set_camera_viewport(&game.camera, width, height);
 
   float text_base_size = 1.0 / 28.0;
   text_scale[0] = text_base_size * 0.5;
   text_scale[1] = text_base_size * width / height;
 }
 
-static void render_mesh(struct GFX_SHADER *shader, struct GFX_MESH *mesh, float *mat_view_projection, float *mat_view, float *mat_model)
+/*
+ * Model draws go through a render queue: each mesh is added with its
+ * bounding sphere, the spheres are culled against the view frustum,
+ * the visible meshes are queued with a key made of their program,
+ * texture, vertex array and depth, the queue is sorted, and the draws
+ * are sent with the binds that didn't change from the previous draw
+ * left out.
+ */
+#define RENDER_PROGRAM_MODEL  0
+#define RENDER_PROGRAM_ANIM   1
+
+#define RENDER_CULL_BATCH     256   // spheres per culling job, a multiple of the SIMD width
+
+struct RENDER_DRAW {
+  uint32_t program;
+  struct GFX_MESH *mesh;
+  int sphere;             // index of the bounding sphere, shared by all meshes of an animated instance
+  int n_bones;
+  const float *bone_matrices;
+  float mat_model[16];
+};
+
+/*
+ * A room or model instance that adds draws.  Its draws and spheres go
+ * to fixed ranges of the arrays, so sources can be set up in parallel.
+ */
+struct RENDER_SOURCE {
+  struct ROOM *room;                        // NULL for model instances
+  struct RENDER_SNAPSHOT_INSTANCE *inst;
+  int first_draw;
+  int first_sphere;
+};
+
+static struct RENDER_QUEUE render_queue;
+static int n_render_sources;
+static struct RENDER_SOURCE render_sources[RENDER_SNAPSHOT_MAX_ROOMS + RENDER_SNAPSHOT_MAX_INSTANCES];
+static int n_render_draws;
+static struct RENDER_DRAW render_draws[RENDER_QUEUE_MAX_ITEMS];
+static struct CULL_SPHERES render_spheres;
+static uint8_t render_sphere_visible[CULL_MAX_SPHERES];
+static struct CULL_FRUSTUM render_frustum;
+static struct RENDER_STATS render_stats;
+
+static void add_render_source(struct ROOM *room, struct RENDER_SNAPSHOT_INSTANCE *inst)
 {
-  if (mesh->texture && (mesh->texture->flags & GFX_TEX_FLAG_LOADED) == 0)
-    return;
-  
-  float mat_model_view_projection[16];
-  mat4_mul(mat_model_view_projection, mat_view_projection, mat_model);
-
-  float mat_inv[16], mat_normal[16];
-  mat4_inverse(mat_inv, mat_model);
-  mat4_transpose(mat_normal, mat_inv);
-
-  if (shader->uni_mat_model_view_projection >= 0)
-    GL_CHECK(glUniformMatrix4fv(shader->uni_mat_model_view_projection, 1, GL_TRUE, mat_model_view_projection));
-  if (shader->uni_mat_normal >= 0)
-    GL_CHECK(glUniformMatrix4fv(shader->uni_mat_normal, 1, GL_TRUE, mat_normal));
-  if (shader->uni_mat_model >= 0)
-    GL_CHECK(glUniformMatrix4fv(shader->uni_mat_model, 1, GL_TRUE, mat_model));
-  
-  if (mesh->texture) {
-    GL_CHECK(glActiveTexture(GL_TEXTURE0));
-    GL_CHECK(glBindTexture(GL_TEXTURE_2D, mesh->texture->id));
+  struct RENDER_SOURCE *src = &render_sources[n_render_sources++];
+  src->room = room;
+  src->inst = inst;
+  src->first_draw = n_render_draws;
+  src->first_sphere = render_spheres.n;
+  if (room) {
+    n_render_draws += room->n_meshes;
+    render_spheres.n += room->n_meshes;
+  } else {
+    n_render_draws += inst->model->n_gfx_meshes;
+    render_spheres.n += (inst->bone_matrices) ? 1 : inst->model->n_gfx_meshes;
   }
-  GL_CHECK(glBindVertexArray(mesh->vtx_array_obj));
-  GL_CHECK(glDrawElements(GL_TRIANGLES, mesh->index_count, mesh->index_type, 0));
 }
 
-static void render_room_mesh(struct GFX_MESH *mesh, float *mat_view_projection, float *mat_view)
+static void set_draw(int index, uint32_t program, struct GFX_MESH *mesh, float *mat_model, int sphere, struct RENDER_SNAPSHOT_INSTANCE *inst)
 {
-  struct ROOM *room = mesh->data;
-  float mat_model[16];
-  mat4_copy(mat_model, mesh->matrix);
-  mat_model[ 3] += room->pos[0];
-  mat_model[ 7] += room->pos[1];
-  mat_model[11] += room->pos[2];
-
-  render_mesh(&shader, mesh, mat_view_projection, mat_view, mat_model);
+  struct RENDER_DRAW *draw = &render_draws[index];
+  draw->program = program;
+  draw->mesh = mesh;
+  draw->sphere = sphere;
+  draw->n_bones = (inst) ? inst->n_bones : 0;
+  draw->bone_matrices = (inst) ? inst->bone_matrices : NULL;
+  mat4_copy(draw->mat_model, mat_model);
 }
 
-static void render_model_instance(struct RENDER_MODEL_INSTANCE *inst, float *mat_view_projection, float *mat_view)
+static void set_room_draws(struct RENDER_SOURCE *src)
 {
-  struct GFX_SHADER *model_shader;
-  if (inst->anim) {
-    model_shader = &anim_shader.base;
-#if 0
-    console("%d bones:\n", inst->anim->skel->n_bones);
-    for (int i = 0; i < inst->anim->skel->n_bones; i++) {
-      console("bone [%d]\n", i);
-      mat4_dump(&inst->anim->matrices[16*i]);
-    }
-    for (int i = 0; i < inst->model->n_gfx_meshes; i++) {
-      console("mesh[%d] matrix:\n", i);
-      mat4_dump(inst->model->gfx_meshes[i]->matrix);
-    }
-    console("inst matrix:\n");
-    mat4_dump(inst->matrix);
-#endif
-    GL_CHECK(glUniformMatrix4fv(anim_shader.uni_mat_bones, inst->anim->skel->n_bones, GL_TRUE, inst->anim->matrices));
-  } else {
-    model_shader = &shader;
+  struct ROOM *room = src->room;
+  for (int i = 0; i < room->n_meshes; i++) {
+    struct GFX_MESH *mesh = room->meshes[i];
+    float mat_model[16];
+    mat4_copy(mat_model, mesh->matrix);
+    mat_model[ 3] += room->pos[0];
+    mat_model[ 7] += room->pos[1];
+    mat_model[11] += room->pos[2];
+    set_cull_sphere(&render_spheres, src->first_sphere + i, mat_model, mesh->bound);
+    set_draw(src->first_draw + i, RENDER_PROGRAM_MODEL, mesh, mat_model, src->first_sphere + i, NULL);
   }
-  
+}
+
+static void set_model_instance_draws(struct RENDER_SOURCE *src)
+{
+  struct RENDER_SNAPSHOT_INSTANCE *inst = src->inst;
   struct RENDER_MODEL *model = inst->model;
+
+  // skinned meshes are culled together, with the bound of the instance's animation
+  if (inst->bone_matrices) {
+    static const float no_bound[4] = { 0, 0, 0, INFINITY };
+    const float *bound = no_bound;
+    if (model->anim_bounds && inst->anim_index >= 0 && inst->anim_index < model->skel.n_animations)
+      bound = &model->anim_bounds[4*inst->anim_index];
+    set_cull_sphere(&render_spheres, src->first_sphere, inst->matrix, bound);
+  }
+
   for (int i = 0; i < model->n_gfx_meshes; i++) {
     struct GFX_MESH *gfx_mesh = model->gfx_meshes[i];
-    float mat_model[16];
+    if (inst->bone_matrices) {
+      set_draw(src->first_draw + i, RENDER_PROGRAM_ANIM, gfx_mesh, inst->matrix, src->first_sphere, inst);
+    } else {
+      float mat_model[16];
+      mat4_mul(mat_model, inst->matrix, gfx_mesh->matrix);
+      set_cull_sphere(&render_spheres, src->first_sphere + i, mat_model, gfx_mesh->bound);
+      set_draw(src->first_draw + i, RENDER_PROGRAM_MODEL, gfx_mesh, mat_model, src->first_sphere + i, inst);
+    }
+  }
+}
 
-    if (inst->anim)
-      mat4_copy(mat_model, inst->matrix);
+static void set_source_draws_range(void *data, int start, int end)
+{
+  for (int i = start; i < end; i++) {
+    if (render_sources[i].room)
+      set_room_draws(&render_sources[i]);
     else
-      mat4_mul(mat_model, inst->matrix, gfx_mesh->matrix);
-    render_mesh(model_shader, gfx_mesh, mat_view_projection, mat_view, mat_model);
+      set_model_instance_draws(&render_sources[i]);
+  }
+}
+
+static void cull_spheres_range(void *data, int start, int end)
+{
+  cull_spheres(&render_frustum, &render_spheres, start, end, render_sphere_visible);
+}
+
+/*
+ * Set up the draws and bounding spheres of all sources and cull the
+ * spheres, both spread over the job system workers.
+ */
+static void cull_render_sources(float *mat_view_projection)
+{
+  get_cull_frustum(&render_frustum, mat_view_projection);
+
+  struct JOB_COUNTER draws_set, culled;
+  init_job_counter(&draws_set);
+  init_job_counter(&culled);
+  run_parallel_for(n_render_sources, 0, set_source_draws_range, NULL, NULL, &draws_set);
+  run_parallel_for(render_spheres.n, RENDER_CULL_BATCH, cull_spheres_range, NULL, &draws_set, &culled);
+  wait_job_counter(&culled);
+
+  render_stats.n_bounds = render_spheres.n;
+  for (int i = 0; i < render_spheres.n; i++) {
+    if (! render_sphere_visible[i])
+      render_stats.n_culled_bounds++;
+  }
+}
+
+static void queue_visible_draws(const float *mat_view, float max_depth)
+{
+  clear_render_queue(&render_queue);
+  for (int i = 0; i < n_render_draws; i++) {
+    struct RENDER_DRAW *draw = &render_draws[i];
+    struct GFX_MESH *mesh = draw->mesh;
+    if ((mesh->flags & GFX_MESH_FLAG_READY) == 0)
+      continue;
+    if (mesh->texture && (mesh->texture->flags & GFX_TEX_FLAG_LOADED) == 0)
+      continue;
+    if (! render_sphere_visible[draw->sphere]) {
+      render_stats.n_culled++;
+      continue;
+    }
+
+    // distance from the camera to the model origin along the view direction
+    float *mat_model = draw->mat_model;
+    float depth = -(mat_view[ 8] * mat_model[3] + mat_view[ 9] * mat_model[7] +
+                    mat_view[10] * mat_model[11] + mat_view[11]);
+    uint32_t texture = (mesh->texture) ? (uint32_t) (mesh->texture - gfx_textures) + 1 : 0;
+    uint64_t key = make_render_key(draw->program, texture, (uint32_t) (mesh - gfx_meshes), depth, max_depth);
+    add_render_queue_item(&render_queue, key, i);
+  }
+}
+
+static void use_model_shader(struct GFX_SHADER *shader, float *light_pos, float *camera_pos)
+{
+  GL_CHECK(glUseProgram(shader->id));
+  GL_CHECK(glUniform1i(shader->uni_tex1, 0));
+  GL_CHECK(glUniform3fv(shader->uni_light_pos, 1, light_pos));
+  GL_CHECK(glUniform3fv(shader->uni_camera_pos, 1, camera_pos));
+}
+
+static void submit_render_queue(float *mat_view_projection, float *light_pos, float *camera_pos)
+{
+  struct GFX_SHADER *cur_shader = NULL;
+  struct GFX_TEXTURE *cur_texture = NULL;
+  GLuint cur_vao = 0;
+  const float *cur_bones = NULL;
+
+  GL_CHECK(glActiveTexture(GL_TEXTURE0));
+  for (int i = 0; i < render_queue.n_items; i++) {
+    struct RENDER_DRAW *draw = &render_draws[render_queue.items[i].payload];
+    struct GFX_MESH *mesh = draw->mesh;
+    struct GFX_SHADER *draw_shader = (draw->program == RENDER_PROGRAM_ANIM) ? &anim_shader.base : &shader;
+
+    // uniforms are kept by each program, and each program is used only once per frame
+    if (draw_shader != cur_shader) {
+      cur_shader = draw_shader;
+      use_model_shader(cur_shader, light_pos, camera_pos);
+      cur_bones = NULL;
+      render_stats.n_program_switches++;
+    }
+    if (draw->bone_matrices && draw->bone_matrices != cur_bones) {
+      cur_bones = draw->bone_matrices;
+      GL_CHECK(glUniformMatrix4fv(anim_shader.uni_mat_bones, draw->n_bones, GL_TRUE, cur_bones));
+    }
+
+    float mat_model_view_projection[16];
+    mat4_mul(mat_model_view_projection, mat_view_projection, draw->mat_model);
+
+    float mat_inv[16], mat_normal[16];
+    mat4_inverse(mat_inv, draw->mat_model);
+    mat4_transpose(mat_normal, mat_inv);
+
+    if (cur_shader->uni_mat_model_view_projection >= 0)
+      GL_CHECK(glUniformMatrix4fv(cur_shader->uni_mat_model_view_projection, 1, GL_TRUE, mat_model_view_projection));
+    if (cur_shader->uni_mat_normal >= 0)
+      GL_CHECK(glUniformMatrix4fv(cur_shader->uni_mat_normal, 1, GL_TRUE, mat_normal));
+    if (cur_shader->uni_mat_model >= 0)
+      GL_CHECK(glUniformMatrix4fv(cur_shader->uni_mat_model, 1, GL_TRUE, draw->mat_model));
+
+    // meshes without a texture draw with whatever is bound, as before
+    if (mesh->texture && mesh->texture != cur_texture) {
+      cur_texture = mesh->texture;
+      GL_CHECK(glBindTexture(GL_TEXTURE_2D, cur_texture->id));
+      render_stats.n_texture_binds++;
+    }
+    if (mesh->vtx_array_obj != cur_vao) {
+      cur_vao = mesh->vtx_array_obj;
+      GL_CHECK(glBindVertexArray(cur_vao));
+      render_stats.n_vao_binds++;
+    }
+    GL_CHECK(glDrawElements(GL_TRIANGLES, mesh->index_count, mesh->index_type, 0));
+    render_stats.n_draws++;
   }
 }
 
@@ -380,62 +634,131 @@ static void render_text(float x, float y, float size, const char *text, size_t l
   }
 }
 
-void render_screen(void)
+void render_screen(struct RENDER_SNAPSHOT *snap)
 {
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   // models
   float camera_pos[3];
-  get_camera_pos(&game.camera, camera_pos);
+  get_camera_pos(&snap->camera, camera_pos);
 
   float light_pos[3];
-  get_light_pos(light_pos);
+  get_light_pos(&snap->camera, light_pos);
   
   float mat_projection[16];
-  get_camera_projection_matrix(&game.camera, mat_projection);
+  get_camera_projection_matrix(&snap->camera, mat_projection);
 
   float mat_view[16];
-  get_camera_view_matrix(&game.camera, mat_view);
+  get_camera_view_matrix(&snap->camera, mat_view);
   
   float mat_view_projection[16];
   mat4_mul(mat_view_projection, mat_projection, mat_view);
 
   glEnable(GL_DEPTH_TEST);
 
-  GL_CHECK(glUseProgram(shader.id));
-  GL_CHECK(glUniform1i(shader.uni_tex1, 0));
-  GL_CHECK(glUniform3fv(shader.uni_light_pos, 1, light_pos));
-  GL_CHECK(glUniform3fv(shader.uni_camera_pos, 1, camera_pos));
-  for (int i = 0; i < NUM_GFX_MESHES; i++) {
-    if (gfx_meshes[i].use_count != 0 && gfx_meshes[i].type == GFX_MESH_TYPE_ROOM)
-      render_room_mesh(&gfx_meshes[i], mat_view_projection, mat_view);
-  }
-  for (struct RENDER_MODEL_INSTANCE *inst = render_model_instances_used_list; inst != NULL; inst = inst->next) {
-    if (! inst->anim)
-      render_model_instance(inst, mat_view_projection, mat_view);
+  memset(&render_stats, 0, sizeof(render_stats));
+  n_render_sources = 0;
+  n_render_draws = 0;
+  render_spheres.n = 0;
+  for (int i = 0; i < snap->n_rooms; i++) {
+    struct ROOM *room = get_room_by_index(snap->room_index[i]);
+    if (room && room->state == ROOM_STATE_RESIDENT)
+      add_render_source(room, NULL);
   }
+  for (int i = 0; i < snap->n_instances; i++)
+    add_render_source(NULL, &snap->instances[i]);
+  cull_render_sources(mat_view_projection);
+  queue_visible_draws(mat_view, snap->camera.view_far);
+  sort_render_queue(&render_queue);
+  submit_render_queue(mat_view_projection, light_pos, camera_pos);
 
-  GL_CHECK(glUseProgram(anim_shader.base.id));
-  GL_CHECK(glUniform1i(anim_shader.base.uni_tex1, 0));
-  GL_CHECK(glUniform3fv(anim_shader.base.uni_light_pos, 1, light_pos));
-  GL_CHECK(glUniform3fv(anim_shader.base.uni_camera_pos, 1, camera_pos));
-  for (struct RENDER_MODEL_INSTANCE *inst = render_model_instances_used_list; inst != NULL; inst = inst->next) {
-    if (inst->anim)
-      render_model_instance(inst, mat_view_projection, mat_view);
-  }
-  
   // text
   glDisable(GL_DEPTH_TEST);
   GL_CHECK(glUseProgram(font_shader.id));
   GL_CHECK(glUniform1i(font_shader.uni_tex1, 0));
 
   char text[1024];
-  snprintf(text, sizeof(text), "%4.1f fps", fps_counter.fps);
+  snprintf(text, sizeof(text), "%4.1f fps, %d creatures updated in %.2f ms by %d threads",
+           fps_counter.fps, snap->n_creatures, snap->creature_update_time * 1000.0, get_job_system_workers() + 1);
   render_text(0, 0, 1, text, 0);
 
-  if (game.show_camera_info) {
+  struct STREAM_STATS *stream = &snap->stream_stats;
+  int n_done = stream->n_hits + stream->n_late + stream->n_wasted;
+  snprintf(text, sizeof(text), "%d rooms prefetched: %d hits, %d late, %d wasted (%.0f%% hit rate)",
+           stream->n_requested, stream->n_hits, stream->n_late, stream->n_wasted,
+           (n_done > 0) ? 100.0 * stream->n_hits / n_done : 0.0);
+  render_text(0, 1, 1, text, 0);
+
+  struct ROOM_RESIDENCY_STATS *res = &snap->residency_stats;
+  snprintf(text, sizeof(text), "%d rooms resident in %.1f MB (%.1f MB GPU), %d evictions, %d reloads",
+           res->n_resident, (res->cpu_bytes + res->gpu_bytes) / (1024.0*1024.0), res->gpu_bytes / (1024.0*1024.0),
+           res->n_evictions, res->n_reloads);
+  render_text(0, 2, 1, text, 0);
+
+  snprintf(text, sizeof(text), "%d draws, %d texture binds, %d VAO binds, %d program switches",
+           render_stats.n_draws, render_stats.n_texture_binds, render_stats.n_vao_binds, render_stats.n_program_switches);
+  render_text(0, 3, 1, text, 0);
+
+  snprintf(text, sizeof(text), "%d of %d bounds culled, %d meshes culled",
+           render_stats.n_culled_bounds, render_stats.n_bounds, render_stats.n_culled);
+  render_text(0, 4, 1, text, 0);
+
+  if (snap->show_camera_info) {
     snprintf(text, sizeof(text), "cam.dist=+%f, cam.theta=%+f, cam.phi=%+f, fov=%+f\n",
-             game.camera.distance, game.camera.theta, game.camera.phi, game.camera.fovy/M_PI*180);
-    render_text(0, 1, 1, text, 0);
+             snap->camera.distance, snap->camera.theta, snap->camera.phi, snap->camera.fovy/M_PI*180);
+    render_text(0, 5, 1, text, 0);
+  }
+}
+
+struct RENDER_SNAPSHOT *new_render_snapshot(void)
+{
+  struct RENDER_SNAPSHOT *snap = malloc(sizeof *snap);
+  if (! snap)
+    return NULL;
+  snap->bone_pool = malloc(sizeof(float) * 16 * SKELETON_MAX_BONES * RENDER_SNAPSHOT_MAX_INSTANCES);
+  if (! snap->bone_pool) {
+    free(snap);
+    return NULL;
+  }
+  clear_render_snapshot(snap);
+  return snap;
+}
+
+void free_render_snapshot(struct RENDER_SNAPSHOT *snap)
+{
+  free(snap->bone_pool);
+  free(snap);
+}
+
+void clear_render_snapshot(struct RENDER_SNAPSHOT *snap)
+{
+  snap->n_rooms = 0;
+  snap->n_instances = 0;
+  snap->n_bone_matrices = 0;
+}
+
+/*
+ * Copy the instance's matrix and bone palette to the snapshot, so the
+ * game can keep updating the instance while the snapshot is rendered.
+ */
+int add_render_snapshot_instance(struct RENDER_SNAPSHOT *snap, struct RENDER_MODEL_INSTANCE *inst)
+{
+  if (snap->n_instances >= RENDER_SNAPSHOT_MAX_INSTANCES)
+    return 1;
+
+  struct RENDER_SNAPSHOT_INSTANCE *snap_inst = &snap->instances[snap->n_instances++];
+  snap_inst->model = inst->model;
+  mat4_copy(snap_inst->matrix, inst->matrix);
+  if (inst->anim) {
+    snap_inst->anim_index = inst->anim->anim_index;
+    snap_inst->n_bones = inst->anim->skel->n_bones;
+    snap_inst->bone_matrices = &snap->bone_pool[16 * snap->n_bone_matrices];
+    memcpy(snap_inst->bone_matrices, inst->anim->matrices, sizeof(float) * 16 * snap_inst->n_bones);
+    snap->n_bone_matrices += snap_inst->n_bones;
+  } else {
+    snap_inst->anim_index = -1;
+    snap_inst->n_bones = 0;
+    snap_inst->bone_matrices = NULL;
   }
+  return 0;
 }
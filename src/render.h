@@ -3,8 +3,15 @@
 #ifndef RENDER_H_FILE
 #define RENDER_H_FILE
 
+#include "camera.h"
+#include "room.h"
+#include "stream.h"
+
 #define MAX_RENDER_MODELS          64
-#define MAX_RENDER_MODEL_INSTANCES 256
+#define MAX_RENDER_MODEL_INSTANCES 2048
+
+#define RENDER_SNAPSHOT_MAX_INSTANCES 1024
+#define RENDER_SNAPSHOT_MAX_ROOMS     (1+ROOM_MAX_NEIGHBORS)
 
 struct GFX_MESH;
 struct SKELETON;
@@ -18,11 +25,48 @@ struct RENDER_MODEL_INSTANCE {
   float matrix[16];
 };
 
+struct RENDER_SNAPSHOT_INSTANCE {
+  struct RENDER_MODEL *model;
+  float matrix[16];
+  int anim_index;
+  int n_bones;
+  float *bone_matrices;   // points into the snapshot's bone pool, NULL if not animated
+};
+
+/*
+ * Everything the render thread needs to draw a frame, built by the
+ * game thread while the previous snapshot is being rendered.
+ */
+struct RENDER_SNAPSHOT {
+  struct CAMERA camera;
+  float player_pos[3];
+  float player_vel[3];
+  int show_camera_info;
+  int n_creatures;
+  double creature_update_time;
+
+  int n_rooms;
+  int room_index[RENDER_SNAPSHOT_MAX_ROOMS];
+  struct STREAM_STATS stream_stats;
+  struct ROOM_RESIDENCY_STATS residency_stats;
+
+  int n_instances;
+  struct RENDER_SNAPSHOT_INSTANCE instances[RENDER_SNAPSHOT_MAX_INSTANCES];
+  int n_bone_matrices;
+  float *bone_pool;
+};
+
 int render_setup(int width, int height);
 void render_set_viewport(int width, int height);
-void render_screen(void);
+void render_screen(struct RENDER_SNAPSHOT *snap);
+
+struct RENDER_SNAPSHOT *new_render_snapshot(void);
+void free_render_snapshot(struct RENDER_SNAPSHOT *snap);
+void clear_render_snapshot(struct RENDER_SNAPSHOT *snap);
+int add_render_snapshot_instance(struct RENDER_SNAPSHOT *snap, struct RENDER_MODEL_INSTANCE *inst);
 
-struct RENDER_MODEL *alloc_render_model(void);
+struct RENDER_MODEL *find_render_model(const char *name);
+struct RENDER_MODEL *alloc_render_model(const char *name);
 void set_render_model_meshes(struct RENDER_MODEL *model, int n_meshes, struct GFX_MESH **meshes);
 struct SKELETON *get_render_model_skeleton(struct RENDER_MODEL *model);
 void free_render_model(struct RENDER_MODEL *model);
@@ -0,0 +1,100 @@
+/* render_queue.c */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "render_queue.h"
+
+#define RADIX_BITS    8
+#define RADIX_SIZE    (1<<RADIX_BITS)
+#define RADIX_PASSES  (64/RADIX_BITS)
+
+static uint64_t key_field(uint32_t value, int bits, int shift)
+{
+  return (uint64_t) (value & ((1u<<bits) - 1)) << shift;
+}
+
+/*
+ * Build a sort key.  Resource ids are truncated to their fields, which
+ * can only make two different resources sort together, never break the
+ * order of the fields above them.  The depth is the distance from the
+ * camera, clamped to [0,max_depth].
+ */
+uint64_t make_render_key(uint32_t program, uint32_t texture, uint32_t vao, float depth, float max_depth)
+{
+  uint32_t depth_max_val = (1u<<RENDER_KEY_DEPTH_BITS) - 1;
+  uint32_t depth_val;
+  if (! (depth > 0))
+    depth_val = 0;
+  else if (depth >= max_depth)
+    depth_val = depth_max_val;
+  else
+    depth_val = (uint32_t) (depth / max_depth * depth_max_val);
+
+  return (key_field(program, RENDER_KEY_PROGRAM_BITS, RENDER_KEY_PROGRAM_SHIFT) |
+          key_field(texture, RENDER_KEY_TEXTURE_BITS, RENDER_KEY_TEXTURE_SHIFT) |
+          key_field(vao, RENDER_KEY_VAO_BITS, RENDER_KEY_VAO_SHIFT) |
+          key_field(depth_val, RENDER_KEY_DEPTH_BITS, RENDER_KEY_DEPTH_SHIFT));
+}
+
+void clear_render_queue(struct RENDER_QUEUE *queue)
+{
+  queue->n_items = 0;
+}
+
+int add_render_queue_item(struct RENDER_QUEUE *queue, uint64_t key, uint32_t payload)
+{
+  if (queue->n_items >= RENDER_QUEUE_MAX_ITEMS)
+    return 1;
+  struct RENDER_QUEUE_ITEM *item = &queue->items[queue->n_items++];
+  item->key = key;
+  item->payload = payload;
+  return 0;
+}
+
+/*
+ * Sort the queue by key with an LSD radix sort.  The histograms of all
+ * digits are counted in one pass over the keys, and digits that are the
+ * same in every key are skipped, which is most of them: only a few bits
+ * of program, texture and vertex array ids are ever used.
+ */
+void sort_render_queue(struct RENDER_QUEUE *queue)
+{
+  static uint32_t count[RADIX_PASSES][RADIX_SIZE];
+
+  int n = queue->n_items;
+  if (n < 2)
+    return;
+
+  memset(count, 0, sizeof(count));
+  for (int i = 0; i < n; i++) {
+    uint64_t key = queue->items[i].key;
+    for (int pass = 0; pass < RADIX_PASSES; pass++)
+      count[pass][(key >> (pass*RADIX_BITS)) & (RADIX_SIZE-1)]++;
+  }
+
+  struct RENDER_QUEUE_ITEM *src = queue->items;
+  struct RENDER_QUEUE_ITEM *dst = queue->sort_tmp;
+  for (int pass = 0; pass < RADIX_PASSES; pass++) {
+    int shift = pass * RADIX_BITS;
+    uint32_t *pass_count = count[pass];
+    if (pass_count[(src[0].key >> shift) & (RADIX_SIZE-1)] == (uint32_t) n)
+      continue;
+
+    uint32_t offset = 0;
+    for (int d = 0; d < RADIX_SIZE; d++) {
+      uint32_t c = pass_count[d];
+      pass_count[d] = offset;
+      offset += c;
+    }
+    for (int i = 0; i < n; i++)
+      dst[pass_count[(src[i].key >> shift) & (RADIX_SIZE-1)]++] = src[i];
+
+    struct RENDER_QUEUE_ITEM *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  if (src != queue->items)
+    memcpy(queue->items, src, n * sizeof(*src));
+}
@@ -0,0 +1,59 @@
+/* render_queue.h */
+
+#ifndef RENDER_QUEUE_H_FILE
+#define RENDER_QUEUE_H_FILE
+
+#include <stdint.h>
+#include "gfx.h"
+#include "model.h"
+#include "render.h"
+
+// every mesh of every snapshot instance and every mesh in the pool (room meshes)
+#define RENDER_QUEUE_MAX_ITEMS  (RENDER_SNAPSHOT_MAX_INSTANCES * MODEL_MAX_MESHES + NUM_GFX_MESHES)
+
+/*
+ * Sort key layout, most significant first, so that sorted draws
+ * change the program least often, then the texture, then the vertex
+ * array, and draws of the same mesh go front to back.
+ */
+#define RENDER_KEY_PROGRAM_BITS   4
+#define RENDER_KEY_TEXTURE_BITS   12
+#define RENDER_KEY_VAO_BITS       12
+#define RENDER_KEY_DEPTH_BITS     24
+
+#define RENDER_KEY_DEPTH_SHIFT    0
+#define RENDER_KEY_VAO_SHIFT      (RENDER_KEY_DEPTH_SHIFT + RENDER_KEY_DEPTH_BITS)
+#define RENDER_KEY_TEXTURE_SHIFT  (RENDER_KEY_VAO_SHIFT + RENDER_KEY_VAO_BITS)
+#define RENDER_KEY_PROGRAM_SHIFT  (RENDER_KEY_TEXTURE_SHIFT + RENDER_KEY_TEXTURE_BITS)
+
+struct RENDER_QUEUE_ITEM {
+  uint64_t key;
+  uint32_t payload;       // index of the draw in the caller's payload array
+};
+
+struct RENDER_QUEUE {
+  int n_items;
+  struct RENDER_QUEUE_ITEM items[RENDER_QUEUE_MAX_ITEMS];
+  struct RENDER_QUEUE_ITEM sort_tmp[RENDER_QUEUE_MAX_ITEMS];
+};
+
+/*
+ * GL work done to draw the queue in the last frame, and the work
+ * saved by frustum culling before it.
+ */
+struct RENDER_STATS {
+  int n_draws;
+  int n_texture_binds;
+  int n_vao_binds;
+  int n_program_switches;
+  int n_bounds;           // bounding spheres tested
+  int n_culled_bounds;    // bounding spheres outside the frustum
+  int n_culled;           // meshes not queued because their bound was culled
+};
+
+uint64_t make_render_key(uint32_t program, uint32_t texture, uint32_t vao, float depth, float max_depth);
+void clear_render_queue(struct RENDER_QUEUE *queue);
+int add_render_queue_item(struct RENDER_QUEUE *queue, uint64_t key, uint32_t payload);
+void sort_render_queue(struct RENDER_QUEUE *queue);
+
+#endif /* RENDER_QUEUE_H_FILE */
@@ -0,0 +1,179 @@
+/* ring.c */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ring.h"
+#include "atomic.h"
+#include "thread.h"
+
+#define RING_SPIN_COUNT 64
+
+#define CELL(ring, pos)      ((ring)->cells + ((pos) & (ring)->mask) * (ring)->cell_size)
+#define CELL_SEQ(cell)       ((volatile size_t *) (cell))
+#define CELL_DATA(cell)      ((cell) + sizeof(size_t))
+
+struct RING *new_ring(size_t capacity, size_t item_size, unsigned int flags)
+{
+  size_t pow2 = 1;
+  while (pow2 < capacity)
+    pow2 *= 2;
+
+  struct RING *ring = malloc(sizeof *ring);
+  if (! ring)
+    return NULL;
+  ring->capacity = pow2;
+  ring->mask = pow2 - 1;
+  ring->item_size = item_size;
+  ring->cell_size = sizeof(size_t) + (item_size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+  ring->flags = flags;
+  ring->head = 0;
+  ring->tail = 0;
+
+  ring->cells = malloc(ring->cell_size * ring->capacity);
+  if (! ring->cells) {
+    free(ring);
+    return NULL;
+  }
+  for (size_t i = 0; i < ring->capacity; i++)
+    *CELL_SEQ(CELL(ring, i)) = i;
+  return ring;
+}
+
+void free_ring(struct RING *ring)
+{
+  free(ring->cells);
+  free(ring);
+}
+
+static inline int is_spsc(struct RING *ring)
+{
+  return (ring->flags & (RING_FLAG_SINGLE_PRODUCER|RING_FLAG_SINGLE_CONSUMER)) == (RING_FLAG_SINGLE_PRODUCER|RING_FLAG_SINGLE_CONSUMER);
+}
+
+/* ========================================================================================
+ * Single producer, single consumer
+ */
+
+static int spsc_try_send(struct RING *ring, const void *data)
+{
+  size_t tail = ring->tail;   // only written by us
+  if (tail - atomic_load_acquire(&ring->head) >= ring->capacity)
+    return 1;
+  memcpy(CELL_DATA(CELL(ring, tail)), data, ring->item_size);
+  atomic_store_release(&ring->tail, tail + 1);
+  return 0;
+}
+
+static int spsc_try_recv(struct RING *ring, void *data)
+{
+  size_t head = ring->head;   // only written by us
+  if (head == atomic_load_acquire(&ring->tail))
+    return 1;
+  memcpy(data, CELL_DATA(CELL(ring, head)), ring->item_size);
+  atomic_store_release(&ring->head, head + 1);
+  return 0;
+}
+
+/* ========================================================================================
+ * Multiple producers, multiple consumers
+ *
+ * A cell whose sequence number equals the tail position is free for
+ * the producer that claims that position; after writing, the producer
+ * sets it to pos+1 to hand it to the consumer that claims the same
+ * position, which in turn sets it to pos+capacity for the next lap.
+ */
+
+static int mpmc_try_send(struct RING *ring, const void *data)
+{
+  size_t pos = atomic_load_acquire(&ring->tail);
+  unsigned char *cell;
+  while (1) {
+    cell = CELL(ring, pos);
+    size_t seq = atomic_load_acquire(CELL_SEQ(cell));
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      if (atomic_cas(&ring->tail, pos, pos + 1))
+        break;
+      pos = atomic_load_acquire(&ring->tail);
+    } else if (diff < 0) {
+      return 1;  // full
+    } else {
+      pos = atomic_load_acquire(&ring->tail);
+    }
+  }
+
+  memcpy(CELL_DATA(cell), data, ring->item_size);
+  atomic_store_release(CELL_SEQ(cell), pos + 1);
+  return 0;
+}
+
+static int mpmc_try_recv(struct RING *ring, void *data)
+{
+  size_t pos = atomic_load_acquire(&ring->head);
+  unsigned char *cell;
+  while (1) {
+    cell = CELL(ring, pos);
+    size_t seq = atomic_load_acquire(CELL_SEQ(cell));
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (diff == 0) {
+      if (atomic_cas(&ring->head, pos, pos + 1))
+        break;
+      pos = atomic_load_acquire(&ring->head);
+    } else if (diff < 0) {
+      return 1;  // empty
+    } else {
+      pos = atomic_load_acquire(&ring->head);
+    }
+  }
+
+  memcpy(data, CELL_DATA(cell), ring->item_size);
+  atomic_store_release(CELL_SEQ(cell), pos + ring->capacity);
+  return 0;
+}
+
+/* ======================================================================================== */
+
+int ring_try_send(struct RING *ring, const void *data)
+{
+  if (is_spsc(ring))
+    return spsc_try_send(ring, data);
+  return mpmc_try_send(ring, data);
+}
+
+int ring_try_recv(struct RING *ring, void *data)
+{
+  if (is_spsc(ring))
+    return spsc_try_recv(ring, data);
+  return mpmc_try_recv(ring, data);
+}
+
+/*
+ * There's nothing to sleep on in a lock-free ring, so blocking calls
+ * spin for a while and then start yielding the processor.
+ */
+void ring_send(struct RING *ring, const void *data)
+{
+  int spin = 0;
+  while (ring_try_send(ring, data) != 0) {
+    if (spin++ < RING_SPIN_COUNT)
+      cpu_relax();
+    else
+      thread_yield();
+  }
+}
+
+int ring_recv(struct RING *ring, void *data, int block)
+{
+  int spin = 0;
+  while (ring_try_recv(ring, data) != 0) {
+    if (! block)
+      return 1;
+    if (spin++ < RING_SPIN_COUNT)
+      cpu_relax();
+    else
+      thread_yield();
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+/* ring.h */
+
+#ifndef RING_H_FILE
+#define RING_H_FILE
+
+#include <stddef.h>
+
+#define RING_FLAG_SINGLE_PRODUCER (1<<0)
+#define RING_FLAG_SINGLE_CONSUMER (1<<1)
+
+#define RING_CACHE_LINE 64
+
+/*
+ * Bounded lock-free ring buffer.  The capacity is rounded up to a
+ * power of two so positions can be masked instead of divided.
+ *
+ * With both RING_FLAG_SINGLE_PRODUCER and RING_FLAG_SINGLE_CONSUMER
+ * set the ring uses plain head/tail counters, otherwise each cell
+ * carries a sequence number so any number of threads can send and
+ * receive concurrently.
+ */
+struct RING {
+  size_t capacity;
+  size_t mask;
+  size_t item_size;
+  size_t cell_size;
+  unsigned int flags;
+  unsigned char *cells;
+
+  // producer and consumer positions live in separate cache lines
+  char pad0[RING_CACHE_LINE];
+  volatile size_t tail;
+  char pad1[RING_CACHE_LINE - sizeof(size_t)];
+  volatile size_t head;
+  char pad2[RING_CACHE_LINE - sizeof(size_t)];
+};
+
+struct RING *new_ring(size_t capacity, size_t item_size, unsigned int flags);
+void free_ring(struct RING *ring);
+int ring_try_send(struct RING *ring, const void *data);
+int ring_try_recv(struct RING *ring, void *data);
+void ring_send(struct RING *ring, const void *data);
+int ring_recv(struct RING *ring, void *data, int block);
+
+#endif /* RING_H_FILE */
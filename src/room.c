@@ -1,86 +1,629 @@
 /* room.c */
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
 
 #include "room.h"
 #include "debug.h"
+#include "thread.h"
+#include "atomic.h"
+#include "gfx.h"
 
 #define MAX_LOADED_ROOMS   64
+#define ROOM_HASH_BITS     7      // hash size must be at least MAX_LOADED_ROOMS
+#define ROOM_HASH_SIZE     (1 << ROOM_HASH_BITS)
+#define ROOM_HASH_MASK     (ROOM_HASH_SIZE - 1)
 
+#define ROOM_HANDLE(gen, slot)  (((uint32_t) (gen) << 16) | (uint32_t) (slot))
+#define ROOM_HANDLE_SLOT(h)     ((h) & 0xffff)
+
+#define ROOM_BUDGET_LOW_WATER   0.75   // once over budget, evict down to this fraction of it
+
+#define MAX_TILE_CHUNKS    2048
+
+// the grid cells are the size of a tile chunk, so each chunk touches at most 2x2 cells
+#define ROOM_GRID_CELL_SIZE    (ROOM_TILE_CHUNK_SIZE * ROOM_TILE_SIZE)
+#define ROOM_GRID_ROOM_CELLS   (ROOM_TILE_CHUNKS + 1)   // cells a room touches along each axis
+#define MAX_GRID_ENTRIES       (MAX_LOADED_ROOMS * ROOM_GRID_ROOM_CELLS * ROOM_GRID_ROOM_CELLS)
+#define ROOM_GRID_HASH_BITS    12
+#define ROOM_GRID_HASH_SIZE    (1 << ROOM_GRID_HASH_BITS)
+
+#define TILE_CHUNK_TILES   (ROOM_TILE_CHUNK_SIZE * ROOM_TILE_CHUNK_SIZE)
+
+union ROOM_TILE_CHUNK {
+  union ROOM_TILE_CHUNK *next;
+  uint16_t tiles[TILE_CHUNK_TILES];
+};
+
+/*
+ * Slot map of rooms.  The slots in use are packed in 'used' so they
+ * can be iterated and removed in constant time, and 'hash' maps world
+ * room indices to slots with linear probing.  Each slot's generation
+ * changes when it's freed, which makes old handles to it stale.
+ */
 struct ROOM_STORE {
-  struct ROOM *alloc_list;
-  struct ROOM *free_list;
+  int n_used;
+  int free_list;                        // first free slot, -1 if none
+  int next_free[MAX_LOADED_ROOMS];
+  uint16_t generation[MAX_LOADED_ROOMS];
+  int used_pos[MAX_LOADED_ROOMS];       // position of each used slot in 'used'
+  int used[MAX_LOADED_ROOMS];
+  int hash[ROOM_HASH_SIZE];             // slot + 1, or 0 if empty
   struct ROOM rooms[MAX_LOADED_ROOMS];
 };
 
+/*
+ * Tile chunks are allocated by the asset loader workers while rooms
+ * are read and freed by the game thread, so the pool has a lock.
+ */
+struct ROOM_TILE_POOL {
+  struct MUTEX *lock;
+  union ROOM_TILE_CHUNK *free_list;
+  union ROOM_TILE_CHUNK chunks[MAX_TILE_CHUNKS];
+};
+
+/*
+ * World space grid of the cells covered by the resident rooms' tile
+ * chunks, kept in a hash of cell coordinates.  Each entry says a room
+ * may have floor tiles in a cell; the entries of a cell are in a
+ * doubly linked bucket list so a room's entries can be removed in
+ * constant time.  There's room for every room touching every cell it
+ * can, so the grid never runs out of entries.
+ */
+struct ROOM_GRID_ENTRY {
+  int32_t cx;
+  int32_t cz;
+  int slot;
+  int prev;          // in the bucket list, -1 at the start
+  int next;          // in the bucket list or the free list, -1 at the end
+  int room_next;     // next entry of the same room
+};
+
+struct ROOM_GRID {
+  int free_list;
+  int bucket[ROOM_GRID_HASH_SIZE];
+  int room_first[MAX_LOADED_ROOMS];   // first entry of each slot's room, -1 if none
+  struct ROOM_GRID_ENTRY entries[MAX_GRID_ENTRIES];
+};
+
+/*
+ * Resident rooms are kept within a memory budget by evicting the
+ * least recently used ones.  Eviction starts when the budget is
+ * exceeded and goes on until usage is under the low water mark, so
+ * rooms aren't evicted and reloaded one at a time while usage hovers
+ * around the budget.
+ */
+struct ROOM_RESIDENCY {
+  size_t budget;
+  bool trimming;
+  uint32_t use_clock;
+  struct ROOM_RESIDENCY_STATS stats;
+  uint8_t *loaded_map;      // one bit per world room index that has been resident
+  size_t loaded_map_size;
+};
+
 static struct ROOM_STORE room_store;
+static struct ROOM_GRID room_grid;
+static struct ROOM_RESIDENCY residency;
+static struct ROOM_TILE_POOL tile_pool;
+static const uint16_t empty_tile_chunk[TILE_CHUNK_TILES];
 
-void init_room_store(void)
+int init_room_store(void)
 {
-  room_store.alloc_list = NULL;
-  room_store.free_list = &room_store.rooms[0];
-  
-  for (int i = 0; i < MAX_LOADED_ROOMS-1; i++)
-    room_store.rooms[i].next = &room_store.rooms[i + 1];
-  room_store.rooms[MAX_LOADED_ROOMS-1].next = NULL;
+  if (! tile_pool.lock) {
+    tile_pool.lock = new_mutex();
+    if (! tile_pool.lock) {
+      debug("** ERROR: can't create room tile lock\n");
+      return 1;
+    }
+  }
+  tile_pool.free_list = &tile_pool.chunks[0];
+  for (int i = 0; i < MAX_TILE_CHUNKS-1; i++)
+    tile_pool.chunks[i].next = &tile_pool.chunks[i + 1];
+  tile_pool.chunks[MAX_TILE_CHUNKS-1].next = NULL;
+
+  room_store.n_used = 0;
+  room_store.free_list = 0;
+  for (int i = 0; i < MAX_LOADED_ROOMS; i++) {
+    room_store.next_free[i] = (i+1 < MAX_LOADED_ROOMS) ? i+1 : -1;
+    room_store.generation[i] = 1;
+    room_store.rooms[i].handle = ROOM_HANDLE_NONE;
+    clear_room_tiles(&room_store.rooms[i]);
+  }
+  for (int i = 0; i < ROOM_HASH_SIZE; i++)
+    room_store.hash[i] = 0;
+
+  room_grid.free_list = 0;
+  for (int i = 0; i < MAX_GRID_ENTRIES; i++)
+    room_grid.entries[i].next = (i+1 < MAX_GRID_ENTRIES) ? i+1 : -1;
+  for (int i = 0; i < ROOM_GRID_HASH_SIZE; i++)
+    room_grid.bucket[i] = -1;
+  for (int i = 0; i < MAX_LOADED_ROOMS; i++)
+    room_grid.room_first[i] = -1;
+
+  residency.budget = SIZE_MAX;
+  residency.trimming = false;
+  residency.use_clock = 0;
+  memset(&residency.stats, 0, sizeof(residency.stats));
+  return 0;
 }
 
-struct ROOM *alloc_room(void)
+/*
+ * Return an uninitialized chunk of ROOM_TILE_CHUNK_SIZE^2 tiles, or
+ * NULL if the pool is exhausted.
+ */
+uint16_t *alloc_room_tile_chunk(void)
 {
-  struct ROOM *room = room_store.free_list;
-  if (room == NULL)
+  mutex_lock(tile_pool.lock);
+  union ROOM_TILE_CHUNK *chunk = tile_pool.free_list;
+  if (chunk)
+    tile_pool.free_list = chunk->next;
+  mutex_unlock(tile_pool.lock);
+  if (! chunk) {
+    debug("** ERROR: out of room tile chunks\n");
     return NULL;
-  room_store.free_list = room->next;
-  room->next = room_store.alloc_list;
-  room_store.alloc_list = room;
+  }
+  return chunk->tiles;
+}
+
+static bool is_pool_tile_chunk(const uint16_t *tiles)
+{
+  // chunks not from the pool are the empty chunk or point into the BWF file mapping
+  const union ROOM_TILE_CHUNK *chunk = (const union ROOM_TILE_CHUNK *) tiles;
+  return chunk >= &tile_pool.chunks[0] && chunk < &tile_pool.chunks[MAX_TILE_CHUNKS];
+}
+
+size_t get_room_tile_bytes(const struct ROOM *room)
+{
+  size_t n_chunks = 0;
+  for (int cy = 0; cy < ROOM_TILE_CHUNKS; cy++) {
+    for (int cx = 0; cx < ROOM_TILE_CHUNKS; cx++) {
+      if (room->tile_chunks[cy][cx] && room->tile_chunks[cy][cx] != empty_tile_chunk)
+        n_chunks++;
+    }
+  }
+  return n_chunks * sizeof(empty_tile_chunk);
+}
+
+/*
+ * Return the room's tile chunks to the pool and make all its tiles
+ * zero.
+ */
+void clear_room_tiles(struct ROOM *room)
+{
+  bool locked = false;
+  for (int cy = 0; cy < ROOM_TILE_CHUNKS; cy++) {
+    for (int cx = 0; cx < ROOM_TILE_CHUNKS; cx++) {
+      const uint16_t *tiles = room->tile_chunks[cy][cx];
+      if (tiles && is_pool_tile_chunk(tiles)) {
+        if (! locked) {
+          mutex_lock(tile_pool.lock);
+          locked = true;
+        }
+        union ROOM_TILE_CHUNK *chunk = (union ROOM_TILE_CHUNK *) tiles;
+        chunk->next = tile_pool.free_list;
+        tile_pool.free_list = chunk;
+      }
+      room->tile_chunks[cy][cx] = empty_tile_chunk;
+    }
+  }
+  if (locked)
+    mutex_unlock(tile_pool.lock);
+}
+
+static int get_room_hash_home(int index)
+{
+  return ((uint32_t) index * 2654435761u) >> (32 - ROOM_HASH_BITS);
+}
+
+/*
+ * Return the hash position of the room with the given index, or -1 if
+ * it's not there.
+ */
+static int find_room_hash_pos(int index)
+{
+  for (int pos = get_room_hash_home(index); room_store.hash[pos] != 0; pos = (pos + 1) & ROOM_HASH_MASK) {
+    if (room_store.rooms[room_store.hash[pos] - 1].index == index)
+      return pos;
+  }
+  return -1;
+}
+
+static void add_room_hash(int slot)
+{
+  int pos = get_room_hash_home(room_store.rooms[slot].index);
+  while (room_store.hash[pos] != 0)
+    pos = (pos + 1) & ROOM_HASH_MASK;
+  room_store.hash[pos] = slot + 1;
+}
+
+/*
+ * Remove a room from the hash, moving back the following entries of
+ * the probe sequence that would become unreachable.
+ */
+static void remove_room_hash(struct ROOM *room)
+{
+  int hole = find_room_hash_pos(room->index);
+  if (hole < 0 || &room_store.rooms[room_store.hash[hole] - 1] != room)
+    return;
+
+  for (int pos = (hole + 1) & ROOM_HASH_MASK; room_store.hash[pos] != 0; pos = (pos + 1) & ROOM_HASH_MASK) {
+    int home = get_room_hash_home(room_store.rooms[room_store.hash[pos] - 1].index);
+    if (((pos - home) & ROOM_HASH_MASK) >= ((pos - hole) & ROOM_HASH_MASK)) {
+      room_store.hash[hole] = room_store.hash[pos];
+      hole = pos;
+    }
+  }
+  room_store.hash[hole] = 0;
+}
+
+static int get_room_grid_bucket(int32_t cx, int32_t cz)
+{
+  return ((uint32_t) cx * 73856093u ^ (uint32_t) cz * 19349663u) & (ROOM_GRID_HASH_SIZE - 1);
+}
+
+static int32_t get_room_grid_cell(float coord)
+{
+  return (int32_t) floorf(coord / ROOM_GRID_CELL_SIZE);
+}
+
+static void add_room_grid_entry(int slot, int32_t cx, int32_t cz)
+{
+  int e = room_grid.free_list;
+  struct ROOM_GRID_ENTRY *entry = &room_grid.entries[e];
+  room_grid.free_list = entry->next;
+
+  int bucket = get_room_grid_bucket(cx, cz);
+  entry->cx = cx;
+  entry->cz = cz;
+  entry->slot = slot;
+  entry->prev = -1;
+  entry->next = room_grid.bucket[bucket];
+  if (entry->next >= 0)
+    room_grid.entries[entry->next].prev = e;
+  room_grid.bucket[bucket] = e;
+
+  entry->room_next = room_grid.room_first[slot];
+  room_grid.room_first[slot] = e;
+}
+
+/*
+ * Add the cells touched by the room's nonempty tile chunks to the
+ * grid.  Chunk (x,y) starts in cell base + (x,y), where base is the
+ * cell of the room's first tile.
+ */
+static void add_room_to_grid(struct ROOM *room)
+{
+  int slot = ROOM_HANDLE_SLOT(room->handle);
+  int32_t base_x = get_room_grid_cell(room->pos[0] - ROOM_TILE_ORIGIN * ROOM_TILE_SIZE);
+  int32_t base_z = get_room_grid_cell(room->pos[2] - ROOM_TILE_ORIGIN * ROOM_TILE_SIZE);
+
+  bool added[ROOM_GRID_ROOM_CELLS][ROOM_GRID_ROOM_CELLS] = { { false } };
+  for (int cy = 0; cy < ROOM_TILE_CHUNKS; cy++) {
+    for (int cx = 0; cx < ROOM_TILE_CHUNKS; cx++) {
+      if (room->tile_chunks[cy][cx] == empty_tile_chunk)
+        continue;
+      for (int z = cy; z <= cy + 1; z++) {
+        for (int x = cx; x <= cx + 1; x++) {
+          if (! added[z][x])
+            add_room_grid_entry(slot, base_x + x, base_z + z);
+          added[z][x] = true;
+        }
+      }
+    }
+  }
+}
+
+static void remove_room_from_grid(int slot)
+{
+  int e = room_grid.room_first[slot];
+  while (e >= 0) {
+    struct ROOM_GRID_ENTRY *entry = &room_grid.entries[e];
+    int room_next = entry->room_next;
+
+    if (entry->prev >= 0)
+      room_grid.entries[entry->prev].next = entry->next;
+    else
+      room_grid.bucket[get_room_grid_bucket(entry->cx, entry->cz)] = entry->next;
+    if (entry->next >= 0)
+      room_grid.entries[entry->next].prev = entry->prev;
+
+    entry->next = room_grid.free_list;
+    room_grid.free_list = e;
+    e = room_next;
+  }
+  room_grid.room_first[slot] = -1;
+}
+
+/*
+ * Return the resident room with a floor tile at the position, or NULL
+ * if there's none.  If several rooms have a tile there, 'prefer' wins
+ * (so the player stays in the current room where rooms overlap),
+ * then the room at the closest height.
+ */
+struct ROOM *find_room_at(const float *pos, struct ROOM *prefer)
+{
+  int32_t cx = get_room_grid_cell(pos[0]);
+  int32_t cz = get_room_grid_cell(pos[2]);
+
+  struct ROOM *found = NULL;
+  for (int e = room_grid.bucket[get_room_grid_bucket(cx, cz)]; e >= 0; e = room_grid.entries[e].next) {
+    struct ROOM_GRID_ENTRY *entry = &room_grid.entries[e];
+    if (entry->cx != cx || entry->cz != cz)
+      continue;
+    struct ROOM *room = &room_store.rooms[entry->slot];
+    int tx = (int) floorf((pos[0] - room->pos[0]) / ROOM_TILE_SIZE) + ROOM_TILE_ORIGIN;
+    int ty = (int) floorf((pos[2] - room->pos[2]) / ROOM_TILE_SIZE) + ROOM_TILE_ORIGIN;
+    if (tx < 0 || tx >= 256 || ty < 0 || ty >= 256 || room_get_tile(room, tx, ty) == 0)
+      continue;
+    if (room == prefer)
+      return room;
+    if (! found || fabsf(room->pos[1] - pos[1]) < fabsf(found->pos[1] - pos[1]))
+      found = room;
+  }
+  return found;
+}
+
+/*
+ * Allocate a room in the REQUESTED state for a world room index that
+ * isn't already in the store.
+ */
+struct ROOM *alloc_room(int index)
+{
+  int slot = room_store.free_list;
+  if (slot < 0)
+    return NULL;
+  room_store.free_list = room_store.next_free[slot];
+
+  room_store.used_pos[slot] = room_store.n_used;
+  room_store.used[room_store.n_used++] = slot;
+
+  struct ROOM *room = &room_store.rooms[slot];
+  room->handle = ROOM_HANDLE(room_store.generation[slot], slot);
+  room->index = index;
+  room->state = ROOM_STATE_REQUESTED;
+  room->mark = 0;
+  room->prefetched = false;
+  room->cpu_bytes = 0;
+  room->gpu_bytes = 0;
+  room->mesh_bytes = 0;
+  room->textures_pending = false;
+  room->n_neighbors = 0;
+  room->n_meshes = 0;
+  add_room_hash(slot);
   return room;
 }
 
+/*
+ * Free a room that's not being used by the asset loader.
+ */
 void free_room(struct ROOM *room)
 {
-  // remove from alloc list
-  struct ROOM **p = &room_store.alloc_list;
-  while (*p && *p != room)
-    p = &(*p)->next;
-  if (! *p)
+  if (get_room(room->handle) != room)
     return;
-  *p = room->next;
+  int slot = ROOM_HANDLE_SLOT(room->handle);
+
+  if (room->state == ROOM_STATE_RESIDENT) {
+    remove_room_from_grid(slot);
+    residency.stats.n_resident--;
+    residency.stats.n_evictions++;
+    residency.stats.cpu_bytes -= room->cpu_bytes;
+    residency.stats.gpu_bytes -= room->gpu_bytes;
+  }
+  remove_room_hash(room);
+  clear_room_tiles(room);
+  room->n_meshes = 0;
+
+  // move the last used slot to this one's place
+  int pos = room_store.used_pos[slot];
+  int last = room_store.used[--room_store.n_used];
+  room_store.used[pos] = last;
+  room_store.used_pos[last] = pos;
+
+  room->handle = ROOM_HANDLE_NONE;
+  if (++room_store.generation[slot] == 0)
+    room_store.generation[slot] = 1;
+  room_store.next_free[slot] = room_store.free_list;
+  room_store.free_list = slot;
+}
 
-  // add to free list
-  room->next = room_store.free_list;
-  room_store.free_list = room;
+/*
+ * Evict a room that the asset loader is still working on.  It stops
+ * being found by its index right away, but it can only be freed when
+ * the loader replies.
+ */
+void evict_room(struct ROOM *room)
+{
+  while (true) {
+    size_t state = atomic_load_acquire(&room->state);
+    if (state != ROOM_STATE_REQUESTED && state != ROOM_STATE_LOADING)
+      return;
+    if (atomic_cas(&room->state, state, ROOM_STATE_EVICTING))
+      break;
+  }
+  remove_room_hash(room);
 }
 
-struct ROOM *get_room_list(void)
+/*
+ * Called by the asset loader before reading a room.  Returns false if
+ * the room was evicted before the loader got to it.
+ */
+bool begin_room_load(struct ROOM *room)
 {
-  return room_store.alloc_list;
+  return atomic_cas(&room->state, ROOM_STATE_REQUESTED, ROOM_STATE_LOADING);
 }
 
-struct ROOM *get_room_by_index(int index)
+/*
+ * Recompute the GPU bytes of a room from its meshes and textures.
+ * Texture sizes are only known when their upload is queued, after
+ * they're decoded, so the room is marked to be updated again until all
+ * its textures are loaded.  Textures shared with other rooms count for
+ * each of them.
+ */
+void update_room_gpu_bytes(struct ROOM *room)
 {
-  for (struct ROOM *room = room_store.alloc_list; room != NULL; room = room->next) {
-    if (room->index == index)
-      return room;
+  size_t gpu_bytes = room->mesh_bytes;
+  room->textures_pending = false;
+  for (int i = 0; i < room->n_meshes; i++) {
+    struct GFX_TEXTURE *tex = room->meshes[i]->texture;
+    if (! tex)
+      continue;
+    int j = 0;
+    while (j < i && room->meshes[j]->texture != tex)
+      j++;
+    if (j < i)
+      continue;
+    gpu_bytes += tex->size;
+    if ((tex->flags & GFX_TEX_FLAG_LOADED) == 0)
+      room->textures_pending = true;
   }
-  return NULL;
+
+  if (room->state == ROOM_STATE_RESIDENT)
+    residency.stats.gpu_bytes += gpu_bytes - room->gpu_bytes;
+  room->gpu_bytes = gpu_bytes;
 }
 
-bool has_free_room(void)
+/*
+ * Update the resident rooms whose textures were still loading.
+ */
+void update_pending_room_gpu_bytes(void)
 {
-  return room_store.free_list != NULL;
+  for (int i = 0; i < room_store.n_used; i++) {
+    struct ROOM *room = &room_store.rooms[room_store.used[i]];
+    if (room->textures_pending && room->state == ROOM_STATE_RESIDENT)
+      update_room_gpu_bytes(room);
+  }
 }
 
-void mark_all_rooms(int mark)
+/*
+ * Make a room resident once it's loaded and its cpu_bytes and
+ * gpu_bytes are set.
+ */
+void set_room_resident(struct ROOM *room)
 {
-  for (struct ROOM *room = room_store.alloc_list; room != NULL; room = room->next)
-    room->mark = mark;
+  atomic_store_release(&room->state, ROOM_STATE_RESIDENT);
+  touch_room(room);
+  add_room_to_grid(room);
+
+  residency.stats.n_resident++;
+  residency.stats.cpu_bytes += room->cpu_bytes;
+  residency.stats.gpu_bytes += room->gpu_bytes;
+
+  // remember which rooms were resident to count reloads
+  if (room->index < 0)
+    return;
+  size_t byte = (size_t) room->index / 8;
+  if (byte >= residency.loaded_map_size) {
+    size_t new_size = 2 * byte + 64;
+    uint8_t *new_map = realloc(residency.loaded_map, new_size);
+    if (! new_map)
+      return;
+    memset(new_map + residency.loaded_map_size, 0, new_size - residency.loaded_map_size);
+    residency.loaded_map = new_map;
+    residency.loaded_map_size = new_size;
+  }
+  uint8_t bit = 1 << (room->index % 8);
+  if (residency.loaded_map[byte] & bit)
+    residency.stats.n_reloads++;
+  residency.loaded_map[byte] |= bit;
 }
 
-struct ROOM *get_marked_room(int mark)
+/*
+ * Set the bytes of room data (tiles, meshes and textures) to keep
+ * resident.
+ */
+void set_room_budget(size_t bytes)
 {
-  for (struct ROOM *room = room_store.alloc_list; room != NULL; room = room->next) {
-    if (room->mark == mark)
-      return room;
+  residency.budget = bytes;
+}
+
+void touch_room(struct ROOM *room)
+{
+  room->last_used = ++residency.use_clock;
+}
+
+/*
+ * Return the least recently used resident room with a zero mark
+ * (marked rooms are pinned) if the rooms are over budget or
+ * 'need_slot' is set, or NULL if no room should be evicted.
+ */
+struct ROOM *get_room_to_evict(bool need_slot)
+{
+  size_t used = residency.stats.cpu_bytes + residency.stats.gpu_bytes;
+  if (used > residency.budget)
+    residency.trimming = true;
+  else if (used <= residency.budget * ROOM_BUDGET_LOW_WATER)
+    residency.trimming = false;
+  if (! residency.trimming && ! need_slot)
+    return NULL;
+
+  struct ROOM *lru = NULL;
+  for (int i = 0; i < room_store.n_used; i++) {
+    struct ROOM *room = &room_store.rooms[room_store.used[i]];
+    if (room->state != ROOM_STATE_RESIDENT || room->mark != 0)
+      continue;
+    if (! lru || (int32_t) (room->last_used - lru->last_used) < 0)
+      lru = room;
   }
-  return NULL;
+  return lru;
+}
+
+void get_room_residency_stats(struct ROOM_RESIDENCY_STATS *stats)
+{
+  *stats = residency.stats;
+}
+
+struct ROOM *get_room(uint32_t handle)
+{
+  int slot = ROOM_HANDLE_SLOT(handle);
+  if (handle == ROOM_HANDLE_NONE || slot >= MAX_LOADED_ROOMS)
+    return NULL;
+  struct ROOM *room = &room_store.rooms[slot];
+  return (room->handle == handle) ? room : NULL;
+}
+
+/*
+ * Return the room with the given world index, unless it's being
+ * evicted.
+ */
+struct ROOM *get_room_by_index(int index)
+{
+  int pos = find_room_hash_pos(index);
+  if (pos < 0)
+    return NULL;
+  return &room_store.rooms[room_store.hash[pos] - 1];
+}
+
+/*
+ * Rooms in use are numbered from 0 to get_num_rooms()-1.  Freeing a
+ * room moves the last one to its position, so iterate backwards when
+ * freeing rooms.
+ */
+int get_num_rooms(void)
+{
+  return room_store.n_used;
+}
+
+struct ROOM *get_room_at(int pos)
+{
+  return &room_store.rooms[room_store.used[pos]];
+}
+
+bool has_free_room(void)
+{
+  return room_store.free_list >= 0;
+}
+
+int get_num_free_rooms(void)
+{
+  return MAX_LOADED_ROOMS - room_store.n_used;
+}
+
+void mark_all_rooms(int mark)
+{
+  for (int i = 0; i < room_store.n_used; i++)
+    room_store.rooms[room_store.used[i]].mark = mark;
 }
@@ -3,34 +3,111 @@
 #ifndef ROOM_H_FILE
 #define ROOM_H_FILE
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #define ROOM_MAX_NEIGHBORS 16
+#define ROOM_MAX_MESHES    256
 
-struct ROOM {
-  struct ROOM *next;
+#define ROOM_TILE_CHUNK_SIZE  16  // tiles per chunk side
+#define ROOM_TILE_CHUNKS      16  // chunks per room side (256 tiles)
+
+/*
+ * Tiles are laid on the room's xz plane centered on its position:
+ * tile (x,y) starts at pos + ((x,y) - ROOM_TILE_ORIGIN) * ROOM_TILE_SIZE.
+ * Nonzero tiles are the room's floor.
+ */
+#define ROOM_TILE_SIZE        0.25f
+#define ROOM_TILE_ORIGIN      128
+
+/*
+ * Residency states.  A room is REQUESTED when it's sent to the asset
+ * loader, which moves it to LOADING when it starts reading it; the
+ * game makes it RESIDENT when the loaded data comes back.  A room
+ * evicted while the asset loader still has it becomes EVICTING, and
+ * it's only freed when the loader replies.  The loader and the game
+ * change the state concurrently, so it's only changed with the
+ * functions below.
+ */
+#define ROOM_STATE_REQUESTED  0
+#define ROOM_STATE_LOADING    1
+#define ROOM_STATE_RESIDENT   2
+#define ROOM_STATE_EVICTING   3
+
+/*
+ * Rooms are referenced by handles that go stale when the room is
+ * freed, even if its slot is reused.  Zero is never a valid handle.
+ */
+#define ROOM_HANDLE_NONE  0
+
+struct GFX_MESH;
+
+struct ROOM_RESIDENCY_STATS {
+  int n_resident;
+  size_t cpu_bytes;
+  size_t gpu_bytes;
+  int n_evictions;   // resident rooms freed
+  int n_reloads;     // rooms made resident again after being freed
+};
 
+struct ROOM {
+  uint32_t handle;
   int index;
+  volatile size_t state;
   int mark;
+  bool prefetched;   // loaded ahead of the player and not needed yet
+  uint32_t last_used;
+  size_t cpu_bytes;  // tile chunks
+  size_t gpu_bytes;  // meshes and textures
+  size_t mesh_bytes;
+  bool textures_pending;  // gpu_bytes doesn't have the size of all textures yet
   float pos[3];
   
   int n_neighbors;
   uint32_t neighbor_index[ROOM_MAX_NEIGHBORS]; 
-  struct ROOM *neighbor[ROOM_MAX_NEIGHBORS];
+
+  // set when the room is uploaded, owned by the gfx mesh pool
+  int n_meshes;
+  struct GFX_MESH *meshes[ROOM_MAX_MESHES];
  
-  uint16_t tiles[256][256];
+  // chunks with no tiles point to a shared chunk of zeros
+  const uint16_t *tile_chunks[ROOM_TILE_CHUNKS][ROOM_TILE_CHUNKS];
 };
 
-void init_room_store(void);
-struct ROOM *alloc_room(void);
+int init_room_store(void);
+struct ROOM *alloc_room(int index);
 void free_room(struct ROOM *room);
+void evict_room(struct ROOM *room);
+
+bool begin_room_load(struct ROOM *room);
+void set_room_resident(struct ROOM *room);
+
+void set_room_budget(size_t bytes);
+void touch_room(struct ROOM *room);
+struct ROOM *get_room_to_evict(bool need_slot);
+void get_room_residency_stats(struct ROOM_RESIDENCY_STATS *stats);
+void update_room_gpu_bytes(struct ROOM *room);
+void update_pending_room_gpu_bytes(void);
+
+void clear_room_tiles(struct ROOM *room);
+size_t get_room_tile_bytes(const struct ROOM *room);
+uint16_t *alloc_room_tile_chunk(void);
+
+static inline uint16_t room_get_tile(const struct ROOM *room, uint8_t x, uint8_t y)
+{
+  const uint16_t *chunk = room->tile_chunks[y / ROOM_TILE_CHUNK_SIZE][x / ROOM_TILE_CHUNK_SIZE];
+  return chunk[(y % ROOM_TILE_CHUNK_SIZE) * ROOM_TILE_CHUNK_SIZE + x % ROOM_TILE_CHUNK_SIZE];
+}
 
-struct ROOM *get_room_list(void);
+struct ROOM *find_room_at(const float *pos, struct ROOM *prefer);
+struct ROOM *get_room(uint32_t handle);
 struct ROOM *get_room_by_index(int index);
+int get_num_rooms(void);
+struct ROOM *get_room_at(int pos);
 
 bool has_free_room(void);
+int get_num_free_rooms(void);
 void mark_all_rooms(int mark);
-struct ROOM *get_marked_room(int mark);
 
 #endif /* ROOM_H_FILE */
@@ -2,39 +2,25 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "shader.h"
 #include "debug.h"
+#include "file.h"
 
 static char *load_file(const char *filename)
 {
-  FILE *f = fopen(filename, "rb");
-  if (! f)
+  struct FILE_READER file;
+  if (file_open(&file, filename) != 0)
     return NULL;
-  if (fseek(f, 0, SEEK_END) < 0)
-    goto err;
-  
-  long size = ftell(f);
-  if (size < 0)
-    goto err;
-
-  if (fseek(f, 0, SEEK_SET) < 0)
-    goto err;
 
-  char *data = malloc(size + 1);
-  if (! data)
-    goto err;
-  data[size] = '\0';
-  if (fread(data, 1, size, f) != (size_t)size) {
-    free(data);
-    goto err;
+  char *data = malloc(file.size + 1);
+  if (data) {
+    memcpy(data, file.start, file.size);
+    data[file.size] = '\0';
   }
-  fclose(f);
+  file_close(&file);
   return data;
-  
- err:
-  fclose(f);
-  return NULL;
 }
 
 static void dump_program_log(GLuint prog_id)
@@ -1,6 +1,7 @@
 /* skeleton.c */
 
 #include <stdlib.h>
+#include <math.h>
 
 #include "skeleton.h"
 #include "matrix.h"
@@ -94,6 +95,8 @@ static void apply_scale_keyframes(float *matrix, float time, struct SKEL_BONE_KE
   
   if (n_keyframes == 2) {
     // TODO: interpolate keyframes[0] and keyframes[1]
+    // (when this is done, get_skeleton_animation_bound() must also sample
+    // poses between keyframes, since it only poses at the keyframe times)
     float scale[16];
     mat4_load_scale(scale, keyframes[0]->data[0], keyframes[0]->data[1], keyframes[0]->data[2]);
     mat4_mul_left(matrix, scale);
@@ -115,6 +118,7 @@ static void apply_rot_keyframes(float *matrix, float time, struct SKEL_BONE_KEYF
   
   if (n_keyframes == 2) {
     // TODO: interpolate keyframes[0] and keyframes[1]
+    // (and sample between keyframes in get_skeleton_animation_bound())
     float rotation[16];
     mat4_load_rot_quat(rotation, keyframes[0]->data);
     mat4_mul_left(matrix, rotation);
@@ -136,6 +140,7 @@ static void apply_trans_keyframes(float *matrix, float time, struct SKEL_BONE_KE
   
   if (n_keyframes == 2) {
     // TODO: interpolate keyframes[0] and keyframes[1]
+    // (and sample between keyframes in get_skeleton_animation_bound())
     float scale[16];
     mat4_load_translation(scale, keyframes[0]->data[0], keyframes[0]->data[1], keyframes[0]->data[2]);
     mat4_mul_left(matrix, scale);
@@ -197,3 +202,71 @@ void update_skeleton_animation_state(struct SKEL_ANIMATION_STATE *state)
     mat4_mul_right(matrix, bone->inv_matrix);
   }
 }
+
+static void add_bone_bound(float *min, float *max, const float *m, const float *sphere)
+{
+  float scale2 = 0;
+  for (int k = 0; k < 3; k++) {
+    float col2 = m[k]*m[k] + m[4+k]*m[4+k] + m[8+k]*m[8+k];
+    if (col2 > scale2)
+      scale2 = col2;
+  }
+  float r = sphere[3] * sqrtf(scale2);
+  for (int k = 0; k < 3; k++) {
+    float c = m[4*k+0]*sphere[0] + m[4*k+1]*sphere[1] + m[4*k+2]*sphere[2] + m[4*k+3];
+    if (c - r < min[k]) min[k] = c - r;
+    if (c + r > max[k]) max[k] = c + r;
+  }
+}
+
+static void add_pose_bound(float *min, float *max, struct SKEL_ANIMATION_STATE *state, float time, const float *sphere)
+{
+  state->time = time;
+  update_skeleton_animation_state(state);
+  for (int i = 0; i < state->skel->n_bones; i++)
+    add_bone_bound(min, max, &state->matrices[16*i], sphere);
+}
+
+static void add_keyframes_bound(float *min, float *max, struct SKEL_ANIMATION_STATE *state,
+                                struct SKEL_BONE_KEYFRAME *keyframes, int n_keyframes, const float *sphere)
+{
+  for (int i = 0; i < n_keyframes; i++)
+    add_pose_bound(min, max, state, keyframes[i].time, sphere);
+}
+
+/*
+ * Get a bounding sphere (x, y, z, radius) of a skinned mesh for every
+ * pose of an animation, given the sphere of its vertices in bind pose.
+ * Skinned vertices are weighted averages of the vertex transformed by
+ * its bones, so they're inside the box of the sphere transformed by
+ * every bone.  Keyframes are not interpolated, so the poses only
+ * change at keyframe times and checking those covers the animation.
+ */
+int get_skeleton_animation_bound(struct SKELETON *skel, int anim_index, const float *sphere, float *bound)
+{
+  struct SKEL_ANIMATION_STATE *state = new_skeleton_animation_state(skel);
+  if (! state)
+    return 1;
+  state->anim_index = anim_index;
+
+  float min[3] = { INFINITY, INFINITY, INFINITY };
+  float max[3] = { -INFINITY, -INFINITY, -INFINITY };
+  add_pose_bound(min, max, state, -INFINITY, sphere);
+
+  struct SKEL_ANIMATION *anim = &skel->animations[anim_index];
+  for (int i = 0; i < skel->n_bones; i++) {
+    struct SKEL_BONE_ANIMATION *bone_anim = &anim->bones[i];
+    add_keyframes_bound(min, max, state, bone_anim->scale_keyframes, bone_anim->n_scale_keyframes, sphere);
+    add_keyframes_bound(min, max, state, bone_anim->rot_keyframes, bone_anim->n_rot_keyframes, sphere);
+    add_keyframes_bound(min, max, state, bone_anim->trans_keyframes, bone_anim->n_trans_keyframes, sphere);
+  }
+  free_skeleton_animation_state(state);
+
+  float radius2 = 0;
+  for (int k = 0; k < 3; k++) {
+    bound[k] = 0.5f * (min[k] + max[k]);
+    radius2 += 0.25f * (max[k] - min[k]) * (max[k] - min[k]);
+  }
+  bound[3] = sqrtf(radius2);
+  return 0;
+}
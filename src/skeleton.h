@@ -59,5 +59,6 @@ struct SKEL_ANIMATION_STATE {
 struct SKEL_ANIMATION_STATE *new_skeleton_animation_state(struct SKELETON *skel);
 void free_skeleton_animation_state(struct SKEL_ANIMATION_STATE *state);
 void update_skeleton_animation_state(struct SKEL_ANIMATION_STATE *state);
+int get_skeleton_animation_bound(struct SKELETON *skel, int anim_index, const float *sphere, float *bound);
 
 #endif /* SKELETON_H_FILE */
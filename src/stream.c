@@ -0,0 +1,120 @@
+/* stream.c */
+
+#include <stddef.h>
+#include <math.h>
+
+#include "stream.h"
+#include "room.h"
+#include "matrix.h"
+
+struct STREAM_CANDIDATE {
+  int room_index;
+  int depth;
+  float score;
+};
+
+static int find_candidate(struct STREAM_CANDIDATE *cand, int n_cand, int room_index)
+{
+  for (int i = 0; i < n_cand; i++) {
+    if (cand[i].room_index == room_index)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Return how much the player is heading towards a position, from -1
+ * (straight away) to 1 (straight towards it), scaled down at low
+ * speeds so a standing player doesn't favor any direction.
+ */
+static float get_heading(const float *player_pos, const float *player_vel, const float *pos)
+{
+  float dir[3];
+  for (int i = 0; i < 3; i++)
+    dir[i] = pos[i] - player_pos[i];
+  float dist2 = vec3_dot(dir, dir);
+  float speed2 = vec3_dot(player_vel, player_vel);
+  if (dist2 < 1e-6 || speed2 < 1e-6)
+    return 0;
+
+  float heading = vec3_dot(dir, player_vel) / sqrtf(dist2 * speed2);
+  float speed_weight = sqrtf(speed2) / STREAM_FULL_SPEED;
+  if (speed_weight > 1)
+    speed_weight = 1;
+  return heading * speed_weight;
+}
+
+/*
+ * Plan which rooms to load before the player needs them.  Rooms are
+ * found by a breadth-first walk of the neighbor graph from the current
+ * room (only loaded rooms have known neighbors) and scored by their
+ * graph distance, lowered when the player is moving towards the room
+ * they're reached through.
+ */
+void plan_room_stream(struct STREAM_PLAN *plan, struct ROOM *current, const float *player_pos, const float *player_vel)
+{
+  plan->n_rooms = 0;
+  if (! current)
+    return;
+
+  struct STREAM_CANDIDATE cand[STREAM_MAX_CANDIDATES];
+  int n_cand = 0;
+  cand[n_cand].room_index = current->index;
+  cand[n_cand].depth = 0;
+  cand[n_cand].score = 0;
+  n_cand++;
+
+  for (int i = 0; i < n_cand && cand[i].depth < STREAM_MAX_DEPTH; i++) {
+    struct ROOM *room = get_room_by_index(cand[i].room_index);
+    if (! room || room->state != ROOM_STATE_RESIDENT)
+      continue;
+    for (int j = 0; j < room->n_neighbors && n_cand < STREAM_MAX_CANDIDATES; j++) {
+      int index = room->neighbor_index[j];
+      int depth = cand[i].depth + 1;
+      float score = depth - STREAM_HEADING_WEIGHT * get_heading(player_pos, player_vel, room->pos);
+
+      // a room reached through several rooms at the same distance keeps the best way there
+      int found = find_candidate(cand, n_cand, index);
+      if (found >= 0) {
+        if (cand[found].depth == depth && cand[found].score > score)
+          cand[found].score = score;
+        continue;
+      }
+      struct STREAM_CANDIDATE *c = &cand[n_cand++];
+      c->room_index = index;
+      c->depth = depth;
+      c->score = score;
+    }
+  }
+
+  // keep the best scored rooms past the current neighbors, sorted by insertion
+  struct STREAM_CANDIDATE *best[STREAM_MAX_PREFETCH];
+  int n_best = 0;
+  for (int i = 0; i < n_cand; i++) {
+    if (cand[i].depth < 2)
+      continue;
+    int pos = n_best;
+    while (pos > 0 && best[pos-1]->score > cand[i].score)
+      pos--;
+    if (pos >= STREAM_MAX_PREFETCH)
+      continue;
+    if (n_best < STREAM_MAX_PREFETCH)
+      n_best++;
+    for (int k = n_best - 1; k > pos; k--)
+      best[k] = best[k-1];
+    best[pos] = &cand[i];
+  }
+
+  for (int i = 0; i < n_best; i++)
+    plan->room_index[i] = best[i]->room_index;
+  plan->n_rooms = n_best;
+}
+
+int stream_plan_has_room(const struct STREAM_PLAN *plan, int room_index)
+{
+  for (int i = 0; i < plan->n_rooms; i++) {
+    if (plan->room_index[i] == room_index)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,36 @@
+/* stream.h */
+
+#ifndef STREAM_H_FILE
+#define STREAM_H_FILE
+
+#define STREAM_MAX_DEPTH        3      // neighbor graph distance from the current room
+#define STREAM_MAX_CANDIDATES   64
+#define STREAM_MAX_PREFETCH     8      // rooms in a plan
+#define STREAM_MAX_IN_FLIGHT    2      // prefetch loads queued at once, so they don't delay needed rooms
+#define STREAM_RESERVED_ROOMS   17     // free room slots left for a room and all its neighbors
+#define STREAM_HEADING_WEIGHT   1.5    // graph distance taken off rooms the player heads straight towards
+#define STREAM_FULL_SPEED       3.0    // player speed (units/s) that gives the heading full weight
+
+struct ROOM;
+
+/*
+ * Rooms to load ahead of the player, best first.  Rooms at distance 1
+ * are the current room's neighbors, which are always loaded, so plans
+ * start at distance 2.
+ */
+struct STREAM_PLAN {
+  int n_rooms;
+  int room_index[STREAM_MAX_PREFETCH];
+};
+
+struct STREAM_STATS {
+  int n_requested;   // prefetch loads sent
+  int n_hits;        // prefetched rooms that were resident when they were needed
+  int n_late;        // prefetched rooms that were still loading when they were needed
+  int n_wasted;      // prefetched rooms unloaded or cancelled without being needed
+};
+
+void plan_room_stream(struct STREAM_PLAN *plan, struct ROOM *current, const float *player_pos, const float *player_vel);
+int stream_plan_has_room(const struct STREAM_PLAN *plan, int room_index);
+
+#endif /* STREAM_H_FILE */
@@ -3,9 +3,21 @@
 #ifndef THREAD_H_FILE
 #define THREAD_H_FILE
 
+#include <stddef.h>
+
+/*
+ * Channel flags: CHAN_FLAG_LOCK_FREE selects the lock-free ring
+ * implementation (ignored for unbuffered channels).  The single
+ * producer/consumer flags are promises made by the caller, and let
+ * the lock-free ring use its faster SPSC path when both are set.
+ */
+#define CHAN_FLAG_LOCK_FREE        (1<<0)
+#define CHAN_FLAG_SINGLE_PRODUCER  (1<<1)
+#define CHAN_FLAG_SINGLE_CONSUMER  (1<<2)
+
 struct CHANNEL;
 
-struct CHANNEL *new_chan(size_t capacity, size_t item_size);
+struct CHANNEL *new_chan(size_t capacity, size_t item_size, unsigned int flags);
 void free_chan(struct CHANNEL *chan);
 void chan_send(struct CHANNEL *chan, void *data);
 int chan_recv(struct CHANNEL *chan, void *data, int block);
@@ -15,5 +27,49 @@ struct THREAD;
 struct THREAD *start_thread(void (*func)(void *data), void *data);
 int join_thread(struct THREAD *thread);
 void thread_sleep(unsigned int msec);
+void thread_yield(void);
+double get_monotonic_time(void);
+int get_num_processors(void);
+
+struct MUTEX;
+
+struct MUTEX *new_mutex(void);
+void free_mutex(struct MUTEX *mutex);
+void mutex_lock(struct MUTEX *mutex);
+void mutex_unlock(struct MUTEX *mutex);
+
+struct COND_VAR;
+
+struct COND_VAR *new_cond_var(void);
+void free_cond_var(struct COND_VAR *cond);
+void cond_var_wait(struct COND_VAR *cond, struct MUTEX *mutex);
+void cond_var_signal(struct COND_VAR *cond);
+void cond_var_broadcast(struct COND_VAR *cond);
+
+/*
+ * Job system: a pool of worker threads running jobs from a shared
+ * queue.  Each job can decrement a counter when it's done and can be
+ * held until another counter reaches zero, which is how dependencies
+ * are expressed.  Counters belong to the caller and must be
+ * initialized with init_job_counter() and outlive their jobs.
+ */
+
+#define JOB_MAX_WORKERS 64
+
+struct JOB;
+
+struct JOB_COUNTER {
+  int count;              // jobs submitted and not yet finished
+  struct JOB *waiting;    // jobs to start when count reaches zero
+};
+
+int start_job_system(int n_workers);
+void stop_job_system(void);
+int get_job_system_workers(void);
+void init_job_counter(struct JOB_COUNTER *counter);
+void run_job(void (*func)(void *data), void *data, struct JOB_COUNTER *after, struct JOB_COUNTER *counter);
+void run_parallel_for(int count, int batch_size, void (*func)(void *data, int start, int end), void *data,
+                      struct JOB_COUNTER *after, struct JOB_COUNTER *counter);
+void wait_job_counter(struct JOB_COUNTER *counter);
 
 #endif /* THREAD_H_FILE */
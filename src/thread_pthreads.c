@@ -5,10 +5,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "thread.h"
 #include "queue.h"
+#include "ring.h"
 
 struct THREAD {
   pthread_t thread;
@@ -16,7 +19,16 @@ struct THREAD {
   void *func_data;
 };
 
+struct MUTEX {
+  pthread_mutex_t mutex;
+};
+
+struct COND_VAR {
+  pthread_cond_t cond;
+};
+
 struct CHANNEL {
+  struct RING *ring;
   pthread_mutex_t mutex;
   pthread_cond_t write_event;
   pthread_cond_t read_event;
@@ -31,6 +43,24 @@ void thread_sleep(unsigned int msec)
   usleep((useconds_t)msec * 1000);
 }
 
+void thread_yield(void)
+{
+  sched_yield();
+}
+
+double get_monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int get_num_processors(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int) n : 1;
+}
+
 static void *thread_start_func(void *data)
 {
   struct THREAD *thread = data;
@@ -59,11 +89,92 @@ int join_thread(struct THREAD *thread)
   return (ret == 0) ? 0 : 1;
 }
 
-struct CHANNEL *new_chan(size_t capacity, size_t item_size)
+struct MUTEX *new_mutex(void)
+{
+  struct MUTEX *mutex = malloc(sizeof *mutex);
+  if (! mutex)
+    return NULL;
+  if (pthread_mutex_init(&mutex->mutex, NULL) != 0) {
+    free(mutex);
+    return NULL;
+  }
+  return mutex;
+}
+
+void free_mutex(struct MUTEX *mutex)
+{
+  pthread_mutex_destroy(&mutex->mutex);
+  free(mutex);
+}
+
+void mutex_lock(struct MUTEX *mutex)
+{
+  pthread_mutex_lock(&mutex->mutex);
+}
+
+void mutex_unlock(struct MUTEX *mutex)
+{
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+struct COND_VAR *new_cond_var(void)
+{
+  struct COND_VAR *cond = malloc(sizeof *cond);
+  if (! cond)
+    return NULL;
+  if (pthread_cond_init(&cond->cond, NULL) != 0) {
+    free(cond);
+    return NULL;
+  }
+  return cond;
+}
+
+void free_cond_var(struct COND_VAR *cond)
+{
+  pthread_cond_destroy(&cond->cond);
+  free(cond);
+}
+
+void cond_var_wait(struct COND_VAR *cond, struct MUTEX *mutex)
+{
+  pthread_cond_wait(&cond->cond, &mutex->mutex);
+}
+
+void cond_var_signal(struct COND_VAR *cond)
+{
+  pthread_cond_signal(&cond->cond);
+}
+
+void cond_var_broadcast(struct COND_VAR *cond)
+{
+  pthread_cond_broadcast(&cond->cond);
+}
+
+static struct CHANNEL *new_lock_free_chan(struct CHANNEL *chan, size_t capacity, size_t item_size, unsigned int flags)
+{
+  unsigned int ring_flags = 0;
+  if (flags & CHAN_FLAG_SINGLE_PRODUCER)
+    ring_flags |= RING_FLAG_SINGLE_PRODUCER;
+  if (flags & CHAN_FLAG_SINGLE_CONSUMER)
+    ring_flags |= RING_FLAG_SINGLE_CONSUMER;
+
+  chan->ring = new_ring(capacity, item_size, ring_flags);
+  if (! chan->ring) {
+    free(chan);
+    return NULL;
+  }
+  return chan;
+}
+
+struct CHANNEL *new_chan(size_t capacity, size_t item_size, unsigned int flags)
 {
   struct CHANNEL *chan = malloc(sizeof *chan);
   if (! chan)
     return NULL;
+  chan->ring = NULL;
+  if (capacity > 0 && (flags & CHAN_FLAG_LOCK_FREE) != 0)
+    return new_lock_free_chan(chan, capacity, item_size, flags);
+
   chan->has_reader = false;
   chan->has_writer = false;
 
@@ -99,6 +210,11 @@ struct CHANNEL *new_chan(size_t capacity, size_t item_size)
 
 void free_chan(struct CHANNEL *chan)
 {
+  if (chan->ring) {
+    free_ring(chan->ring);
+    free(chan);
+    return;
+  }
   pthread_cond_destroy(&chan->write_event);
   pthread_cond_destroy(&chan->read_event);
   pthread_mutex_destroy(&chan->mutex);
@@ -146,15 +262,13 @@ static void async_send(struct CHANNEL *chan, void *data)
 {
   //printf("async send for %p\n", chan);
   pthread_mutex_lock(&chan->mutex);
-    
-  chan->has_writer = true;
+
   while (chan->queue.num_items == chan->queue.capacity)
     pthread_cond_wait(&chan->read_event, &chan->mutex);
-  chan->has_writer = false;
-  
+
   queue_add(&chan->queue, data);
-  if (chan->has_reader)
-    pthread_cond_signal(&chan->write_event);
+  // always wake: there may be more than one reader or writer waiting
+  pthread_cond_signal(&chan->write_event);
   pthread_mutex_unlock(&chan->mutex);
 }
 
@@ -167,22 +281,21 @@ static int async_recv(struct CHANNEL *chan, void *data, int block)
     pthread_mutex_unlock(&chan->mutex);
     return 1;
   }
-  
-  chan->has_reader = true;
+
   while (chan->queue.num_items == 0)
     pthread_cond_wait(&chan->write_event, &chan->mutex);
-  chan->has_reader = false;
 
   queue_remove(&chan->queue, data);
-  if (chan->has_writer)
-    pthread_cond_signal(&chan->read_event);
+  pthread_cond_signal(&chan->read_event);
   pthread_mutex_unlock(&chan->mutex);
   return 0;
 }
 
 void chan_send(struct CHANNEL *chan, void *data)
 {
-  if (chan->queue.capacity == 0)
+  if (chan->ring)
+    ring_send(chan->ring, data);
+  else if (chan->queue.capacity == 0)
     sync_send(chan, data);
   else
     async_send(chan, data);
@@ -190,7 +303,9 @@ void chan_send(struct CHANNEL *chan, void *data)
 
 int chan_recv(struct CHANNEL *chan, void *data, int block)
 {
-  if (chan->queue.capacity == 0)
+  if (chan->ring)
+    return ring_recv(chan->ring, data, block);
+  else if (chan->queue.capacity == 0)
     return sync_recv(chan, data, block);
   else
     return async_recv(chan, data, block);
@@ -11,6 +11,7 @@
 
 #include "thread.h"
 #include "queue.h"
+#include "ring.h"
 
 struct THREAD {
   HANDLE handle;
@@ -19,7 +20,16 @@ struct THREAD {
   void *func_data;
 };
 
+struct MUTEX {
+  CRITICAL_SECTION cs;
+};
+
+struct COND_VAR {
+  CONDITION_VARIABLE cond;
+};
+
 struct CHANNEL {
+  struct RING *ring;
   CRITICAL_SECTION cs;
   CONDITION_VARIABLE write_event;
   CONDITION_VARIABLE read_event;
@@ -34,6 +44,28 @@ void thread_sleep(unsigned int msec)
   Sleep(msec);
 }
 
+void thread_yield(void)
+{
+  SwitchToThread();
+}
+
+double get_monotonic_time(void)
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double) count.QuadPart / (double) freq.QuadPart;
+}
+
+int get_num_processors(void)
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (info.dwNumberOfProcessors > 0) ? (int) info.dwNumberOfProcessors : 1;
+}
+
 static DWORD WINAPI thread_start_func(void *data)
 {
   struct THREAD *thread = data;
@@ -64,11 +96,88 @@ int join_thread(struct THREAD *thread)
   return (ret == WAIT_OBJECT_0) ? 0 : 1;
 }
 
-struct CHANNEL *new_chan(size_t capacity, size_t item_size)
+struct MUTEX *new_mutex(void)
+{
+  struct MUTEX *mutex = malloc(sizeof *mutex);
+  if (! mutex)
+    return NULL;
+  if (! InitializeCriticalSectionAndSpinCount(&mutex->cs, 1024)) {
+    free(mutex);
+    return NULL;
+  }
+  return mutex;
+}
+
+void free_mutex(struct MUTEX *mutex)
+{
+  DeleteCriticalSection(&mutex->cs);
+  free(mutex);
+}
+
+void mutex_lock(struct MUTEX *mutex)
+{
+  EnterCriticalSection(&mutex->cs);
+}
+
+void mutex_unlock(struct MUTEX *mutex)
+{
+  LeaveCriticalSection(&mutex->cs);
+}
+
+struct COND_VAR *new_cond_var(void)
+{
+  struct COND_VAR *cond = malloc(sizeof *cond);
+  if (! cond)
+    return NULL;
+  InitializeConditionVariable(&cond->cond);
+  return cond;
+}
+
+void free_cond_var(struct COND_VAR *cond)
+{
+  free(cond);
+}
+
+void cond_var_wait(struct COND_VAR *cond, struct MUTEX *mutex)
+{
+  SleepConditionVariableCS(&cond->cond, &mutex->cs, INFINITE);
+}
+
+void cond_var_signal(struct COND_VAR *cond)
+{
+  WakeConditionVariable(&cond->cond);
+}
+
+void cond_var_broadcast(struct COND_VAR *cond)
+{
+  WakeAllConditionVariable(&cond->cond);
+}
+
+static struct CHANNEL *new_lock_free_chan(struct CHANNEL *chan, size_t capacity, size_t item_size, unsigned int flags)
+{
+  unsigned int ring_flags = 0;
+  if (flags & CHAN_FLAG_SINGLE_PRODUCER)
+    ring_flags |= RING_FLAG_SINGLE_PRODUCER;
+  if (flags & CHAN_FLAG_SINGLE_CONSUMER)
+    ring_flags |= RING_FLAG_SINGLE_CONSUMER;
+
+  chan->ring = new_ring(capacity, item_size, ring_flags);
+  if (! chan->ring) {
+    free(chan);
+    return NULL;
+  }
+  return chan;
+}
+
+struct CHANNEL *new_chan(size_t capacity, size_t item_size, unsigned int flags)
 {
   struct CHANNEL *chan = malloc(sizeof *chan);
   if (! chan)
     return NULL;
+  chan->ring = NULL;
+  if (capacity > 0 && (flags & CHAN_FLAG_LOCK_FREE) != 0)
+    return new_lock_free_chan(chan, capacity, item_size, flags);
+
   chan->has_reader = false;
   chan->has_writer = false;
 
@@ -95,6 +204,11 @@ struct CHANNEL *new_chan(size_t capacity, size_t item_size)
 
 void free_chan(struct CHANNEL *chan)
 {
+  if (chan->ring) {
+    free_ring(chan->ring);
+    free(chan);
+    return;
+  }
   DeleteCriticalSection(&chan->cs);
   free_queue(&chan->queue);
   free(chan->data);
@@ -140,15 +254,13 @@ static void async_send(struct CHANNEL *chan, void *data)
 {
   //printf("async send for %p\n", chan);
   EnterCriticalSection(&chan->cs);
-    
-  chan->has_writer = true;
+
   while (chan->queue.num_items == chan->queue.capacity)
     SleepConditionVariableCS(&chan->read_event, &chan->cs, INFINITE);
-  chan->has_writer = false;
-  
+
   queue_add(&chan->queue, data);
-  if (chan->has_reader)
-    WakeConditionVariable(&chan->write_event);
+  // always wake: there may be more than one reader or writer waiting
+  WakeConditionVariable(&chan->write_event);
   LeaveCriticalSection(&chan->cs);
 }
 
@@ -161,22 +273,21 @@ static int async_recv(struct CHANNEL *chan, void *data, int block)
     LeaveCriticalSection(&chan->cs);
     return 1;
   }
-  
-  chan->has_reader = true;
+
   while (chan->queue.num_items == 0)
     SleepConditionVariableCS(&chan->write_event, &chan->cs, INFINITE);
-  chan->has_reader = false;
 
   queue_remove(&chan->queue, data);
-  if (chan->has_writer)
-    WakeConditionVariable(&chan->read_event);
+  WakeConditionVariable(&chan->read_event);
   LeaveCriticalSection(&chan->cs);
   return 0;
 }
 
 void chan_send(struct CHANNEL *chan, void *data)
 {
-  if (chan->queue.capacity == 0)
+  if (chan->ring)
+    ring_send(chan->ring, data);
+  else if (chan->queue.capacity == 0)
     sync_send(chan, data);
   else
     async_send(chan, data);
@@ -184,7 +295,9 @@ void chan_send(struct CHANNEL *chan, void *data)
 
 int chan_recv(struct CHANNEL *chan, void *data, int block)
 {
-  if (chan->queue.capacity == 0)
+  if (chan->ring)
+    return ring_recv(chan->ring, data, block);
+  else if (chan->queue.capacity == 0)
     return sync_recv(chan, data, block);
   else
     return async_recv(chan, data, block);